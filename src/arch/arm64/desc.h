@@ -2,5 +2,12 @@
 
 #define RAM_BASE (1UL << 31)
 #define SERIAL_IRQ 0
-#define VIRTIO_BLK_IRQ 1
-#define KERNEL_OPTS "console=ttyS0"
+/* The UART line is level-triggered, see the /uart node of the device tree */
+#define SERIAL_IRQ_LEVEL
+/* SPIs for PCI devices, one per device */
+#define PCI_IRQS {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}
+/* The vCPU and the vGIC cannot be saved, so neither can the VM */
+#define SNAPSHOT_UNSUPPORTED
+/* The UART of stdout-path prints what comes before the hvc driver is up */
+#define KERNEL_OPTS "earlycon console=hvc0"
+#define KERNEL_SERIAL_OPTS "console=ttyS0"
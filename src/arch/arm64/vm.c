@@ -6,6 +6,7 @@
 #include <linux/kvm.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
@@ -154,7 +155,7 @@ typedef struct {
     uint32_t res5;        /* reserved (used for PE COFF offset) */
 } arm64_kernel_header_t;
 
-int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_image(vm_t *v, void *data, size_t datasz, int fd)
 {
     vm_arch_priv_t *priv = (vm_arch_priv_t *) v->priv;
 
@@ -173,17 +174,17 @@ int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
         return throw_err("Image size too large\n");
     }
 
-    void *dest = vm_guest_to_host(v, ARM_KERNEL_BASE + offset);
-    memmove(dest, data, datasz);
+    if (vm_load_file(v, fd, data, 0, ARM_KERNEL_BASE + offset, datasz) < 0)
+        return -1;
     priv->entry = ARM_KERNEL_BASE + offset;
     return 0;
 }
 
-int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz, int fd)
 {
     vm_arch_priv_t *priv = (vm_arch_priv_t *) v->priv;
-    void *dest = vm_guest_to_host(v, ARM_INITRD_BASE);
-    memmove(dest, data, datasz);
+    if (vm_load_file(v, fd, data, 0, ARM_INITRD_BASE, datasz) < 0)
+        return -1;
     priv->initrdsz = datasz;
     return 0;
 }
@@ -260,7 +261,8 @@ static int generate_fdt(vm_t *v)
 
     /* Create /chosen node */
     __FDT(begin_node, "chosen");
-    __FDT(property_string, "bootargs", KERNEL_OPTS);
+    __FDT(property_string, "bootargs",
+          v->serial_console ? KERNEL_SERIAL_OPTS : KERNEL_OPTS);
     __FDT(property_string, "stdout-path", "/uart");
     if (priv->initrdsz > 0) {
         __FDT(property_u64, "linux,initrd-start", ARM_INITRD_BASE);
@@ -269,12 +271,45 @@ static int generate_fdt(vm_t *v)
     }
     __FDT(end_node); /* End of /chosen node */
 
-    /* Create /memory node */
-    __FDT(begin_node, "memory");
-    __FDT(property_string, "device_type", "memory");
-    uint64_t mem_reg[2] = {cpu_to_fdt64(RAM_BASE), cpu_to_fdt64(RAM_SIZE)};
-    __FDT(property, "reg", mem_reg, sizeof(mem_reg));
-    __FDT(end_node); /* End of /memory node */
+    /* Create /memory node, or one per NUMA node */
+    if (!v->numa.nr_nodes) {
+        __FDT(begin_node, "memory");
+        __FDT(property_string, "device_type", "memory");
+        uint64_t mem_reg[2] = {cpu_to_fdt64(RAM_BASE),
+                               cpu_to_fdt64(RAM_SIZE)};
+        __FDT(property, "reg", mem_reg, sizeof(mem_reg));
+        __FDT(end_node); /* End of /memory node */
+    }
+    for (int i = 0; i < v->numa.nr_nodes; i++) {
+        uint64_t start, len;
+        char name[32];
+        numa_node_range(&v->numa, i, RAM_SIZE, &start, &len);
+        snprintf(name, sizeof(name), "memory@%llx",
+                 (unsigned long long) (RAM_BASE + start));
+        __FDT(begin_node, name);
+        __FDT(property_string, "device_type", "memory");
+        uint64_t mem_reg[2] = {cpu_to_fdt64(RAM_BASE + start),
+                               cpu_to_fdt64(len)};
+        __FDT(property, "reg", mem_reg, sizeof(mem_reg));
+        __FDT(property_cell, "numa-node-id", i);
+        __FDT(end_node);
+    }
+    /* Distances between the host nodes behind the guest nodes */
+    if (v->numa.nr_nodes) {
+        uint32_t matrix[NUMA_MAX_NODES * NUMA_MAX_NODES * 3];
+        int nr = 0;
+        for (int i = 0; i < v->numa.nr_nodes; i++) {
+            for (int j = 0; j < v->numa.nr_nodes; j++) {
+                matrix[nr++] = cpu_to_fdt32(i);
+                matrix[nr++] = cpu_to_fdt32(j);
+                matrix[nr++] = cpu_to_fdt32(v->numa.distance[i][j]);
+            }
+        }
+        __FDT(begin_node, "distance-map");
+        __FDT(property_string, "compatible", "numa-distance-map-v1");
+        __FDT(property, "distance-matrix", matrix, nr * sizeof(uint32_t));
+        __FDT(end_node);
+    }
 
     /* Create /cpus node */
     __FDT(begin_node, "cpus");
@@ -289,6 +324,8 @@ static int generate_fdt(vm_t *v)
     __FDT(property_cell, "reg", mpidr);
     __FDT(property_string, "device_type", "cpu");
     __FDT(property_string, "compatible", "arm,arm-v8");
+    if (v->numa.nr_nodes)
+        __FDT(property_cell, "numa-node-id", 0);
     __FDT(end_node); /* End of /cpus/cpu */
     __FDT(end_node); /* End of /cpu */
 
@@ -360,12 +397,10 @@ static int generate_fdt(vm_t *v)
          cpu_to_fdt64(ARM_PCI_MMIO_BASE), cpu_to_fdt64(ARM_PCI_MMIO_SIZE)},
     };
     __FDT(property, "ranges", &pci_ranges, sizeof(pci_ranges));
-    /* interrupt-map contains the interrupt mapping between the PCI device and
-     * the IRQ number of interrupt controller.
-     * virtio-blk is the only PCI device.
+    /* interrupt-map contains the interrupt mapping between the PCI devices
+     * and the IRQ numbers of interrupt controller. Every device has its own
+     * line, which is also reported in its PCI_INTERRUPT_LINE.
      */
-    struct virtio_blk_dev *virtio_blk = &v->virtio_blk_dev;
-    struct pci_dev *virtio_blk_pci = (struct pci_dev *) virtio_blk;
     struct {
         uint32_t pci_hi;
         uint64_t pci_addr;
@@ -374,16 +409,23 @@ static int generate_fdt(vm_t *v)
         uint32_t gic_type;
         uint32_t gic_irqn;
         uint32_t gic_irq_type;
-    } __attribute__((packed)) pci_irq_map[] = {{
-        cpu_to_fdt32(virtio_blk_pci->config_dev.base & ~(1UL << 31)),
-        0,
-        cpu_to_fdt32(1),
-        cpu_to_fdt32(FDT_PHANDLE_GIC),
-        cpu_to_fdt32(ARM_FDT_IRQ_TYPE_SPI),
-        cpu_to_fdt32(VIRTIO_BLK_IRQ),
-        cpu_to_fdt32(ARM_FDT_IRQ_EDGE_TRIGGER),
-    }};
-    __FDT(property, "interrupt-map", &pci_irq_map, sizeof(pci_irq_map));
+    } __attribute__((packed)) pci_irq_map[32];
+    int nr_irq_map = 0;
+    for (struct dev *dev = v->pci.pci_bus.head; dev && nr_irq_map < 32;
+         dev = dev->next) {
+        struct pci_dev *pci_dev = (struct pci_dev *) dev->owner;
+        pci_irq_map[nr_irq_map++] = (typeof(pci_irq_map[0])){
+            cpu_to_fdt32(dev->base & ~(1UL << 31)),
+            0,
+            cpu_to_fdt32(1),
+            cpu_to_fdt32(FDT_PHANDLE_GIC),
+            cpu_to_fdt32(ARM_FDT_IRQ_TYPE_SPI),
+            cpu_to_fdt32(PCI_HDR_READ(pci_dev->hdr, PCI_INTERRUPT_LINE, 8)),
+            cpu_to_fdt32(ARM_FDT_IRQ_EDGE_TRIGGER),
+        };
+    }
+    __FDT(property, "interrupt-map", &pci_irq_map,
+          nr_irq_map * sizeof(pci_irq_map[0]));
     __FDT(end_node); /* End of /pci node */
 
     /* Finalize the device tree */
@@ -461,3 +503,18 @@ int vm_irq_line(vm_t *v, int irq, int level)
 
     return 0;
 }
+
+/* Snapshots are refused at option parsing, see SNAPSHOT_UNSUPPORTED. Clones
+ * and migrations requested over the control socket fail here.
+ */
+int vm_arch_save(vm_t *v, struct snapshot *s)
+{
+    errno = ENOTSUP;
+    return throw_err("Snapshots are not supported on arm64");
+}
+
+int vm_arch_restore(vm_t *v, struct snapshot *s)
+{
+    errno = ENOTSUP;
+    return throw_err("Snapshots are not supported on arm64");
+}
@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "acpi.h"
+#include "err.h"
+#include "vm.h"
+
+static uint8_t acpi_checksum(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint8_t sum = 0;
+
+    while (len--)
+        sum += *p++;
+    return -sum;
+}
+
+static void acpi_init_header(struct acpi_header *h,
+                             const char *signature,
+                             uint32_t length,
+                             uint8_t revision)
+{
+    memcpy(h->signature, signature, 4);
+    h->length = length;
+    h->revision = revision;
+    memcpy(h->oem_id, "KVMH  ", 6);
+    memcpy(h->oem_table_id, "KVMHOST ", 8);
+    h->oem_revision = 1;
+    memcpy(h->creator_id, "KVMH", 4);
+    h->creator_revision = 1;
+    h->checksum = acpi_checksum(h, length);
+}
+
+/* Build the tables in the BIOS area below 1 MB, which the e820 map leaves
+ * out of the guest RAM. Nothing is built without NUMA.
+ */
+int acpi_build(vm_t *v)
+{
+    struct numa *n = &v->numa;
+    uint64_t addr = ACPI_RSDP_ADDR + 0x40, xsdt_addr, srat_addr, slit_addr;
+    uint32_t xsdt_len = sizeof(struct acpi_header) + 2 * sizeof(uint64_t);
+    uint32_t srat_len = sizeof(struct acpi_header) + 12 +
+                        sizeof(struct acpi_srat_cpu) +
+                        n->nr_nodes * sizeof(struct acpi_srat_mem);
+    uint32_t slit_len =
+        sizeof(struct acpi_header) + 8 + n->nr_nodes * n->nr_nodes;
+
+    if (!n->nr_nodes)
+        return 0;
+    xsdt_addr = addr;
+    srat_addr = (xsdt_addr + xsdt_len + 15) & ~15;
+    slit_addr = (srat_addr + srat_len + 15) & ~15;
+    if (slit_addr + slit_len > ACPI_TABLES_END)
+        return throw_err("The ACPI tables do not fit");
+
+    /* SRAT: the vCPU is in node 0, and each node has its part of the RAM */
+    uint8_t *srat = vm_guest_to_host(v, srat_addr);
+    memset(srat, 0, srat_len);
+    srat[sizeof(struct acpi_header)] = 1; /* reserved, 1 for compatibility */
+    struct acpi_srat_cpu *cpu =
+        (struct acpi_srat_cpu *) (srat + sizeof(struct acpi_header) + 12);
+    *cpu = (struct acpi_srat_cpu){
+        .type = 0,
+        .length = sizeof(*cpu),
+        .flags = ACPI_SRAT_ENABLED,
+    };
+    struct acpi_srat_mem *mem = (struct acpi_srat_mem *) (cpu + 1);
+    for (int i = 0; i < n->nr_nodes; i++) {
+        uint64_t start, len;
+        numa_node_range(n, i, RAM_SIZE, &start, &len);
+        mem[i] = (struct acpi_srat_mem){
+            .type = 1,
+            .length = sizeof(mem[i]),
+            .proximity = i,
+            .base = RAM_BASE + start,
+            .size = len,
+            .flags = ACPI_SRAT_ENABLED,
+        };
+    }
+    acpi_init_header((struct acpi_header *) srat, "SRAT", srat_len, 3);
+
+    /* SLIT: the distances between the host nodes behind the guest nodes */
+    uint8_t *slit = vm_guest_to_host(v, slit_addr);
+    uint64_t nr = n->nr_nodes;
+    memset(slit, 0, slit_len);
+    memcpy(slit + sizeof(struct acpi_header), &nr, sizeof(nr));
+    for (int i = 0; i < n->nr_nodes; i++)
+        memcpy(slit + sizeof(struct acpi_header) + 8 + i * n->nr_nodes,
+               n->distance[i], n->nr_nodes);
+    acpi_init_header((struct acpi_header *) slit, "SLIT", slit_len, 1);
+
+    uint8_t *xsdt = vm_guest_to_host(v, xsdt_addr);
+    uint64_t entries[] = {srat_addr, slit_addr};
+    memset(xsdt, 0, xsdt_len);
+    memcpy(xsdt + sizeof(struct acpi_header), entries, sizeof(entries));
+    acpi_init_header((struct acpi_header *) xsdt, "XSDT", xsdt_len, 1);
+
+    struct acpi_rsdp *rsdp = vm_guest_to_host(v, ACPI_RSDP_ADDR);
+    *rsdp = (struct acpi_rsdp){
+        .signature = {'R', 'S', 'D', ' ', 'P', 'T', 'R', ' '},
+        .oem_id = {'K', 'V', 'M', 'H', ' ', ' '},
+        .revision = 2,
+        .length = sizeof(*rsdp),
+        .xsdt_addr = xsdt_addr,
+    };
+    rsdp->checksum = acpi_checksum(rsdp, 20);
+    rsdp->ext_checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The ACPI tables kvm-host provides, only for the NUMA topology of the
+ * guest: an RSDP where the kernel scans the BIOS area for it, and an XSDT
+ * pointing to an SRAT and a SLIT. Without a FADT and a DSDT, the kernel
+ * parses these tables but does not enable the ACPI interpreter.
+ */
+
+#define ACPI_RSDP_ADDR 0xe0000
+#define ACPI_TABLES_END 0x100000
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    char creator_id[4];
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_srat_cpu {
+    uint8_t type; /* 0 */
+    uint8_t length;
+    uint8_t proximity_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_mem {
+    uint8_t type; /* 1 */
+    uint8_t length;
+    uint32_t proximity;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+#define ACPI_SRAT_ENABLED 1
+
+struct vm;
+
+int acpi_build(struct vm *v);
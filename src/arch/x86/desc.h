@@ -2,5 +2,8 @@
 
 #define RAM_BASE 0
 #define SERIAL_IRQ 4
-#define VIRTIO_BLK_IRQ 15
-#define KERNEL_OPTS "console=ttyS0 pci=conf1"
+/* Legacy PIC lines left free for PCI devices, one per device */
+#define PCI_IRQS {15, 14, 11, 10, 9, 7, 6, 5, 3}
+/* The UART prints what comes before the hvc driver is up */
+#define KERNEL_OPTS "earlycon=uart8250,io,0x3f8 console=hvc0 pci=conf1"
+#define KERNEL_SERIAL_OPTS "console=ttyS0 pci=conf1"
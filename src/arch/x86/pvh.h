@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The PVH boot ABI, under which an uncompressed vmlinux is entered in 32-bit
+ * protected mode with paging off, at the address of its
+ * XEN_ELFNOTE_PHYS32_ENTRY note and with %ebx pointing to a struct
+ * hvm_start_info. See xen/include/public/arch-x86/hvm/start_info.h.
+ */
+
+#define XEN_ELFNOTE_PHYS32_ENTRY 18
+#define XEN_HVM_START_MAGIC_VALUE 0x336ec578
+
+/* Version 1 adds the memory map, which Linux needs outside of Xen */
+struct hvm_start_info {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nr_modules;
+    uint64_t modlist_paddr;
+    uint64_t cmdline_paddr;
+    uint64_t rsdp_paddr;
+    uint64_t memmap_paddr;
+    uint32_t memmap_entries;
+    uint32_t reserved;
+};
+
+struct hvm_modlist_entry {
+    uint64_t paddr;
+    uint64_t size;
+    uint64_t cmdline_paddr;
+    uint64_t reserved;
+};
+
+struct hvm_memmap_table_entry {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+/* Where kvm-host puts them in guest memory */
+#define PVH_START_INFO 0x6000
+#define PVH_MODLIST 0x6100
+#define PVH_MEMMAP 0x6200
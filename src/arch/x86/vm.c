@@ -4,12 +4,18 @@
 
 #include <asm/bootparam.h>
 #include <asm/e820.h>
+#include <elf.h>
 #include <linux/kvm.h>
 #include <linux/kvm_para.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
+#include "acpi.h"
 #include "err.h"
+#include "pvh.h"
+#include "snapshot.h"
+#include "utils.h"
 #include "vm.h"
 
 static int vm_init_regs(vm_t *v)
@@ -122,16 +128,122 @@ int vm_arch_init_platform_device(vm_t *v)
     bus_register_dev(&v->io_bus, &v->pci.pci_bus_dev);
     if (serial_init(&v->serial, &v->io_bus))
         return throw_err("Failed to init UART device");
-    virtio_blk_init(&v->virtio_blk_dev);
     return 0;
 }
 
-int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
+/* Usable address ranges of the guest, told to the kernel for the initrd */
+static const struct {
+    uint64_t addr, size;
+} ram_ranges[] = {
+    {0x0, ISA_START_ADDRESS - 1},
+    {ISA_END_ADDRESS, RAM_SIZE - ISA_END_ADDRESS},
+};
+
+/* Find the PVH entry point among the notes of a vmlinux */
+static uint64_t vm_find_pvh_entry(const uint8_t *data, size_t datasz)
+{
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) data;
+    const Elf64_Phdr *phdr = (const Elf64_Phdr *) (data + ehdr->e_phoff);
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_NOTE || phdr[i].p_offset > datasz ||
+            phdr[i].p_filesz > datasz - phdr[i].p_offset)
+            continue;
+        const uint8_t *note = data + phdr[i].p_offset;
+        const uint8_t *end = note + phdr[i].p_filesz;
+        while (note + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr *nhdr = (const Elf64_Nhdr *) note;
+            const uint8_t *name = note + sizeof(*nhdr);
+            const uint8_t *desc = name + ((nhdr->n_namesz + 3) & ~3);
+            if (desc + nhdr->n_descsz > end)
+                break;
+            if (nhdr->n_type == XEN_ELFNOTE_PHYS32_ENTRY &&
+                nhdr->n_namesz == 4 && !memcmp(name, "Xen", 4)) {
+                if (nhdr->n_descsz == 8)
+                    return *(const uint64_t *) desc;
+                if (nhdr->n_descsz == 4)
+                    return *(const uint32_t *) desc;
+            }
+            note = desc + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    return 0;
+}
+
+/* Load an uncompressed vmlinux and enter it through PVH, which skips the
+ * real-mode setup and the decompressor of a bzImage. The segments are
+ * placed at their physical addresses with vm_load_file, so that they are
+ * mapped from the file where they are page-aligned.
+ */
+static int vm_load_elf(vm_t *v, void *data, size_t datasz, int fd)
+{
+    const Elf64_Ehdr *ehdr = data;
+    struct hvm_start_info *start_info =
+        vm_guest_to_host(v, PVH_START_INFO);
+    struct hvm_memmap_table_entry *memmap = vm_guest_to_host(v, PVH_MEMMAP);
+    char *cmdline = vm_guest_to_host(v, 0x20000);
+    struct kvm_regs regs;
+    uint64_t entry;
+
+    if (datasz < sizeof(*ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_machine != EM_X86_64 ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr) || ehdr->e_phoff > datasz ||
+        ehdr->e_phnum > (datasz - ehdr->e_phoff) / sizeof(Elf64_Phdr))
+        return throw_err("Invalid ELF kernel");
+    entry = vm_find_pvh_entry(data, datasz);
+    if (!entry)
+        return throw_err("The kernel has no PVH entry point (CONFIG_PVH)");
+
+    const Elf64_Phdr *phdr =
+        (const Elf64_Phdr *) ((uint8_t *) data + ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD)
+            continue;
+        if (phdr[i].p_filesz > phdr[i].p_memsz ||
+            phdr[i].p_offset > datasz ||
+            phdr[i].p_filesz > datasz - phdr[i].p_offset ||
+            !vm_guest_range_to_host(v, phdr[i].p_paddr, phdr[i].p_memsz))
+            return throw_err("Invalid segment of the ELF kernel");
+        if (vm_load_file(v, fd, data, phdr[i].p_offset, phdr[i].p_paddr,
+                         phdr[i].p_filesz) < 0)
+            return -1;
+        memset(vm_guest_to_host(v, phdr[i].p_paddr + phdr[i].p_filesz), 0,
+               phdr[i].p_memsz - phdr[i].p_filesz);
+    }
+
+    strcpy(cmdline, v->serial_console ? KERNEL_SERIAL_OPTS : KERNEL_OPTS);
+    for (size_t i = 0; i < ARRAY_SIZE(ram_ranges); i++)
+        memmap[i] = (struct hvm_memmap_table_entry){
+            .addr = ram_ranges[i].addr,
+            .size = ram_ranges[i].size,
+            .type = E820_RAM,
+        };
+    *start_info = (struct hvm_start_info){
+        .magic = XEN_HVM_START_MAGIC_VALUE,
+        .version = 1,
+        .cmdline_paddr = 0x20000,
+        .memmap_paddr = PVH_MEMMAP,
+        .memmap_entries = ARRAY_SIZE(ram_ranges),
+    };
+
+    /* vm_arch_cpu_init left the vCPU in flat 32-bit protected mode */
+    if (ioctl(v->vcpu_fd, KVM_GET_REGS, &regs) < 0)
+        return throw_err("Failed to get registers");
+    regs.rip = entry;
+    regs.rbx = PVH_START_INFO;
+    if (ioctl(v->vcpu_fd, KVM_SET_REGS, &regs) < 0)
+        return throw_err("Failed to set registers");
+    return 0;
+}
+
+int vm_arch_load_image(vm_t *v, void *data, size_t datasz, int fd)
 {
     struct boot_params *boot =
         (struct boot_params *) ((uint8_t *) v->mem + 0x10000);
     void *cmdline = ((uint8_t *) v->mem) + 0x20000;
-    void *kernel = ((uint8_t *) v->mem) + 0x100000;
+
+    if (datasz >= SELFMAG && !memcmp(data, ELFMAG, SELFMAG))
+        return vm_load_elf(v, data, datasz, fd);
 
     memset(boot, 0, sizeof(struct boot_params));
     memmove(boot, data, sizeof(struct boot_params));
@@ -145,31 +257,32 @@ int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
     boot->hdr.ext_loader_ver = 0x0;
     boot->hdr.cmd_line_ptr = 0x20000;
     memset(cmdline, 0, boot->hdr.cmdline_size);
-    memcpy(cmdline, KERNEL_OPTS, sizeof(KERNEL_OPTS));
-    memmove(kernel, (char *) data + setupsz, datasz - setupsz);
+    strcpy(cmdline, v->serial_console ? KERNEL_SERIAL_OPTS : KERNEL_OPTS);
+    if (setupsz > datasz ||
+        vm_load_file(v, fd, data, setupsz, 0x100000, datasz - setupsz) < 0)
+        return throw_err("Failed to load the kernel");
 
     /* setup E820 memory map to report usable address ranges for initrd */
-    unsigned int idx = 0;
-    boot->e820_table[idx++] = (struct boot_e820_entry){
-        .addr = 0x0,
-        .size = ISA_START_ADDRESS - 1,
-        .type = E820_RAM,
-    };
-    boot->e820_table[idx++] = (struct boot_e820_entry){
-        .addr = ISA_END_ADDRESS,
-        .size = RAM_SIZE - ISA_END_ADDRESS,
-        .type = E820_RAM,
-    };
-    boot->e820_entries = idx;
+    for (size_t i = 0; i < ARRAY_SIZE(ram_ranges); i++)
+        boot->e820_table[i] = (struct boot_e820_entry){
+            .addr = ram_ranges[i].addr,
+            .size = ram_ranges[i].size,
+            .type = E820_RAM,
+        };
+    boot->e820_entries = ARRAY_SIZE(ram_ranges);
 
     return 0;
 }
 
-int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz, int fd)
 {
     struct boot_params *boot =
         (struct boot_params *) ((uint8_t *) v->mem + 0x10000);
-    unsigned long addr = boot->hdr.initrd_addr_max & ~0xfffff;
+    struct hvm_start_info *start_info = vm_guest_to_host(v, PVH_START_INFO);
+    bool pvh = start_info->magic == XEN_HVM_START_MAGIC_VALUE;
+    /* A PVH kernel takes the initrd below the limit of a bzImage header */
+    unsigned long addr =
+        (pvh ? 0x37ffffff : boot->hdr.initrd_addr_max) & ~0xfffff;
 
     for (;;) {
         if (addr < 0x100000)
@@ -179,11 +292,16 @@ int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
         addr -= 0x100000;
     }
 
-    void *initrd = ((uint8_t *) v->mem) + addr;
-
-    memset(initrd, 0, datasz);
-    memmove(initrd, data, datasz);
+    if (vm_load_file(v, fd, data, 0, addr, datasz) < 0)
+        return -1;
 
+    if (pvh) {
+        struct hvm_modlist_entry *mod = vm_guest_to_host(v, PVH_MODLIST);
+        *mod = (struct hvm_modlist_entry){.paddr = addr, .size = datasz};
+        start_info->modlist_paddr = PVH_MODLIST;
+        start_info->nr_modules = 1;
+        return 0;
+    }
     boot->hdr.ramdisk_image = addr;
     boot->hdr.ramdisk_size = datasz;
     return 0;
@@ -191,6 +309,19 @@ int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
 
 int vm_late_init(vm_t *v)
 {
+    struct boot_params *boot =
+        (struct boot_params *) ((uint8_t *) v->mem + 0x10000);
+    struct hvm_start_info *start_info = vm_guest_to_host(v, PVH_START_INFO);
+
+    /* The tables of a restored VM are in its memory */
+    if (v->restore || !v->numa.nr_nodes)
+        return 0;
+    if (acpi_build(v) < 0)
+        return -1;
+    if (start_info->magic == XEN_HVM_START_MAGIC_VALUE)
+        start_info->rsdp_paddr = ACPI_RSDP_ADDR;
+    else
+        boot->acpi_rsdp_addr = ACPI_RSDP_ADDR;
     return 0;
 }
 
@@ -206,3 +337,202 @@ int vm_irq_line(vm_t *v, int irq, int level)
 
     return 0;
 }
+
+/* Sections of the x86 state in a snapshot */
+enum {
+    X86_REGS,
+    X86_XSAVE,
+    X86_XCRS,
+    X86_SREGS,
+    X86_MSRS,
+    X86_MP_STATE,
+    X86_LAPIC,
+    X86_VCPU_EVENTS,
+    X86_DEBUGREGS,
+    X86_PIC_MASTER,
+    X86_PIC_SLAVE,
+    X86_IOAPIC,
+    X86_PIT,
+    X86_CLOCK,
+};
+
+/* The vCPU state which is copied as a whole, in the order it is restored.
+ * The MSRs follow the special registers, as the features they enable decide
+ * which MSRs may be set, and the local APIC follows the MSRs.
+ */
+static const struct {
+    int id;
+    unsigned long get, set;
+    size_t size;
+} vcpu_state[] = {
+    {X86_REGS, KVM_GET_REGS, KVM_SET_REGS, sizeof(struct kvm_regs)},
+    {X86_XSAVE, KVM_GET_XSAVE, KVM_SET_XSAVE, sizeof(struct kvm_xsave)},
+    {X86_XCRS, KVM_GET_XCRS, KVM_SET_XCRS, sizeof(struct kvm_xcrs)},
+    {X86_SREGS, KVM_GET_SREGS, KVM_SET_SREGS, sizeof(struct kvm_sregs)},
+    {X86_MP_STATE, KVM_GET_MP_STATE, KVM_SET_MP_STATE,
+     sizeof(struct kvm_mp_state)},
+    {X86_LAPIC, KVM_GET_LAPIC, KVM_SET_LAPIC, sizeof(struct kvm_lapic_state)},
+    {X86_VCPU_EVENTS, KVM_GET_VCPU_EVENTS, KVM_SET_VCPU_EVENTS,
+     sizeof(struct kvm_vcpu_events)},
+    {X86_DEBUGREGS, KVM_GET_DEBUGREGS, KVM_SET_DEBUGREGS,
+     sizeof(struct kvm_debugregs)},
+};
+
+#define MSR_IA32_TSC_DEADLINE 0x000006e0
+
+/* KVM_GET_MSRS and KVM_SET_MSRS stop at the first MSR they cannot access.
+ * It is skipped, so that the rest are not lost, and the entries which were
+ * accessed are moved to the front. Returns their number.
+ */
+static int vm_access_msrs(vm_t *v,
+                          unsigned long req,
+                          struct kvm_msr_entry *entries,
+                          int nr)
+{
+    struct kvm_msrs *msrs = malloc(sizeof(*msrs) + nr * sizeof(*entries));
+    int done = 0;
+
+    if (!msrs)
+        return throw_err("Failed to allocate the MSRs");
+    for (int i = 0; i < nr;) {
+        msrs->nmsrs = nr - i;
+        memcpy(msrs->entries, entries + i, (nr - i) * sizeof(*entries));
+        int ret = ioctl(v->vcpu_fd, req, msrs);
+        if (ret < 0) {
+            free(msrs);
+            return throw_err("Failed to access the MSRs");
+        }
+        memmove(entries + done, msrs->entries, ret * sizeof(*entries));
+        done += ret;
+        i += ret + 1;
+    }
+    free(msrs);
+    return done;
+}
+
+/* Every MSR which KVM saves and restores for migration */
+static int vm_save_msrs(vm_t *v, struct snapshot *s)
+{
+    struct kvm_msr_list probe = {.nmsrs = 0}, *list;
+    struct kvm_msr_entry *entries;
+    int nr, ret = -1;
+
+    if (ioctl(v->kvm_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG)
+        return throw_err("Failed to get the MSR list");
+    list = malloc(sizeof(*list) + probe.nmsrs * sizeof(list->indices[0]));
+    entries = calloc(probe.nmsrs, sizeof(*entries));
+    if (!list || !entries)
+        goto out;
+    list->nmsrs = probe.nmsrs;
+    if (ioctl(v->kvm_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+        throw_err("Failed to get the MSR list");
+        goto out;
+    }
+    for (uint32_t i = 0; i < list->nmsrs; i++)
+        entries[i].index = list->indices[i];
+    nr = vm_access_msrs(v, KVM_GET_MSRS, entries, list->nmsrs);
+    if (nr >= 0)
+        ret = snapshot_add(s, SNAPSHOT_ARCH, X86_MSRS, entries,
+                           nr * sizeof(*entries));
+out:
+    free(list);
+    free(entries);
+    return ret;
+}
+
+int vm_arch_save(vm_t *v, struct snapshot *s)
+{
+    uint8_t buf[sizeof(struct kvm_xsave)];
+
+    for (size_t i = 0; i < ARRAY_SIZE(vcpu_state); i++) {
+        if (ioctl(v->vcpu_fd, vcpu_state[i].get, buf) < 0)
+            return throw_err("Failed to get the vCPU state %d",
+                             vcpu_state[i].id);
+        if (snapshot_add(s, SNAPSHOT_ARCH, vcpu_state[i].id, buf,
+                         vcpu_state[i].size) < 0)
+            return -1;
+    }
+    if (vm_save_msrs(v, s) < 0)
+        return -1;
+
+    for (int chip = 0; chip < 3; chip++) {
+        struct kvm_irqchip irqchip = {.chip_id = chip};
+        if (ioctl(v->vm_fd, KVM_GET_IRQCHIP, &irqchip) < 0 ||
+            snapshot_add(s, SNAPSHOT_ARCH, X86_PIC_MASTER + chip, &irqchip,
+                         sizeof(irqchip)) < 0)
+            return throw_err("Failed to save the interrupt controllers");
+    }
+
+    struct kvm_pit_state2 pit;
+    struct kvm_clock_data clock;
+    if (ioctl(v->vm_fd, KVM_GET_PIT2, &pit) < 0 ||
+        snapshot_add(s, SNAPSHOT_ARCH, X86_PIT, &pit, sizeof(pit)) < 0)
+        return throw_err("Failed to save the interval timer");
+    if (ioctl(v->vm_fd, KVM_GET_CLOCK, &clock) < 0 ||
+        snapshot_add(s, SNAPSHOT_ARCH, X86_CLOCK, &clock, sizeof(clock)) < 0)
+        return throw_err("Failed to save the clock");
+    return 0;
+}
+
+static int vm_restore_msrs(vm_t *v, struct snapshot *s, bool deadline)
+{
+    struct snapshot_section *section =
+        snapshot_find(s, SNAPSHOT_ARCH, X86_MSRS);
+    struct kvm_msr_entry *entries;
+    int nr = 0;
+
+    if (!section || section->len % sizeof(*entries))
+        return throw_err("The snapshot lacks the MSRs");
+    entries = malloc(section->len ? section->len : 1);
+    if (!entries)
+        return throw_err("Failed to allocate the MSRs");
+    /* The TSC deadline is only kept once the local APIC is restored */
+    for (size_t i = 0; i < section->len / sizeof(*entries); i++) {
+        struct kvm_msr_entry *entry = (struct kvm_msr_entry *) section->data + i;
+        if ((entry->index == MSR_IA32_TSC_DEADLINE) == deadline)
+            entries[nr++] = *entry;
+    }
+    nr = vm_access_msrs(v, KVM_SET_MSRS, entries, nr);
+    free(entries);
+    return nr < 0 ? -1 : 0;
+}
+
+int vm_arch_restore(vm_t *v, struct snapshot *s)
+{
+    uint8_t buf[sizeof(struct kvm_xsave)];
+
+    for (size_t i = 0; i < ARRAY_SIZE(vcpu_state); i++) {
+        if (snapshot_read(s, SNAPSHOT_ARCH, vcpu_state[i].id, buf,
+                          vcpu_state[i].size) < 0)
+            return -1;
+        if (ioctl(v->vcpu_fd, vcpu_state[i].set, buf) < 0)
+            return throw_err("Failed to restore the vCPU state %d",
+                             vcpu_state[i].id);
+        if (vcpu_state[i].id == X86_SREGS && vm_restore_msrs(v, s, false) < 0)
+            return -1;
+    }
+    if (vm_restore_msrs(v, s, true) < 0)
+        return -1;
+
+    for (int chip = 0; chip < 3; chip++) {
+        struct kvm_irqchip irqchip;
+        if (snapshot_read(s, SNAPSHOT_ARCH, X86_PIC_MASTER + chip, &irqchip,
+                          sizeof(irqchip)) < 0)
+            return -1;
+        if (ioctl(v->vm_fd, KVM_SET_IRQCHIP, &irqchip) < 0)
+            return throw_err("Failed to restore the interrupt controllers");
+    }
+
+    struct kvm_pit_state2 pit;
+    struct kvm_clock_data clock;
+    if (snapshot_read(s, SNAPSHOT_ARCH, X86_PIT, &pit, sizeof(pit)) < 0 ||
+        snapshot_read(s, SNAPSHOT_ARCH, X86_CLOCK, &clock, sizeof(clock)) < 0)
+        return -1;
+    if (ioctl(v->vm_fd, KVM_SET_PIT2, &pit) < 0)
+        return throw_err("Failed to restore the interval timer");
+    /* Only the clock value itself may be set */
+    clock.flags = 0;
+    if (ioctl(v->vm_fd, KVM_SET_CLOCK, &clock) < 0)
+        return throw_err("Failed to restore the clock");
+    return 0;
+}
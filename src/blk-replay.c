@@ -0,0 +1,316 @@
+#include <getopt.h>
+#include <linux/virtio_blk.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blk-trace.h"
+#include "diskimg.h"
+#include "err.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define MAX_JOBS 256
+
+static struct {
+    struct diskimg diskimg;
+    struct blk_trace_record *records;
+    uint64_t *latency_ns;
+    int *status;
+    size_t nr_records;
+    size_t max_len;
+
+    /* A flush waits for the requests before it, and holds back the ones
+     * after it until it completes.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;
+    size_t nr_running;
+    bool flushing;
+
+    bool original_speed;
+    bool read_only;
+    struct timespec start;
+} replay;
+
+enum {
+    OP_READ,
+    OP_WRITE,
+    OP_FLUSH,
+    OP_DISCARD,
+    OP_OTHER,
+    NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = {"read", "write", "flush", "discard",
+                                       "other"};
+
+static int op_of(uint8_t type)
+{
+    switch (type) {
+    case VIRTIO_BLK_T_IN:
+        return OP_READ;
+    case VIRTIO_BLK_T_OUT:
+        return OP_WRITE;
+    case VIRTIO_BLK_T_FLUSH:
+        return OP_FLUSH;
+    case VIRTIO_BLK_T_DISCARD:
+        return OP_DISCARD;
+    default:
+        return OP_OTHER;
+    }
+}
+
+static uint64_t elapsed_ns(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * NS_PER_SEC + to->tv_nsec -
+           from->tv_nsec;
+}
+
+static void usage(const char *execpath)
+{
+    printf("\n usage: %s [options] trace disk-image[,opt=value]\n\n", execpath);
+    printf("Replay a block trace captured by kvm-host against a disk image.\n");
+    printf("Writes and discards modify the image, so use a scratch copy.\n\n");
+    printf("options:\n");
+    printf("  %-30s%s", "-m, --mode original|max",
+           "Issue requests at their original time or as fast as possible\n");
+    printf("  %-30s%s", "-j, --jobs n",
+           "Number of requests in flight (default: 4)\n");
+    printf("  %-30s%s", "", "Flushes still wait for the requests before them\n");
+    printf("  %-30s%s", "-r, --read-only", "Skip writes and discards\n");
+    printf("  %-30s%s", "-h, --help", "Print help of CLI and exit.\n");
+}
+
+static int replay_one(struct blk_trace_record *record, void *buf)
+{
+    off_t offset = record->sector << 9;
+
+    switch (record->type) {
+    case VIRTIO_BLK_T_IN:
+        return diskimg_read(&replay.diskimg, buf, offset, record->len) < 0;
+    case VIRTIO_BLK_T_OUT:
+        if (replay.read_only)
+            return 0;
+        return diskimg_write(&replay.diskimg, buf, offset, record->len) < 0;
+    case VIRTIO_BLK_T_FLUSH:
+        return diskimg_flush(&replay.diskimg) < 0;
+    case VIRTIO_BLK_T_DISCARD:
+        if (replay.read_only)
+            return 0;
+        return diskimg_discard(&replay.diskimg, offset, record->len) < 0;
+    default:
+        return 0;
+    }
+}
+
+/* Pick the next request, or return false once there is none left */
+static bool replay_take(size_t *i)
+{
+    pthread_mutex_lock(&replay.lock);
+    while (replay.flushing)
+        pthread_cond_wait(&replay.cond, &replay.lock);
+    *i = replay.next;
+    if (*i < replay.nr_records) {
+        replay.next++;
+        if (replay.records[*i].type == VIRTIO_BLK_T_FLUSH)
+            replay.flushing = true;
+        else
+            replay.nr_running++;
+    }
+    pthread_mutex_unlock(&replay.lock);
+    return *i < replay.nr_records;
+}
+
+static void replay_begin_flush(void)
+{
+    pthread_mutex_lock(&replay.lock);
+    while (replay.nr_running)
+        pthread_cond_wait(&replay.cond, &replay.lock);
+    pthread_mutex_unlock(&replay.lock);
+}
+
+static void replay_done(struct blk_trace_record *record)
+{
+    pthread_mutex_lock(&replay.lock);
+    if (record->type == VIRTIO_BLK_T_FLUSH) {
+        replay.flushing = false;
+        pthread_cond_broadcast(&replay.cond);
+    } else if (!--replay.nr_running && replay.flushing) {
+        pthread_cond_broadcast(&replay.cond);
+    }
+    pthread_mutex_unlock(&replay.lock);
+}
+
+static void *replay_worker(void *arg)
+{
+    void *buf = calloc(1, replay.max_len ? replay.max_len : 1);
+    size_t i;
+
+    while (buf && replay_take(&i)) {
+        struct blk_trace_record *record = &replay.records[i];
+        struct timespec issue, done;
+
+        if (replay.original_speed) {
+            uint64_t at = replay.start.tv_nsec + record->timestamp_ns;
+            struct timespec deadline = {
+                .tv_sec = replay.start.tv_sec + at / NS_PER_SEC,
+                .tv_nsec = at % NS_PER_SEC,
+            };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+
+        if (record->type == VIRTIO_BLK_T_FLUSH)
+            replay_begin_flush();
+        clock_gettime(CLOCK_MONOTONIC, &issue);
+        replay.status[i] = replay_one(record, buf);
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        replay.latency_ns[i] = elapsed_ns(&issue, &done);
+        replay_done(record);
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, size_t n, double p)
+{
+    size_t rank = (size_t) (p / 100 * n + 0.5);
+    if (rank > 0)
+        rank--;
+    return sorted[rank < n ? rank : n - 1] / 1000.0;
+}
+
+static void report(double elapsed)
+{
+    uint64_t *sorted = malloc(replay.nr_records * sizeof(uint64_t) + 1);
+    uint64_t total_bytes = 0;
+    size_t nr_errors = 0;
+
+    if (!sorted) {
+        throw_err("Failed to allocate the latency report");
+        return;
+    }
+
+    for (size_t i = 0; i < replay.nr_records; i++) {
+        nr_errors += replay.status[i];
+        if (op_of(replay.records[i].type) <= OP_WRITE)
+            total_bytes += replay.records[i].len;
+    }
+    printf("%zu requests in %.3f s: %.1f IOPS, %.1f MiB/s, %zu errors\n",
+           replay.nr_records, elapsed, replay.nr_records / elapsed,
+           total_bytes / elapsed / (1 << 20), nr_errors);
+
+    for (int op = 0; op < NR_OPS; op++) {
+        size_t n = 0;
+        uint64_t bytes = 0;
+
+        for (size_t i = 0; i < replay.nr_records; i++) {
+            if (op_of(replay.records[i].type) != op)
+                continue;
+            sorted[n++] = replay.latency_ns[i];
+            bytes += replay.records[i].len;
+        }
+        if (!n)
+            continue;
+        qsort(sorted, n, sizeof(uint64_t), compare_u64);
+        printf("  %-8s %8zu requests %10.1f MiB  latency us: p50 %.1f  "
+               "p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               op_names[op], n, bytes / (double) (1 << 20),
+               percentile_us(sorted, n, 50), percentile_us(sorted, n, 90),
+               percentile_us(sorted, n, 99), percentile_us(sorted, n, 99.9),
+               sorted[n - 1] / 1000.0);
+    }
+    free(sorted);
+}
+
+int main(int argc, char *argv[])
+{
+    struct option opts[] = {
+        {"mode", 1, NULL, 'm'},
+        {"jobs", 1, NULL, 'j'},
+        {"read-only", 0, NULL, 'r'},
+        {"help", 0, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int nr_jobs = 4;
+
+    replay.original_speed = true;
+    int c;
+    while ((c = getopt_long(argc, argv, "m:j:rh", opts, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            if (!strcmp(optarg, "max"))
+                replay.original_speed = false;
+            else if (strcmp(optarg, "original"))
+                return throw_err("Unknown replay mode '%s'", optarg);
+            break;
+        case 'j':
+            nr_jobs = atoi(optarg);
+            if (nr_jobs < 1 || nr_jobs > MAX_JOBS)
+                return throw_err("The number of jobs must be 1-%d", MAX_JOBS);
+            break;
+        case 'r':
+            replay.read_only = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    replay.records = blk_trace_load(argv[optind], &replay.nr_records);
+    if (!replay.records)
+        return 1;
+    if (diskimg_init(&replay.diskimg, argv[optind + 1]) < 0)
+        return throw_err("Failed to open disk image %s", argv[optind + 1]);
+    for (size_t i = 0; i < replay.nr_records; i++) {
+        struct blk_trace_record *record = &replay.records[i];
+        if (op_of(record->type) <= OP_WRITE && record->len > replay.max_len)
+            replay.max_len = record->len;
+    }
+    replay.latency_ns = calloc(replay.nr_records + 1, sizeof(uint64_t));
+    replay.status = calloc(replay.nr_records + 1, sizeof(int));
+    if (!replay.latency_ns || !replay.status) {
+        diskimg_exit(&replay.diskimg);
+        free(replay.records);
+        free(replay.latency_ns);
+        free(replay.status);
+        return throw_err("Failed to allocate the replay state");
+    }
+    pthread_mutex_init(&replay.lock, NULL);
+    pthread_cond_init(&replay.cond, NULL);
+
+    pthread_t jobs[MAX_JOBS];
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &replay.start);
+    for (int i = 0; i < nr_jobs; i++)
+        pthread_create(&jobs[i], NULL, replay_worker, NULL);
+    for (int i = 0; i < nr_jobs; i++)
+        pthread_join(jobs[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(elapsed_ns(&replay.start, &end) / (double) NS_PER_SEC);
+
+    diskimg_exit(&replay.diskimg);
+    free(replay.records);
+    free(replay.latency_ns);
+    free(replay.status);
+    pthread_mutex_destroy(&replay.lock);
+    pthread_cond_destroy(&replay.cond);
+    return 0;
+}
@@ -0,0 +1,256 @@
+#include <string.h>
+#include <time.h>
+
+#include "blk-stats.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static const char *op_names[BLK_STATS_NR_OPS] = {
+    [BLK_STATS_READ] = "read",
+    [BLK_STATS_WRITE] = "write",
+    [BLK_STATS_FLUSH] = "flush",
+    [BLK_STATS_OTHER] = "other",
+};
+
+static const char *phase_names[BLK_STATS_NR_PHASES] = {
+    [BLK_STATS_BACKEND] = "backend",
+    [BLK_STATS_PUBLISH] = "publish",
+    [BLK_STATS_TOTAL] = "total",
+};
+
+static uint64_t blk_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+#define stats_add(ptr, val) __atomic_fetch_add(ptr, val, __ATOMIC_RELAXED)
+#define stats_load(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
+static void stats_max(uint64_t *ptr, uint64_t val)
+{
+    uint64_t old = stats_load(ptr);
+    while (old < val && !__atomic_compare_exchange_n(ptr, &old, val, true,
+                                                     __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+        ;
+}
+
+static void blk_stats_hist_record(struct blk_stats_hist *hist, uint64_t ns)
+{
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= BLK_STATS_HIST_BUCKETS)
+        bucket = BLK_STATS_HIST_BUCKETS - 1;
+
+    stats_add(&hist->buckets[bucket], 1);
+    stats_add(&hist->count, 1);
+    stats_add(&hist->sum_ns, ns);
+    stats_max(&hist->max_ns, ns);
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static uint64_t blk_stats_hist_percentile(struct blk_stats_hist *hist,
+                                          uint64_t count,
+                                          unsigned int percent)
+{
+    uint64_t max = stats_load(&hist->max_ns);
+    uint64_t rank = (count * percent + 99) / 100, seen = 0;
+
+    for (int i = 0; i < BLK_STATS_HIST_BUCKETS; i++) {
+        seen += stats_load(&hist->buckets[i]);
+        if (seen >= rank) {
+            uint64_t bound = (2ULL << i) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+void blk_stats_init(struct blk_stats *stats)
+{
+    memset(stats, 0, sizeof(struct blk_stats));
+    stats->start_ns = blk_stats_now();
+}
+
+void blk_stats_harvest(struct blk_stats *stats, struct blk_stats_req *req)
+{
+    req->harvest_ns = blk_stats_now();
+    req->backend_ns = 0;
+    stats_max(&stats->max_inflight, stats_add(&stats->inflight, 1) + 1);
+}
+
+void blk_stats_backend_done(struct blk_stats_req *req)
+{
+    req->backend_ns = blk_stats_now();
+}
+
+void blk_stats_publish(struct blk_stats *stats,
+                       struct blk_stats_req *req,
+                       enum blk_stats_op op,
+                       size_t bytes,
+                       bool error)
+{
+    struct blk_stats_op_stats *op_stats = &stats->ops[op];
+    uint64_t now = blk_stats_now();
+
+    /* Requests rejected before reaching the backend complete right away */
+    if (!req->backend_ns)
+        req->backend_ns = now;
+
+    stats_add(&op_stats->nr_requests, 1);
+    stats_add(&op_stats->nr_bytes, bytes);
+    if (error)
+        stats_add(&op_stats->nr_errors, 1);
+    blk_stats_hist_record(&op_stats->phases[BLK_STATS_BACKEND],
+                          req->backend_ns - req->harvest_ns);
+    blk_stats_hist_record(&op_stats->phases[BLK_STATS_PUBLISH],
+                          now - req->backend_ns);
+    blk_stats_hist_record(&op_stats->phases[BLK_STATS_TOTAL],
+                          now - req->harvest_ns);
+    stats_add(&stats->inflight, -1);
+
+    if (!stats->batch_used_ns)
+        stats->batch_used_ns = now;
+}
+
+/* Called before a batch of requests is processed */
+void blk_stats_batch_begin(struct blk_stats *stats)
+{
+    stats->batch_used_ns = 0;
+}
+
+/* Called when the guest is interrupted for the used buffers of a batch */
+void blk_stats_notify(struct blk_stats *stats)
+{
+    if (!stats->batch_used_ns)
+        return;
+    blk_stats_hist_record(&stats->notify,
+                          blk_stats_now() - stats->batch_used_ns);
+    stats->batch_used_ns = 0;
+}
+
+static void blk_stats_dump_hist_text(struct blk_stats_hist *hist,
+                                     const char *name,
+                                     FILE *f)
+{
+    uint64_t count = stats_load(&hist->count);
+    if (!count)
+        return;
+
+    fprintf(f,
+            "    %-8s avg %8.1f us  p50 %8.1f us  p99 %8.1f us  "
+            "max %8.1f us\n",
+            name, stats_load(&hist->sum_ns) / 1000.0 / count,
+            blk_stats_hist_percentile(hist, count, 50) / 1000.0,
+            blk_stats_hist_percentile(hist, count, 99) / 1000.0,
+            stats_load(&hist->max_ns) / 1000.0);
+}
+
+static void blk_stats_dump_text(struct blk_stats *stats,
+                                const char *name,
+                                FILE *f,
+                                double elapsed)
+{
+    uint64_t nr_requests = 0;
+    for (int op = 0; op < BLK_STATS_NR_OPS; op++)
+        nr_requests += stats_load(&stats->ops[op].nr_requests);
+
+    fprintf(f, "%s: %lu requests, %.1f IOPS, inflight %lu, max inflight %lu\n",
+            name, nr_requests, nr_requests / elapsed,
+            stats_load(&stats->inflight), stats_load(&stats->max_inflight));
+    for (int op = 0; op < BLK_STATS_NR_OPS; op++) {
+        struct blk_stats_op_stats *op_stats = &stats->ops[op];
+        uint64_t n = stats_load(&op_stats->nr_requests);
+        if (!n)
+            continue;
+        fprintf(f, "  %s: %lu requests, %lu bytes, %lu errors\n", op_names[op],
+                n, stats_load(&op_stats->nr_bytes),
+                stats_load(&op_stats->nr_errors));
+        for (int phase = 0; phase < BLK_STATS_NR_PHASES; phase++)
+            blk_stats_dump_hist_text(&op_stats->phases[phase],
+                                     phase_names[phase], f);
+    }
+    if (stats_load(&stats->notify.count)) {
+        fprintf(f, "  interrupts: %lu\n", stats_load(&stats->notify.count));
+        blk_stats_dump_hist_text(&stats->notify, "notify", f);
+    }
+}
+
+static void blk_stats_dump_hist_json(struct blk_stats_hist *hist, FILE *f)
+{
+    uint64_t count = stats_load(&hist->count);
+
+    fprintf(f,
+            "{\"count\": %lu, \"sum_ns\": %lu, \"p50_ns\": %lu, "
+            "\"p99_ns\": %lu, \"max_ns\": %lu, \"buckets\": [",
+            count, stats_load(&hist->sum_ns),
+            blk_stats_hist_percentile(hist, count, 50),
+            blk_stats_hist_percentile(hist, count, 99),
+            stats_load(&hist->max_ns));
+    for (int i = 0; i < BLK_STATS_HIST_BUCKETS; i++)
+        fprintf(f, "%s%lu", i ? ", " : "", stats_load(&hist->buckets[i]));
+    fprintf(f, "]}");
+}
+
+/* Print @s as a quoted JSON string, as names may be paths */
+void blk_stats_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void blk_stats_dump_json(struct blk_stats *stats,
+                                const char *name,
+                                FILE *f,
+                                double elapsed)
+{
+    fprintf(f, "{\"name\": ");
+    blk_stats_json_string(f, name);
+    fprintf(f,
+            ", \"elapsed_s\": %.3f, \"inflight\": %lu, "
+            "\"max_inflight\": %lu, \"ops\": {",
+            elapsed, stats_load(&stats->inflight),
+            stats_load(&stats->max_inflight));
+    for (int op = 0; op < BLK_STATS_NR_OPS; op++) {
+        struct blk_stats_op_stats *op_stats = &stats->ops[op];
+        uint64_t n = stats_load(&op_stats->nr_requests);
+
+        fprintf(f,
+                "%s\"%s\": {\"requests\": %lu, \"iops\": %.1f, "
+                "\"bytes\": %lu, \"errors\": %lu",
+                op ? ", " : "", op_names[op], n, n / elapsed,
+                stats_load(&op_stats->nr_bytes),
+                stats_load(&op_stats->nr_errors));
+        for (int phase = 0; phase < BLK_STATS_NR_PHASES; phase++) {
+            fprintf(f, ", \"%s\": ", phase_names[phase]);
+            blk_stats_dump_hist_json(&op_stats->phases[phase], f);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "}, \"notify\": ");
+    blk_stats_dump_hist_json(&stats->notify, f);
+    fprintf(f, "}");
+}
+
+void blk_stats_dump(struct blk_stats *stats,
+                    const char *name,
+                    FILE *f,
+                    enum blk_stats_format format)
+{
+    double elapsed = (blk_stats_now() - stats->start_ns) / (double) NS_PER_SEC;
+
+    if (format == BLK_STATS_JSON)
+        blk_stats_dump_json(stats, name, f, elapsed);
+    else
+        blk_stats_dump_text(stats, name, f, elapsed);
+}
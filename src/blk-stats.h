@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Per-queue telemetry of the block request path.
+ *
+ * A request is timestamped when its descriptors are harvested from the
+ * available ring, when the backend completes it and when it is published to
+ * the used ring. Interrupts are timed from the first publication of a batch
+ * to the irqfd write. All counters are updated with atomics by the queue
+ * handler and may be read by a dumping thread at any time.
+ */
+
+enum blk_stats_op {
+    BLK_STATS_READ,
+    BLK_STATS_WRITE,
+    BLK_STATS_FLUSH,
+    BLK_STATS_OTHER,
+    BLK_STATS_NR_OPS,
+};
+
+enum blk_stats_phase {
+    BLK_STATS_BACKEND, /* harvest -> backend completion */
+    BLK_STATS_PUBLISH, /* backend completion -> used ring */
+    BLK_STATS_TOTAL,   /* harvest -> used ring */
+    BLK_STATS_NR_PHASES,
+};
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one is open */
+#define BLK_STATS_HIST_BUCKETS 36
+
+struct blk_stats_hist {
+    uint64_t buckets[BLK_STATS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+};
+
+struct blk_stats_op_stats {
+    uint64_t nr_requests;
+    uint64_t nr_bytes;
+    uint64_t nr_errors;
+    struct blk_stats_hist phases[BLK_STATS_NR_PHASES];
+};
+
+struct blk_stats {
+    struct blk_stats_op_stats ops[BLK_STATS_NR_OPS];
+    struct blk_stats_hist notify;
+    uint64_t inflight;
+    uint64_t max_inflight;
+    uint64_t batch_used_ns;
+    uint64_t start_ns;
+};
+
+/* Timestamps of one request on its way through the queue */
+struct blk_stats_req {
+    uint64_t harvest_ns;
+    uint64_t backend_ns;
+};
+
+enum blk_stats_format {
+    BLK_STATS_TEXT,
+    BLK_STATS_JSON,
+};
+
+void blk_stats_init(struct blk_stats *stats);
+void blk_stats_harvest(struct blk_stats *stats, struct blk_stats_req *req);
+void blk_stats_backend_done(struct blk_stats_req *req);
+void blk_stats_publish(struct blk_stats *stats,
+                       struct blk_stats_req *req,
+                       enum blk_stats_op op,
+                       size_t bytes,
+                       bool error);
+void blk_stats_batch_begin(struct blk_stats *stats);
+void blk_stats_notify(struct blk_stats *stats);
+void blk_stats_json_string(FILE *f, const char *s);
+void blk_stats_dump(struct blk_stats *stats,
+                    const char *name,
+                    FILE *f,
+                    enum blk_stats_format format);
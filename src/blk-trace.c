@@ -0,0 +1,98 @@
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "blk-trace.h"
+#include "err.h"
+
+#define BLK_TRACE_BUF_SIZE (1 << 20)
+
+static uint64_t blk_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int blk_trace_open(struct blk_trace *trace, const char *path)
+{
+    memset(trace, 0, sizeof(struct blk_trace));
+    trace->file = fopen(path, "w");
+    if (!trace->file)
+        return throw_err("Failed to create the block trace %s", path);
+    setvbuf(trace->file, NULL, _IOFBF, BLK_TRACE_BUF_SIZE);
+    if (fwrite(BLK_TRACE_MAGIC, strlen(BLK_TRACE_MAGIC), 1, trace->file) != 1) {
+        fclose(trace->file);
+        return throw_err("Failed to write the block trace %s", path);
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->start_ns = blk_trace_now();
+    return 0;
+}
+
+void blk_trace_add(struct blk_trace *trace,
+                   uint8_t type,
+                   uint8_t queue,
+                   uint64_t sector,
+                   uint32_t len)
+{
+    struct blk_trace_record record = {
+        .timestamp_ns = htole64(blk_trace_now() - trace->start_ns),
+        .sector = htole64(sector),
+        .len = htole32(len),
+        .type = type,
+        .queue = queue,
+    };
+
+    pthread_mutex_lock(&trace->lock);
+    if (fwrite(&record, sizeof(record), 1, trace->file) == 1)
+        trace->nr_records++;
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void blk_trace_close(struct blk_trace *trace)
+{
+    fclose(trace->file);
+    pthread_mutex_destroy(&trace->lock);
+}
+
+struct blk_trace_record *blk_trace_load(const char *path, size_t *nr_records)
+{
+    FILE *file = fopen(path, "r");
+    char magic[sizeof(BLK_TRACE_MAGIC) - 1];
+    struct stat st;
+
+    if (!file) {
+        throw_err("Failed to open the block trace %s", path);
+        return NULL;
+    }
+    if (fstat(fileno(file), &st) < 0 ||
+        fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, BLK_TRACE_MAGIC, sizeof(magic))) {
+        fclose(file);
+        throw_err("Invalid block trace %s", path);
+        return NULL;
+    }
+
+    *nr_records = (st.st_size - sizeof(magic)) / sizeof(struct blk_trace_record);
+    struct blk_trace_record *records =
+        malloc(*nr_records * sizeof(struct blk_trace_record) + 1);
+    if (!records || fread(records, sizeof(struct blk_trace_record),
+                          *nr_records, file) != *nr_records) {
+        free(records);
+        fclose(file);
+        throw_err("Failed to read the block trace %s", path);
+        return NULL;
+    }
+    fclose(file);
+    for (size_t i = 0; i < *nr_records; i++) {
+        records[i].timestamp_ns = le64toh(records[i].timestamp_ns);
+        records[i].sector = le64toh(records[i].sector);
+        records[i].len = le32toh(records[i].len);
+    }
+
+    return records;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Capture of block requests for offline replay.
+ *
+ * A trace is BLK_TRACE_MAGIC followed by one struct blk_trace_record per
+ * request in the order the requests were harvested, all in little endian.
+ * The type is a VIRTIO_BLK_T_* request type.
+ */
+
+#define BLK_TRACE_MAGIC "KVMHBTR1"
+
+struct blk_trace_record {
+    uint64_t timestamp_ns; /* since the capture started */
+    uint64_t sector;
+    uint32_t len;
+    uint8_t type;
+    uint8_t queue;
+    uint16_t reserved;
+} __attribute__((packed));
+
+struct blk_trace {
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start_ns;
+    uint64_t nr_records;
+};
+
+int blk_trace_open(struct blk_trace *trace, const char *path);
+void blk_trace_add(struct blk_trace *trace,
+                   uint8_t type,
+                   uint8_t queue,
+                   uint64_t sector,
+                   uint32_t len);
+void blk_trace_close(struct blk_trace *trace);
+struct blk_trace_record *blk_trace_load(const char *path, size_t *nr_records);
@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <linux/virtio_config.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "diskimg.h"
+#include "err.h"
+#include "placement.h"
+#include "vhost-user.h"
+#include "virtio-blk-req.h"
+#include "virtq.h"
+
+/* vhost-user-blk backend serving disk images to other VMMs, kvm-host among
+ * them. A single thread waits for the kicks of all queues of all disks, so
+ * storage processing stays on the cores it is pinned to, however many VMs
+ * are served. Each disk is bound to a socket which serves one VM at a time.
+ */
+
+#define BLKD_MAX_DISKS 64
+#define BLKD_VIRTQ_NUM 1
+#define BLKD_MAX_EVENTS 64
+
+#define BLKD_PROTOCOL_FEATURES                   \
+    ((1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+enum blkd_event_type {
+    BLKD_EV_LISTEN,
+    BLKD_EV_CONN,
+    BLKD_EV_KICK,
+    BLKD_EV_TIMER,
+    BLKD_EV_SIGNAL,
+};
+
+struct blkd_event {
+    enum blkd_event_type type;
+    struct blkd_disk *disk;
+    int index;
+};
+
+/* A region of the memory table of the VM, mapped into the daemon */
+struct blkd_region {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t userspace_addr;
+    void *mmap_addr;
+    size_t mmap_size;
+    void *host;
+};
+
+struct blkd_disk {
+    const char *socket_path;
+    const char *spec;
+    int listen_fd;
+    int sock; /* the connected VM, or -1 */
+    struct diskimg diskimg;
+    struct virtio_blk_disk disk;
+    struct virtq vq[BLKD_VIRTQ_NUM];
+    struct virtio_blk_queue queues[BLKD_VIRTQ_NUM];
+    int kickfd[BLKD_VIRTQ_NUM];
+    int callfd[BLKD_VIRTQ_NUM];
+    bool ring_started[BLKD_VIRTQ_NUM]; /* kick fd received */
+    bool ring_enabled[BLKD_VIRTQ_NUM];
+    bool has_vring_addr[BLKD_VIRTQ_NUM];
+    struct vhost_vring_addr vring_addr[BLKD_VIRTQ_NUM];
+    struct blkd_region regions[VHOST_USER_MAX_REGIONS];
+    int nr_regions;
+    uint64_t features;
+    uint64_t protocol_features;
+    struct blkd_event listen_ev, conn_ev, timer_ev;
+    struct blkd_event kick_ev[BLKD_VIRTQ_NUM];
+};
+
+static struct {
+    struct blkd_disk disks[BLKD_MAX_DISKS];
+    int nr_disks;
+    int epfd;
+    bool busy_poll;
+    bool stats_enabled;
+    enum blk_stats_format stats_format;
+    struct blkd_event signal_ev;
+} blkd;
+
+static void usage(const char *execpath)
+{
+    printf("\n usage: %s [options] socket disk-image[,opt=value] ...\n\n",
+           execpath);
+    printf("Serve disk images over vhost-user-blk, one per socket.\n");
+    printf("Disk image options are the ones of kvm-host.\n\n");
+    printf("options:\n");
+    printf("  %-30s%s", "-c, --cpu n",
+           "Pin the queue processing thread and disk helpers to a CPU\n");
+    printf("  %-30s%s", "-p, --poll",
+           "Busy-poll the queues, with guest kicks suppressed\n");
+    printf("  %-30s%s", "-s, --stats text|json",
+           "Dump queue statistics on SIGUSR2 and at exit\n");
+    printf("  %-30s%s", "-h, --help", "Print help of CLI and exit.\n");
+}
+
+static void *blkd_translate(struct blkd_disk *d,
+                            uint64_t addr,
+                            uint64_t len,
+                            bool userspace)
+{
+    for (int i = 0; i < d->nr_regions; i++) {
+        struct blkd_region *r = &d->regions[i];
+        uint64_t start = userspace ? r->userspace_addr : r->guest_phys_addr;
+        if (addr >= start && addr + len >= addr &&
+            addr + len <= start + r->size)
+            return r->host + (addr - start);
+    }
+    return NULL;
+}
+
+static void *blkd_guest_to_host(void *owner, uint64_t addr, uint64_t len)
+{
+    return blkd_translate((struct blkd_disk *) owner, addr, len, false);
+}
+
+static void blkd_epoll_add(int fd, struct blkd_event *ev)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = ev};
+
+    if (epoll_ctl(blkd.epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        throw_err("Failed to watch fd %d", fd);
+}
+
+static void blkd_close(int *fd)
+{
+    if (*fd < 0)
+        return;
+    /* The VMM keeps the eventfds open, so closing ours alone would leave
+     * them in the epoll set. Fds which were never added are refused.
+     */
+    epoll_ctl(blkd.epfd, EPOLL_CTL_DEL, *fd, NULL);
+    close(*fd);
+    *fd = -1;
+}
+
+static void blkd_complete_request(struct virtq *vq)
+{
+    struct blkd_disk *d = (struct blkd_disk *) vq->dev;
+
+    virtio_blk_process(&d->disk, &d->queues[vq - d->vq], vq);
+}
+
+static void blkd_notify_used(struct virtq *vq)
+{
+    struct blkd_disk *d = (struct blkd_disk *) vq->dev;
+    int index = vq - d->vq;
+    uint64_t n = 1;
+
+    if (d->callfd[index] >= 0 && write(d->callfd[index], &n, sizeof(n)) < 0)
+        throw_err("Failed to signal the call fd");
+    blk_stats_notify(&d->queues[index].stats);
+}
+
+static void blkd_enable_vq(struct virtq *vq) {}
+
+static struct virtq_ops ops = {
+    .enable_vq = blkd_enable_vq,
+    .complete_request = blkd_complete_request,
+    .notify_used = blkd_notify_used,
+};
+
+/* The descriptors of all entries of the ring and both event suppression
+ * structures must each lie within a single region of the memory table.
+ */
+static int blkd_map_ring(struct blkd_disk *d, int index)
+{
+    struct vhost_vring_addr *a = &d->vring_addr[index];
+    struct virtq *vq = &d->vq[index];
+    uint64_t ring_size = sizeof(struct vring_packed_desc) * vq->info.size;
+    uint64_t event_size = sizeof(struct vring_packed_desc_event);
+
+    vq->desc_ring = blkd_translate(d, a->desc_user_addr, ring_size, true);
+    vq->guest_event = blkd_translate(d, a->avail_user_addr, event_size, true);
+    vq->device_event = blkd_translate(d, a->used_user_addr, event_size, true);
+    if (!vq->desc_ring || !vq->guest_event || !vq->device_event) {
+        vq->desc_ring = NULL;
+        errno = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+/* A ring is processed once it has a kick fd and has been enabled. It is
+ * mapped again when it starts, with the size and memory table of the time.
+ * With busy polling, the guest is asked not to kick at all.
+ */
+static int blkd_update_ring(struct blkd_disk *d, int index)
+{
+    struct virtq *vq = &d->vq[index];
+    bool enable = d->ring_started[index] && d->ring_enabled[index] &&
+                  d->has_vring_addr[index];
+
+    if (enable == vq->info.enable)
+        return 0;
+    if (enable && blkd_map_ring(d, index) < 0)
+        return -1;
+    vq->info.enable = enable;
+    if (!enable)
+        return 0;
+    if (blkd.busy_poll)
+        vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    if (virtq_has_avail(vq))
+        virtq_handle_avail(vq);
+    return 0;
+}
+
+/* Rings which are processed must not change under the daemon */
+static bool blkd_rings_running(struct blkd_disk *d)
+{
+    for (int i = 0; i < BLKD_VIRTQ_NUM; i++) {
+        if (d->vq[i].info.enable)
+            return true;
+    }
+    return false;
+}
+
+static void blkd_unmap_regions(struct blkd_disk *d)
+{
+    for (int i = 0; i < d->nr_regions; i++)
+        munmap(d->regions[i].mmap_addr, d->regions[i].mmap_size);
+    d->nr_regions = 0;
+}
+
+static void blkd_reset(struct blkd_disk *d)
+{
+    for (int i = 0; i < BLKD_VIRTQ_NUM; i++) {
+        blkd_close(&d->kickfd[i]);
+        blkd_close(&d->callfd[i]);
+        d->ring_started[i] = d->ring_enabled[i] = false;
+        d->has_vring_addr[i] = false;
+        virtq_init(&d->vq[i], d, &ops);
+        d->vq[i].desc_ring = NULL;
+    }
+    blkd_unmap_regions(d);
+    d->features = d->protocol_features = 0;
+}
+
+static void blkd_disconnect(struct blkd_disk *d)
+{
+    blkd_close(&d->sock);
+    blkd_reset(d);
+    fprintf(stderr, "%s: disconnected\n", d->socket_path);
+}
+
+static int blkd_set_mem_table(struct blkd_disk *d, struct vhost_user_msg *msg)
+{
+    struct vhost_user_memory *mem = &msg->payload.memory;
+
+    if (mem->nregions > VHOST_USER_MAX_REGIONS ||
+        mem->nregions != (uint32_t) msg->nr_fds) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (blkd_rings_running(d)) {
+        errno = EBUSY;
+        return -1;
+    }
+    blkd_unmap_regions(d);
+    for (uint32_t i = 0; i < mem->nregions; i++) {
+        struct vhost_user_region *region = &mem->regions[i];
+        struct blkd_region *r = &d->regions[i];
+        r->mmap_size = region->memory_size + region->mmap_offset;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, msg->fds[i], 0);
+        if (r->mmap_addr == MAP_FAILED)
+            return -1;
+        d->nr_regions++;
+        r->guest_phys_addr = region->guest_phys_addr;
+        r->size = region->memory_size;
+        r->userspace_addr = region->userspace_addr;
+        r->host = r->mmap_addr + region->mmap_offset;
+    }
+    return 0;
+}
+
+static int blkd_set_vring_addr(struct blkd_disk *d, struct vhost_vring_addr *a)
+{
+    d->vring_addr[a->index] = *a;
+    d->has_vring_addr[a->index] = blkd_map_ring(d, a->index) == 0;
+    return d->has_vring_addr[a->index] ? 0 : -1;
+}
+
+/* Replace the kick or call fd of a ring. The message may carry no fd. */
+static int blkd_set_vring_fd(struct blkd_disk *d,
+                             struct vhost_user_msg *msg,
+                             int *fds)
+{
+    int index = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+
+    if (index >= BLKD_VIRTQ_NUM) {
+        errno = EINVAL;
+        return -1;
+    }
+    blkd_close(&fds[index]);
+    if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) && msg->nr_fds)
+        fds[index] = msg->fds[--msg->nr_fds];
+    return index;
+}
+
+/* Handle one message of the VMM. Returns 1 if a reply is in msg. */
+static int blkd_handle_msg(struct blkd_disk *d, struct vhost_user_msg *msg)
+{
+    struct vhost_vring_state *state = &msg->payload.state;
+    uint64_t value = msg->payload.u64;
+    int index;
+
+    switch (msg->hdr.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg->payload.u64 = (1ULL << VIRTIO_F_VERSION_1) |
+                           (1ULL << VIRTIO_F_RING_PACKED) |
+                           (1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+                           virtio_blk_disk_features(&d->disk);
+        msg->hdr.size = sizeof(uint64_t);
+        return 1;
+    case VHOST_USER_SET_FEATURES:
+        /* Only packed rings are implemented by virtq.c */
+        if (!(value & (1ULL << VIRTIO_F_RING_PACKED))) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        d->features = value;
+        if (!(value & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+            for (int i = 0; i < BLKD_VIRTQ_NUM; i++)
+                d->ring_enabled[i] = true;
+        }
+        return 0;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg->payload.u64 = BLKD_PROTOCOL_FEATURES;
+        msg->hdr.size = sizeof(uint64_t);
+        return 1;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        d->protocol_features = value & BLKD_PROTOCOL_FEATURES;
+        return 0;
+    case VHOST_USER_GET_QUEUE_NUM:
+        msg->payload.u64 = BLKD_VIRTQ_NUM;
+        msg->hdr.size = sizeof(uint64_t);
+        return 1;
+    case VHOST_USER_SET_OWNER:
+        return 0;
+    case VHOST_USER_SET_MEM_TABLE:
+        return blkd_set_mem_table(d, msg);
+    case VHOST_USER_GET_CONFIG: {
+        struct vhost_user_config *config = &msg->payload.config;
+        if (config->offset > sizeof(d->disk.config) ||
+            config->size > sizeof(d->disk.config) - config->offset) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(config->region, (uint8_t *) &d->disk.config + config->offset,
+               config->size);
+        msg->hdr.size = offsetof(struct vhost_user_config, region) +
+                        config->size;
+        return 1;
+    }
+    case VHOST_USER_SET_CONFIG: {
+        /* The write cache toggle is the only writable field */
+        struct vhost_user_config *config = &msg->payload.config;
+        if (config->offset != offsetof(struct virtio_blk_config, wce) ||
+            config->size != sizeof(d->disk.config.wce)) {
+            errno = EINVAL;
+            return -1;
+        }
+        d->disk.config.wce = config->region[0];
+        return 0;
+    }
+    }
+
+    /* The remaining requests concern a single ring, whose layout only
+     * changes while it is stopped.
+     */
+    if (state->index >= BLKD_VIRTQ_NUM &&
+        msg->hdr.request != VHOST_USER_SET_VRING_KICK &&
+        msg->hdr.request != VHOST_USER_SET_VRING_CALL &&
+        msg->hdr.request != VHOST_USER_SET_VRING_ERR) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((msg->hdr.request == VHOST_USER_SET_VRING_NUM ||
+         msg->hdr.request == VHOST_USER_SET_VRING_ADDR ||
+         msg->hdr.request == VHOST_USER_SET_VRING_BASE) &&
+        d->vq[state->index].info.enable) {
+        errno = EBUSY;
+        return -1;
+    }
+    switch (msg->hdr.request) {
+    case VHOST_USER_SET_VRING_NUM:
+        if (!state->num || state->num > 32768) {
+            errno = EINVAL;
+            return -1;
+        }
+        d->vq[state->index].info.size = state->num;
+        return 0;
+    case VHOST_USER_SET_VRING_ADDR:
+        return blkd_set_vring_addr(d, &msg->payload.addr);
+    case VHOST_USER_SET_VRING_BASE:
+        /* The wrap counter of a packed ring is in bit 15 */
+        d->vq[state->index].next_avail_idx = state->num & 0x7fff;
+        d->vq[state->index].used_wrap_count = state->num >> 15;
+        return 0;
+    case VHOST_USER_GET_VRING_BASE: {
+        struct virtq *vq = &d->vq[state->index];
+        d->ring_started[state->index] = false;
+        blkd_update_ring(d, state->index);
+        state->num = vq->next_avail_idx | (vq->used_wrap_count << 15);
+        msg->hdr.size = sizeof(*state);
+        return 1;
+    }
+    case VHOST_USER_SET_VRING_KICK:
+        /* Without a kick fd the ring is only processed when busy polling */
+        if ((msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) &&
+            !blkd.busy_poll) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if ((index = blkd_set_vring_fd(d, msg, d->kickfd)) < 0)
+            return -1;
+        if (d->kickfd[index] >= 0)
+            blkd_epoll_add(d->kickfd[index], &d->kick_ev[index]);
+        d->ring_started[index] = true;
+        return blkd_update_ring(d, index);
+    case VHOST_USER_SET_VRING_CALL:
+        return blkd_set_vring_fd(d, msg, d->callfd) < 0 ? -1 : 0;
+    case VHOST_USER_SET_VRING_ERR:
+        /* Errors are reported through the status byte instead */
+        vhost_user_close_fds(msg);
+        return 0;
+    case VHOST_USER_SET_VRING_ENABLE:
+        d->ring_enabled[state->index] = state->num;
+        return blkd_update_ring(d, state->index);
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+}
+
+static void blkd_handle_conn(struct blkd_disk *d)
+{
+    struct vhost_user_msg msg;
+
+    if (vhost_user_recv(d->sock, &msg) < 0) {
+        if (errno != ECONNRESET)
+            throw_err("%s: failed to receive a message", d->socket_path);
+        blkd_disconnect(d);
+        return;
+    }
+
+    bool need_reply = (msg.hdr.flags & VHOST_USER_FLAG_NEED_REPLY) &&
+                      (d->protocol_features &
+                       (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+    int r = blkd_handle_msg(d, &msg);
+    vhost_user_close_fds(&msg);
+    if (r < 0)
+        throw_err("%s: vhost-user request %u failed", d->socket_path,
+                  msg.hdr.request);
+    /* A failure the VMM cannot be told about leaves the device unusable */
+    if (r < 0 && !need_reply) {
+        blkd_disconnect(d);
+        return;
+    }
+    if (r == 0 && !need_reply)
+        return;
+    if (r <= 0) {
+        msg.payload.u64 = r < 0;
+        msg.hdr.size = sizeof(uint64_t);
+    }
+    msg.hdr.flags = VHOST_USER_FLAG_REPLY;
+    if (vhost_user_send(d->sock, &msg) < 0) {
+        throw_err("%s: failed to reply", d->socket_path);
+        blkd_disconnect(d);
+    }
+}
+
+static void blkd_accept(struct blkd_disk *d)
+{
+    int sock = accept4(d->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (sock < 0) {
+        throw_err("%s: failed to accept a connection", d->socket_path);
+        return;
+    }
+    if (d->sock >= 0) {
+        fprintf(stderr, "%s: already serving a VM\n", d->socket_path);
+        close(sock);
+        return;
+    }
+    d->sock = sock;
+    blkd_epoll_add(d->sock, &d->conn_ev);
+    fprintf(stderr, "%s: connected\n", d->socket_path);
+}
+
+static int blkd_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int blkd_add_disk(const char *socket_path, const char *spec)
+{
+    struct blkd_disk *d = &blkd.disks[blkd.nr_disks];
+
+    if (blkd.nr_disks == BLKD_MAX_DISKS)
+        return throw_err("At most %d disks are supported", BLKD_MAX_DISKS);
+    d->socket_path = socket_path;
+    d->spec = spec;
+    d->sock = -1;
+    if (diskimg_init(&d->diskimg, spec) < 0)
+        return -1;
+    if (virtio_blk_disk_init(&d->disk, &d->diskimg, blkd_guest_to_host, d) < 0)
+        return -1;
+    for (int i = 0; i < BLKD_VIRTQ_NUM; i++) {
+        d->kickfd[i] = d->callfd[i] = -1;
+        d->kick_ev[i] = (struct blkd_event){BLKD_EV_KICK, d, i};
+        virtio_blk_queue_init(&d->queues[i], i);
+    }
+    blkd_reset(d);
+    d->listen_fd = blkd_listen(socket_path);
+    if (d->listen_fd < 0)
+        return throw_err("Failed to listen on %s", socket_path);
+    d->listen_ev = (struct blkd_event){BLKD_EV_LISTEN, d, 0};
+    d->conn_ev = (struct blkd_event){BLKD_EV_CONN, d, 0};
+    d->timer_ev = (struct blkd_event){BLKD_EV_TIMER, d, 0};
+    blkd_epoll_add(d->listen_fd, &d->listen_ev);
+    blkd_epoll_add(d->disk.throttle_timerfd, &d->timer_ev);
+    blkd.nr_disks++;
+    return 0;
+}
+
+static void blkd_dump_stats(void)
+{
+    if (blkd.stats_format == BLK_STATS_JSON)
+        fprintf(stderr, "{\"disks\": [");
+    for (int i = 0; i < blkd.nr_disks; i++) {
+        struct blkd_disk *d = &blkd.disks[i];
+        if (blkd.stats_format == BLK_STATS_JSON && i)
+            fprintf(stderr, ", ");
+        virtio_blk_disk_dump_stats(&d->disk, d->queues, BLKD_VIRTQ_NUM,
+                                   d->socket_path, stderr, blkd.stats_format);
+    }
+    if (blkd.stats_format == BLK_STATS_JSON)
+        fprintf(stderr, "]}\n");
+    fflush(stderr);
+}
+
+/* Busy polling goes over all rings between the checks for other events */
+static void blkd_poll_rings(void)
+{
+    for (int i = 0; i < blkd.nr_disks; i++) {
+        struct blkd_disk *d = &blkd.disks[i];
+        for (int j = 0; j < BLKD_VIRTQ_NUM; j++) {
+            if (d->vq[j].info.enable && virtq_has_avail(&d->vq[j]))
+                virtq_handle_avail(&d->vq[j]);
+        }
+    }
+}
+
+/* Returns false once the daemon is asked to stop */
+static bool blkd_handle_event(struct blkd_event *ev, int sigfd)
+{
+    struct blkd_disk *d = ev->disk;
+    struct signalfd_siginfo si;
+    uint64_t n;
+
+    switch (ev->type) {
+    case BLKD_EV_LISTEN:
+        blkd_accept(d);
+        break;
+    case BLKD_EV_CONN:
+        blkd_handle_conn(d);
+        break;
+    case BLKD_EV_KICK:
+        if (read(d->kickfd[ev->index], &n, sizeof(n)) < 0)
+            throw_err("Failed to read the kick fd");
+        virtq_handle_avail(&d->vq[ev->index]);
+        break;
+    case BLKD_EV_TIMER:
+        if (read(d->disk.throttle_timerfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the throttle timer");
+        for (int i = 0; i < BLKD_VIRTQ_NUM; i++)
+            virtq_handle_avail(&d->vq[i]);
+        break;
+    case BLKD_EV_SIGNAL:
+        if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+            break;
+        if (si.ssi_signo != SIGUSR2)
+            return false;
+        if (blkd.stats_enabled)
+            blkd_dump_stats();
+        break;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct option opts[] = {
+        {"cpu", required_argument, NULL, 'c'},
+        {"poll", no_argument, NULL, 'p'},
+        {"stats", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    char placement[64];
+    int c;
+
+    while ((c = getopt_long(argc, argv, "c:ps:h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'c':
+            snprintf(placement, sizeof(placement), "io,cpus=%s", optarg);
+            if (placement_parse(placement) < 0)
+                exit(1);
+            break;
+        case 'p':
+            blkd.busy_poll = true;
+            break;
+        case 's':
+            blkd.stats_enabled = true;
+            if (!strcmp(optarg, "json"))
+                blkd.stats_format = BLK_STATS_JSON;
+            else if (strcmp(optarg, "text"))
+                return throw_err("Unknown statistics format '%s'", optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (optind == argc || (argc - optind) % 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* The helper threads of the disks place themselves as I/O threads too */
+    placement_apply(PLACEMENT_IO, NULL);
+
+    /* Signals are taken as events of the polling thread. They are blocked
+     * before disks start any helper thread, so those inherit the mask.
+     */
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    int sigfd = signalfd(-1, &sigset, SFD_CLOEXEC);
+
+    blkd.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (blkd.epfd < 0 || sigfd < 0)
+        return throw_err("Failed to set up the event loop");
+    blkd.signal_ev.type = BLKD_EV_SIGNAL;
+    blkd_epoll_add(sigfd, &blkd.signal_ev);
+
+    for (int i = optind; i < argc; i += 2) {
+        if (blkd_add_disk(argv[i], argv[i + 1]) < 0)
+            return throw_err("Failed to serve disk image %s", argv[i + 1]);
+    }
+
+    struct epoll_event events[BLKD_MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(blkd.epfd, events, BLKD_MAX_EVENTS,
+                           blkd.busy_poll ? 0 : -1);
+        if (n < 0 && errno != EINTR)
+            return throw_err("Failed to wait for events");
+        for (int i = 0; i < n && running; i++)
+            running = blkd_handle_event(events[i].data.ptr, sigfd);
+        if (blkd.busy_poll)
+            blkd_poll_rings();
+    }
+
+    if (blkd.stats_enabled)
+        blkd_dump_stats();
+    for (int i = 0; i < blkd.nr_disks; i++) {
+        struct blkd_disk *d = &blkd.disks[i];
+        blkd_close(&d->sock);
+        blkd_reset(d);
+        close(d->listen_fd);
+        unlink(d->socket_path);
+        virtio_blk_disk_exit(&d->disk);
+    }
+    return 0;
+}
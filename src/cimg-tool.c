@@ -0,0 +1,177 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cimg.h"
+#include "err.h"
+
+static void usage(const char *execpath)
+{
+    printf("\n usage: %s [options] input output\n\n", execpath);
+    printf("Convert a raw disk image to a compressed read-only image.\n\n");
+    printf("options:\n");
+    printf("  %-30s%s", "-c, --chunk-size size",
+           "Size of a chunk in bytes, a power of two (default: 65536)\n");
+    printf("  %-30s%s", "-l, --level level",
+           "zlib compression level 1-9 (default: 6)\n");
+    printf("  %-30s%s", "-x, --extract",
+           "Convert a compressed image back to a raw image\n");
+    printf("  %-30s%s", "-h, --help", "Print help of CLI and exit.\n");
+}
+
+static int compress_image(int in, int out, uint32_t chunk_shift, int level)
+{
+    struct stat st;
+    if (fstat(in, &st) < 0)
+        return throw_err("Failed to stat the input image");
+
+    size_t chunk_size = 1UL << chunk_shift;
+    uint64_t nr_chunks = (st.st_size + chunk_size - 1) >> chunk_shift;
+    struct cimg_header hdr = {
+        .version = htole32(CIMG_VERSION),
+        .chunk_shift = htole32(chunk_shift),
+        .size = htole64(st.st_size),
+        .nr_chunks = htole64(nr_chunks),
+    };
+    memcpy(hdr.magic, CIMG_MAGIC, sizeof(hdr.magic));
+
+    size_t index_len = (nr_chunks + 1) * sizeof(uint64_t);
+    uint64_t *index = malloc(index_len);
+    uint8_t *src = malloc(chunk_size);
+    size_t bound = compressBound(chunk_size);
+    uint8_t *dst = malloc(bound);
+    int ret = 0;
+    if (!index || !src || !dst) {
+        ret = throw_err("Failed to allocate buffers");
+        goto out;
+    }
+
+    uint64_t pos = sizeof(hdr) + index_len;
+    for (uint64_t i = 0; i < nr_chunks; i++) {
+        off_t offset = i << chunk_shift;
+        size_t len = st.st_size - offset < chunk_size ? st.st_size - offset
+                                                      : chunk_size;
+        if (pread(in, src, len, offset) != (ssize_t) len) {
+            ret = throw_err("Failed to read chunk %lu", i);
+            goto out;
+        }
+
+        size_t stored = bound;
+        if (cimg_compress_chunk(dst, &stored, src, len, level) < 0) {
+            ret = throw_err("Failed to compress chunk %lu", i);
+            goto out;
+        }
+        if (pwrite(out, dst, stored, pos) != (ssize_t) stored) {
+            ret = throw_err("Failed to write chunk %lu", i);
+            goto out;
+        }
+        index[i] = htole64(pos);
+        pos += stored;
+    }
+    index[nr_chunks] = htole64(pos);
+
+    if (pwrite(out, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(out, index, index_len, sizeof(hdr)) != (ssize_t) index_len) {
+        ret = throw_err("Failed to write the image header");
+        goto out;
+    }
+
+    printf("%lu bytes in %lu chunks compressed to %lu bytes (%.1f%%)\n",
+           (uint64_t) st.st_size, nr_chunks, pos,
+           st.st_size ? 100.0 * pos / st.st_size : 0);
+out:
+    free(index);
+    free(src);
+    free(dst);
+    return ret;
+}
+
+static int extract_image(int in, int out)
+{
+    struct cimg cimg;
+    if (cimg_open(&cimg, in) < 0)
+        return -1;
+
+    size_t buf_len = 1UL << 20;
+    uint8_t *buf = malloc(buf_len);
+    int ret = buf ? 0 : throw_err("Failed to allocate buffers");
+    for (uint64_t pos = 0; pos < cimg.size && !ret; pos += buf_len) {
+        size_t len = cimg.size - pos < buf_len ? cimg.size - pos : buf_len;
+        if (cimg_read(&cimg, buf, pos, len) < 0)
+            ret = throw_err("Failed to read the compressed image");
+        else if (pwrite(out, buf, len, pos) != (ssize_t) len)
+            ret = throw_err("Failed to write the raw image");
+    }
+
+    free(buf);
+    cimg_close(&cimg);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    struct option opts[] = {
+        {"chunk-size", 1, NULL, 'c'},
+        {"level", 1, NULL, 'l'},
+        {"extract", 0, NULL, 'x'},
+        {"help", 0, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    uint32_t chunk_shift = CIMG_DEFAULT_CHUNK_SHIFT;
+    int level = Z_DEFAULT_COMPRESSION;
+    bool extract = false;
+    unsigned long chunk_size;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "c:l:xh", opts, NULL)) != -1) {
+        switch (c) {
+        case 'c':
+            chunk_size = strtoul(optarg, NULL, 0);
+            if (!chunk_size || (chunk_size & (chunk_size - 1)))
+                return throw_err("The chunk size must be a power of two");
+            chunk_shift = __builtin_ctzl(chunk_size);
+            if (chunk_shift < CIMG_MIN_CHUNK_SHIFT ||
+                chunk_shift > CIMG_MAX_CHUNK_SHIFT)
+                return throw_err("The chunk size must be within %lu and %lu",
+                                 1UL << CIMG_MIN_CHUNK_SHIFT,
+                                 1UL << CIMG_MAX_CHUNK_SHIFT);
+            break;
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'x':
+            extract = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    int in = open(argv[optind], O_RDONLY);
+    if (in < 0)
+        return throw_err("Failed to open %s", argv[optind]);
+    int out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        return throw_err("Failed to create %s", argv[optind + 1]);
+
+    int ret = extract ? extract_image(in, out)
+                      : compress_image(in, out, chunk_shift, level);
+    if (fsync(out) < 0)
+        ret = throw_err("Failed to sync %s", argv[optind + 1]);
+    close(in);
+    close(out);
+    return ret < 0 ? 1 : 0;
+}
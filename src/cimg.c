@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cimg.h"
+#include "err.h"
+#include "placement.h"
+
+bool cimg_probe(int fd)
+{
+    char magic[sizeof(((struct cimg_header *) 0)->magic)];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           !memcmp(magic, CIMG_MAGIC, sizeof(magic));
+}
+
+static size_t cimg_chunk_len(struct cimg *cimg, uint64_t chunk)
+{
+    uint64_t start = chunk << cimg->chunk_shift;
+    uint64_t len = 1ULL << cimg->chunk_shift;
+
+    return start + len > cimg->size ? cimg->size - start : len;
+}
+
+/* Decompress a chunk into out, which holds a full chunk */
+static int cimg_inflate(struct cimg *cimg, uint64_t chunk, uint8_t *out)
+{
+    size_t len = cimg_chunk_len(cimg, chunk);
+    uint64_t start = cimg->index[chunk];
+    size_t stored = cimg->index[chunk + 1] - start;
+
+    if (stored == 0) {
+        memset(out, 0, len);
+        return 0;
+    }
+    if (stored == len)
+        return pread(cimg->fd, out, len, start) == (ssize_t) len ? 0 : -1;
+
+    void *buf = malloc(stored);
+    if (!buf)
+        return -1;
+    int ret = -1;
+    uLongf out_len = len;
+    if (pread(cimg->fd, buf, stored, start) == (ssize_t) stored &&
+        uncompress(out, &out_len, buf, stored) == Z_OK && out_len == len)
+        ret = 0;
+    free(buf);
+    return ret;
+}
+
+/* The following helpers are called with cimg->lock held */
+
+static struct cimg_slot *cimg_lookup(struct cimg *cimg, uint64_t chunk)
+{
+    for (int i = 0; i < CIMG_CACHE_SLOTS; i++) {
+        struct cimg_slot *slot = &cimg->slots[i];
+        if (slot->state != CIMG_SLOT_EMPTY && slot->chunk == chunk)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Pick the least recently used slot which nobody is reading from */
+static struct cimg_slot *cimg_evict(struct cimg *cimg, uint64_t chunk)
+{
+    struct cimg_slot *victim = NULL;
+
+    for (int i = 0; i < CIMG_CACHE_SLOTS; i++) {
+        struct cimg_slot *slot = &cimg->slots[i];
+        if (slot->refs || slot->state == CIMG_SLOT_LOADING)
+            continue;
+        if (!victim || slot->last_use < victim->last_use)
+            victim = slot;
+    }
+    if (!victim)
+        return NULL;
+    if (!victim->data && !(victim->data = malloc(1UL << cimg->chunk_shift)))
+        return NULL;
+
+    victim->chunk = chunk;
+    victim->state = CIMG_SLOT_LOADING;
+    victim->refs = 1;
+    return victim;
+}
+
+static void cimg_loaded(struct cimg *cimg, struct cimg_slot *slot, int ret)
+{
+    slot->state = ret < 0 ? CIMG_SLOT_EMPTY : CIMG_SLOT_READY;
+    slot->last_use = ++cimg->clock;
+    pthread_cond_broadcast(&cimg->cond);
+}
+
+/* Get a pinned slot holding the decompressed chunk. Returns NULL if the cache
+ * has no free slot, and sets *err if the chunk cannot be decompressed.
+ */
+static struct cimg_slot *cimg_get(struct cimg *cimg, uint64_t chunk, int *err)
+{
+    struct cimg_slot *slot;
+
+    *err = 0;
+    pthread_mutex_lock(&cimg->lock);
+    while ((slot = cimg_lookup(cimg, chunk)) &&
+           slot->state == CIMG_SLOT_LOADING)
+        pthread_cond_wait(&cimg->cond, &cimg->lock);
+    if (slot) {
+        slot->refs++;
+        slot->last_use = ++cimg->clock;
+        pthread_mutex_unlock(&cimg->lock);
+        return slot;
+    }
+
+    slot = cimg_evict(cimg, chunk);
+    pthread_mutex_unlock(&cimg->lock);
+    if (!slot)
+        return NULL;
+
+    *err = cimg_inflate(cimg, chunk, slot->data);
+
+    pthread_mutex_lock(&cimg->lock);
+    cimg_loaded(cimg, slot, *err);
+    if (*err < 0) {
+        slot->refs = 0;
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&cimg->lock);
+    return slot;
+}
+
+static void cimg_put(struct cimg *cimg, struct cimg_slot *slot)
+{
+    pthread_mutex_lock(&cimg->lock);
+    slot->refs--;
+    pthread_mutex_unlock(&cimg->lock);
+}
+
+static void *cimg_worker(void *arg)
+{
+    struct cimg *cimg = (struct cimg *) arg;
+
+    placement_apply(PLACEMENT_IO, "cimg");
+    pthread_mutex_lock(&cimg->lock);
+    while (!cimg->stop) {
+        if (cimg->queue_head == cimg->queue_tail) {
+            pthread_cond_wait(&cimg->queue_cond, &cimg->lock);
+            continue;
+        }
+        uint64_t chunk = cimg->queue[cimg->queue_head++ % CIMG_QUEUE_LEN];
+        if (cimg_lookup(cimg, chunk))
+            continue;
+        struct cimg_slot *slot = cimg_evict(cimg, chunk);
+        if (!slot)
+            continue;
+        pthread_mutex_unlock(&cimg->lock);
+
+        int ret = cimg_inflate(cimg, chunk, slot->data);
+
+        pthread_mutex_lock(&cimg->lock);
+        cimg_loaded(cimg, slot, ret);
+        slot->refs = 0;
+    }
+    pthread_mutex_unlock(&cimg->lock);
+
+    return NULL;
+}
+
+/* Queue the chunks following a sequential read for the workers */
+static void cimg_readahead(struct cimg *cimg, uint64_t first, uint64_t last)
+{
+    pthread_mutex_lock(&cimg->lock);
+    bool sequential = first == cimg->last_chunk || first == cimg->last_chunk + 1;
+    cimg->last_chunk = last;
+    if (!sequential) {
+        pthread_mutex_unlock(&cimg->lock);
+        return;
+    }
+
+    for (uint64_t chunk = last + 1;
+         chunk <= last + CIMG_READAHEAD_CHUNKS && chunk < cimg->nr_chunks;
+         chunk++) {
+        if (cimg->queue_tail - cimg->queue_head == CIMG_QUEUE_LEN)
+            break;
+        if (cimg_lookup(cimg, chunk))
+            continue;
+        cimg->queue[cimg->queue_tail++ % CIMG_QUEUE_LEN] = chunk;
+    }
+    pthread_cond_broadcast(&cimg->queue_cond);
+    pthread_mutex_unlock(&cimg->lock);
+}
+
+ssize_t cimg_read(struct cimg *cimg, void *data, off_t offset, size_t size)
+{
+    uint64_t end = offset + size;
+    uint8_t *buf = data;
+
+    /* Past the end of the image reads as zeros */
+    if ((uint64_t) offset >= cimg->size) {
+        memset(buf, 0, size);
+        return size;
+    }
+    if (end > cimg->size) {
+        memset(buf + (cimg->size - offset), 0, end - cimg->size);
+        end = cimg->size;
+    }
+    if (!size)
+        return 0;
+
+    uint64_t first = offset >> cimg->chunk_shift;
+    uint64_t last = (end - 1) >> cimg->chunk_shift;
+    cimg_readahead(cimg, first, last);
+
+    for (uint64_t chunk = first, pos = offset; chunk <= last; chunk++) {
+        uint64_t chunk_start = chunk << cimg->chunk_shift;
+        uint64_t chunk_end = chunk_start + cimg_chunk_len(cimg, chunk);
+        size_t len = (chunk_end < end ? chunk_end : end) - pos;
+        int err;
+
+        struct cimg_slot *slot = cimg_get(cimg, chunk, &err);
+        if (err < 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (slot) {
+            memcpy(buf + (pos - offset), slot->data + (pos - chunk_start), len);
+            cimg_put(cimg, slot);
+        } else {
+            /* Every slot is in use, decompress without caching */
+            uint8_t *tmp = malloc(1UL << cimg->chunk_shift);
+            if (!tmp || cimg_inflate(cimg, chunk, tmp) < 0) {
+                free(tmp);
+                errno = EIO;
+                return -1;
+            }
+            memcpy(buf + (pos - offset), tmp + (pos - chunk_start), len);
+            free(tmp);
+        }
+        pos += len;
+    }
+
+    return size;
+}
+
+/* Bring the stored chunks of [offset, offset + size) into the page cache */
+int cimg_prefetch(struct cimg *cimg, off_t offset, size_t size)
+{
+    uint64_t end = offset + size;
+
+    if (end > cimg->size)
+        end = cimg->size;
+    if ((uint64_t) offset >= end)
+        return 0;
+
+    uint64_t first = offset >> cimg->chunk_shift;
+    uint64_t last = (end - 1) >> cimg->chunk_shift;
+    return readahead(cimg->fd, cimg->index[first],
+                     cimg->index[last + 1] - cimg->index[first]);
+}
+
+int cimg_compress_chunk(void *dst,
+                        size_t *dst_len,
+                        const void *src,
+                        size_t src_len,
+                        int level)
+{
+    const uint8_t *p = src;
+    size_t i;
+
+    for (i = 0; i < src_len && !p[i]; i++)
+        ;
+    if (i == src_len) {
+        *dst_len = 0;
+        return 0;
+    }
+
+    uLongf len = *dst_len;
+    if (compress2(dst, &len, src, src_len, level) != Z_OK || len >= src_len) {
+        if (*dst_len < src_len)
+            return -1;
+        memcpy(dst, src, src_len);
+        len = src_len;
+    }
+    *dst_len = len;
+    return 0;
+}
+
+int cimg_open(struct cimg *cimg, int fd)
+{
+    struct cimg_header hdr;
+    struct stat st;
+
+    memset(cimg, 0, sizeof(struct cimg));
+    cimg->fd = fd;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &st) < 0)
+        return throw_err("Failed to read the compressed image header");
+    hdr.version = le32toh(hdr.version);
+    hdr.chunk_shift = le32toh(hdr.chunk_shift);
+    hdr.size = le64toh(hdr.size);
+    hdr.nr_chunks = le64toh(hdr.nr_chunks);
+    if (hdr.version != CIMG_VERSION || hdr.chunk_shift < CIMG_MIN_CHUNK_SHIFT ||
+        hdr.chunk_shift > CIMG_MAX_CHUNK_SHIFT ||
+        hdr.nr_chunks != (hdr.size >> hdr.chunk_shift) +
+                             !!(hdr.size & ((1ULL << hdr.chunk_shift) - 1)))
+        return throw_err("Unsupported compressed image");
+
+    cimg->size = hdr.size;
+    cimg->chunk_shift = hdr.chunk_shift;
+    cimg->nr_chunks = hdr.nr_chunks;
+    size_t index_len = (cimg->nr_chunks + 1) * sizeof(uint64_t);
+    cimg->index = malloc(index_len);
+    if (!cimg->index ||
+        pread(fd, cimg->index, index_len, sizeof(hdr)) != (ssize_t) index_len) {
+        free(cimg->index);
+        return throw_err("Failed to read the compressed image index");
+    }
+    for (uint64_t i = 0; i <= cimg->nr_chunks; i++)
+        cimg->index[i] = le64toh(cimg->index[i]);
+    for (uint64_t i = 0; i < cimg->nr_chunks; i++) {
+        uint64_t stored = cimg->index[i + 1] - cimg->index[i];
+        if (cimg->index[i + 1] < cimg->index[i] ||
+            cimg->index[i + 1] > (uint64_t) st.st_size ||
+            stored > cimg_chunk_len(cimg, i)) {
+            free(cimg->index);
+            return throw_err("Corrupted compressed image index");
+        }
+    }
+
+    pthread_mutex_init(&cimg->lock, NULL);
+    pthread_cond_init(&cimg->cond, NULL);
+    pthread_cond_init(&cimg->queue_cond, NULL);
+    cimg->last_chunk = -1;
+    for (int i = 0; i < CIMG_NR_WORKERS; i++)
+        pthread_create(&cimg->workers[i], NULL, cimg_worker, cimg);
+
+    return 0;
+}
+
+void cimg_close(struct cimg *cimg)
+{
+    pthread_mutex_lock(&cimg->lock);
+    cimg->stop = true;
+    pthread_cond_broadcast(&cimg->queue_cond);
+    pthread_mutex_unlock(&cimg->lock);
+    for (int i = 0; i < CIMG_NR_WORKERS; i++)
+        pthread_join(cimg->workers[i], NULL);
+
+    for (int i = 0; i < CIMG_CACHE_SLOTS; i++)
+        free(cimg->slots[i].data);
+    free(cimg->index);
+    pthread_mutex_destroy(&cimg->lock);
+    pthread_cond_destroy(&cimg->cond);
+    pthread_cond_destroy(&cimg->queue_cond);
+}
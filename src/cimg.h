@@ -0,0 +1,88 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Seekable compressed read-only disk image.
+ *
+ * The image is split into fixed-size chunks which are deflated
+ * independently, so any chunk can be read without touching the others.
+ *
+ *   struct cimg_header
+ *   uint64_t index[nr_chunks + 1]    file offset of each chunk
+ *   chunk data
+ *
+ * Chunk i occupies [index[i], index[i + 1]) in the file. An empty chunk is
+ * all zeros, and a chunk as long as its uncompressed size is stored as is.
+ * All fields are little endian.
+ */
+
+#define CIMG_MAGIC "KVMHCIMG"
+#define CIMG_VERSION 1
+#define CIMG_DEFAULT_CHUNK_SHIFT 16 /* 64 KiB */
+#define CIMG_MIN_CHUNK_SHIFT 12
+#define CIMG_MAX_CHUNK_SHIFT 24
+
+struct cimg_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_shift;
+    uint64_t size;
+    uint64_t nr_chunks;
+} __attribute__((packed));
+
+/* Decompressed chunks are kept in a small cache, and sequential reads let a
+ * pool of threads decompress the following chunks ahead of the guest.
+ */
+#define CIMG_CACHE_SLOTS 256
+#define CIMG_READAHEAD_CHUNKS 8
+#define CIMG_NR_WORKERS 4
+#define CIMG_QUEUE_LEN 64
+
+enum cimg_slot_state {
+    CIMG_SLOT_EMPTY,
+    CIMG_SLOT_LOADING,
+    CIMG_SLOT_READY,
+};
+
+struct cimg_slot {
+    uint64_t chunk;
+    enum cimg_slot_state state;
+    unsigned int refs;
+    uint64_t last_use;
+    uint8_t *data;
+};
+
+struct cimg {
+    int fd;
+    uint64_t size;
+    uint32_t chunk_shift;
+    uint64_t nr_chunks;
+    uint64_t *index;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct cimg_slot slots[CIMG_CACHE_SLOTS];
+    uint64_t clock;
+    uint64_t last_chunk;
+
+    /* Chunks waiting to be decompressed by the readahead workers */
+    uint64_t queue[CIMG_QUEUE_LEN];
+    unsigned int queue_head, queue_tail;
+    pthread_cond_t queue_cond;
+    pthread_t workers[CIMG_NR_WORKERS];
+    bool stop;
+};
+
+bool cimg_probe(int fd);
+int cimg_open(struct cimg *cimg, int fd);
+ssize_t cimg_read(struct cimg *cimg, void *data, off_t offset, size_t size);
+int cimg_prefetch(struct cimg *cimg, off_t offset, size_t size);
+int cimg_compress_chunk(void *dst,
+                        size_t *dst_len,
+                        const void *src,
+                        size_t src_len,
+                        int level);
+void cimg_close(struct cimg *cimg);
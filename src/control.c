@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "err.h"
+#include "placement.h"
+#include "vm.h"
+
+static pid_t control_clone(struct control *c, char *args)
+{
+    struct vm_clone_opts opts = {.id = ++c->nr_clones};
+    int nr_disks = 0, nr_nics = 0;
+    char *save, *arg;
+
+    for (arg = strtok_r(args, " \t", &save); arg;
+         arg = strtok_r(NULL, " \t", &save)) {
+        if (!strncmp(arg, "disk=", 5) && nr_disks < VM_MAX_DISKS)
+            opts.disk_paths[nr_disks++] = arg + 5;
+        else if (!strncmp(arg, "net=", 4) && nr_nics < VM_MAX_NICS)
+            opts.nic_specs[nr_nics++] = arg + 4;
+        else if (!strncmp(arg, "console=", 8))
+            opts.console = arg + 8;
+        else
+            return throw_err("Unknown clone option %s", arg);
+    }
+    return vm_clone(c->vm, c->config, &opts);
+}
+
+/* Without an argument, report the balloon. Otherwise the guest is asked to
+ * shrink or grow to the given size in MB.
+ */
+static int control_balloon(struct control *c, char *args, char *reply)
+{
+    struct virtio_balloon_dev *dev = &c->vm->virtio_balloon_dev;
+    char *save, *arg = strtok_r(args, " \t", &save), *end;
+    unsigned long mb;
+
+    if (!dev->enable) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (arg) {
+        mb = strtoul(arg, &end, 10);
+        if (*end || end == arg || mb > RAM_SIZE >> 20) {
+            errno = EINVAL;
+            return -1;
+        }
+        virtio_balloon_set_target(dev, (RAM_SIZE - ((uint64_t) mb << 20)) >>
+                                           VIRTIO_BALLOON_PFN_SHIFT);
+    }
+    snprintf(reply, CONTROL_MAX_LINE, "ok ");
+    virtio_balloon_info(dev, reply + 3, CONTROL_MAX_LINE - 4);
+    strcat(reply, "\n");
+    return 0;
+}
+
+static void control_handle(struct control *c, char *cmd)
+{
+    char *save, *word = strtok_r(cmd, " \t", &save);
+    size_t size = sizeof(c->reply);
+    pid_t pid;
+
+    if (c->migration) {
+        c->migrated = migrate_finish(c->migration) == 0;
+        if (c->migrated)
+            snprintf(c->reply, size, "ok downtime %llu ms\n",
+                     (unsigned long long) (c->migration->downtime_ns /
+                                           1000000));
+        else
+            snprintf(c->reply, size, "error %s\n", strerror(errno));
+    } else if (!word) {
+        snprintf(c->reply, size, "error empty command\n");
+    } else if (!strcmp(word, "pause")) {
+        c->paused = true;
+        snprintf(c->reply, size, "ok\n");
+    } else if (!strcmp(word, "resume")) {
+        c->paused = false;
+        snprintf(c->reply, size, "ok\n");
+    } else if (!strcmp(word, "status")) {
+        snprintf(c->reply, size, "ok %s\n", c->paused ? "paused" : "running");
+    } else if (!strcmp(word, "clone")) {
+        pid = control_clone(c, save);
+        if (pid < 0)
+            snprintf(c->reply, size, "error %s\n", strerror(errno));
+        else
+            snprintf(c->reply, size, "ok %d\n", (int) pid);
+    } else if (!strcmp(word, "balloon")) {
+        if (control_balloon(c, save, c->reply) < 0)
+            snprintf(c->reply, size, "error %s\n", strerror(errno));
+    } else {
+        snprintf(c->reply, size, "error unknown command %s\n", word);
+    }
+}
+
+/* Called by the vCPU thread whenever vm_run returns VM_RUN_STOPPED. The
+ * pending command is carried out, and further ones while the VM is paused.
+ * Returns true once the VM has migrated away and must exit.
+ */
+bool control_serve(struct control *c)
+{
+    bool migrated;
+
+    pthread_mutex_lock(&c->lock);
+    c->serving = true;
+    while (1) {
+        while (!c->pending && c->paused)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (!c->pending)
+            break;
+        control_handle(c, c->cmd);
+        c->pending = false;
+        pthread_cond_broadcast(&c->cond);
+        if (!c->paused || c->migrated)
+            break;
+    }
+    c->serving = false;
+    migrated = c->migrated;
+    pthread_mutex_unlock(&c->lock);
+    return migrated;
+}
+
+/* Hand a command, or the end of @migration, to the vCPU thread and wait for
+ * its reply.
+ */
+static void control_submit(struct control *c,
+                           const char *cmd,
+                           struct migrate *migration,
+                           char *reply)
+{
+    pthread_mutex_lock(&c->lock);
+    snprintf(c->cmd, sizeof(c->cmd), "%s", cmd);
+    c->migration = migration;
+    c->pending = true;
+    if (c->serving)
+        pthread_cond_broadcast(&c->cond);
+    else
+        vm_kick(c->vm);
+    while (c->pending && !c->closed)
+        pthread_cond_wait(&c->cond, &c->lock);
+    if (c->pending) {
+        c->pending = false;
+        snprintf(reply, CONTROL_MAX_LINE, "error the VM has exited\n");
+    } else {
+        memcpy(reply, c->reply, CONTROL_MAX_LINE);
+    }
+    c->migration = NULL;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Memory is sent by the control thread while the VM runs, which is only
+ * stopped for the last round.
+ */
+static void control_migrate(struct control *c, const char *dest, char *reply)
+{
+    struct migrate m;
+
+    if (migrate_begin(&m, c->vm, dest) < 0 || migrate_precopy(&m) < 0)
+        snprintf(reply, CONTROL_MAX_LINE, "error %s\n", strerror(errno));
+    else
+        control_submit(c, "", &m, reply);
+    migrate_end(&m);
+}
+
+static int control_write(int fd, const char *buf)
+{
+    size_t len = strlen(buf);
+
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Serve the commands of a client until it disconnects. Returns false once
+ * control_exit has been called.
+ */
+static bool control_session(struct control *c, int fd)
+{
+    char buf[CONTROL_MAX_LINE], reply[CONTROL_MAX_LINE];
+    size_t len = 0;
+    char *nl;
+
+    while (1) {
+        struct pollfd fds[] = {
+            {.fd = c->stopfd, .events = POLLIN},
+            {.fd = fd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (fds[0].revents)
+            return false;
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        if (n <= 0)
+            return true;
+        len += n;
+        while ((nl = memchr(buf, '\n', len))) {
+            *nl = '\0';
+            if (nl > buf && nl[-1] == '\r')
+                nl[-1] = '\0';
+            if (!strncmp(buf, "migrate ", 8))
+                control_migrate(c, buf + 8, reply);
+            else
+                control_submit(c, buf, NULL, reply);
+            if (control_write(fd, reply) < 0)
+                return true;
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+        }
+        /* A line which does not fit is not a command */
+        if (len == sizeof(buf))
+            return true;
+    }
+}
+
+static void *control_thread(void *arg)
+{
+    struct control *c = (struct control *) arg;
+
+    placement_apply(PLACEMENT_OTHER, "control");
+    while (1) {
+        struct pollfd fds[] = {
+            {.fd = c->stopfd, .events = POLLIN},
+            {.fd = c->listenfd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        int fd = accept4(c->listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        bool more = control_session(c, fd);
+        close(fd);
+        if (!more)
+            break;
+    }
+    return NULL;
+}
+
+int control_init(struct control *c,
+                 struct vm *vm,
+                 struct vm_config *config,
+                 const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    memset(c, 0, sizeof(*c));
+    c->vm = vm;
+    c->config = config;
+    c->listenfd = c->stopfd = -1;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return throw_err("The control socket path %s is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+    c->path = strdup(path);
+    c->stopfd = eventfd(0, EFD_CLOEXEC);
+    c->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!c->path || c->stopfd < 0 || c->listenfd < 0)
+        return throw_err("Failed to create the control socket");
+    unlink(path);
+    if (bind(c->listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(c->listenfd, 1) < 0)
+        return throw_err("Failed to listen on %s", path);
+
+    /* Clones are reaped as soon as they exit */
+    signal(SIGCHLD, SIG_IGN);
+    pthread_create(&c->thread, NULL, control_thread, c);
+    c->started = true;
+    return 0;
+}
+
+void control_exit(struct control *c)
+{
+    uint64_t n = 1;
+
+    pthread_mutex_lock(&c->lock);
+    c->closed = true;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    if (c->started) {
+        if (write(c->stopfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to stop the control thread");
+        pthread_join(c->thread, NULL);
+    }
+    if (c->listenfd >= 0) {
+        close(c->listenfd);
+        unlink(c->path);
+    }
+    if (c->stopfd >= 0)
+        close(c->stopfd);
+    free(c->path);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+}
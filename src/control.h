@@ -0,0 +1,62 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "migrate.h"
+
+#define CONTROL_MAX_LINE 4096
+
+struct vm;
+struct vm_config;
+
+/* Control socket of a VM, e.g. a template for clones.
+ *
+ * Clients connect to a unix socket and send one command per line, each
+ * answered by a line starting with "ok" or "error":
+ * - pause: stop the vCPU and keep it stopped, e.g. once the guest is ready
+ * - resume: let a paused VM continue
+ * - status: "ok running" or "ok paused"
+ * - clone [disk=path]... [net=tap-spec]... [console=path]: fork a clone of
+ *   the VM, answered by "ok <pid>". Writable disks are copied to the given
+ *   paths in order, next to their image by default, and every interface
+ *   needs a tap of its own.
+ * - balloon [MB]: ask the guest to shrink or grow to MB of RAM through its
+ *   virtio-balloon, and answer with the balloon and the last memory
+ *   statistics of the guest, which it is asked to update
+ * - migrate path: send the VM to the kvm-host which listens on the unix
+ *   socket at path, or to a file, and exit once it is sent. The memory is
+ *   sent by the control thread while the VM keeps running, and only the
+ *   last round by the vCPU thread.
+ *
+ * Commands are carried out by the vCPU thread, which the control thread
+ * kicks out of KVM_RUN, so they always find the VM stopped.
+ */
+struct control {
+    struct vm *vm;
+    struct vm_config *config;
+    char *path;
+    int listenfd;
+    int stopfd;
+    pthread_t thread;
+    bool started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char cmd[CONTROL_MAX_LINE];
+    char reply[CONTROL_MAX_LINE];
+    bool pending; /* cmd waits for the vCPU thread */
+    bool serving; /* the vCPU thread is in control_serve */
+    bool paused;
+    bool closed;
+    int nr_clones;
+    struct migrate *migration; /* to be finished by the vCPU thread */
+    bool migrated;
+};
+
+int control_init(struct control *c,
+                 struct vm *vm,
+                 struct vm_config *config,
+                 const char *path);
+bool control_serve(struct control *c);
+void control_exit(struct control *c);
@@ -1,16 +1,243 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "cimg.h"
 #include "diskimg.h"
+#include "err.h"
+
+/* Index of the first extent which ends after offset */
+static size_t extent_map_lookup(struct diskimg_extent_map *map, off_t offset)
+{
+    size_t lo = 0, hi = map->nr_extents;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->extents[mid].end <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Whether [start, end) lies within a single data extent */
+static bool extent_map_covers(struct diskimg_extent_map *map,
+                              off_t start,
+                              off_t end)
+{
+    size_t i = extent_map_lookup(map, start);
+
+    return i < map->nr_extents && map->extents[i].start <= start &&
+           map->extents[i].end >= end;
+}
+
+/* Make room for one more extent */
+static int extent_map_reserve(struct diskimg_extent_map *map)
+{
+    if (map->nr_extents < map->capacity)
+        return 0;
+
+    size_t capacity = map->capacity ? map->capacity * 2 : 16;
+    void *extents =
+        realloc(map->extents, capacity * sizeof(struct diskimg_extent));
+    if (!extents)
+        return -1;
+    map->extents = extents;
+    map->capacity = capacity;
+    return 0;
+}
+
+static int extent_map_append(struct diskimg_extent_map *map,
+                             off_t start,
+                             off_t end)
+{
+    if (extent_map_reserve(map) < 0)
+        return -1;
+    map->extents[map->nr_extents++] = (struct diskimg_extent){start, end};
+    return 0;
+}
+
+/* Mark [start, end) as data, merging it with the extents it touches */
+static int extent_map_add(struct diskimg_extent_map *map, off_t start, off_t end)
+{
+    size_t first = extent_map_lookup(map, start);
+    size_t last = first;
+
+    /* An extent ending exactly at start is adjacent and gets merged too */
+    if (first > 0 && map->extents[first - 1].end == start)
+        first--;
+    while (last < map->nr_extents && map->extents[last].start <= end)
+        last++;
+
+    if (first == last) {
+        if (extent_map_reserve(map) < 0)
+            return -1;
+        memmove(&map->extents[first + 1], &map->extents[first],
+                (map->nr_extents - first) * sizeof(struct diskimg_extent));
+        map->extents[first] = (struct diskimg_extent){start, end};
+        map->nr_extents++;
+        return 0;
+    }
+
+    if (map->extents[first].start < start)
+        start = map->extents[first].start;
+    if (map->extents[last - 1].end > end)
+        end = map->extents[last - 1].end;
+    map->extents[first] = (struct diskimg_extent){start, end};
+    memmove(&map->extents[first + 1], &map->extents[last],
+            (map->nr_extents - last) * sizeof(struct diskimg_extent));
+    map->nr_extents -= last - first - 1;
+    return 0;
+}
+
+/* Mark [start, end) as a hole, trimming or splitting the extents it covers */
+static int extent_map_remove(struct diskimg_extent_map *map,
+                             off_t start,
+                             off_t end)
+{
+    size_t first = extent_map_lookup(map, start);
+    size_t last = first;
+
+    while (last < map->nr_extents && map->extents[last].start < end)
+        last++;
+    if (first == last)
+        return 0;
+
+    struct diskimg_extent head = map->extents[first];
+    struct diskimg_extent tail = map->extents[last - 1];
+    bool keep_head = head.start < start, keep_tail = tail.end > end;
+    size_t nr_keep = keep_head + keep_tail;
+
+    /* Only a hole in the middle of one extent makes the map grow */
+    if (nr_keep > last - first && extent_map_reserve(map) < 0)
+        return -1;
+
+    memmove(&map->extents[first + nr_keep], &map->extents[last],
+            (map->nr_extents - last) * sizeof(struct diskimg_extent));
+    map->nr_extents = map->nr_extents - (last - first) + nr_keep;
+    if (keep_head)
+        map->extents[first++] = (struct diskimg_extent){head.start, start};
+    if (keep_tail)
+        map->extents[first] = (struct diskimg_extent){end, tail.end};
+    return 0;
+}
+
+/* Walk the image with SEEK_DATA/SEEK_HOLE to find its allocated ranges */
+static int extent_map_init(struct diskimg_extent_map *map, int fd, off_t size)
+{
+    off_t start = 0;
+
+    *map = (struct diskimg_extent_map){0};
+    pthread_rwlock_init(&map->lock, NULL);
+    while (start < size) {
+        start = lseek(fd, start, SEEK_DATA);
+        if (start < 0 && errno == ENXIO)
+            break;
+        if (start < 0) {
+            /* Without hole detection, treat the whole image as data */
+            map->nr_extents = 0;
+            return extent_map_append(map, 0, size);
+        }
+        off_t end = lseek(fd, start, SEEK_HOLE);
+        if (end < 0 || end > size)
+            end = size;
+        if (extent_map_append(map, start, end) < 0)
+            return -1;
+        start = end;
+    }
+    return 0;
+}
+
+static void extent_map_exit(struct diskimg_extent_map *map)
+{
+    free(map->extents);
+    pthread_rwlock_destroy(&map->lock);
+}
+
+static ssize_t diskimg_nbd_ret(int err, ssize_t ret)
+{
+    if (err < 0) {
+        errno = -err;
+        return -1;
+    }
+    return ret;
+}
+
+/* In writethrough mode, NBD writes are made stable by the server with FUA */
+static uint16_t diskimg_nbd_write_flags(struct diskimg *diskimg)
+{
+    if (diskimg->cache_mode == DISKIMG_CACHE_WRITETHROUGH &&
+        (diskimg->nbd->flags & NBD_FLAG_SEND_FUA))
+        return NBD_CMD_FLAG_FUA;
+    return 0;
+}
 
 ssize_t diskimg_read(struct diskimg *diskimg,
                      void *data,
                      off_t offset,
                      size_t size)
 {
-    lseek(diskimg->fd, offset, SEEK_SET);
-    return read(diskimg->fd, data, size);
+    struct diskimg_extent_map *map = &diskimg->map;
+    off_t pos = offset, end = offset + size;
+
+    prefetch_record(&diskimg->prefetch, offset, size);
+    if (diskimg->cimg)
+        return cimg_read(diskimg->cimg, data, offset, size);
+    if (diskimg->nbd)
+        return diskimg_nbd_ret(
+            nbd_io(diskimg->nbd, NBD_CMD_READ, 0, data, offset, size), size);
+
+    pthread_rwlock_rdlock(&map->lock);
+    for (size_t i = extent_map_lookup(map, pos); pos < end; i++) {
+        off_t data_start = i < map->nr_extents ? map->extents[i].start : end;
+        if (data_start > end)
+            data_start = end;
+
+        /* Holes are served by zero-filling the buffer directly */
+        if (pos < data_start) {
+            memset(data + (pos - offset), 0, data_start - pos);
+            pos = data_start;
+            if (pos == end)
+                break;
+        }
+
+        off_t data_end = map->extents[i].end < end ? map->extents[i].end : end;
+        while (pos < data_end) {
+            ssize_t r =
+                pread(diskimg->fd, data + (pos - offset), data_end - pos, pos);
+            if (r < 0) {
+                pthread_rwlock_unlock(&map->lock);
+                return r;
+            }
+            /* The file is shorter than the map tells, which reads as zeros */
+            if (r == 0) {
+                memset(data + (pos - offset), 0, data_end - pos);
+                r = data_end - pos;
+            }
+            pos += r;
+        }
+    }
+    pthread_rwlock_unlock(&map->lock);
+
+    return size;
+}
+
+/* Bring a range of a local image into the page cache without copying it */
+int diskimg_readahead(struct diskimg *diskimg, off_t offset, size_t size)
+{
+    if (diskimg->nbd) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (diskimg->cimg)
+        return cimg_prefetch(diskimg->cimg, offset, size);
+    return readahead(diskimg->fd, offset, size);
 }
 
 ssize_t diskimg_write(struct diskimg *diskimg,
@@ -18,22 +245,407 @@ ssize_t diskimg_write(struct diskimg *diskimg,
                       off_t offset,
                       size_t size)
 {
-    lseek(diskimg->fd, offset, SEEK_SET);
-    return write(diskimg->fd, data, size);
+    struct diskimg_extent_map *map = &diskimg->map;
+
+    if (diskimg->readonly) {
+        errno = EROFS;
+        return -1;
+    }
+    if (diskimg->nbd)
+        return diskimg_nbd_ret(nbd_io(diskimg->nbd, NBD_CMD_WRITE,
+                                      diskimg_nbd_write_flags(diskimg), data,
+                                      offset, size),
+                               size);
+
+    /* The map lock is held across the write, so a discard never punches a
+     * hole under it. Writes within data run concurrently, while one which
+     * fills a hole records it as data first, so a concurrent read never
+     * takes it for a hole once the write has landed.
+     */
+    pthread_rwlock_rdlock(&map->lock);
+    if (!extent_map_covers(map, offset, offset + size)) {
+        pthread_rwlock_unlock(&map->lock);
+        pthread_rwlock_wrlock(&map->lock);
+        if (extent_map_add(map, offset, offset + size) < 0) {
+            pthread_rwlock_unlock(&map->lock);
+            return -1;
+        }
+    }
+    ssize_t ret = pwrite(diskimg->fd, data, size, offset);
+    pthread_rwlock_unlock(&map->lock);
+    return ret;
 }
 
-int diskimg_init(struct diskimg *diskimg, const char *file_path)
+/* Deallocate a range of the image. It reads as zeros afterwards. */
+int diskimg_discard(struct diskimg *diskimg, off_t offset, size_t size)
 {
-    diskimg->fd = open(file_path, O_RDWR);
-    if (diskimg->fd < 0)
+    struct diskimg_extent_map *map = &diskimg->map;
+
+    if (diskimg->readonly) {
+        errno = EROFS;
         return -1;
+    }
+    if (diskimg->nbd) {
+        if (!(diskimg->nbd->flags & NBD_FLAG_SEND_TRIM)) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        return diskimg_nbd_ret(
+            nbd_io(diskimg->nbd, NBD_CMD_TRIM, 0, NULL, offset, size), 0);
+    }
+
+    /* Overlapping writes and reads wait until the hole and the map agree */
+    pthread_rwlock_wrlock(&map->lock);
+    int ret = fallocate(diskimg->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        offset, size);
+    if (ret == 0)
+        ret = extent_map_remove(map, offset, offset + size);
+    pthread_rwlock_unlock(&map->lock);
+    return ret;
+}
+
+/* NBD requests are sent here and waited for in diskimg_complete(), so a
+ * batch of them is in flight at once. Other disks do the I/O right away.
+ */
+void diskimg_submit(struct diskimg *diskimg, struct diskimg_req *req)
+{
+    req->nbd.conn = NULL;
+    if (!diskimg->nbd || (req->write && diskimg->readonly)) {
+        req->ret = req->write ? diskimg_write(diskimg, req->data, req->offset,
+                                              req->size)
+                              : diskimg_read(diskimg, req->data, req->offset,
+                                             req->size);
+        return;
+    }
+
+    req->nbd.type = req->write ? NBD_CMD_WRITE : NBD_CMD_READ;
+    req->nbd.flags = req->write ? diskimg_nbd_write_flags(diskimg) : 0;
+    req->nbd.buf = req->data;
+    req->nbd.offset = req->offset;
+    req->nbd.len = req->size;
+    req->ret = nbd_submit(diskimg->nbd, &req->nbd) < 0 ? -1 : 0;
+}
+
+ssize_t diskimg_complete(struct diskimg *diskimg, struct diskimg_req *req)
+{
+    if (req->nbd.conn)
+        req->ret = diskimg_nbd_ret(nbd_wait(&req->nbd), req->size);
+    return req->ret;
+}
+
+static int diskimg_sync(struct diskimg *diskimg)
+{
+    if (diskimg->nbd) {
+        if (!(diskimg->nbd->flags & NBD_FLAG_SEND_FLUSH))
+            return 0;
+        return nbd_io(diskimg->nbd, NBD_CMD_FLUSH, 0, NULL, 0, 0);
+    }
+    return fdatasync(diskimg->fd) < 0 ? -errno : 0;
+}
+
+/* Make every write completed so far stable on the disk image.
+ *
+ * A caller needs a sync which starts after it arrives. If one is
+ * already running, it waits for that one to finish and then either starts the
+ * next one or piggybacks on the one another waiter started, so any number of
+ * concurrent callers cost at most two syncs.
+ */
+int diskimg_flush(struct diskimg *diskimg)
+{
+    if (diskimg->cache_mode == DISKIMG_CACHE_UNSAFE || diskimg->readonly)
+        return 0;
+
+    pthread_mutex_lock(&diskimg->flush_lock);
+    uint64_t target = diskimg->flush_started + 1;
+    while (diskimg->flush_done < target) {
+        if (diskimg->flush_running) {
+            pthread_cond_wait(&diskimg->flush_cond, &diskimg->flush_lock);
+            continue;
+        }
+        uint64_t gen = ++diskimg->flush_started;
+        diskimg->flush_running = true;
+        pthread_mutex_unlock(&diskimg->flush_lock);
+
+        int err = diskimg_sync(diskimg);
+
+        pthread_mutex_lock(&diskimg->flush_lock);
+        diskimg->flush_running = false;
+        diskimg->flush_done = gen;
+        diskimg->flush_err = err;
+        pthread_cond_broadcast(&diskimg->flush_cond);
+    }
+    int ret = diskimg->flush_err;
+    pthread_mutex_unlock(&diskimg->flush_lock);
+
+    return ret;
+}
+
+static int diskimg_parse_cache_mode(const char *mode)
+{
+    if (!strcmp(mode, "writethrough"))
+        return DISKIMG_CACHE_WRITETHROUGH;
+    if (!strcmp(mode, "writeback"))
+        return DISKIMG_CACHE_WRITEBACK;
+    if (!strcmp(mode, "unsafe"))
+        return DISKIMG_CACHE_UNSAFE;
+    return -1;
+}
+
+/* The disk is described as "path[,key=value]...". Supported keys:
+ * - cache=writethrough|writeback|unsafe (default: writeback)
+ * - readonly=on|off: open the image read-only and expose it so (default: off)
+ * - iops, iops_burst, bps, bps_burst: I/O limits, see throttle.h
+ * - prefetch=record|replay: boot trace driven prefetch, see prefetch.h
+ * - prefetch_file=path: the boot trace (default: the image path + ".prefetch")
+ *   Only local images are prefetched.
+ * - capture=path: capture the block requests of the guest, see blk-trace.h
+ * - connections=n: number of connections to an NBD server, see nbd.h
+ */
+static int diskimg_parse_opts(struct diskimg *diskimg, char *opts)
+{
+    char *saveptr;
+
+    for (char *opt = strtok_r(opts, ",", &saveptr); opt;
+         opt = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(opt, '=');
+        if (!value)
+            return throw_err("Missing value of disk option '%s'", opt);
+        *value++ = '\0';
+
+        if (!strcmp(opt, "cache")) {
+            int mode = diskimg_parse_cache_mode(value);
+            if (mode < 0)
+                return throw_err("Unknown cache mode '%s'", value);
+            diskimg->cache_mode = mode;
+            continue;
+        }
+        if (!strcmp(opt, "readonly")) {
+            if (strcmp(value, "on") && strcmp(value, "off"))
+                return throw_err("readonly must be on or off");
+            diskimg->readonly = !strcmp(value, "on");
+            continue;
+        }
+        if (!strcmp(opt, "prefetch")) {
+            if (!strcmp(value, "record"))
+                diskimg->prefetch_mode = PREFETCH_RECORD;
+            else if (!strcmp(value, "replay"))
+                diskimg->prefetch_mode = PREFETCH_REPLAY;
+            else
+                return throw_err("Unknown prefetch mode '%s'", value);
+            continue;
+        }
+        if (!strcmp(opt, "prefetch_file")) {
+            free(diskimg->prefetch_file);
+            diskimg->prefetch_file = strdup(value);
+            continue;
+        }
+        if (!strcmp(opt, "capture")) {
+            free(diskimg->capture_file);
+            diskimg->capture_file = strdup(value);
+            continue;
+        }
+        if (!strcmp(opt, "connections")) {
+            diskimg->nbd_conns = atoi(value);
+            if (diskimg->nbd_conns < 1 || diskimg->nbd_conns > NBD_MAX_CONNS)
+                return throw_err("The number of connections must be 1-%d",
+                                 NBD_MAX_CONNS);
+            continue;
+        }
+
+        int ret = throttle_parse_opt(&diskimg->throttle, opt, value);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            return throw_err("Unknown disk option '%s'", opt);
+    }
+
+    return 0;
+}
+
+static void diskimg_free_opts(struct diskimg *diskimg)
+{
+    free(diskimg->prefetch_file);
+    free(diskimg->capture_file);
+}
+
+/* The rest of the setup, once the image itself has been opened */
+static int diskimg_init_common(struct diskimg *diskimg)
+{
+    pthread_mutex_init(&diskimg->flush_lock, NULL);
+    pthread_cond_init(&diskimg->flush_cond, NULL);
+    diskimg->flush_running = false;
+    diskimg->flush_started = 0;
+    diskimg->flush_done = 0;
+    diskimg->flush_err = 0;
+
+    /* Prefetching starts last, as its workers read through this image */
+    if (prefetch_init(&diskimg->prefetch, diskimg, diskimg->prefetch_mode,
+                      diskimg->prefetch_file) < 0) {
+        diskimg_exit(diskimg);
+        return -1;
+    }
+    return 0;
+}
+
+static bool diskimg_is_nbd(const char *path)
+{
+    return !strncmp(path, NBD_URI_PREFIX, strlen(NBD_URI_PREFIX)) ||
+           !strncmp(path, NBD_UNIX_URI_PREFIX, strlen(NBD_UNIX_URI_PREFIX));
+}
+
+/* Consumes uri. The extent map stays empty, as the server knows the holes. */
+static int diskimg_init_nbd(struct diskimg *diskimg, char *uri)
+{
+    diskimg->fd = -1;
+    diskimg->nbd = malloc(sizeof(struct nbd));
+    if (!diskimg->nbd ||
+        nbd_open(diskimg->nbd, uri, diskimg->nbd_conns) < 0) {
+        free(diskimg->nbd);
+        free(uri);
+        diskimg_free_opts(diskimg);
+        return -1;
+    }
+    free(uri);
+    diskimg->size = diskimg->nbd->size;
+    if (diskimg->nbd->flags & NBD_FLAG_READ_ONLY)
+        diskimg->readonly = true;
+    extent_map_init(&diskimg->map, -1, 0);
+
+    return diskimg_init_common(diskimg);
+}
+
+int diskimg_init(struct diskimg *diskimg, const char *spec)
+{
+    char *file_path = strdup(spec);
+    char *opts = strchr(file_path, ',');
+
+    diskimg->cache_mode = DISKIMG_CACHE_WRITEBACK;
+    diskimg->readonly = false;
+    diskimg->throttle = (struct throttle_config){0};
+    diskimg->prefetch_mode = PREFETCH_OFF;
+    diskimg->prefetch_file = NULL;
+    diskimg->capture_file = NULL;
+    diskimg->nbd_conns = DISKIMG_DEFAULT_NBD_CONNS;
+    if (opts) {
+        *opts++ = '\0';
+        if (diskimg_parse_opts(diskimg, opts) < 0) {
+            diskimg_free_opts(diskimg);
+            free(file_path);
+            return -1;
+        }
+    }
+    bool nbd = diskimg_is_nbd(file_path);
+    if (nbd && diskimg->prefetch_mode != PREFETCH_OFF) {
+        diskimg_free_opts(diskimg);
+        free(file_path);
+        errno = ENOTSUP;
+        return throw_err("Only local disk images can be prefetched");
+    }
+    if (!diskimg->prefetch_file && !nbd) {
+        diskimg->prefetch_file =
+            malloc(strlen(file_path) + sizeof(PREFETCH_FILE_SUFFIX));
+        strcat(strcpy(diskimg->prefetch_file, file_path), PREFETCH_FILE_SUFFIX);
+    }
+
+    diskimg->cimg = NULL;
+    diskimg->nbd = NULL;
+    if (nbd)
+        return diskimg_init_nbd(diskimg, file_path);
+
+    int flags = diskimg->readonly ? O_RDONLY : O_RDWR;
+    if (diskimg->cache_mode == DISKIMG_CACHE_WRITETHROUGH && !diskimg->readonly)
+        flags |= O_DSYNC;
+    diskimg->fd = open(file_path, flags);
+    free(file_path);
+    if (diskimg->fd < 0) {
+        diskimg_free_opts(diskimg);
+        return -1;
+    }
     struct stat st;
     fstat(diskimg->fd, &st);
     diskimg->size = st.st_size;
-    return 0;
+
+    if (cimg_probe(diskimg->fd)) {
+        diskimg->cimg = malloc(sizeof(struct cimg));
+        if (!diskimg->cimg || cimg_open(diskimg->cimg, diskimg->fd) < 0) {
+            free(diskimg->cimg);
+            diskimg_free_opts(diskimg);
+            close(diskimg->fd);
+            return -1;
+        }
+        diskimg->readonly = true;
+        diskimg->size = diskimg->cimg->size;
+    }
+
+    /* Compressed images have no holes in the sense of the file system */
+    off_t map_size = diskimg->cimg ? 0 : diskimg->size;
+    if (extent_map_init(&diskimg->map, diskimg->fd, map_size) < 0) {
+        diskimg_free_opts(diskimg);
+        close(diskimg->fd);
+        return throw_err("Failed to build the extent map of disk image");
+    }
+
+    return diskimg_init_common(diskimg);
+}
+
+/* Copy the data extents of a local image to @path, sharing its blocks
+ * instead where the file system supports reflinks.
+ */
+int diskimg_clone(struct diskimg *diskimg, const char *path)
+{
+    int fd, ret = 0;
+
+    if (diskimg->nbd || diskimg->cimg) {
+        errno = ENOTSUP;
+        return throw_err("Only local raw disk images can be copied");
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return throw_err("Failed to create the disk image %s", path);
+    if (!ioctl(fd, FICLONE, diskimg->fd))
+        goto out;
+
+    if (ftruncate(fd, diskimg->size) < 0) {
+        ret = throw_err("Failed to resize the disk image %s", path);
+        goto out;
+    }
+    pthread_rwlock_rdlock(&diskimg->map.lock);
+    for (size_t i = 0; i < diskimg->map.nr_extents && !ret; i++) {
+        loff_t in = diskimg->map.extents[i].start, out = in;
+        while (in < diskimg->map.extents[i].end) {
+            ssize_t n = copy_file_range(diskimg->fd, &in, fd, &out,
+                                        diskimg->map.extents[i].end - in, 0);
+            if (n <= 0) {
+                ret = throw_err("Failed to copy the disk image to %s", path);
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&diskimg->map.lock);
+out:
+    close(fd);
+    if (ret < 0)
+        unlink(path);
+    return ret;
 }
 
 void diskimg_exit(struct diskimg *diskimg)
 {
-    close(diskimg->fd);
-}
\ No newline at end of file
+    prefetch_exit(&diskimg->prefetch);
+    diskimg_free_opts(diskimg);
+    /* Writes acknowledged in writeback mode must not be lost on exit */
+    diskimg_flush(diskimg);
+    if (diskimg->cimg) {
+        cimg_close(diskimg->cimg);
+        free(diskimg->cimg);
+    }
+    if (diskimg->nbd) {
+        nbd_close(diskimg->nbd);
+        free(diskimg->nbd);
+    } else {
+        close(diskimg->fd);
+    }
+    extent_map_exit(&diskimg->map);
+    pthread_mutex_destroy(&diskimg->flush_lock);
+    pthread_cond_destroy(&diskimg->flush_cond);
+}
@@ -1,21 +1,99 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "nbd.h"
+#include "prefetch.h"
+#include "throttle.h"
+
+struct cimg;
+
+#define DISKIMG_DEFAULT_NBD_CONNS 4
+
 /* simple backed by disk image file */
 
+/* How guest writes reach the disk image.
+ * - writethrough: every write is stable before it completes
+ * - writeback: writes may sit in the host page cache until the guest flushes
+ * - unsafe: like writeback, but flushes are ignored
+ */
+enum diskimg_cache_mode {
+    DISKIMG_CACHE_WRITETHROUGH,
+    DISKIMG_CACHE_WRITEBACK,
+    DISKIMG_CACHE_UNSAFE,
+};
+
+/* A range [start, end) of the image which is backed by data */
+struct diskimg_extent {
+    off_t start;
+    off_t end;
+};
+
+/* Sorted, non-overlapping data extents of a sparse image. Everything outside
+ * of them is a hole which reads as zeros without touching the image file.
+ */
+struct diskimg_extent_map {
+    struct diskimg_extent *extents;
+    size_t nr_extents;
+    size_t capacity;
+    pthread_rwlock_t lock;
+};
+
 struct diskimg {
     int fd;
     size_t size;
+    bool readonly;
+    struct cimg *cimg; /* set for compressed images */
+    struct nbd *nbd;   /* set for disks on an NBD server */
+    int nbd_conns;
+    enum diskimg_cache_mode cache_mode;
+    struct throttle_config throttle;
+    enum prefetch_mode prefetch_mode;
+    char *prefetch_file;
+    char *capture_file; /* block requests are captured to this file */
+    struct prefetch prefetch;
+    struct diskimg_extent_map map;
+
+    /* Concurrent flushes are coalesced into one sync in flight, which is an
+     * fdatasync() or an NBD flush.
+     */
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_cond;
+    bool flush_running;
+    uint64_t flush_started;
+    uint64_t flush_done;
+    int flush_err;
+};
+
+/* A read or write which may stay in flight while further requests are
+ * submitted. Only NBD disks overlap requests, the others complete them
+ * within diskimg_submit().
+ */
+struct diskimg_req {
+    bool write;
+    void *data;
+    off_t offset;
+    size_t size;
+    ssize_t ret;
+    struct nbd_req nbd;
 };
 
+void diskimg_submit(struct diskimg *diskimg, struct diskimg_req *req);
+ssize_t diskimg_complete(struct diskimg *diskimg, struct diskimg_req *req);
 ssize_t diskimg_read(struct diskimg *diskimg,
                      void *data,
                      off_t offset,
                      size_t size);
+int diskimg_readahead(struct diskimg *diskimg, off_t offset, size_t size);
 ssize_t diskimg_write(struct diskimg *diskimg,
                       void *data,
                       off_t offset,
                       size_t size);
-int diskimg_init(struct diskimg *diskimg, const char *file_path);
+int diskimg_discard(struct diskimg *diskimg, off_t offset, size_t size);
+int diskimg_flush(struct diskimg *diskimg);
+int diskimg_init(struct diskimg *diskimg, const char *spec);
+int diskimg_clone(struct diskimg *diskimg, const char *path);
 void diskimg_exit(struct diskimg *diskimg);
@@ -1,24 +1,153 @@
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "control.h"
 #include "err.h"
+#include "placement.h"
 #include "vm.h"
 
-static char *kernel_file = NULL, *initrd_file = NULL, *diskimg_file = NULL;
+static struct vm_config config;
+static char *snapshot_file = NULL, *restore_file = NULL;
+static char *control_path = NULL, *incoming_path = NULL;
+static bool stats_enabled = false;
+static enum blk_stats_format stats_format = BLK_STATS_TEXT;
 
 #define print_option(args, help_msg) printf("  %-30s%s", args, help_msg)
 
 static void usage(const char *execpath)
 {
-    printf("\n usage: %s -k bzImage [options]\n\n", execpath);
+    printf("\n usage: %s -k bzImage [options]\n", execpath);
+    printf("        %s -r snapshot [options]\n", execpath);
+    printf("        %s -I path [options]\n\n", execpath);
     printf("options:\n");
 
     print_option("-h, --help", "Print help of CLI and exit.\n");
     print_option("-i, --initrd initrd", "Initial RAM disk image\n");
-    print_option("-d, --disk disk-image",
+    print_option("-d, --disk disk-image[,opt=value]",
                  "Disk image for virtio-blk devices\n");
+    print_option("", "or nbd://host[:port]/export, nbd+unix:///export?socket=path\n");
+    print_option("", "or vhost-user:socket-path for an external backend\n");
+    print_option("", "cache: writethrough, writeback (default), unsafe\n");
+    print_option("", "readonly=on: expose the image read-only\n");
+    print_option("", "iops, iops_burst, bps, bps_burst: I/O limits\n");
+    print_option("", "Repeat to attach up to 8 disks, vda, vdb, ...\n");
+    print_option("-n, --net tap-name[,opt=value]",
+                 "tap interface for a virtio-net device\n");
+    print_option("", "queues=n: queue pairs, vhost=on|off, mac=address\n");
+    print_option("", "Repeat to attach up to 4 interfaces\n");
+    print_option("-v, --vsock cid|auto",
+                 "virtio-vsock device served by vhost-vsock\n");
+    print_option("", "auto: the first free CID from 3\n");
+    print_option("-p, --port name,backend",
+                 "virtio-console port /dev/virtio-ports/name\n");
+    print_option("", "backend: file=path or socket=path\n");
+    print_option("", "Repeat to add up to 7 ports\n");
+    print_option("-S, --serial-console",
+                 "Use ttyS0 rather than hvc0 as the console\n");
+    print_option("-M, --map-images",
+                 "Map the kernel and initrd instead of copying them\n");
+    print_option("", "They must not change while the VM runs\n");
+    print_option("-b, --balloon dontneed|free",
+                 "virtio-balloon device with free page reporting\n");
+    print_option("", "free: the host reclaims released RAM lazily\n");
+    print_option("-P, --prealloc threads|auto",
+                 "Populate the guest RAM before the vCPU starts\n");
+    print_option("", "auto: a thread per CPU, at most 16\n");
+    print_option("-N, --numa node[,node]...",
+                 "Back guest NUMA node i with the i-th host node\n");
+    print_option("", "The vCPU and I/O threads run on the first one\n");
+    print_option("-A, --placement class,opt=value",
+                 "Place the vcpu, io or console threads\n");
+    print_option("", "cpus=2-3:6, fifo=prio, nice=n, cgroup=path\n");
+    print_option("-o, --snapshot path",
+                 "Save the VM to a snapshot on SIGUSR1 and exit\n");
+    print_option("-r, --restore path[,opt=value]",
+                 "Resume a snapshot instead of booting a kernel\n");
+    print_option("", "The devices must be given as when it was saved\n");
+    print_option("", "uffd=on: fault the RAM in with userfaultfd\n");
+    print_option("", "prefetch=record|replay: working set of uffd=on\n");
+    print_option("-c, --control path",
+                 "Unix socket to pause, resume, clone and migrate the VM\n");
+    print_option("-I, --incoming path",
+                 "Receive a migrating VM on a unix socket or from a file\n");
+    print_option("-s, --stats text|json",
+                 "Dump device statistics on SIGUSR2 and at exit\n");
+}
+
+/* Statistics are dumped by a dedicated thread, so the signal never
+ * interrupts the vCPU or a device thread. SIGUSR2 must be blocked before any
+ * thread is created for them to inherit the mask.
+ */
+static sigset_t stats_sigset;
+static bool stats_stop;
+
+static void block_stats_signal(void)
+{
+    sigemptyset(&stats_sigset);
+    sigaddset(&stats_sigset, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &stats_sigset, NULL);
+}
+
+static void *stats_thread(void *arg)
+{
+    vm_t *v = (vm_t *) arg;
+    int sig;
+
+    placement_apply(PLACEMENT_OTHER, "stats");
+    while (sigwait(&stats_sigset, &sig) == 0 &&
+           !__atomic_load_n(&stats_stop, __ATOMIC_ACQUIRE))
+        vm_dump_stats(v, stderr, stats_format);
+    return NULL;
+}
+
+/* The thread is woken by a signal of its own, and gone before the devices
+ * it dumps are torn down.
+ */
+static void stop_stats_thread(pthread_t tid)
+{
+    __atomic_store_n(&stats_stop, true, __ATOMIC_RELEASE);
+    pthread_kill(tid, SIGUSR2);
+    pthread_join(tid, NULL);
+}
+
+/* SIGUSR1 is only delivered to the vCPU thread, where it interrupts KVM_RUN.
+ * It must be blocked before any other thread is created.
+ */
+static vm_t *snapshot_vm;
+static volatile sig_atomic_t snapshot_requested;
+
+static void snapshot_signal(int sig)
+{
+    snapshot_requested = 1;
+    vm_stop(snapshot_vm);
+}
+
+static void block_snapshot_signal(void)
+{
+    struct sigaction sa = {
+        .sa_handler = snapshot_signal,
+        .sa_flags = SA_RESTART,
+    };
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void unblock_snapshot_signal(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 }
 
 static struct termios saved_attributes;
@@ -53,21 +182,91 @@ int main(int argc, char *argv[])
         {"kernel", 1, NULL, 'k'},
         {"initrd", 1, NULL, 'i'},
         {"disk", 1, NULL, 'd'},
+        {"net", 1, NULL, 'n'},
+        {"vsock", 1, NULL, 'v'},
+        {"port", 1, NULL, 'p'},
+        {"serial-console", 0, NULL, 'S'},
+        {"map-images", 0, NULL, 'M'},
+        {"balloon", 1, NULL, 'b'},
+        {"prealloc", 1, NULL, 'P'},
+        {"numa", 1, NULL, 'N'},
+        {"placement", 1, NULL, 'A'},
+        {"snapshot", 1, NULL, 'o'},
+        {"restore", 1, NULL, 'r'},
+        {"control", 1, NULL, 'c'},
+        {"incoming", 1, NULL, 'I'},
+        {"stats", 1, NULL, 's'},
         {"help", 0, NULL, 'h'},
     };
 
     int c;
-    while ((c = getopt_long(argc, argv, "k:i:d:h", opts, &option_index)) !=
-           -1) {
+    while ((c = getopt_long(argc, argv, "k:i:d:n:v:p:SMb:P:N:A:o:r:c:I:s:h", opts,
+                            &option_index)) != -1) {
         switch (c) {
         case 'i':
-            initrd_file = optarg;
+            config.initrd_file = optarg;
             break;
         case 'k':
-            kernel_file = optarg;
+            config.kernel_file = optarg;
             break;
         case 'd':
-            diskimg_file = optarg;
+            if (config.nr_diskimg_files == VM_MAX_DISKS)
+                return throw_err("At most %d disks are supported",
+                                 VM_MAX_DISKS);
+            config.diskimg_files[config.nr_diskimg_files++] = optarg;
+            break;
+        case 'n':
+            if (config.nr_nic_specs == VM_MAX_NICS)
+                return throw_err("At most %d network interfaces are supported",
+                                 VM_MAX_NICS);
+            config.nic_specs[config.nr_nic_specs++] = optarg;
+            break;
+        case 'v':
+            config.vsock_cid = optarg;
+            break;
+        case 'p':
+            if (config.nr_port_specs == VIRTIO_CONSOLE_MAX_PORTS - 1)
+                return throw_err("At most %d console ports are supported",
+                                 VIRTIO_CONSOLE_MAX_PORTS - 1);
+            config.port_specs[config.nr_port_specs++] = optarg;
+            break;
+        case 'S':
+            config.serial_console = true;
+            break;
+        case 'M':
+            config.map_images = true;
+            break;
+        case 'b':
+            config.balloon = optarg;
+            break;
+        case 'P':
+            config.prealloc = optarg;
+            break;
+        case 'N':
+            config.numa = optarg;
+            break;
+        case 'A':
+            if (placement_parse(optarg) < 0)
+                return -1;
+            break;
+        case 'o':
+            snapshot_file = optarg;
+            break;
+        case 'r':
+            restore_file = optarg;
+            break;
+        case 'c':
+            control_path = optarg;
+            break;
+        case 'I':
+            incoming_path = optarg;
+            break;
+        case 's':
+            stats_enabled = true;
+            if (!strcmp(optarg, "json"))
+                stats_format = BLK_STATS_JSON;
+            else if (strcmp(optarg, "text"))
+                return throw_err("Unknown statistics format '%s'", optarg);
             break;
         case 'h':
             usage(argv[0]);
@@ -77,27 +276,80 @@ int main(int argc, char *argv[])
         }
     }
 
-    set_input_mode();
-
-    vm_t vm;
-    if (vm_init(&vm) < 0)
-        return throw_err("Failed to initialize guest vm");
-
-    if (!kernel_file)
+    if (!config.kernel_file && !restore_file && !incoming_path)
         return throw_err(
             "The kernel image must be used as the input of kvm-host!");
+    if (restore_file && incoming_path)
+        return throw_err("A VM is either restored or migrated in");
+#ifdef SNAPSHOT_UNSUPPORTED
+    if (snapshot_file || restore_file || incoming_path) {
+        errno = ENOTSUP;
+        return throw_err(
+            "Snapshots and migration are not supported on this architecture");
+    }
+#endif
 
-    if (vm_load_image(&vm, kernel_file) < 0)
-        return throw_err("Failed to load guest image");
-    if (initrd_file && vm_load_initrd(&vm, initrd_file) < 0)
-        return throw_err("Failed to load initrd");
-    if (diskimg_file && vm_load_diskimg(&vm, diskimg_file) < 0)
-        return throw_err("Failed to load disk image");
+    set_input_mode();
+    if (stats_enabled)
+        block_stats_signal();
+    if (snapshot_file)
+        block_snapshot_signal();
 
-    if (vm_late_init(&vm) < 0)
+    vm_t vm;
+    struct snapshot snapshot;
+    struct uffd_mem lazy_mem;
+    if (restore_file) {
+        char *opts = strchr(restore_file, ',');
+        if (opts)
+            *opts++ = '\0';
+        if (uffd_mem_parse_opts(&lazy_mem, opts, restore_file) < 0)
+            return throw_err("Invalid restore options");
+        if (snapshot_open(&snapshot, restore_file) < 0)
+            return throw_err("Failed to open the snapshot %s", restore_file);
+    }
+    if (incoming_path && migrate_receive(&snapshot, incoming_path) < 0)
+        return throw_err("Failed to receive the VM on %s", incoming_path);
+    if (vm_create(&vm, &config,
+                  restore_file || incoming_path ? &snapshot : NULL,
+                  restore_file && lazy_mem.enable ? &lazy_mem : NULL) < 0)
         return -1;
+    if (restore_file || incoming_path)
+        snapshot_free(&snapshot);
+
+    pthread_t stats_tid;
+    if (stats_enabled)
+        pthread_create(&stats_tid, NULL, stats_thread, &vm);
+
+    struct control control;
+    if (control_path && control_init(&control, &vm, &config, control_path) < 0)
+        return throw_err("Failed to create the control socket %s",
+                         control_path);
 
-    vm_run(&vm);
+    if (snapshot_file) {
+        snapshot_vm = &vm;
+        unblock_snapshot_signal();
+    }
+    /* The vCPU runs on the main thread, which keeps the name of the process
+     * and is placed once the threads it creates have placed themselves.
+     */
+    placement_apply(PLACEMENT_VCPU, NULL);
+    while (vm_run(&vm) == VM_RUN_STOPPED) {
+        if (control_path && control_serve(&control))
+            break;
+        if (snapshot_requested) {
+            if (vm_save(&vm, snapshot_file) < 0)
+                throw_err("Failed to save the VM to %s", snapshot_file);
+            else
+                fprintf(stderr, "Saved the VM to %s\n", snapshot_file);
+            break;
+        }
+    }
+    if (control_path)
+        control_exit(&control);
+    if (stats_enabled) {
+        stop_stats_thread(stats_tid);
+        vm_dump_stats(&vm, stderr, stats_format);
+    }
     vm_exit(&vm);
 
     reset_input_mode();
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "migrate.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define NS_PER_MS 1000000ULL
+
+struct migrate_header {
+    char magic[8];
+    uint64_t ram_size;
+};
+
+struct migrate_section {
+    uint32_t type;
+    uint32_t id;
+    uint64_t len;
+};
+
+static uint64_t migrate_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int migrate_write(struct migrate *m, const void *buf, size_t len)
+{
+    while (len) {
+        /* A receiver which went away must not kill the VM with SIGPIPE */
+        ssize_t n = m->socket ? send(m->fd, buf, len, MSG_NOSIGNAL)
+                              : write(m->fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return throw_err("Failed to send the migration stream");
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int migrate_read(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return throw_err("The migration stream ended early");
+        }
+        buf = (uint8_t *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static bool migrate_page_is_zero(const uint8_t *page)
+{
+    return !page[0] && !memcmp(page, page + 1, VM_PAGE_SIZE - 1);
+}
+
+static bool migrate_test(const uint64_t *bitmap, uint64_t page)
+{
+    return bitmap[page / 64] & (1ULL << (page % 64));
+}
+
+static uint64_t migrate_count(const uint64_t *bitmap, uint64_t nr_pages)
+{
+    uint64_t nr = 0;
+
+    for (uint64_t i = 0; i < nr_pages / 64; i++)
+        nr += __builtin_popcountll(bitmap[i]);
+    return nr;
+}
+
+/* Send the pages of m->dirty in runs of pages with data and of zero pages.
+ * Zero pages are skipped in the first round, which the receiver starts with
+ * zeroed memory for.
+ */
+static int migrate_send_dirty(struct migrate *m, bool first, uint64_t *sent)
+{
+    uint8_t *mem = m->vm->mem;
+    uint64_t page = 0;
+
+    *sent = 0;
+    while (page < m->nr_pages) {
+        if (!m->dirty[page / 64]) {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        if (!migrate_test(m->dirty, page)) {
+            page++;
+            continue;
+        }
+        bool zero = migrate_page_is_zero(mem + page * VM_PAGE_SIZE);
+        struct migrate_record rec = {
+            .type = zero ? MIGRATE_ZERO : MIGRATE_PAGES,
+            .page = page,
+        };
+        while (page < m->nr_pages && rec.count < MIGRATE_MAX_RUN &&
+               migrate_test(m->dirty, page) &&
+               migrate_page_is_zero(mem + page * VM_PAGE_SIZE) == zero) {
+            rec.count++;
+            page++;
+        }
+        if (zero && first)
+            continue;
+        if (migrate_write(m, &rec, sizeof(rec)) < 0 ||
+            (!zero && migrate_write(m, mem + rec.page * VM_PAGE_SIZE,
+                                    (uint64_t) rec.count * VM_PAGE_SIZE) < 0))
+            return -1;
+        *sent += rec.count;
+    }
+    m->nr_sent += *sent;
+    return 0;
+}
+
+static int migrate_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Open @dest, a unix socket of the receiver or a file, and start logging the
+ * pages which the guest and the devices write.
+ */
+int migrate_begin(struct migrate *m, struct vm *vm, const char *dest)
+{
+    struct migrate_header hdr = {.magic = MIGRATE_MAGIC, .ram_size = RAM_SIZE};
+    size_t bitmap_size = RAM_SIZE / VM_PAGE_SIZE / 8;
+    struct stat st;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    m->vm = vm;
+    m->nr_pages = RAM_SIZE / VM_PAGE_SIZE;
+    m->start_ns = migrate_now();
+    if (vm_check_snapshot_devices(vm) < 0)
+        return -1;
+
+    m->socket = !stat(dest, &st) && S_ISSOCK(st.st_mode);
+    if (m->socket)
+        m->fd = migrate_connect(dest);
+    else
+        m->fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (m->fd < 0)
+        return throw_err("Failed to open the migration target %s", dest);
+
+    m->dirty = calloc(1, bitmap_size);
+    if (!m->dirty)
+        return throw_err("Failed to allocate the dirty page bitmap");
+    if (migrate_write(m, &hdr, sizeof(hdr)) < 0 ||
+        vm_set_dirty_log(vm, true) < 0)
+        return -1;
+    memset(vm->dev_dirty, 0, sizeof(vm->dev_dirty));
+    __atomic_store_n(&vm->log_dev_writes, true, __ATOMIC_RELEASE);
+    m->logging = true;
+    return 0;
+}
+
+/* Send the memory in rounds while the VM runs */
+int migrate_precopy(struct migrate *m)
+{
+    memset(m->dirty, 0xff, m->nr_pages / 8);
+    while (m->nr_rounds < MIGRATE_MAX_ROUNDS) {
+        uint64_t start = migrate_now(), sent, nr_dirty, ms;
+
+        if (migrate_send_dirty(m, !m->nr_rounds, &sent) < 0 ||
+            vm_get_dirty_log(m->vm, m->dirty) < 0)
+            return -1;
+        nr_dirty = migrate_count(m->dirty, m->nr_pages);
+        ms = (migrate_now() - start) / NS_PER_MS;
+        fprintf(stderr,
+                "migration: round %d sent %llu pages in %llu ms, %llu dirtied "
+                "(%llu MB/s)\n",
+                m->nr_rounds, (unsigned long long) sent,
+                (unsigned long long) ms, (unsigned long long) nr_dirty,
+                (unsigned long long) (nr_dirty * VM_PAGE_SIZE * 1000 /
+                                      (ms + 1) / (1024 * 1024)));
+        m->nr_rounds++;
+        if (nr_dirty <= MIGRATE_FINAL_PAGES)
+            break;
+    }
+    return 0;
+}
+
+static int migrate_send_state(struct migrate *m, struct snapshot *s)
+{
+    struct migrate_record rec = {
+        .type = MIGRATE_STATE,
+        .count = s->nr_sections,
+    };
+
+    if (migrate_write(m, &rec, sizeof(rec)) < 0)
+        return -1;
+    for (int i = 0; i < s->nr_sections; i++) {
+        struct migrate_section sec = {
+            .type = s->sections[i].type,
+            .id = s->sections[i].id,
+            .len = s->sections[i].len,
+        };
+        if (migrate_write(m, &sec, sizeof(sec)) < 0 ||
+            migrate_write(m, s->sections[i].data, sec.len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Called by the vCPU thread once vm_stop has stopped the VM. The devices
+ * stay stopped if the migration completes, and continue otherwise.
+ */
+int migrate_finish(struct migrate *m)
+{
+    struct migrate_record end = {.type = MIGRATE_END};
+    uint64_t *log = calloc(1, m->nr_pages / 8);
+    uint64_t start = migrate_now(), sent;
+    struct snapshot s;
+
+    snapshot_init(&s);
+    if (!log || vm_save_state(m->vm, &s) < 0)
+        goto fail;
+    vm_log_ring_writes(m->vm);
+    if (vm_get_dirty_log(m->vm, log) < 0)
+        goto fail;
+    for (uint64_t i = 0; i < m->nr_pages / 64; i++)
+        m->dirty[i] |= log[i] | m->vm->dev_dirty[i];
+    if (migrate_send_dirty(m, false, &sent) < 0 ||
+        migrate_send_state(m, &s) < 0 ||
+        migrate_write(m, &end, sizeof(end)) < 0 ||
+        (!m->socket && fsync(m->fd) < 0))
+        goto fail;
+
+    m->downtime_ns = migrate_now() - start;
+    fprintf(stderr,
+            "migration: sent %llu pages in %d rounds and %llu ms, the last "
+            "%llu with %llu ms of downtime\n",
+            (unsigned long long) m->nr_sent, m->nr_rounds + 1,
+            (unsigned long long) ((migrate_now() - m->start_ns) / NS_PER_MS),
+            (unsigned long long) sent,
+            (unsigned long long) (m->downtime_ns / NS_PER_MS));
+    free(log);
+    snapshot_free(&s);
+    return 0;
+
+fail:
+    free(log);
+    snapshot_free(&s);
+    vm_resume_devices(m->vm);
+    return -1;
+}
+
+/* Stop logging, whether the migration completed or failed */
+void migrate_end(struct migrate *m)
+{
+    if (m->logging) {
+        __atomic_store_n(&m->vm->log_dev_writes, false, __ATOMIC_RELEASE);
+        vm_set_dirty_log(m->vm, false);
+    }
+    if (m->fd >= 0)
+        close(m->fd);
+    free(m->dirty);
+}
+
+/* Wait for the sender on a unix socket at @path */
+static int migrate_accept(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int listenfd, fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0)
+        return -1;
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    close(listenfd);
+    unlink(path);
+    return fd;
+}
+
+static int migrate_receive_state(struct snapshot *s, int fd, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        struct migrate_section sec;
+        void *data;
+
+        if (migrate_read(fd, &sec, sizeof(sec)) < 0)
+            return -1;
+        data = malloc(sec.len ? sec.len : 1);
+        if (!data || migrate_read(fd, data, sec.len) < 0 ||
+            snapshot_add(s, sec.type, sec.id, data, sec.len) < 0) {
+            free(data);
+            return -1;
+        }
+        free(data);
+    }
+    return 0;
+}
+
+/* Receive a VM from the file @src, or from a sender which connects to a unix
+ * socket at @src, into a snapshot held in memory.
+ */
+int migrate_receive(struct snapshot *s, const char *src)
+{
+    struct migrate_header hdr;
+    struct migrate_record rec;
+    uint64_t start, nr_pages = 0, nr_received = 0;
+    struct stat st;
+    uint8_t *ram = MAP_FAILED;
+    int fd;
+
+    snapshot_init(s);
+    if (!stat(src, &st) && S_ISREG(st.st_mode))
+        fd = open(src, O_RDONLY | O_CLOEXEC);
+    else
+        fd = migrate_accept(src);
+    if (fd < 0)
+        return throw_err("Failed to open the migration source %s", src);
+    start = migrate_now();
+
+    if (migrate_read(fd, &hdr, sizeof(hdr)) < 0 ||
+        memcmp(hdr.magic, MIGRATE_MAGIC, sizeof(hdr.magic))) {
+        throw_err("%s is not a kvm-host migration stream", src);
+        goto fail;
+    }
+    nr_pages = hdr.ram_size / VM_PAGE_SIZE;
+    ram = mmap(NULL, hdr.ram_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED) {
+        throw_err("Failed to allocate the guest memory");
+        goto fail;
+    }
+
+    while (1) {
+        if (migrate_read(fd, &rec, sizeof(rec)) < 0)
+            goto fail;
+        if (rec.type == MIGRATE_END)
+            break;
+        if ((rec.type == MIGRATE_PAGES || rec.type == MIGRATE_ZERO) &&
+            (rec.page > nr_pages || rec.count > nr_pages - rec.page)) {
+            throw_err("The migration stream has pages beyond the memory");
+            goto fail;
+        }
+        switch (rec.type) {
+        case MIGRATE_PAGES:
+            if (migrate_read(fd, ram + rec.page * VM_PAGE_SIZE,
+                             (uint64_t) rec.count * VM_PAGE_SIZE) < 0)
+                goto fail;
+            nr_received += rec.count;
+            break;
+        case MIGRATE_ZERO:
+            madvise(ram + rec.page * VM_PAGE_SIZE,
+                    (uint64_t) rec.count * VM_PAGE_SIZE, MADV_DONTNEED);
+            nr_received += rec.count;
+            break;
+        case MIGRATE_STATE:
+            if (migrate_receive_state(s, fd, rec.count) < 0)
+                goto fail;
+            break;
+        default:
+            throw_err("Unknown record %u in the migration stream", rec.type);
+            goto fail;
+        }
+    }
+    close(fd);
+    s->ram = ram;
+    s->ram_size = hdr.ram_size;
+    fprintf(stderr, "migration: received %llu pages in %llu ms\n",
+            (unsigned long long) nr_received,
+            (unsigned long long) ((migrate_now() - start) / NS_PER_MS));
+    return 0;
+
+fail:
+    close(fd);
+    if (ram != MAP_FAILED)
+        munmap(ram, hdr.ram_size);
+    snapshot_free(s);
+    return -1;
+}
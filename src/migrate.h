@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Live migration of a VM to another kvm-host process.
+ *
+ * Memory is sent in rounds while the guest keeps running: all of it first,
+ * then the pages the guest dirtied during the previous round, as logged by
+ * KVM, until few enough are left or MIGRATE_MAX_ROUNDS have passed. The VM
+ * is then stopped, and the last dirty pages are sent together with every
+ * page a device has mapped since the migration began, whose writes KVM does
+ * not see, followed by the state of the vCPU and the devices.
+ *
+ * The stream is MIGRATE_MAGIC and the RAM size, followed by records which
+ * start with a struct migrate_record: runs of pages with their data, runs of
+ * zero pages, the state as snapshot sections, and the end. It goes to the
+ * unix socket of the receiving kvm-host or to a file.
+ */
+
+#define MIGRATE_MAGIC "KVMHMIG1"
+#define MIGRATE_MAX_ROUNDS 30
+#define MIGRATE_FINAL_PAGES 256 /* the VM is stopped once this few are dirty */
+#define MIGRATE_MAX_RUN 256     /* pages per record */
+
+enum migrate_record_type {
+    MIGRATE_PAGES = 1, /* followed by the data of the pages */
+    MIGRATE_ZERO,
+    MIGRATE_STATE, /* count snapshot sections, each with its header */
+    MIGRATE_END,
+};
+
+struct migrate_record {
+    uint32_t type;
+    uint32_t count;
+    uint64_t page;
+};
+
+struct snapshot;
+struct vm;
+
+struct migrate {
+    struct vm *vm;
+    int fd;
+    bool socket;
+    bool logging;
+    uint64_t *dirty;   /* pages still to be sent */
+    uint64_t nr_pages; /* of the RAM */
+    uint64_t nr_sent;
+    int nr_rounds;
+    uint64_t start_ns;
+    uint64_t downtime_ns;
+};
+
+int migrate_begin(struct migrate *m, struct vm *vm, const char *dest);
+int migrate_precopy(struct migrate *m);
+int migrate_finish(struct migrate *m);
+void migrate_end(struct migrate *m);
+int migrate_receive(struct snapshot *s, const char *src);
@@ -0,0 +1,651 @@
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "nbd.h"
+#include "placement.h"
+
+#define NBD_MAGIC 0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_IHAVEOPT 0x49484156454f5054ULL
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+/* Handshake flags of the server and the client */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_FLAG_ERROR (1U << 31)
+#define NBD_INFO_EXPORT 0
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_NONE 0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR ((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) | 2)
+#define NBD_REPLY_TYPE_IS_ERR(type) ((type) & (1 << 15))
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t len;
+} __attribute__((packed));
+
+struct nbd_structured_reply {
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint32_t len;
+} __attribute__((packed));
+
+struct nbd_opt_reply {
+    uint64_t magic;
+    uint32_t opt;
+    uint32_t type;
+    uint32_t len;
+} __attribute__((packed));
+
+static int nbd_recv_all(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t r = recv(fd, buf, len, MSG_WAITALL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        buf += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int nbd_skip(int fd, size_t len)
+{
+    char buf[512];
+
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (nbd_recv_all(fd, buf, n) < 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int nbd_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+
+    while (msg.msg_iovlen) {
+        ssize_t r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (msg.msg_iovlen && (size_t) r >= msg.msg_iov->iov_len) {
+            r -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base += r;
+            msg.msg_iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+static int nbd_send_all(int fd, void *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    return nbd_sendv(fd, &iov, 1);
+}
+
+/* Split an NBD URI into the export name and either a Unix socket path or a
+ * host and port. All strings point into uri, which is modified.
+ */
+static int nbd_parse_uri(char *uri,
+                         char **export,
+                         char **socket_path,
+                         char **host,
+                         char **port)
+{
+    bool is_unix = !strncmp(uri, NBD_UNIX_URI_PREFIX,
+                            strlen(NBD_UNIX_URI_PREFIX));
+    char *authority;
+
+    *socket_path = *host = NULL;
+    *port = NBD_DEFAULT_PORT;
+    if (is_unix)
+        authority = uri + strlen(NBD_UNIX_URI_PREFIX);
+    else if (!strncmp(uri, NBD_URI_PREFIX, strlen(NBD_URI_PREFIX)))
+        authority = uri + strlen(NBD_URI_PREFIX);
+    else
+        return -1;
+
+    char *query = strchr(authority, '?');
+    if (query)
+        *query++ = '\0';
+    char *path = strchr(authority, '/');
+    if (path)
+        *path++ = '\0';
+    *export = path ? path : "";
+
+    if (is_unix) {
+        /* nbd+unix:///export?socket=path */
+        if (*authority || !query || strncmp(query, "socket=", 7))
+            return -1;
+        *socket_path = query + 7;
+        return 0;
+    }
+
+    if (*authority == '[') {
+        char *end = strchr(authority, ']');
+        if (!end)
+            return -1;
+        *end++ = '\0';
+        *host = authority + 1;
+        if (*end == ':')
+            *port = end + 1;
+    } else {
+        char *colon = strchr(authority, ':');
+        if (colon) {
+            *colon = '\0';
+            *port = colon + 1;
+        }
+        *host = authority;
+    }
+    return **host ? 0 : -1;
+}
+
+static int nbd_connect(const char *socket_path, const char *host, const char *port)
+{
+    if (socket_path) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, socket_path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+    if (getaddrinfo(host, port, &hints, &res)) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        /* Requests are small and latency bound */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int nbd_send_opt(int fd, uint32_t opt, void *data, uint32_t len)
+{
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t len;
+    } __attribute__((packed)) hdr = {
+        htobe64(NBD_IHAVEOPT),
+        htobe32(opt),
+        htobe32(len),
+    };
+    struct iovec iov[] = {
+        {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+        {.iov_base = data, .iov_len = len},
+    };
+    return nbd_sendv(fd, iov, len ? 2 : 1);
+}
+
+/* Read the header of an option reply. Its payload is left in the socket. */
+static int nbd_recv_opt_reply(int fd, uint32_t opt, struct nbd_opt_reply *reply)
+{
+    if (nbd_recv_all(fd, reply, sizeof(*reply)) < 0)
+        return -1;
+    reply->magic = be64toh(reply->magic);
+    reply->opt = be32toh(reply->opt);
+    reply->type = be32toh(reply->type);
+    reply->len = be32toh(reply->len);
+    if (reply->magic != NBD_REP_MAGIC || reply->opt != opt) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Fixed newstyle negotiation, ending in transmission of the export */
+static int nbd_handshake(struct nbd *nbd, int fd, const char *export)
+{
+    struct {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting;
+    struct nbd_opt_reply reply;
+
+    if (nbd_recv_all(fd, &greeting, sizeof(greeting)) < 0)
+        return throw_err("Failed to receive the NBD greeting");
+    uint16_t hflags = be16toh(greeting.flags);
+    if (be64toh(greeting.magic) != NBD_MAGIC ||
+        be64toh(greeting.opt_magic) != NBD_IHAVEOPT ||
+        !(hflags & NBD_FLAG_FIXED_NEWSTYLE))
+        return throw_err("The NBD server does not speak fixed newstyle");
+    uint32_t cflags =
+        htobe32(NBD_FLAG_FIXED_NEWSTYLE | (hflags & NBD_FLAG_NO_ZEROES));
+    if (nbd_send_all(fd, &cflags, sizeof(cflags)) < 0)
+        return throw_err("Failed to send the NBD client flags");
+
+    if (nbd_send_opt(fd, NBD_OPT_STRUCTURED_REPLY, NULL, 0) < 0 ||
+        nbd_recv_opt_reply(fd, NBD_OPT_STRUCTURED_REPLY, &reply) < 0 ||
+        nbd_skip(fd, reply.len) < 0)
+        return throw_err("Failed to negotiate NBD structured replies");
+    nbd->structured = reply.type == NBD_REP_ACK;
+
+    size_t name_len = strlen(export);
+    size_t len = sizeof(uint32_t) + name_len + sizeof(uint16_t);
+    uint8_t *data = calloc(1, len);
+    if (!data)
+        return -1;
+    *(uint32_t *) data = htobe32(name_len);
+    memcpy(data + sizeof(uint32_t), export, name_len);
+    int ret = nbd_send_opt(fd, NBD_OPT_GO, data, len);
+    free(data);
+    if (ret < 0)
+        return throw_err("Failed to request the NBD export '%s'", export);
+
+    bool has_info = false;
+    while (nbd_recv_opt_reply(fd, NBD_OPT_GO, &reply) == 0) {
+        if (reply.type == NBD_REP_ACK)
+            return has_info ? 0 : throw_err("No NBD export information");
+        if (reply.type & NBD_REP_FLAG_ERROR) {
+            char msg[256] = {0};
+            size_t n = reply.len < sizeof(msg) - 1 ? reply.len : sizeof(msg) - 1;
+            nbd_recv_all(fd, msg, n);
+            return throw_err("The NBD server refused export '%s': %s", export,
+                             msg);
+        }
+
+        struct {
+            uint16_t type;
+            uint64_t size;
+            uint16_t flags;
+        } __attribute__((packed)) info;
+        if (reply.type == NBD_REP_INFO && reply.len >= sizeof(info)) {
+            if (nbd_recv_all(fd, &info, sizeof(info)) < 0)
+                break;
+            reply.len -= sizeof(info);
+            if (be16toh(info.type) == NBD_INFO_EXPORT) {
+                nbd->size = be64toh(info.size);
+                nbd->flags = be16toh(info.flags);
+                has_info = true;
+            }
+        }
+        if (nbd_skip(fd, reply.len) < 0)
+            break;
+    }
+    return throw_err("Failed to negotiate the NBD export '%s'", export);
+}
+
+/* Called with conn->lock held */
+static void nbd_complete(struct nbd_conn *conn, uint64_t handle)
+{
+    struct nbd_req *req = conn->slots[handle];
+
+    conn->slots[handle] = NULL;
+    conn->nr_inflight--;
+    req->done = true;
+    pthread_cond_broadcast(&conn->cond);
+}
+
+static struct nbd_req *nbd_lookup(struct nbd_conn *conn, uint64_t handle)
+{
+    struct nbd_req *req = NULL;
+
+    pthread_mutex_lock(&conn->lock);
+    if (handle < NBD_MAX_INFLIGHT)
+        req = conn->slots[handle];
+    pthread_mutex_unlock(&conn->lock);
+    if (!req)
+        errno = EPROTO;
+    return req;
+}
+
+static int nbd_recv_simple_reply(struct nbd_conn *conn)
+{
+    struct {
+        uint32_t error;
+        uint64_t handle;
+    } __attribute__((packed)) reply;
+
+    if (nbd_recv_all(conn->fd, &reply, sizeof(reply)) < 0)
+        return -1;
+    uint64_t handle = be64toh(reply.handle);
+    struct nbd_req *req = nbd_lookup(conn, handle);
+    if (!req)
+        return -1;
+
+    /* Simple replies to reads carry the data even without structured replies */
+    req->err = be32toh(reply.error);
+    if (!req->err && req->type == NBD_CMD_READ &&
+        nbd_recv_all(conn->fd, req->buf, req->len) < 0)
+        return -1;
+
+    pthread_mutex_lock(&conn->lock);
+    nbd_complete(conn, handle);
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+static int nbd_recv_structured_reply(struct nbd_conn *conn)
+{
+    struct nbd_structured_reply reply;
+    uint64_t offset;
+
+    if (nbd_recv_all(conn->fd, &reply, sizeof(reply)) < 0)
+        return -1;
+    uint16_t type = be16toh(reply.type);
+    uint64_t handle = be64toh(reply.handle);
+    uint32_t len = be32toh(reply.len);
+    struct nbd_req *req = nbd_lookup(conn, handle);
+    if (!req)
+        return -1;
+
+    switch (type) {
+    case NBD_REPLY_TYPE_NONE:
+        break;
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE: {
+        uint32_t hole_len;
+        if (len < sizeof(offset) ||
+            nbd_recv_all(conn->fd, &offset, sizeof(offset)) < 0)
+            return -1;
+        len -= sizeof(offset);
+        offset = be64toh(offset);
+        if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            if (len != sizeof(hole_len) ||
+                nbd_recv_all(conn->fd, &hole_len, sizeof(hole_len)) < 0)
+                return -1;
+            len = be32toh(hole_len);
+        }
+        /* Written so that a huge offset cannot wrap around */
+        if (offset < req->offset || len > req->len ||
+            offset - req->offset > req->len - len) {
+            errno = EPROTO;
+            return -1;
+        }
+        void *dst = req->buf + (offset - req->offset);
+        if (type == NBD_REPLY_TYPE_OFFSET_HOLE)
+            memset(dst, 0, len);
+        else if (nbd_recv_all(conn->fd, dst, len) < 0)
+            return -1;
+        len = 0;
+        break;
+    }
+    default:
+        if (NBD_REPLY_TYPE_IS_ERR(type)) {
+            uint32_t error;
+            if (len < sizeof(error) ||
+                nbd_recv_all(conn->fd, &error, sizeof(error)) < 0)
+                return -1;
+            len -= sizeof(error);
+            req->err = be32toh(error) ? be32toh(error) : EIO;
+        }
+        break;
+    }
+    /* Error messages and unknown chunks are of no use here */
+    if (nbd_skip(conn->fd, len) < 0)
+        return -1;
+
+    if (be16toh(reply.flags) & NBD_REPLY_FLAG_DONE) {
+        pthread_mutex_lock(&conn->lock);
+        nbd_complete(conn, handle);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    return 0;
+}
+
+static void *nbd_receiver(void *arg)
+{
+    struct nbd_conn *conn = (struct nbd_conn *) arg;
+    uint32_t magic;
+    int ret;
+
+    placement_apply(PLACEMENT_IO, "nbd-rx");
+    do {
+        if (nbd_recv_all(conn->fd, &magic, sizeof(magic)) < 0)
+            break;
+        if (be32toh(magic) == NBD_SIMPLE_REPLY_MAGIC) {
+            ret = nbd_recv_simple_reply(conn);
+        } else if (be32toh(magic) == NBD_STRUCTURED_REPLY_MAGIC) {
+            ret = nbd_recv_structured_reply(conn);
+        } else {
+            errno = EPROTO;
+            ret = -1;
+        }
+    } while (ret == 0);
+
+    /* The connection is unusable from here on, so fail what is in flight */
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->dead)
+        throw_err("The NBD connection failed");
+    conn->dead = true;
+    for (uint64_t i = 0; i < NBD_MAX_INFLIGHT; i++) {
+        if (conn->slots[i]) {
+            conn->slots[i]->err = EIO;
+            nbd_complete(conn, i);
+        }
+    }
+    pthread_cond_broadcast(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+
+    return NULL;
+}
+
+/* Send a request on the next connection which has a free slot */
+int nbd_submit(struct nbd *nbd, struct nbd_req *req)
+{
+    unsigned int first =
+        __atomic_fetch_add(&nbd->next_conn, 1, __ATOMIC_RELAXED);
+    struct nbd_conn *conn = NULL;
+    uint64_t handle;
+
+    req->done = false;
+    req->err = 0;
+    req->conn = NULL;
+    for (int i = 0; i < nbd->nr_conns && !conn; i++) {
+        conn = &nbd->conns[(first + i) % nbd->nr_conns];
+        pthread_mutex_lock(&conn->lock);
+        if (conn->dead) {
+            pthread_mutex_unlock(&conn->lock);
+            conn = NULL;
+        }
+    }
+    if (!conn) {
+        errno = EIO;
+        return -1;
+    }
+
+    while (conn->nr_inflight == NBD_MAX_INFLIGHT && !conn->dead)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    if (conn->dead) {
+        pthread_mutex_unlock(&conn->lock);
+        errno = EIO;
+        return -1;
+    }
+    for (handle = 0; conn->slots[handle]; handle++)
+        ;
+    conn->slots[handle] = req;
+    conn->nr_inflight++;
+    req->conn = conn;
+    pthread_mutex_unlock(&conn->lock);
+
+    struct nbd_request hdr = {
+        .magic = htobe32(NBD_REQUEST_MAGIC),
+        .flags = htobe16(req->flags),
+        .type = htobe16(req->type),
+        .handle = htobe64(handle),
+        .offset = htobe64(req->offset),
+        .len = htobe32(req->len),
+    };
+    struct iovec iov[] = {
+        {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+        {.iov_base = req->buf, .iov_len = req->len},
+    };
+    pthread_mutex_lock(&conn->send_lock);
+    int ret = nbd_sendv(conn->fd, iov, req->type == NBD_CMD_WRITE ? 2 : 1);
+    pthread_mutex_unlock(&conn->send_lock);
+
+    /* The receiver fails the request once it notices the broken connection */
+    if (ret < 0)
+        shutdown(conn->fd, SHUT_RDWR);
+    return 0;
+}
+
+/* Wait for a submitted request, returning 0 or a negative errno */
+int nbd_wait(struct nbd_req *req)
+{
+    struct nbd_conn *conn = req->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    while (!req->done)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    pthread_mutex_unlock(&conn->lock);
+
+    return -req->err;
+}
+
+int nbd_io(struct nbd *nbd,
+           uint16_t type,
+           uint16_t flags,
+           void *buf,
+           uint64_t offset,
+           uint32_t len)
+{
+    struct nbd_req req = {
+        .type = type,
+        .flags = flags,
+        .buf = buf,
+        .offset = offset,
+        .len = len,
+    };
+
+    if (nbd_submit(nbd, &req) < 0)
+        return -errno;
+    return nbd_wait(&req);
+}
+
+int nbd_open(struct nbd *nbd, const char *uri, int nr_conns)
+{
+    char *buf = strdup(uri), *export, *socket_path, *host, *port;
+
+    memset(nbd, 0, sizeof(struct nbd));
+    if (!buf)
+        return -1;
+    if (nbd_parse_uri(buf, &export, &socket_path, &host, &port) < 0) {
+        free(buf);
+        return throw_err("Invalid NBD URI %s", uri);
+    }
+
+    for (int i = 0; i < nr_conns; i++) {
+        struct nbd_conn *conn = &nbd->conns[i];
+
+        conn->fd = nbd_connect(socket_path, host, port);
+        if (conn->fd < 0) {
+            throw_err("Failed to connect to the NBD server of %s", uri);
+            break;
+        }
+        if (nbd_handshake(nbd, conn->fd, export) < 0) {
+            close(conn->fd);
+            break;
+        }
+        conn->nbd = nbd;
+        pthread_mutex_init(&conn->send_lock, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        pthread_create(&conn->receiver, NULL, nbd_receiver, conn);
+        nbd->nr_conns++;
+
+        /* Without the guarantee that a flush on one connection covers the
+         * writes of the others, more connections would risk data loss.
+         */
+        if (!(nbd->flags & NBD_FLAG_CAN_MULTI_CONN) && nr_conns > 1) {
+            fprintf(stderr,
+                    "NBD server of %s does not allow multiple connections, "
+                    "using one\n",
+                    uri);
+            break;
+        }
+    }
+    free(buf);
+    if (!nbd->nr_conns)
+        return -1;
+    return 0;
+}
+
+void nbd_close(struct nbd *nbd)
+{
+    struct nbd_request disc = {
+        .magic = htobe32(NBD_REQUEST_MAGIC),
+        .type = htobe16(NBD_CMD_DISC),
+    };
+
+    for (int i = 0; i < nbd->nr_conns; i++) {
+        struct nbd_conn *conn = &nbd->conns[i];
+
+        pthread_mutex_lock(&conn->lock);
+        conn->dead = true;
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_lock(&conn->send_lock);
+        nbd_send_all(conn->fd, &disc, sizeof(disc));
+        pthread_mutex_unlock(&conn->send_lock);
+        shutdown(conn->fd, SHUT_RDWR);
+        pthread_join(conn->receiver, NULL);
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->send_lock);
+        pthread_mutex_destroy(&conn->lock);
+        pthread_cond_destroy(&conn->cond);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Network Block Device client.
+ *
+ * Exports are named by URIs as in the NBD URI specification:
+ *   nbd://host[:port][/export]
+ *   nbd+unix:///[export]?socket=path
+ *
+ * A disk may use several connections to the server, each of which has up to
+ * NBD_MAX_INFLIGHT requests in flight. Requests are sent by the submitting
+ * thread and their replies are collected by one receiver thread per
+ * connection, which matches them by handle. Structured replies are used if
+ * the server supports them, so holes are not transferred as data.
+ *
+ * Protocol reference: https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+ */
+
+#define NBD_URI_PREFIX "nbd://"
+#define NBD_UNIX_URI_PREFIX "nbd+unix://"
+#define NBD_DEFAULT_PORT "10809"
+
+#define NBD_MAX_CONNS 16
+#define NBD_MAX_INFLIGHT 64 /* per connection */
+
+/* Request types */
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+
+/* Command flags */
+#define NBD_CMD_FLAG_FUA (1 << 0)
+
+/* Transmission flags of an export */
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_FUA (1 << 3)
+#define NBD_FLAG_SEND_TRIM (1 << 5)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+struct nbd_conn;
+
+struct nbd_req {
+    uint16_t type;
+    uint16_t flags;
+    void *buf;
+    uint64_t offset;
+    uint32_t len;
+    int err; /* errno of the failure, valid once done */
+    bool done;
+    struct nbd_conn *conn;
+};
+
+struct nbd_conn {
+    int fd;
+    struct nbd *nbd;
+    pthread_t receiver;
+    bool dead;
+
+    /* Requests are written as a whole under send_lock, while lock protects
+     * the in-flight slots. The receiver only takes lock, so a sender blocked
+     * on a full socket never stops replies from being drained.
+     */
+    pthread_mutex_t send_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* a request completed or a slot became free */
+    struct nbd_req *slots[NBD_MAX_INFLIGHT];
+    int nr_inflight;
+};
+
+struct nbd {
+    uint64_t size;
+    uint16_t flags; /* transmission flags */
+    bool structured;
+    int nr_conns;
+    unsigned int next_conn;
+    struct nbd_conn conns[NBD_MAX_CONNS];
+};
+
+int nbd_open(struct nbd *nbd, const char *uri, int nr_conns);
+int nbd_submit(struct nbd *nbd, struct nbd_req *req);
+int nbd_wait(struct nbd_req *req);
+int nbd_io(struct nbd *nbd,
+           uint16_t type,
+           uint16_t flags,
+           void *buf,
+           uint64_t offset,
+           uint32_t len);
+void nbd_close(struct nbd *nbd);
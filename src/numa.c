@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "numa.h"
+
+#define NUMA_SYSFS "/sys/devices/system/node/node%d/%s"
+#define NUMA_ALIGN (2 << 20) /* so that huge pages do not straddle nodes */
+
+static FILE *numa_open(int host_node, const char *file)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), NUMA_SYSFS, host_node, file);
+    return fopen(path, "r");
+}
+
+/* The distances of a host node to the others, in the order of their ids */
+static void numa_read_distances(struct numa *n, int node)
+{
+    int host_distance[64], nr = 0;
+    FILE *f = numa_open(n->host_nodes[node], "distance");
+
+    while (f && nr < 64 && fscanf(f, "%d", &host_distance[nr]) == 1)
+        nr++;
+    if (f)
+        fclose(f);
+    for (int i = 0; i < n->nr_nodes; i++) {
+        int d = n->host_nodes[i] < nr ? host_distance[n->host_nodes[i]]
+                                      : NUMA_REMOTE_DISTANCE;
+        /* Distinct guest nodes must be further apart than local */
+        if (i == node)
+            d = NUMA_LOCAL_DISTANCE;
+        else if (d <= NUMA_LOCAL_DISTANCE || d > 254)
+            d = NUMA_REMOTE_DISTANCE;
+        n->distance[node][i] = d;
+    }
+}
+
+/* A comma separated list of host nodes, one for each guest node */
+int numa_parse(struct numa *n, const char *spec)
+{
+    const char *p = spec;
+    char *end;
+
+    memset(n, 0, sizeof(*n));
+    while (*p) {
+        long node = strtol(p, &end, 10);
+        if (end == p || (*end && *end != ',') || node < 0 || node >= 64 ||
+            n->nr_nodes == NUMA_MAX_NODES) {
+            errno = EINVAL;
+            return throw_err("Invalid NUMA nodes %s, at most %d host nodes",
+                             spec, NUMA_MAX_NODES);
+        }
+        n->host_nodes[n->nr_nodes++] = node;
+        p = *end ? end + 1 : end;
+    }
+    for (int i = 0; i < n->nr_nodes; i++) {
+        FILE *f = numa_open(n->host_nodes[i], "cpulist");
+        if (!f)
+            return throw_err("There is no host NUMA node %d",
+                             n->host_nodes[i]);
+        fclose(f);
+        numa_read_distances(n, i);
+    }
+    return 0;
+}
+
+/* Guest node @node has @len bytes from @start of RAM of @size bytes */
+void numa_node_range(struct numa *n,
+                     int node,
+                     uint64_t size,
+                     uint64_t *start,
+                     uint64_t *len)
+{
+    uint64_t per_node = size / n->nr_nodes & ~((uint64_t) NUMA_ALIGN - 1);
+
+    *start = node * per_node;
+    *len = node == n->nr_nodes - 1 ? size - *start : per_node;
+}
+
+/* Called before the RAM is touched, as mbind does not move pages */
+int numa_bind(struct numa *n, void *mem, uint64_t size)
+{
+    for (int i = 0; i < n->nr_nodes; i++) {
+        unsigned long mask = 1UL << n->host_nodes[i];
+        uint64_t start, len;
+
+        numa_node_range(n, i, size, &start, &len);
+        if (syscall(SYS_mbind, (uint8_t *) mem + start, len, MPOL_BIND, &mask,
+                    sizeof(mask) * 8 + 1, 0) < 0)
+            return throw_err("Failed to bind guest node %d to host node %d",
+                             i, n->host_nodes[i]);
+    }
+    return 0;
+}
+
+/* Run the calling thread, and the threads it creates later, on the CPUs of
+ * the host node of guest node 0
+ */
+int numa_pin(struct numa *n)
+{
+    FILE *f;
+    cpu_set_t set;
+    int first, last;
+    char sep;
+
+    if (!n->nr_nodes)
+        return 0;
+    f = numa_open(n->host_nodes[0], "cpulist");
+    if (!f)
+        return throw_err("Failed to read the CPUs of host node %d",
+                         n->host_nodes[0]);
+    CPU_ZERO(&set);
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        sep = fgetc(f);
+        if (sep == '-' && fscanf(f, "%d", &last) == 1)
+            sep = fgetc(f);
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &set);
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+    /* A node without CPUs only provides memory */
+    if (!CPU_COUNT(&set))
+        return 0;
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        return throw_err("Failed to run on the CPUs of host node %d",
+                         n->host_nodes[0]);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Guest NUMA nodes, each backed by a node of the host.
+ *
+ * The guest RAM is split into one region per guest node, which is bound to
+ * its host node with mbind before it is touched. The vCPU and the device
+ * threads run on the CPUs of the host node of guest node 0, where the vCPU
+ * is, and the guest learns the topology and the distances between the host
+ * nodes from the ACPI SRAT and SLIT on x86 or from the device tree on arm64.
+ */
+
+#define NUMA_MAX_NODES 8
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20 /* if the host does not tell */
+
+struct numa {
+    int nr_nodes; /* 0 without NUMA */
+    int host_nodes[NUMA_MAX_NODES];
+    uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+};
+
+int numa_parse(struct numa *n, const char *spec);
+void numa_node_range(struct numa *n,
+                     int node,
+                     uint64_t size,
+                     uint64_t *start,
+                     uint64_t *len);
+int numa_bind(struct numa *n, void *mem, uint64_t size);
+int numa_pin(struct numa *n);
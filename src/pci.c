@@ -173,6 +173,17 @@ void pci_dev_init(struct pci_dev *dev,
     dev->mmio_bus = mmio_bus;
 }
 
+/* Load a saved configuration space and map the BARs it places */
+void pci_dev_restore(struct pci_dev *dev, const uint8_t *cfg_space)
+{
+    memcpy(dev->cfg_space, cfg_space, PCI_CFG_SPACE_SIZE);
+    for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
+        if (dev->bar_size[i])
+            pci_config_bar(dev, i);
+    }
+    pci_command_bar(dev);
+}
+
 void pci_dev_register(struct pci_dev *dev)
 {
     /* FIXEME: It just simplifies the registration on pci bus 0 */
@@ -51,6 +51,7 @@ void pci_set_bar(struct pci_dev *dev,
                  bool is_io_space,
                  dev_io_fn do_io);
 void pci_set_status(struct pci_dev *dev, uint16_t status);
+void pci_dev_restore(struct pci_dev *dev, const uint8_t *cfg_space);
 void pci_dev_register(struct pci_dev *dev);
 void pci_dev_init(struct pci_dev *dev,
                   struct pci *pci,
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+
+struct placement {
+    bool has_cpus;
+    cpu_set_t cpus;
+    int fifo; /* priority, 0 for SCHED_OTHER */
+    int nice;
+    char *cgroup;
+};
+
+static const char *class_names[PLACEMENT_NR_CLASSES] = {
+    [PLACEMENT_VCPU] = "vcpu",
+    [PLACEMENT_IO] = "io",
+    [PLACEMENT_CONSOLE] = "console",
+};
+
+static struct placement placements[PLACEMENT_NR_CLASSES];
+static bool configured;
+
+/* The affinity of the first thread placed, which all inherit until then */
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool has_default_cpus;
+static cpu_set_t default_cpus;
+
+static int placement_parse_cpus(const char *list, cpu_set_t *set)
+{
+    char *end;
+
+    CPU_ZERO(set);
+    while (*list) {
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*end && *end != ':')
+            return -1;
+        list = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* class,opt=value,... where the CPUs are separated by colons, as commas
+ * separate the options: vcpu,cpus=2:3,fifo=10
+ */
+int placement_parse(const char *spec)
+{
+    char *copy = strdup(spec), *save, *opt;
+    struct placement *p = NULL;
+    int cls, ret = -1;
+
+    if (!copy)
+        return -1;
+    opt = strtok_r(copy, ",", &save);
+    for (cls = PLACEMENT_VCPU; opt && cls < PLACEMENT_NR_CLASSES; cls++) {
+        if (!strcmp(opt, class_names[cls]))
+            p = &placements[cls];
+    }
+    if (!p) {
+        errno = EINVAL;
+        throw_err("Unknown thread class in %s, not vcpu, io or console", spec);
+        goto out;
+    }
+    while ((opt = strtok_r(NULL, ",", &save))) {
+        char *value = strchr(opt, '=');
+        if (!value)
+            goto invalid;
+        *value++ = '\0';
+        if (!strcmp(opt, "cpus")) {
+            if (placement_parse_cpus(value, &p->cpus) < 0)
+                goto invalid;
+            p->has_cpus = true;
+        } else if (!strcmp(opt, "fifo")) {
+            p->fifo = atoi(value);
+            if (p->fifo < 1 || p->fifo > 99)
+                goto invalid;
+        } else if (!strcmp(opt, "nice")) {
+            p->nice = atoi(value);
+            if (p->nice < -20 || p->nice > 19)
+                goto invalid;
+        } else if (!strcmp(opt, "cgroup")) {
+            free(p->cgroup);
+            p->cgroup = strdup(value);
+        } else {
+            goto invalid;
+        }
+    }
+    configured = true;
+    ret = 0;
+    goto out;
+invalid:
+    errno = EINVAL;
+    throw_err("Invalid thread placement %s", spec);
+out:
+    free(copy);
+    return ret;
+}
+
+static int placement_join_cgroup(const char *dir)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/cgroup.threads", dir);
+    f = fopen(path, "w");
+    if (!f) {
+        snprintf(path, sizeof(path), "%s/tasks", dir);
+        f = fopen(path, "w");
+    }
+    if (!f)
+        return -1;
+    fprintf(f, "%d\n", gettid());
+    return fclose(f);
+}
+
+/* Called by a thread when it starts. Failures are reported, and the thread
+ * runs on as it is.
+ */
+void placement_apply(enum placement_class cls, const char *fmt, ...)
+{
+    struct placement *p = &placements[cls];
+    struct sched_param param = {.sched_priority = p->fifo};
+    char name[16];
+    va_list args;
+
+    /* The names are limited to 15 characters */
+    if (fmt) {
+        va_start(args, fmt);
+        vsnprintf(name, sizeof(name), fmt, args);
+        va_end(args);
+        pthread_setname_np(pthread_self(), name);
+    }
+    if (!configured)
+        return;
+
+    pthread_mutex_lock(&default_lock);
+    if (!has_default_cpus)
+        has_default_cpus =
+            sched_getaffinity(0, sizeof(default_cpus), &default_cpus) == 0;
+    pthread_mutex_unlock(&default_lock);
+    if (cls == PLACEMENT_OTHER)
+        return;
+
+    if (p->has_cpus || has_default_cpus) {
+        cpu_set_t *cpus = p->has_cpus ? &p->cpus : &default_cpus;
+        if (sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+            throw_err("Failed to set the CPUs of the %s threads",
+                      class_names[cls]);
+    }
+    if (sched_setscheduler(0, p->fifo ? SCHED_FIFO : SCHED_OTHER, &param) <
+        0)
+        throw_err("Failed to set the scheduling policy of the %s threads",
+                  class_names[cls]);
+    if (!p->fifo && setpriority(PRIO_PROCESS, gettid(), p->nice) < 0)
+        throw_err("Failed to set the nice value of the %s threads",
+                  class_names[cls]);
+    if (p->cgroup && placement_join_cgroup(p->cgroup) < 0)
+        throw_err("Failed to move a %s thread to the cgroup %s",
+                  class_names[cls], p->cgroup);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/* Names, CPU affinity, scheduling and cgroups of the threads of kvm-host.
+ *
+ * Every thread places itself when it starts with placement_apply, giving its
+ * class and name. Each class may be configured with placement_parse:
+ * - cpus=list: CPUs to run on, e.g. 2-3,6
+ * - fifo=prio: SCHED_FIFO with the given priority, 1 to 99
+ * - nice=n: the nice value under SCHED_OTHER
+ * - cgroup=path: a cgroup v2 directory whose cgroup.threads the thread is
+ *   moved to, or a v1 directory with tasks
+ *
+ * Once any class is configured, threads of a class without a setting get
+ * the affinity every thread started with, SCHED_OTHER and nice 0 instead of
+ * inheriting those of the thread which created them, e.g. the vCPU thread
+ * which starts device threads when the guest enables their queues.
+ */
+
+enum placement_class {
+    PLACEMENT_OTHER, /* only named, e.g. management and helper threads */
+    PLACEMENT_VCPU,
+    PLACEMENT_IO,
+    PLACEMENT_CONSOLE,
+    PLACEMENT_NR_CLASSES,
+};
+
+int placement_parse(const char *spec);
+void placement_apply(enum placement_class cls, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+#include "prealloc.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t prealloc_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* "auto" for a thread per CPU, or the number of threads */
+int prealloc_parse(struct prealloc *p, const char *arg)
+{
+    char *end;
+
+    memset(p, 0, sizeof(*p));
+    if (!strcmp(arg, "auto")) {
+        p->nr_threads = -1;
+        return 0;
+    }
+    p->nr_threads = strtol(arg, &end, 10);
+    if (*end || p->nr_threads < 1 || p->nr_threads > PREALLOC_MAX_THREADS) {
+        errno = EINVAL;
+        return throw_err("The prealloc threads must be auto or 1 to %d",
+                         PREALLOC_MAX_THREADS);
+    }
+    return 0;
+}
+
+static void *prealloc_thread(void *arg)
+{
+    struct prealloc_worker *w = (struct prealloc_worker *) arg;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    placement_apply(PLACEMENT_OTHER, "prealloc-%d",
+                    (int) (w - w->p->workers));
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (madvise(w->mem, w->size, MADV_POPULATE_WRITE) == 0)
+        return NULL;
+    if (errno != EINVAL) {
+        w->err = errno;
+        return NULL;
+    }
+    /* Before Linux 5.14, every page is written without changing it, as the
+     * kernel may already be loaded into it.
+     */
+    for (uint64_t off = 0; off < w->size; off += page_size)
+        __atomic_fetch_add(w->mem + off, 0, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int prealloc_start(struct prealloc *p, void *mem, uint64_t size)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], nr_cpus = 0;
+    uint64_t slice;
+
+    if (!p->nr_threads)
+        return 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[nr_cpus++] = cpu;
+        }
+    }
+    p->nr_workers = p->nr_threads;
+    if (p->nr_workers < 0)
+        p->nr_workers = nr_cpus ? nr_cpus : 1;
+    if (p->nr_workers > PREALLOC_MAX_THREADS)
+        p->nr_workers = PREALLOC_MAX_THREADS;
+    slice = size / p->nr_workers;
+    slice = (slice + PREALLOC_ALIGN - 1) & ~((uint64_t) PREALLOC_ALIGN - 1);
+
+    p->size = size;
+    p->start_ns = prealloc_now();
+    for (int i = 0; i < p->nr_workers; i++) {
+        struct prealloc_worker *w = &p->workers[i];
+        uint64_t start = i * slice < size ? i * slice : size;
+
+        w->p = p;
+        w->mem = (uint8_t *) mem + start;
+        w->size = size - start < slice ? size - start : slice;
+        w->cpu = nr_cpus ? cpus[(long) i * nr_cpus / p->nr_workers] : -1;
+        w->err = 0;
+        if (pthread_create(&w->thread, NULL, prealloc_thread, w) != 0) {
+            p->nr_workers = i;
+            prealloc_wait(p);
+            errno = EAGAIN;
+            return throw_err("Failed to start the prealloc threads");
+        }
+    }
+    return 0;
+}
+
+int prealloc_wait(struct prealloc *p)
+{
+    int err = 0;
+
+    for (int i = 0; i < p->nr_workers; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+        if (p->workers[i].err)
+            err = p->workers[i].err;
+    }
+    if (!p->nr_workers)
+        return 0;
+    p->duration_ns = prealloc_now() - p->start_ns;
+    if (err) {
+        errno = err;
+        return throw_err("Failed to preallocate guest memory");
+    }
+    return 0;
+}
+
+void prealloc_dump_stats(struct prealloc *p,
+                         FILE *f,
+                         enum blk_stats_format format)
+{
+    unsigned long long mb = p->size >> 20, us = p->duration_ns / 1000;
+
+    if (format == BLK_STATS_JSON)
+        fprintf(f,
+                "{\"prealloc_mb\": %llu, \"prealloc_threads\": %d, "
+                "\"prealloc_us\": %llu}",
+                mb, p->nr_workers, us);
+    else
+        fprintf(f, "memory: %llu MB preallocated by %d threads in %llu us\n",
+                mb, p->nr_workers, us);
+}
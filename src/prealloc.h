@@ -0,0 +1,52 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blk-stats.h"
+
+/* Guest RAM populated before the vCPU starts, so that the guest does not
+ * take a host page fault on the first touch of every page.
+ *
+ * The RAM is split into one contiguous slice per thread, aligned to
+ * PREALLOC_ALIGN so that transparent huge pages are not split. Each thread
+ * populates its slice with MADV_POPULATE_WRITE, or touches every page on
+ * kernels without it. The threads are spread evenly over the CPUs the
+ * process may run on, so that the pages are allocated on the NUMA nodes the
+ * VM runs on, unless a memory policy of the RAM says otherwise.
+ *
+ * prealloc_start returns once the threads are started, so that the kernel
+ * is loaded meanwhile, and prealloc_wait waits for them.
+ */
+
+#define PREALLOC_MAX_THREADS 16
+#define PREALLOC_ALIGN (2 << 20)
+
+struct prealloc;
+
+struct prealloc_worker {
+    struct prealloc *p;
+    pthread_t thread;
+    uint8_t *mem;
+    uint64_t size;
+    int cpu; /* -1 if not pinned */
+    int err; /* errno of the failure */
+};
+
+struct prealloc {
+    int nr_threads; /* 0 for none, -1 for one per CPU */
+    struct prealloc_worker workers[PREALLOC_MAX_THREADS];
+    int nr_workers;
+    uint64_t size;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+int prealloc_parse(struct prealloc *p, const char *arg);
+int prealloc_start(struct prealloc *p, void *mem, uint64_t size);
+int prealloc_wait(struct prealloc *p);
+void prealloc_dump_stats(struct prealloc *p,
+                         FILE *f,
+                         enum blk_stats_format format);
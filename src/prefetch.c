@@ -0,0 +1,200 @@
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "diskimg.h"
+#include "err.h"
+#include "placement.h"
+#include "prefetch.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t prefetch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* The trace is written to a temporary file and only replaces the previous
+ * one once it is complete.
+ */
+static char *prefetch_tmp_path(const char *path)
+{
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp)
+        strcat(strcpy(tmp, path), ".tmp");
+    return tmp;
+}
+
+static int prefetch_init_record(struct prefetch *prefetch, const char *path)
+{
+    char *tmp = prefetch_tmp_path(path);
+    if (!tmp)
+        return -1;
+
+    prefetch->file = fopen(tmp, "w");
+    free(tmp);
+    if (!prefetch->file ||
+        fwrite(PREFETCH_MAGIC, strlen(PREFETCH_MAGIC), 1, prefetch->file) != 1)
+        return throw_err("Failed to create the prefetch trace %s", path);
+
+    prefetch->path = strdup(path);
+    prefetch->deadline_ns =
+        prefetch_now() + PREFETCH_RECORD_SECONDS * NS_PER_SEC;
+    return 0;
+}
+
+/* Called with prefetch->lock held */
+static bool prefetch_write_extent(struct prefetch *prefetch)
+{
+    struct prefetch_extent extent = {
+        .offset = htole64(prefetch->pending.offset),
+        .len = htole32(prefetch->pending.len),
+    };
+
+    return fwrite(&extent, sizeof(extent), 1, prefetch->file) == 1;
+}
+
+/* Called with prefetch->lock held */
+static void prefetch_finish_record(struct prefetch *prefetch)
+{
+    if (!prefetch->file)
+        return;
+
+    if (prefetch->pending.len)
+        prefetch_write_extent(prefetch);
+    char *tmp = prefetch_tmp_path(prefetch->path);
+    if (fclose(prefetch->file) == 0 && tmp)
+        rename(tmp, prefetch->path);
+    free(tmp);
+    prefetch->file = NULL;
+}
+
+void prefetch_record(struct prefetch *prefetch, off_t offset, size_t len)
+{
+    struct prefetch_extent *pending = &prefetch->pending;
+
+    if (prefetch->mode != PREFETCH_RECORD)
+        return;
+
+    pthread_mutex_lock(&prefetch->lock);
+    if (!prefetch->file)
+        goto out;
+    if (prefetch_now() > prefetch->deadline_ns ||
+        prefetch->nr_recorded >= PREFETCH_MAX_EXTENTS) {
+        prefetch_finish_record(prefetch);
+        goto out;
+    }
+
+    if (pending->len && pending->offset + pending->len == (uint64_t) offset &&
+        pending->len + len <= PREFETCH_MAX_IO) {
+        pending->len += len;
+        goto out;
+    }
+    if (pending->len && prefetch_write_extent(prefetch))
+        prefetch->nr_recorded++;
+    *pending = (struct prefetch_extent){.offset = offset, .len = len};
+out:
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/* The extents are only pulled into the page cache, nothing is copied */
+static void *prefetch_worker(void *arg)
+{
+    struct prefetch *prefetch = (struct prefetch *) arg;
+
+    placement_apply(PLACEMENT_IO, "prefetch");
+    while (!__atomic_load_n(&prefetch->stop, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&prefetch->next, 1, __ATOMIC_RELAXED);
+        if (i >= prefetch->nr_extents)
+            break;
+
+        struct prefetch_extent *extent = &prefetch->extents[i];
+        if (extent->offset >= prefetch->diskimg->size)
+            continue;
+        uint64_t len = prefetch->diskimg->size - extent->offset;
+        if (len > extent->len)
+            len = extent->len;
+        if (diskimg_readahead(prefetch->diskimg, extent->offset, len) < 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static int prefetch_init_replay(struct prefetch *prefetch, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char magic[sizeof(PREFETCH_MAGIC) - 1];
+    struct stat st;
+
+    /* Without a trace the disk simply boots without prefetching */
+    if (!file)
+        return 0;
+    if (fstat(fileno(file), &st) < 0 || fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, PREFETCH_MAGIC, sizeof(magic))) {
+        fclose(file);
+        return throw_err("Invalid prefetch trace %s", path);
+    }
+
+    prefetch->nr_extents =
+        (st.st_size - sizeof(magic)) / sizeof(struct prefetch_extent);
+    prefetch->extents =
+        malloc(prefetch->nr_extents * sizeof(struct prefetch_extent));
+    if (!prefetch->extents ||
+        fread(prefetch->extents, sizeof(struct prefetch_extent),
+              prefetch->nr_extents, file) != prefetch->nr_extents) {
+        fclose(file);
+        free(prefetch->extents);
+        prefetch->extents = NULL;
+        return throw_err("Failed to read prefetch trace %s", path);
+    }
+    fclose(file);
+    for (size_t i = 0; i < prefetch->nr_extents; i++) {
+        prefetch->extents[i].offset = le64toh(prefetch->extents[i].offset);
+        prefetch->extents[i].len = le32toh(prefetch->extents[i].len);
+    }
+
+    for (int i = 0; i < PREFETCH_NR_WORKERS; i++)
+        pthread_create(&prefetch->workers[i], NULL, prefetch_worker, prefetch);
+    return 0;
+}
+
+int prefetch_init(struct prefetch *prefetch,
+                  struct diskimg *diskimg,
+                  enum prefetch_mode mode,
+                  const char *path)
+{
+    memset(prefetch, 0, sizeof(struct prefetch));
+    prefetch->mode = mode;
+    prefetch->diskimg = diskimg;
+    pthread_mutex_init(&prefetch->lock, NULL);
+
+    switch (mode) {
+    case PREFETCH_RECORD:
+        return prefetch_init_record(prefetch, path);
+    case PREFETCH_REPLAY:
+        return prefetch_init_replay(prefetch, path);
+    default:
+        return 0;
+    }
+}
+
+void prefetch_exit(struct prefetch *prefetch)
+{
+    if (prefetch->mode == PREFETCH_RECORD) {
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch_finish_record(prefetch);
+        pthread_mutex_unlock(&prefetch->lock);
+    } else if (prefetch->mode == PREFETCH_REPLAY && prefetch->extents) {
+        __atomic_store_n(&prefetch->stop, true, __ATOMIC_RELAXED);
+        for (int i = 0; i < PREFETCH_NR_WORKERS; i++)
+            pthread_join(prefetch->workers[i], NULL);
+    }
+    free(prefetch->extents);
+    free(prefetch->path);
+    pthread_mutex_destroy(&prefetch->lock);
+}
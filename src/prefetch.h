@@ -0,0 +1,70 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Boot-trace-driven prefetch of disk images.
+ *
+ * In record mode, the reads of the guest during boot are logged to a sidecar
+ * file next to the image. In replay mode, a pool of threads issues readahead
+ * for the recorded extents in their original order right after the image is
+ * opened, so they are in the page cache before the guest asks for them. NBD
+ * disks are not prefetched.
+ *
+ * The sidecar file is PREFETCH_MAGIC followed by struct prefetch_extent
+ * entries in little endian.
+ */
+
+#define PREFETCH_MAGIC "KVMHPFT1"
+#define PREFETCH_FILE_SUFFIX ".prefetch"
+
+/* Recording stops after this long or this many extents, whichever is first */
+#define PREFETCH_RECORD_SECONDS 60
+#define PREFETCH_MAX_EXTENTS (1 << 20)
+
+#define PREFETCH_NR_WORKERS 8
+#define PREFETCH_MAX_IO (1 << 20)
+
+struct diskimg;
+
+enum prefetch_mode {
+    PREFETCH_OFF,
+    PREFETCH_RECORD,
+    PREFETCH_REPLAY,
+};
+
+struct prefetch_extent {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct prefetch {
+    enum prefetch_mode mode;
+    struct diskimg *diskimg;
+
+    /* record mode: contiguous reads are merged before they are logged */
+    pthread_mutex_t lock;
+    char *path;
+    FILE *file;
+    struct prefetch_extent pending;
+    uint64_t nr_recorded;
+    uint64_t deadline_ns;
+
+    /* replay mode */
+    struct prefetch_extent *extents;
+    size_t nr_extents;
+    size_t next; /* next extent a worker picks up */
+    pthread_t workers[PREFETCH_NR_WORKERS];
+    bool stop;
+};
+
+int prefetch_init(struct prefetch *prefetch,
+                  struct diskimg *diskimg,
+                  enum prefetch_mode mode,
+                  const char *path);
+void prefetch_record(struct prefetch *prefetch, off_t offset, size_t len);
+void prefetch_exit(struct prefetch *prefetch);
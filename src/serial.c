@@ -1,115 +1,269 @@
+#include <errno.h>
 #include <linux/serial_reg.h>
 #include <poll.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "err.h"
+#include "placement.h"
 #include "serial.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "vm.h"
 
 #define IO_READ8(data) *((uint8_t *) data)
 #define IO_WRITE8(data, value) ((uint8_t *) data)[0] = value
 
+/* Depth of the receive and transmit FIFOs of a 16550A */
+#define SERIAL_FIFO_LEN 16
+/* Output waiting for the writer thread, a power of two */
+#define SERIAL_TX_RING_LEN 4096
+
+/* The receive FIFO is filled by the worker thread and drained by the vCPU,
+ * and the transmit ring the other way round with the writer thread, so
+ * neither needs a lock. The transmit FIFO of the UART drains into the ring
+ * at once, and THRE is only cleared while the ring has no room for another
+ * FIFO worth of output. A guest which writes anyway waits for the writer.
+ *
+ * The lock orders the interrupt updates of the threads, so that none of them
+ * drops the line on a stale IIR after another found it raised.
+ */
 struct serial_dev_priv {
     uint8_t dll;
     uint8_t dlm;
-    uint8_t iir;
     uint8_t ier;
     uint8_t fcr;
     uint8_t lcr;
     uint8_t mcr;
-    uint8_t lsr;
     uint8_t msr;
     uint8_t scr;
+    bool thri; /* THRE interrupt pending until IIR is read or THR written */
+
+    uint8_t rx_fifo[SERIAL_FIFO_LEN];
+    unsigned int rx_head, rx_tail;
+    uint8_t tx_ring[SERIAL_TX_RING_LEN];
+    unsigned int tx_head, tx_tail;
 
-    struct fifo rx_buf;
     pthread_mutex_t lock;
-    pthread_cond_t cond;
+    pthread_cond_t tx_room; /* the writer has made room in the ring */
+    bool irq_asserted;
+    int irqfd;
+    int resamplefd; /* of a level-triggered line, or -1 */
+    int rx_wakefd;  /* the receive FIFO is no longer full */
+    int tx_wakefd;  /* the transmit ring is no longer empty */
+    int stopfd;
 };
 
 static struct serial_dev_priv serial_dev_priv = {
-    .iir = UART_IIR_NO_INT,
     .mcr = UART_MCR_OUT2,
-    .lsr = UART_LSR_TEMT | UART_LSR_THRE,
     .msr = UART_MSR_DCD | UART_MSR_DSR | UART_MSR_CTS,
-    .lock = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER,
 };
 
-/* FIXME: This implementation is incomplete */
-static void serial_update_irq(serial_dev_t *s)
+static unsigned int serial_rx_len(struct serial_dev_priv *priv)
 {
-    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
-    uint8_t iir = UART_IIR_NO_INT;
+    return __atomic_load_n(&priv->rx_tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&priv->rx_head, __ATOMIC_ACQUIRE);
+}
 
-    /* If enable receiver data interrupt and receiver data ready */
-    if ((priv->ier & UART_IER_RDI) && (priv->lsr & UART_LSR_DR))
-        iir = UART_IIR_RDI;
-    /* If enable transmiter data interrupt and transmiter empty */
-    else if ((priv->ier & UART_IER_THRI) && (priv->lsr & UART_LSR_TEMT))
-        iir = UART_IIR_THRI;
+static unsigned int serial_tx_room(struct serial_dev_priv *priv)
+{
+    return SERIAL_TX_RING_LEN -
+           (__atomic_load_n(&priv->tx_tail, __ATOMIC_SEQ_CST) -
+            __atomic_load_n(&priv->tx_head, __ATOMIC_SEQ_CST));
+}
 
-    __atomic_store_n(&priv->iir, iir | 0xc0, __ATOMIC_RELEASE);
+static uint8_t serial_lsr(struct serial_dev_priv *priv)
+{
+    uint8_t lsr = 0;
 
-    /* FIXME: the return error of vm_irq_line should be handled */
-    vm_irq_line(container_of(s, vm_t, serial), s->irq_num,
-                iir == UART_IIR_NO_INT ? 0 /* inactive */ : 1 /* active */);
+    if (serial_rx_len(priv))
+        lsr |= UART_LSR_DR;
+    if (serial_tx_room(priv) >= SERIAL_FIFO_LEN)
+        lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+    return lsr;
 }
 
-static int serial_readable(serial_dev_t *s, int timeout)
+static uint8_t serial_iir(struct serial_dev_priv *priv)
 {
-    struct pollfd pollfd = (struct pollfd){
-        .fd = s->infd,
-        .events = POLLIN,
-    };
-    return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
+    uint8_t ier = __atomic_load_n(&priv->ier, __ATOMIC_RELAXED);
+
+    if ((ier & UART_IER_RDI) && serial_rx_len(priv))
+        return UART_IIR_RDI;
+    if ((ier & UART_IER_THRI) && __atomic_load_n(&priv->thri, __ATOMIC_ACQUIRE))
+        return UART_IIR_THRI;
+    return UART_IIR_NO_INT;
 }
 
-#define FREQ_NS ((int) (1.0e6))
-#define NS_PER_SEC ((int) (1.0e9))
+static void serial_signal(int fd)
+{
+    uint64_t n = 1;
 
-/* global state to stop the loop of thread */
-static volatile bool thread_stop = false;
+    if (write(fd, &n, sizeof(n)) < 0)
+        throw_err("Failed to signal the serial device");
+}
+
+/* The line is only raised when an interrupt becomes pending. An edge
+ * triggered line drops again right away, so it is raised once more for the
+ * next interrupt. A level triggered line stays up until the guest
+ * acknowledges it, and the worker thread raises it again if the interrupt
+ * is still pending by then.
+ */
+static void serial_update_irq(serial_dev_t *s)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+
+    pthread_mutex_lock(&priv->lock);
+    if (serial_iir(priv) != UART_IIR_NO_INT) {
+        if (!priv->irq_asserted)
+            serial_signal(priv->irqfd);
+        priv->irq_asserted = true;
+    } else if (priv->resamplefd < 0) {
+        priv->irq_asserted = false;
+    }
+    pthread_mutex_unlock(&priv->lock);
+}
+
+/* Read as much input as the receive FIFO takes */
+static void serial_receive(serial_dev_t *s)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    unsigned int tail = priv->rx_tail;
+    unsigned int room = SERIAL_FIFO_LEN - serial_rx_len(priv);
+    unsigned int offset = tail % SERIAL_FIFO_LEN;
+    uint8_t buf[SERIAL_FIFO_LEN];
+    ssize_t n = read(s->infd, buf, room);
+
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+        /* End of input */
+        s->infd = -1;
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++)
+        priv->rx_fifo[(offset + i) % SERIAL_FIFO_LEN] = buf[i];
+    if (n > 0) {
+        __atomic_store_n(&priv->rx_tail, tail + n, __ATOMIC_RELEASE);
+        serial_update_irq(s);
+    }
+}
 
 static void *serial_thread(serial_dev_t *s)
 {
     struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
-    while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
-        if (!serial_readable(s, -1))
+    uint64_t n;
+
+    placement_apply(PLACEMENT_CONSOLE, "serial");
+    while (true) {
+        struct pollfd fds[4] = {
+            {.fd = priv->stopfd, .events = POLLIN},
+            {.fd = priv->rx_wakefd, .events = POLLIN},
+            {.fd = priv->resamplefd, .events = POLLIN},
+            {.fd = -1, .events = POLLIN},
+        };
+        /* Input is left in the pipe while the FIFO is full */
+        if (s->infd >= 0 && serial_rx_len(priv) < SERIAL_FIFO_LEN)
+            fds[3].fd = s->infd;
+        if (poll(fds, 4, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the serial input");
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if ((fds[1].revents & POLLIN) &&
+            read(priv->rx_wakefd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the serial wakeup");
+        if (fds[2].revents & POLLIN) {
+            if (read(priv->resamplefd, &n, sizeof(n)) < 0)
+                throw_err("Failed to read the serial resample event");
+            pthread_mutex_lock(&priv->lock);
+            priv->irq_asserted = false;
+            pthread_mutex_unlock(&priv->lock);
+            serial_update_irq(s);
+        }
+        if (fds[3].revents)
+            serial_receive(s);
+    }
+    return NULL;
+}
+
+/* Write out whatever the guest has put into the ring in one go */
+static void serial_flush(serial_dev_t *s)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    unsigned int head = priv->tx_head;
+    unsigned int tail;
+
+    while ((tail = __atomic_load_n(&priv->tx_tail, __ATOMIC_SEQ_CST)) != head) {
+        unsigned int offset = head % SERIAL_TX_RING_LEN;
+        unsigned int len = tail - head;
+        if (len > SERIAL_TX_RING_LEN - offset)
+            len = SERIAL_TX_RING_LEN - offset;
+        ssize_t n = write(STDOUT_FILENO, priv->tx_ring + offset, len);
+        if (n < 0 && errno == EINTR)
             continue;
+        /* Output which cannot be written is dropped */
+        head += n > 0 ? n : len;
+        __atomic_store_n(&priv->tx_head, head, __ATOMIC_SEQ_CST);
         pthread_mutex_lock(&priv->lock);
-        if (fifo_is_full(&priv->rx_buf)) {
-            /* stdin is readable, but the rx_buf is full.
-             * Wait for notification.
-             */
-            pthread_cond_wait(&priv->cond, &priv->lock);
-        }
-        serial_console(s);
+        pthread_cond_broadcast(&priv->tx_room);
         pthread_mutex_unlock(&priv->lock);
     }
-
-    return NULL;
+    /* The transmit FIFO is empty again */
+    __atomic_store_n(&priv->thri, true, __ATOMIC_RELEASE);
+    serial_update_irq(s);
 }
 
-void serial_console(serial_dev_t *s)
+static void *serial_writer_thread(serial_dev_t *s)
 {
     struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    struct pollfd fds[2] = {
+        {.fd = priv->stopfd, .events = POLLIN},
+        {.fd = priv->tx_wakefd, .events = POLLIN},
+    };
+    uint64_t n;
 
-    while (!fifo_is_full(&priv->rx_buf) && serial_readable(s, 0)) {
-        char c;
-        if (read(s->infd, &c, 1) == -1)
+    placement_apply(PLACEMENT_CONSOLE, "serial-tx");
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the serial output");
             break;
-        if (!fifo_put(&priv->rx_buf, c))
+        }
+        if ((fds[1].revents & POLLIN) &&
+            read(priv->tx_wakefd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the serial wakeup");
+        serial_flush(s);
+        if (fds[0].revents)
             break;
-        __atomic_store_n(&priv->lsr, priv->lsr | UART_LSR_DR, __ATOMIC_RELEASE);
     }
-    serial_update_irq(s);
+    return NULL;
+}
+
+static void serial_transmit(serial_dev_t *s, uint8_t value)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    unsigned int tail = priv->tx_tail;
+
+    /* Cleared first, so that the flush of this byte raises it again */
+    __atomic_store_n(&priv->thri, false, __ATOMIC_RELEASE);
+    if (serial_tx_room(priv) == 0) {
+        pthread_mutex_lock(&priv->lock);
+        while (serial_tx_room(priv) == 0)
+            pthread_cond_wait(&priv->tx_room, &priv->lock);
+        pthread_mutex_unlock(&priv->lock);
+    }
+    priv->tx_ring[tail % SERIAL_TX_RING_LEN] = value;
+    __atomic_store_n(&priv->tx_tail, tail + 1, __ATOMIC_SEQ_CST);
+    /* The writer only needs waking if it may have found the ring empty */
+    if (__atomic_load_n(&priv->tx_head, __ATOMIC_SEQ_CST) == tail)
+        serial_signal(priv->tx_wakefd);
 }
 
 static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
@@ -122,23 +276,16 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
         if (priv->lcr & UART_LCR_DLAB) {
             IO_WRITE8(data, priv->dll);
         } else {
-            pthread_mutex_lock(&priv->lock);
-            if (fifo_get(&priv->rx_buf, value))
-                IO_WRITE8(data, value);
-
-            if (fifo_is_empty(&priv->rx_buf)) {
-                priv->lsr &= ~UART_LSR_DR;
+            unsigned int len = serial_rx_len(priv);
+            if (!len)
+                break;
+            IO_WRITE8(data, priv->rx_fifo[priv->rx_head % SERIAL_FIFO_LEN]);
+            __atomic_store_n(&priv->rx_head, priv->rx_head + 1,
+                             __ATOMIC_RELEASE);
+            if (len == SERIAL_FIFO_LEN)
+                serial_signal(priv->rx_wakefd);
+            if (len == 1)
                 serial_update_irq(s);
-            }
-            /* The worker thread waits on the condition variable when rx_buf is
-             * full and stdin is still readable. Notify the worker thread when
-             * the capacity of the buffer drops to its half size, so the worker
-             * thread can read up to half of the buffer size before it is
-             * blocked again.
-             */
-            if (fifo_capacity(&priv->rx_buf) == FIFO_LEN / 2)
-                pthread_cond_signal(&priv->cond);
-            pthread_mutex_unlock(&priv->lock);
         }
         break;
     case UART_IER:
@@ -148,8 +295,15 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
             IO_WRITE8(data, priv->ier);
         break;
     case UART_IIR:
-        value = __atomic_load_n(&priv->iir, __ATOMIC_ACQUIRE);
-        IO_WRITE8(data, value | 0xc0); /* 0xc0 stands for FIFO enabled */
+        value = serial_iir(priv);
+        /* Reading IIR acknowledges a THRE interrupt */
+        if (value == UART_IIR_THRI) {
+            __atomic_store_n(&priv->thri, false, __ATOMIC_RELEASE);
+            serial_update_irq(s);
+        }
+        if (priv->fcr & UART_FCR_ENABLE_FIFO)
+            value |= 0xc0;
+        IO_WRITE8(data, value);
         break;
     case UART_LCR:
         IO_WRITE8(data, priv->lcr);
@@ -158,8 +312,7 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
         IO_WRITE8(data, priv->mcr);
         break;
     case UART_LSR:
-        value = __atomic_load_n(&priv->lsr, __ATOMIC_ACQUIRE);
-        IO_WRITE8(data, priv->lsr);
+        IO_WRITE8(data, serial_lsr(priv));
         break;
     case UART_MSR:
         IO_WRITE8(data, priv->msr);
@@ -175,51 +328,58 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
 static void serial_out(serial_dev_t *s, uint16_t offset, void *data)
 {
     struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    uint8_t value = IO_READ8(data);
 
     switch (offset) {
     case UART_TX:
         if (priv->lcr & UART_LCR_DLAB) {
-            priv->dll = IO_READ8(data);
+            priv->dll = value;
         } else {
-            putchar(((char *) data)[0]);
-            fflush(stdout);
-            pthread_mutex_lock(&priv->lock);
-            priv->lsr |= (UART_LSR_TEMT | UART_LSR_THRE); /* flush TX */
+            serial_transmit(s, value);
             serial_update_irq(s);
-            pthread_mutex_unlock(&priv->lock);
         }
         break;
     case UART_IER:
         if (!(priv->lcr & UART_LCR_DLAB)) {
-            pthread_mutex_lock(&priv->lock);
-            priv->ier = IO_READ8(data);
+            /* Enabling the THRE interrupt raises it if THR is empty */
+            if ((value & ~priv->ier & UART_IER_THRI) &&
+                (serial_lsr(priv) & UART_LSR_THRE))
+                __atomic_store_n(&priv->thri, true, __ATOMIC_RELEASE);
+            __atomic_store_n(&priv->ier, value & 0x0f, __ATOMIC_RELEASE);
             serial_update_irq(s);
-            pthread_mutex_unlock(&priv->lock);
         } else {
-            priv->dlm = IO_READ8(data);
+            priv->dlm = value;
         }
         break;
     case UART_FCR:
-        priv->fcr = IO_READ8(data);
+        /* Clearing the receive FIFO drops what the guest has not read */
+        if (value & UART_FCR_CLEAR_RCVR) {
+            unsigned int len = serial_rx_len(priv);
+            __atomic_store_n(&priv->rx_head, priv->rx_head + len,
+                             __ATOMIC_RELEASE);
+            if (len == SERIAL_FIFO_LEN)
+                serial_signal(priv->rx_wakefd);
+            serial_update_irq(s);
+        }
+        priv->fcr = value & ~(UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
         break;
     case UART_LCR:
-        priv->lcr = IO_READ8(data);
+        priv->lcr = value;
         break;
     case UART_MCR:
-        priv->mcr = IO_READ8(data);
+        priv->mcr = value;
         break;
     case UART_LSR: /* factory test */
     case UART_MSR: /* not used */
         break;
     case UART_SCR:
-        priv->scr = IO_READ8(data);
+        priv->scr = value;
         break;
     default:
         break;
     }
 }
 
-
 static void serial_handle_io(void *owner,
                              void *data,
                              uint8_t is_write,
@@ -235,12 +395,42 @@ static void serial_handle_io(void *owner,
 
 int serial_init(serial_dev_t *s, struct bus *bus)
 {
+    vm_t *v = container_of(s, vm_t, serial);
+    struct serial_dev_priv *priv = &serial_dev_priv;
+
     *s = (serial_dev_t){
-        .priv = (void *) &serial_dev_priv,
-        .infd = STDIN_FILENO,
+        .priv = (void *) priv,
+        .infd = -1,
         .irq_num = SERIAL_IRQ,
     };
+    /* stdin goes to hvc0 unless ttyS0 is the console */
+    if (v->serial_console)
+        s->infd = STDIN_FILENO;
+
+    pthread_mutex_init(&priv->lock, NULL);
+    pthread_cond_init(&priv->tx_room, NULL);
+    priv->irq_asserted = false;
+    priv->irqfd = eventfd(0, EFD_CLOEXEC);
+    priv->resamplefd = -1;
+    priv->rx_wakefd = eventfd(0, EFD_CLOEXEC);
+    priv->tx_wakefd = eventfd(0, EFD_CLOEXEC);
+    priv->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (priv->irqfd < 0 || priv->rx_wakefd < 0 || priv->tx_wakefd < 0 ||
+        priv->stopfd < 0)
+        return throw_err("Failed to create the eventfds of the UART");
+#ifdef SERIAL_IRQ_LEVEL
+    priv->resamplefd = eventfd(0, EFD_CLOEXEC);
+    if (priv->resamplefd < 0 ||
+        vm_irqfd_register_resample(v, priv->irqfd, priv->resamplefd,
+                                   s->irq_num) < 0)
+        return -1;
+#else
+    vm_irqfd_register(v, priv->irqfd, s->irq_num, 0);
+#endif
+
     pthread_create(&s->worker_tid, NULL, (void *) serial_thread, (void *) s);
+    pthread_create(&s->writer_tid, NULL, (void *) serial_writer_thread,
+                   (void *) s);
 
     dev_init(&s->dev, COM1_PORT_BASE, COM1_PORT_SIZE, s, serial_handle_io);
     bus_register_dev(bus, &s->dev);
@@ -248,8 +438,78 @@ int serial_init(serial_dev_t *s, struct bus *bus)
     return 0;
 }
 
+/* Output is never pending in a snapshot, as the ring is flushed at exit */
+struct serial_state {
+    uint8_t dll, dlm, ier, fcr, lcr, mcr, msr, scr;
+    uint8_t thri;
+    uint8_t rx_len;
+    uint8_t rx_fifo[SERIAL_FIFO_LEN];
+};
+
+int serial_save(serial_dev_t *s, struct snapshot *snap)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    unsigned int head = __atomic_load_n(&priv->rx_head, __ATOMIC_ACQUIRE);
+    struct serial_state state = {
+        .dll = priv->dll,
+        .dlm = priv->dlm,
+        .ier = priv->ier,
+        .fcr = priv->fcr,
+        .lcr = priv->lcr,
+        .mcr = priv->mcr,
+        .msr = priv->msr,
+        .scr = priv->scr,
+        .thri = __atomic_load_n(&priv->thri, __ATOMIC_ACQUIRE),
+        .rx_len = serial_rx_len(priv),
+    };
+
+    for (int i = 0; i < state.rx_len; i++)
+        state.rx_fifo[i] = priv->rx_fifo[(head + i) % SERIAL_FIFO_LEN];
+    return snapshot_add(snap, SNAPSHOT_SERIAL, 0, &state, sizeof(state));
+}
+
+/* Input which arrived before the restore keeps the saved input out */
+int serial_restore(serial_dev_t *s, struct snapshot *snap)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    struct serial_state state;
+
+    if (snapshot_read(snap, SNAPSHOT_SERIAL, 0, &state, sizeof(state)) < 0)
+        return -1;
+    priv->dll = state.dll;
+    priv->dlm = state.dlm;
+    priv->fcr = state.fcr;
+    priv->lcr = state.lcr;
+    priv->mcr = state.mcr;
+    priv->msr = state.msr;
+    priv->scr = state.scr;
+    __atomic_store_n(&priv->ier, state.ier, __ATOMIC_RELAXED);
+    __atomic_store_n(&priv->thri, state.thri, __ATOMIC_RELEASE);
+    if (!serial_rx_len(priv) && state.rx_len <= SERIAL_FIFO_LEN) {
+        unsigned int tail = priv->rx_tail;
+        for (int i = 0; i < state.rx_len; i++)
+            priv->rx_fifo[(tail + i) % SERIAL_FIFO_LEN] = state.rx_fifo[i];
+        __atomic_store_n(&priv->rx_tail, tail + state.rx_len,
+                         __ATOMIC_RELEASE);
+    }
+    serial_update_irq(s);
+    return 0;
+}
+
 void serial_exit(serial_dev_t *s)
 {
-    __atomic_store_n(&thread_stop, true, __ATOMIC_RELAXED);
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+
+    /* The writer flushes what is left before it stops */
+    serial_signal(priv->stopfd);
     pthread_join(s->worker_tid, NULL);
+    pthread_join(s->writer_tid, NULL);
+    close(priv->irqfd);
+    if (priv->resamplefd >= 0)
+        close(priv->resamplefd);
+    close(priv->rx_wakefd);
+    close(priv->tx_wakefd);
+    close(priv->stopfd);
+    pthread_cond_destroy(&priv->tx_room);
+    pthread_mutex_destroy(&priv->lock);
 }
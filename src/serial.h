@@ -11,12 +11,16 @@ typedef struct serial_dev serial_dev_t;
 
 struct serial_dev {
     void *priv;
-    pthread_t worker_tid;
-    int infd; /* file descriptor for serial input */
+    pthread_t worker_tid; /* input and interrupt resampling */
+    pthread_t writer_tid; /* output */
+    int infd;             /* file descriptor for serial input, or -1 */
     struct dev dev;
     int irq_num;
 };
 
-void serial_console(serial_dev_t *s);
+struct snapshot;
+
 int serial_init(serial_dev_t *s, struct bus *bus);
+int serial_save(serial_dev_t *s, struct snapshot *snap);
+int serial_restore(serial_dev_t *s, struct snapshot *snap);
 void serial_exit(serial_dev_t *s);
@@ -0,0 +1,254 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_PAGE_SIZE 4096
+#define SNAPSHOT_ALIGN(x, a) (((x) + (a) - 1) & ~((uint64_t) (a) - 1))
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_sections;
+    uint64_t ram_offset;
+    uint64_t ram_size;
+};
+
+struct snapshot_section_header {
+    uint32_t type;
+    uint32_t id;
+    uint64_t len;
+};
+
+void snapshot_init(struct snapshot *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+int snapshot_add(struct snapshot *s,
+                 uint32_t type,
+                 uint32_t id,
+                 const void *data,
+                 uint64_t len)
+{
+    struct snapshot_section *sections =
+        realloc(s->sections, (s->nr_sections + 1) * sizeof(*sections));
+    void *copy = malloc(len ? len : 1);
+
+    if (!sections || !copy) {
+        free(copy);
+        if (sections)
+            s->sections = sections;
+        return throw_err("Failed to allocate a snapshot section");
+    }
+    memcpy(copy, data, len);
+    s->sections = sections;
+    s->sections[s->nr_sections++] = (struct snapshot_section){
+        .type = type,
+        .id = id,
+        .len = len,
+        .data = copy,
+    };
+    return 0;
+}
+
+struct snapshot_section *snapshot_find(struct snapshot *s,
+                                       uint32_t type,
+                                       uint32_t id)
+{
+    for (int i = 0; i < s->nr_sections; i++) {
+        if (s->sections[i].type == type && s->sections[i].id == id)
+            return &s->sections[i];
+    }
+    return NULL;
+}
+
+/* Copy a section of a known size */
+int snapshot_read(struct snapshot *s,
+                  uint32_t type,
+                  uint32_t id,
+                  void *data,
+                  uint64_t len)
+{
+    struct snapshot_section *section = snapshot_find(s, type, id);
+
+    if (!section || section->len != len)
+        return throw_err("The snapshot lacks the state %u.%u", type, id);
+    memcpy(data, section->data, len);
+    return 0;
+}
+
+static int snapshot_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const uint8_t *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int snapshot_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (uint8_t *) buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static bool snapshot_page_is_zero(const uint8_t *page)
+{
+    return !page[0] && !memcmp(page, page + 1, SNAPSHOT_PAGE_SIZE - 1);
+}
+
+/* Write runs of pages with data, leaving the zero pages as holes */
+static int snapshot_write_ram(int fd,
+                              uint64_t offset,
+                              const uint8_t *ram,
+                              uint64_t ram_size)
+{
+    uint64_t start = 0;
+
+    for (uint64_t pos = 0; pos <= ram_size; pos += SNAPSHOT_PAGE_SIZE) {
+        if (pos < ram_size && !snapshot_page_is_zero(ram + pos))
+            continue;
+        if (pos > start &&
+            snapshot_pwrite(fd, ram + start, pos - start, offset + start) < 0)
+            return -1;
+        start = pos + SNAPSHOT_PAGE_SIZE;
+    }
+    return 0;
+}
+
+/* The snapshot is written to a temporary file which replaces @path once it
+ * is complete, so that a failed save never leaves a truncated snapshot.
+ */
+int snapshot_write(struct snapshot *s,
+                   const char *path,
+                   const void *ram,
+                   uint64_t ram_size)
+{
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .nr_sections = s->nr_sections,
+        .ram_size = ram_size,
+    };
+    char tmp_path[4096];
+    uint64_t offset = sizeof(hdr);
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int) sizeof(tmp_path))
+        return throw_err("The snapshot path %s is too long", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return throw_err("Failed to create the snapshot %s", tmp_path);
+
+    for (int i = 0; i < s->nr_sections; i++) {
+        struct snapshot_section *section = &s->sections[i];
+        struct snapshot_section_header shdr = {
+            .type = section->type,
+            .id = section->id,
+            .len = section->len,
+        };
+        if (snapshot_pwrite(fd, &shdr, sizeof(shdr), offset) < 0 ||
+            snapshot_pwrite(fd, section->data, section->len,
+                            offset + sizeof(shdr)) < 0)
+            goto fail;
+        offset += sizeof(shdr) + SNAPSHOT_ALIGN(section->len, 8);
+    }
+    hdr.ram_offset = SNAPSHOT_ALIGN(offset, SNAPSHOT_PAGE_SIZE);
+    if (snapshot_pwrite(fd, &hdr, sizeof(hdr), 0) < 0 ||
+        ftruncate(fd, hdr.ram_offset + ram_size) < 0 ||
+        snapshot_write_ram(fd, hdr.ram_offset, ram, ram_size) < 0 ||
+        fsync(fd) < 0)
+        goto fail;
+    close(fd);
+    if (rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+        return throw_err("Failed to rename the snapshot to %s", path);
+    }
+    return 0;
+
+fail:
+    throw_err("Failed to write the snapshot %s", tmp_path);
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+}
+
+/* Read the sections of a snapshot. The file stays open for the guest RAM to
+ * be mapped from it.
+ */
+int snapshot_open(struct snapshot *s, const char *path)
+{
+    struct snapshot_header hdr;
+    uint64_t offset = sizeof(hdr);
+    struct stat st;
+
+    snapshot_init(s);
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0)
+        return throw_err("Failed to open the snapshot %s", path);
+    if (snapshot_pread(s->fd, &hdr, sizeof(hdr), 0) < 0 ||
+        memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != SNAPSHOT_VERSION)
+        return throw_err("%s is not a kvm-host snapshot", path);
+    if (fstat(s->fd, &st) < 0 ||
+        (uint64_t) st.st_size < hdr.ram_offset + hdr.ram_size ||
+        hdr.ram_offset % SNAPSHOT_PAGE_SIZE)
+        return throw_err("The snapshot %s is truncated", path);
+
+    for (uint32_t i = 0; i < hdr.nr_sections; i++) {
+        struct snapshot_section_header shdr;
+        void *data;
+
+        if (snapshot_pread(s->fd, &shdr, sizeof(shdr), offset) < 0 ||
+            offset + sizeof(shdr) + shdr.len > hdr.ram_offset)
+            return throw_err("The snapshot %s is corrupted", path);
+        data = malloc(shdr.len ? shdr.len : 1);
+        if (!data ||
+            snapshot_pread(s->fd, data, shdr.len, offset + sizeof(shdr)) < 0 ||
+            snapshot_add(s, shdr.type, shdr.id, data, shdr.len) < 0) {
+            free(data);
+            return throw_err("Failed to read the snapshot %s", path);
+        }
+        free(data);
+        offset += sizeof(shdr) + SNAPSHOT_ALIGN(shdr.len, 8);
+    }
+    s->ram_offset = hdr.ram_offset;
+    s->ram_size = hdr.ram_size;
+    return 0;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+    for (int i = 0; i < s->nr_sections; i++)
+        free(s->sections[i].data);
+    free(s->sections);
+    if (s->fd >= 0)
+        close(s->fd);
+    snapshot_init(s);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A snapshot file holds the state of a stopped VM: a header, a list of
+ * tagged sections with the state of the vCPU and the devices, and the guest
+ * RAM at a page aligned offset. Pages of zeros are left as holes, and the RAM
+ * of a restored VM is mapped privately from the file, so that it is only
+ * read as the guest touches it.
+ */
+
+#define SNAPSHOT_MAGIC "KVMHSNAP"
+#define SNAPSHOT_VERSION 1
+
+enum snapshot_section_type {
+    SNAPSHOT_DEVICES = 1, /* PCI device IDs, in the order of creation */
+    SNAPSHOT_ARCH,        /* vCPU and interrupt controllers, id per arch */
+    SNAPSHOT_PCI,         /* configuration address latch */
+    SNAPSHOT_VIRTIO_PCI,  /* id numbers the PCI devices */
+    SNAPSHOT_VIRTQ,       /* id is the device << 16 | queue index */
+    SNAPSHOT_DEV,         /* device specific state, id of the device */
+    SNAPSHOT_SERIAL,
+};
+
+struct snapshot_section {
+    uint32_t type;
+    uint32_t id;
+    uint64_t len;
+    void *data;
+};
+
+struct snapshot {
+    struct snapshot_section *sections;
+    int nr_sections;
+    int fd;              /* of a snapshot read from a file, or -1 */
+    uint64_t ram_offset; /* of the guest RAM in the file */
+    uint64_t ram_size;
+    void *ram; /* of a snapshot kept in memory instead of a file */
+};
+
+void snapshot_init(struct snapshot *s);
+int snapshot_add(struct snapshot *s,
+                 uint32_t type,
+                 uint32_t id,
+                 const void *data,
+                 uint64_t len);
+struct snapshot_section *snapshot_find(struct snapshot *s,
+                                       uint32_t type,
+                                       uint32_t id);
+int snapshot_read(struct snapshot *s,
+                  uint32_t type,
+                  uint32_t id,
+                  void *data,
+                  uint64_t len);
+int snapshot_write(struct snapshot *s,
+                   const char *path,
+                   const void *ram,
+                   uint64_t ram_size);
+int snapshot_open(struct snapshot *s, const char *path);
+void snapshot_free(struct snapshot *s);
@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "tap.h"
+
+static int tap_open_queue(struct tap *tap, int flags)
+{
+    struct ifreq ifr = {.ifr_flags = flags};
+    int hdr_size = sizeof(struct virtio_net_hdr_v1);
+
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return throw_err("Failed to open /dev/net/tun");
+    memcpy(ifr.ifr_name, tap->ifname, IFNAMSIZ);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0 ||
+        ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+        throw_err("Failed to set up tap interface %s", tap->ifname);
+        close(fd);
+        return -1;
+    }
+    /* The kernel may have picked the name, e.g. for "tap%d" */
+    memcpy(tap->ifname, ifr.ifr_name, IFNAMSIZ);
+    return fd;
+}
+
+/* The interface is created if it does not exist yet. A multi-queue
+ * interface starts with only its first queue attached.
+ */
+int tap_open(struct tap *tap, const char *ifname, int nr_queues)
+{
+    int flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+
+    memset(tap, 0, sizeof(struct tap));
+    if (strlen(ifname) >= IFNAMSIZ || nr_queues < 1 ||
+        nr_queues > TAP_MAX_QUEUES) {
+        errno = EINVAL;
+        return throw_err("Invalid tap interface %s", ifname);
+    }
+    strcpy(tap->ifname, ifname);
+    if (nr_queues > 1)
+        flags |= IFF_MULTI_QUEUE;
+    for (int i = 0; i < nr_queues; i++) {
+        int fd = tap_open_queue(tap, flags);
+        if (fd < 0) {
+            tap_close(tap);
+            return -1;
+        }
+        tap->fds[tap->nr_queues++] = fd;
+        tap->attached[i] = true;
+    }
+    return tap_set_queues(tap, 1);
+}
+
+/* offload is a set of TUN_F_* flags, i.e. what the guest can receive */
+int tap_set_offload(struct tap *tap, unsigned int offload)
+{
+    if (ioctl(tap->fds[0], TUNSETOFFLOAD, offload) < 0)
+        return throw_err("Failed to set the offloads of %s", tap->ifname);
+    return 0;
+}
+
+/* Only attached queues get frames from the host, so the ones the guest does
+ * not use are detached.
+ */
+int tap_set_queues(struct tap *tap, int nr_active)
+{
+    if (tap->nr_queues == 1)
+        return 0;
+    for (int i = 0; i < tap->nr_queues; i++) {
+        bool attach = i < nr_active;
+        struct ifreq ifr = {
+            .ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE,
+        };
+        if (attach == tap->attached[i])
+            continue;
+        if (ioctl(tap->fds[i], TUNSETQUEUE, &ifr) < 0)
+            return throw_err("Failed to %s queue %d of %s",
+                             attach ? "attach" : "detach", i, tap->ifname);
+        tap->attached[i] = attach;
+    }
+    return 0;
+}
+
+void tap_close(struct tap *tap)
+{
+    for (int i = 0; i < tap->nr_queues; i++)
+        close(tap->fds[i]);
+    tap->nr_queues = 0;
+}
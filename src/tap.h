@@ -0,0 +1,25 @@
+#pragma once
+
+#include <net/if.h>
+#include <stdbool.h>
+
+/* tap network interface, opened with one file descriptor per queue.
+ *
+ * Frames are read and written with a 12-byte virtio_net_hdr_v1 in front, so
+ * checksum and segmentation offloads pass between the guest and the host
+ * network stack without being resolved in kvm-host.
+ */
+
+#define TAP_MAX_QUEUES 8
+
+struct tap {
+    char ifname[IFNAMSIZ];
+    int fds[TAP_MAX_QUEUES];
+    bool attached[TAP_MAX_QUEUES];
+    int nr_queues;
+};
+
+int tap_open(struct tap *tap, const char *ifname, int nr_queues);
+int tap_set_offload(struct tap *tap, unsigned int offload);
+int tap_set_queues(struct tap *tap, int nr_active);
+void tap_close(struct tap *tap);
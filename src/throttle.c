@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "throttle.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t throttle_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Parse a number with an optional binary suffix, e.g. "64M" */
+static int throttle_parse_size(const char *value, uint64_t *size)
+{
+    char *end;
+    uint64_t n = strtoull(value, &end, 10);
+
+    if (end == value)
+        return -1;
+    switch (*end) {
+    case 'G':
+    case 'g':
+        n <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        n <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        n <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end)
+        return -1;
+
+    *size = n;
+    return 0;
+}
+
+/* Returns 1 if key is a throttle option, 0 if it is not and -1 on a bad
+ * value.
+ */
+int throttle_parse_opt(struct throttle_config *config,
+                       const char *key,
+                       const char *value)
+{
+    uint64_t *field;
+
+    if (!strcmp(key, "iops"))
+        field = &config->iops;
+    else if (!strcmp(key, "iops_burst"))
+        field = &config->iops_burst;
+    else if (!strcmp(key, "bps"))
+        field = &config->bps;
+    else if (!strcmp(key, "bps_burst"))
+        field = &config->bps_burst;
+    else
+        return 0;
+
+    if (throttle_parse_size(value, field) < 0)
+        return throw_err("Invalid value '%s' of disk option '%s'", value,
+                         key);
+    return 1;
+}
+
+static void throttle_bucket_init(struct throttle_bucket *bucket,
+                                 uint64_t rate,
+                                 uint64_t burst)
+{
+    bucket->rate = rate;
+    bucket->burst = burst ? burst : rate;
+    bucket->tokens = bucket->burst;
+}
+
+static void throttle_bucket_refill(struct throttle_bucket *bucket,
+                                   uint64_t elapsed_ns)
+{
+    if (!bucket->rate)
+        return;
+    bucket->tokens += bucket->rate * elapsed_ns / NS_PER_SEC;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+}
+
+/* Nanoseconds until the bucket is out of debt */
+static uint64_t throttle_bucket_wait(struct throttle_bucket *bucket)
+{
+    if (!bucket->rate || bucket->tokens > 0)
+        return 0;
+    return (uint64_t) ((1 - bucket->tokens) * NS_PER_SEC / bucket->rate) + 1;
+}
+
+void throttle_init(struct throttle *throttle, struct throttle_config *config)
+{
+    memset(throttle, 0, sizeof(struct throttle));
+    throttle->enabled = config->iops || config->bps;
+    throttle_bucket_init(&throttle->iops, config->iops, config->iops_burst);
+    throttle_bucket_init(&throttle->bps, config->bps, config->bps_burst);
+    throttle->last_refill_ns = throttle_now();
+}
+
+/* Check if the next request may be issued. Returns 0 if it may, otherwise the
+ * nanoseconds the caller should defer the request path for.
+ */
+uint64_t throttle_check(struct throttle *throttle)
+{
+    if (!throttle->enabled)
+        return 0;
+
+    uint64_t now = throttle_now();
+    throttle_bucket_refill(&throttle->iops, now - throttle->last_refill_ns);
+    throttle_bucket_refill(&throttle->bps, now - throttle->last_refill_ns);
+    throttle->last_refill_ns = now;
+
+    uint64_t wait_iops = throttle_bucket_wait(&throttle->iops);
+    uint64_t wait_bps = throttle_bucket_wait(&throttle->bps);
+    uint64_t wait = wait_iops > wait_bps ? wait_iops : wait_bps;
+
+    if (wait && !throttle->throttled_since_ns) {
+        throttle->throttled_since_ns = now;
+        throttle->stats.nr_throttled++;
+    } else if (!wait && throttle->throttled_since_ns) {
+        throttle->stats.throttled_ns += now - throttle->throttled_since_ns;
+        throttle->throttled_since_ns = 0;
+    }
+    return wait;
+}
+
+/* Charge an issued request against the buckets */
+void throttle_account(struct throttle *throttle, size_t bytes)
+{
+    if (!throttle->enabled)
+        return;
+    if (throttle->iops.rate)
+        throttle->iops.tokens -= 1;
+    if (throttle->bps.rate)
+        throttle->bps.tokens -= bytes;
+}
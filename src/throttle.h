@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Limits of a disk, 0 means unlimited. A burst is the size of the bucket,
+ * i.e. how much may be issued at once after the disk has been idle. It
+ * defaults to one second worth of the rate.
+ */
+struct throttle_config {
+    uint64_t iops;
+    uint64_t iops_burst;
+    uint64_t bps;
+    uint64_t bps_burst;
+};
+
+/* Token bucket, refilled at rate tokens per second up to burst tokens. It may
+ * go into debt, so a large request is never starved by a small bucket.
+ */
+struct throttle_bucket {
+    double rate;
+    double burst;
+    double tokens;
+};
+
+struct throttle_stats {
+    uint64_t nr_throttled; /* times the request path was deferred */
+    uint64_t throttled_ns; /* total time spent deferred */
+};
+
+struct throttle {
+    bool enabled;
+    struct throttle_bucket iops;
+    struct throttle_bucket bps;
+    uint64_t last_refill_ns;
+    uint64_t throttled_since_ns;
+    struct throttle_stats stats;
+};
+
+int throttle_parse_opt(struct throttle_config *config,
+                       const char *key,
+                       const char *value);
+void throttle_init(struct throttle *throttle, struct throttle_config *config);
+uint64_t throttle_check(struct throttle *throttle);
+void throttle_account(struct throttle *throttle, size_t bytes);
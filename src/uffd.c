@@ -0,0 +1,358 @@
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+#include "uffd.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t uffd_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* The memory is described as "path[,key=value]..." like a disk. Supported
+ * keys:
+ * - uffd=on|off: fault the RAM in from the snapshot (default: off)
+ * - prefetch=record|replay: working set driven prefetch, see uffd.h
+ * - prefetch_file=path: the working set (default: the path + ".ws")
+ */
+int uffd_mem_parse_opts(struct uffd_mem *m,
+                        char *opts,
+                        const char *snapshot_path)
+{
+    char *saveptr;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = m->snapfd = m->stopfd = -1;
+    for (char *opt = opts ? strtok_r(opts, ",", &saveptr) : NULL; opt;
+         opt = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(opt, '=');
+        if (!value)
+            return throw_err("Missing value of restore option '%s'", opt);
+        *value++ = '\0';
+
+        if (!strcmp(opt, "uffd")) {
+            if (strcmp(value, "on") && strcmp(value, "off"))
+                return throw_err("uffd must be on or off");
+            m->enable = !strcmp(value, "on");
+        } else if (!strcmp(opt, "prefetch")) {
+            if (!strcmp(value, "record"))
+                m->mode = PREFETCH_RECORD;
+            else if (!strcmp(value, "replay"))
+                m->mode = PREFETCH_REPLAY;
+            else
+                return throw_err("Unknown prefetch mode '%s'", value);
+        } else if (!strcmp(opt, "prefetch_file")) {
+            free(m->ws_path);
+            m->ws_path = strdup(value);
+        } else {
+            return throw_err("Unknown restore option '%s'", opt);
+        }
+    }
+    if (m->mode != PREFETCH_OFF && !m->enable)
+        return throw_err("The working set is only prefetched with uffd=on");
+    if (!m->ws_path) {
+        m->ws_path =
+            malloc(strlen(snapshot_path) + sizeof(UFFD_WS_FILE_SUFFIX));
+        if (m->ws_path)
+            strcat(strcpy(m->ws_path, snapshot_path), UFFD_WS_FILE_SUFFIX);
+    }
+    return m->ws_path ? 0 : throw_err("Failed to allocate the working set path");
+}
+
+static bool uffd_page_is_zero(const uint8_t *page)
+{
+    return !page[0] && !memcmp(page, page + 1, UFFD_PAGE_SIZE - 1);
+}
+
+/* Copy a page in from the snapshot. Returns 1 if it was copied, 0 if it
+ * was already present, -1 on error.
+ */
+static int uffd_populate(struct uffd_mem *m, uint64_t page, uint8_t *buf)
+{
+    uint64_t addr = (uintptr_t) (m->mem + page * UFFD_PAGE_SIZE);
+    int ret;
+
+    if (__atomic_load_n(&m->present[page], __ATOMIC_ACQUIRE))
+        return 0;
+    if (pread(m->snapfd, buf, UFFD_PAGE_SIZE,
+              m->offset + page * UFFD_PAGE_SIZE) != UFFD_PAGE_SIZE)
+        return throw_err("Failed to read page %llu of the snapshot",
+                         (unsigned long long) page);
+
+    /* EAGAIN means the mapping changed under the copy, which is retried */
+    do {
+        if (uffd_page_is_zero(buf)) {
+            struct uffdio_zeropage zeropage = {
+                .range = {.start = addr, .len = UFFD_PAGE_SIZE},
+            };
+            ret = ioctl(m->fd, UFFDIO_ZEROPAGE, &zeropage);
+        } else {
+            struct uffdio_copy copy = {
+                .dst = addr,
+                .src = (uintptr_t) buf,
+                .len = UFFD_PAGE_SIZE,
+            };
+            ret = ioctl(m->fd, UFFDIO_COPY, &copy);
+        }
+    } while (ret < 0 && errno == EAGAIN);
+    if (ret < 0 && errno != EEXIST)
+        return throw_err("Failed to fill page %llu of the guest",
+                         (unsigned long long) page);
+    __atomic_store_n(&m->present[page], 1, __ATOMIC_RELEASE);
+    if (ret == 0)
+        return 1;
+
+    /* The other thread won, and its copy may not have woken the fault */
+    struct uffdio_range range = {.start = addr, .len = UFFD_PAGE_SIZE};
+    ioctl(m->fd, UFFDIO_WAKE, &range);
+    return 0;
+}
+
+/* The working set is written to a temporary file which only replaces the
+ * previous one once it is complete.
+ */
+static void uffd_finish_record(struct uffd_mem *m)
+{
+    char *tmp;
+    FILE *file;
+
+    if (m->mode != PREFETCH_RECORD || !m->ws)
+        return;
+    tmp = malloc(strlen(m->ws_path) + sizeof(".tmp"));
+    if (!tmp)
+        return;
+    strcat(strcpy(tmp, m->ws_path), ".tmp");
+    file = fopen(tmp, "w");
+    if (!file ||
+        fwrite(UFFD_WS_MAGIC, strlen(UFFD_WS_MAGIC), 1, file) != 1 ||
+        fwrite(m->ws, sizeof(m->ws[0]), m->nr_ws, file) != m->nr_ws) {
+        throw_err("Failed to write the working set %s", tmp);
+        if (file)
+            fclose(file);
+    } else if (fclose(file) == 0) {
+        rename(tmp, m->ws_path);
+    }
+    free(tmp);
+    free(m->ws);
+    m->ws = NULL;
+}
+
+static void uffd_record(struct uffd_mem *m, uint64_t page)
+{
+    if (m->mode != PREFETCH_RECORD || !m->ws)
+        return;
+    if (uffd_now() > m->deadline_ns) {
+        uffd_finish_record(m);
+        return;
+    }
+    m->ws[m->nr_ws++] = page;
+}
+
+static void *uffd_fault_thread(void *arg)
+{
+    struct uffd_mem *m = (struct uffd_mem *) arg;
+    struct pollfd fds[] = {
+        {.fd = m->fd, .events = POLLIN},
+        {.fd = m->stopfd, .events = POLLIN},
+    };
+    uint8_t *buf = malloc(UFFD_PAGE_SIZE);
+    struct uffd_msg msg;
+
+    placement_apply(PLACEMENT_IO, "uffd-fault");
+    while (buf) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the userfaultfd");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (read(m->fd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            throw_err("Failed to read the userfaultfd");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        uint64_t page =
+            (msg.arg.pagefault.address - (uintptr_t) m->mem) / UFFD_PAGE_SIZE;
+        int ret = uffd_populate(m, page, buf);
+        /* Nothing else will ever serve the fault, so the vCPU would hang */
+        if (ret < 0)
+            exit(1);
+        if (ret > 0) {
+            __atomic_fetch_add(&m->nr_faulted, 1, __ATOMIC_RELAXED);
+            uffd_record(m, page);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *uffd_prefetch_thread(void *arg)
+{
+    struct uffd_mem *m = (struct uffd_mem *) arg;
+    uint8_t *buf = malloc(UFFD_PAGE_SIZE);
+
+    placement_apply(PLACEMENT_IO, "uffd-prefetch");
+    for (uint64_t i = 0; buf && i < m->nr_ws; i++) {
+        if (__atomic_load_n(&m->stop, __ATOMIC_RELAXED))
+            break;
+        if (m->ws[i] >= m->size / UFFD_PAGE_SIZE)
+            continue;
+        int ret = uffd_populate(m, m->ws[i], buf);
+        if (ret < 0)
+            break;
+        if (ret > 0)
+            __atomic_fetch_add(&m->nr_prefetched, 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Without a working set the VM simply starts without prefetching */
+static int uffd_load_ws(struct uffd_mem *m)
+{
+    FILE *file = fopen(m->ws_path, "r");
+    char magic[sizeof(UFFD_WS_MAGIC) - 1];
+    struct stat st;
+
+    if (!file)
+        return 0;
+    if (fstat(fileno(file), &st) < 0 ||
+        fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, UFFD_WS_MAGIC, sizeof(magic))) {
+        fclose(file);
+        return throw_err("Invalid working set %s", m->ws_path);
+    }
+    m->nr_ws = (st.st_size - sizeof(magic)) / sizeof(m->ws[0]);
+    m->ws = malloc(m->nr_ws * sizeof(m->ws[0]) + 1);
+    if (!m->ws || fread(m->ws, sizeof(m->ws[0]), m->nr_ws, file) != m->nr_ws) {
+        fclose(file);
+        return throw_err("Failed to read the working set %s", m->ws_path);
+    }
+    fclose(file);
+    return 0;
+}
+
+/* @mem must be an anonymous mapping which nothing has touched yet */
+int uffd_mem_start(struct uffd_mem *m,
+                   void *mem,
+                   uint64_t size,
+                   int snapfd,
+                   uint64_t offset)
+{
+    struct uffdio_api api = {.api = UFFD_API};
+    struct uffdio_register reg = {
+        .range = {.start = (uintptr_t) mem, .len = size},
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    m->mem = mem;
+    m->size = size;
+    m->offset = offset;
+    m->snapfd = dup(snapfd);
+    m->present = calloc(size / UFFD_PAGE_SIZE, 1);
+    m->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (m->snapfd < 0 || !m->present || m->stopfd < 0)
+        return throw_err("Failed to set up the lazy restore");
+
+    m->fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (m->fd < 0)
+        return throw_err("Failed to create a userfaultfd");
+    if (ioctl(m->fd, UFFDIO_API, &api) < 0 ||
+        ioctl(m->fd, UFFDIO_REGISTER, &reg) < 0)
+        return throw_err("Failed to register the guest RAM with userfaultfd");
+
+    if (m->mode == PREFETCH_RECORD) {
+        m->ws = malloc(size / UFFD_PAGE_SIZE * sizeof(m->ws[0]));
+        if (!m->ws)
+            return throw_err("Failed to allocate the working set");
+        m->deadline_ns = uffd_now() + PREFETCH_RECORD_SECONDS * NS_PER_SEC;
+    } else if (m->mode == PREFETCH_REPLAY && uffd_load_ws(m) < 0) {
+        return -1;
+    }
+
+    pthread_create(&m->fault_thread, NULL, uffd_fault_thread, m);
+    m->started = true;
+    if (m->mode == PREFETCH_REPLAY && m->ws) {
+        pthread_create(&m->prefetch_thread, NULL, uffd_prefetch_thread, m);
+        m->prefetching = true;
+    }
+    return 0;
+}
+
+/* Copy in every page which is still missing, e.g. before a fork, whose
+ * child would see zeros where the pages of its parent are missing.
+ */
+int uffd_mem_populate_all(struct uffd_mem *m)
+{
+    uint8_t *buf = malloc(UFFD_PAGE_SIZE);
+    int ret = buf ? 0 : throw_err("Failed to allocate a page buffer");
+
+    for (uint64_t page = 0; !ret && page < m->size / UFFD_PAGE_SIZE; page++)
+        ret = uffd_populate(m, page, buf) < 0 ? -1 : 0;
+    free(buf);
+    return ret;
+}
+
+void uffd_mem_dump_stats(struct uffd_mem *m,
+                         FILE *f,
+                         enum blk_stats_format format)
+{
+    unsigned long long faulted =
+        __atomic_load_n(&m->nr_faulted, __ATOMIC_RELAXED);
+    unsigned long long prefetched =
+        __atomic_load_n(&m->nr_prefetched, __ATOMIC_RELAXED);
+
+    if (format == BLK_STATS_JSON)
+        fprintf(f, "{\"faulted_pages\": %llu, \"prefetched_pages\": %llu}",
+                faulted, prefetched);
+    else
+        fprintf(f, "memory: %llu pages faulted, %llu prefetched\n", faulted,
+                prefetched);
+}
+
+/* The guest RAM must be unmapped after, as nothing serves its faults */
+void uffd_mem_exit(struct uffd_mem *m)
+{
+    uint64_t n = 1;
+
+    if (m->prefetching) {
+        __atomic_store_n(&m->stop, true, __ATOMIC_RELAXED);
+        pthread_join(m->prefetch_thread, NULL);
+    }
+    if (m->started) {
+        if (write(m->stopfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to stop the userfaultfd thread");
+        pthread_join(m->fault_thread, NULL);
+    }
+    uffd_finish_record(m);
+    free(m->ws);
+    free(m->present);
+    free(m->ws_path);
+    if (m->fd >= 0)
+        close(m->fd);
+    if (m->snapfd >= 0)
+        close(m->snapfd);
+    if (m->stopfd >= 0)
+        close(m->stopfd);
+    memset(m, 0, sizeof(*m));
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blk-stats.h"
+#include "prefetch.h"
+
+/* Guest RAM of a restored VM which is filled from the snapshot on demand.
+ *
+ * The RAM is registered with userfaultfd, and a thread copies every page in
+ * from the snapshot when the guest, KVM or a device first touches it. Pages
+ * of zeros are mapped to the zero page instead.
+ *
+ * In record mode, the pages are logged in the order of their first fault to
+ * a sidecar file next to the snapshot. In replay mode, a thread copies the
+ * recorded pages in that order as soon as the VM is restored, so that most
+ * are present before the guest asks for them.
+ *
+ * The sidecar file is UFFD_WS_MAGIC followed by 32-bit page numbers in
+ * little endian.
+ */
+
+#define UFFD_WS_MAGIC "KVMHWS01"
+#define UFFD_WS_FILE_SUFFIX ".ws"
+#define UFFD_PAGE_SIZE 4096
+
+struct uffd_mem {
+    bool enable;
+    enum prefetch_mode mode;
+    char *ws_path;
+
+    int fd;     /* userfaultfd */
+    int snapfd; /* snapshot the pages are read from */
+    uint64_t offset;
+    uint8_t *mem;
+    uint64_t size;
+    uint8_t *present; /* a byte per page */
+    int stopfd;
+    pthread_t fault_thread;
+    bool started;
+
+    /* record mode, written by the fault thread only */
+    uint32_t *ws;
+    uint64_t nr_ws;
+    uint64_t deadline_ns;
+
+    /* replay mode */
+    pthread_t prefetch_thread;
+    bool prefetching;
+    bool stop;
+
+    uint64_t nr_faulted;
+    uint64_t nr_prefetched;
+};
+
+int uffd_mem_parse_opts(struct uffd_mem *m,
+                        char *opts,
+                        const char *snapshot_path);
+int uffd_mem_start(struct uffd_mem *m,
+                   void *mem,
+                   uint64_t size,
+                   int snapfd,
+                   uint64_t offset);
+int uffd_mem_populate_all(struct uffd_mem *m);
+void uffd_mem_dump_stats(struct uffd_mem *m,
+                         FILE *f,
+                         enum blk_stats_format format);
+void uffd_mem_exit(struct uffd_mem *m);
@@ -0,0 +1,438 @@
+#include <linux/virtio_config.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "vhost-user-blk.h"
+#include "vhost-user.h"
+#include "virtio-blk.h"
+#include "vm.h"
+
+/* Features which are passed from the backend on to the guest. The ring
+ * layout is up to them, since kvm-host never looks into the rings. The
+ * write cache toggle is left out as config writes are not forwarded.
+ */
+#define VHOST_USER_BLK_FEATURES                                       \
+    ((1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_BLK_F_SEG_MAX) | \
+     (1ULL << VIRTIO_BLK_F_GEOMETRY) | (1ULL << VIRTIO_BLK_F_RO) |       \
+     (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_FLUSH) |    \
+     (1ULL << VIRTIO_BLK_F_TOPOLOGY) | (1ULL << VIRTIO_BLK_F_MQ) |       \
+     (1ULL << VIRTIO_BLK_F_DISCARD) |                                  \
+     (1ULL << VIRTIO_BLK_F_WRITE_ZEROES) |                             \
+     (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |                           \
+     (1ULL << VIRTIO_RING_F_EVENT_IDX) | (1ULL << VIRTIO_F_VERSION_1) | \
+     (1ULL << VIRTIO_F_RING_PACKED))
+
+#define VHOST_USER_BLK_PROTOCOL_FEATURES          \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) |         \
+     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |  \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+static bool vhost_user_blk_has_protocol(struct vhost_user_blk_dev *dev,
+                                        int feature)
+{
+    return dev->protocol_features & (1ULL << feature);
+}
+
+/* Send a request. Requests starting with GET_ wait for their reply in msg,
+ * and the others wait for an acknowledgement if the backend supports them.
+ */
+static int vhost_user_blk_request(struct vhost_user_blk_dev *dev,
+                                  struct vhost_user_msg *msg,
+                                  bool get)
+{
+    uint32_t request = msg->hdr.request;
+    bool ack = !get && vhost_user_blk_has_protocol(
+                           dev, VHOST_USER_PROTOCOL_F_REPLY_ACK);
+
+    if (ack)
+        msg->hdr.flags |= VHOST_USER_FLAG_NEED_REPLY;
+    if (vhost_user_send(dev->sock, msg) < 0)
+        return throw_err("Failed to send vhost-user request %u", request);
+    if (!get && !ack)
+        return 0;
+
+    if (vhost_user_recv(dev->sock, msg) < 0)
+        return throw_err("Failed to receive vhost-user reply to %u", request);
+    vhost_user_close_fds(msg);
+    if (msg->hdr.request != request ||
+        !(msg->hdr.flags & VHOST_USER_FLAG_REPLY)) {
+        errno = EPROTO;
+        return throw_err("Unexpected vhost-user reply to %u", request);
+    }
+    if (ack && msg->payload.u64) {
+        errno = EIO;
+        return throw_err("vhost-user backend failed request %u", request);
+    }
+    return 0;
+}
+
+static int vhost_user_blk_get_u64(struct vhost_user_blk_dev *dev,
+                                  uint32_t request,
+                                  uint64_t *value)
+{
+    struct vhost_user_msg msg = {.hdr.request = request};
+
+    if (vhost_user_blk_request(dev, &msg, true) < 0)
+        return -1;
+    if (msg.hdr.size != sizeof(uint64_t)) {
+        errno = EPROTO;
+        return throw_err("Bad size of vhost-user reply to %u", request);
+    }
+    *value = msg.payload.u64;
+    return 0;
+}
+
+static int vhost_user_blk_set_u64(struct vhost_user_blk_dev *dev,
+                                  uint32_t request,
+                                  uint64_t value)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = request, .size = sizeof(uint64_t)},
+        .payload.u64 = value,
+    };
+    return vhost_user_blk_request(dev, &msg, false);
+}
+
+static int vhost_user_blk_set_state(struct vhost_user_blk_dev *dev,
+                                    uint32_t request,
+                                    unsigned int index,
+                                    unsigned int num)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = request, .size = sizeof(struct vhost_vring_state)},
+        .payload.state = {.index = index, .num = num},
+    };
+    return vhost_user_blk_request(dev, &msg, false);
+}
+
+static int vhost_user_blk_set_vring_fd(struct vhost_user_blk_dev *dev,
+                                       uint32_t request,
+                                       unsigned int index,
+                                       int fd)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = request, .size = sizeof(uint64_t)},
+        .payload.u64 = index,
+        .fds = {fd},
+        .nr_fds = 1,
+    };
+    return vhost_user_blk_request(dev, &msg, false);
+}
+
+/* Guest RAM is a single region of the memfd behind v->mem */
+static int vhost_user_blk_set_mem_table(struct vhost_user_blk_dev *dev)
+{
+    vm_t *v = dev->vm;
+    struct vhost_user_msg msg = {
+        .hdr = {.request = VHOST_USER_SET_MEM_TABLE,
+                .size = offsetof(struct vhost_user_memory, regions) +
+                        sizeof(struct vhost_user_region)},
+        .payload.memory = {
+            .nregions = 1,
+            .regions[0] = {
+                .guest_phys_addr = RAM_BASE,
+                .memory_size = RAM_SIZE,
+                .userspace_addr = (uint64_t) v->mem,
+                .mmap_offset = 0,
+            },
+        },
+        .fds = {v->mem_fd},
+        .nr_fds = 1,
+    };
+    return vhost_user_blk_request(dev, &msg, false);
+}
+
+static int vhost_user_blk_get_config(struct vhost_user_blk_dev *dev)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = VHOST_USER_GET_CONFIG,
+                .size = offsetof(struct vhost_user_config, region) +
+                        sizeof(struct virtio_blk_config)},
+        .payload.config = {.size = sizeof(struct virtio_blk_config)},
+    };
+
+    if (vhost_user_blk_request(dev, &msg, true) < 0)
+        return -1;
+    if (msg.hdr.size != offsetof(struct vhost_user_config, region) +
+                            sizeof(struct virtio_blk_config)) {
+        errno = EPROTO;
+        return throw_err("Bad size of the vhost-user-blk config");
+    }
+    memcpy(&dev->config, msg.payload.config.region, sizeof(dev->config));
+    return 0;
+}
+
+/* Stop a ring in the backend, which no longer touches it afterwards */
+static void vhost_user_blk_stop_vq(struct vhost_user_blk_dev *dev,
+                                   unsigned int index)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = VHOST_USER_GET_VRING_BASE,
+                .size = sizeof(struct vhost_vring_state)},
+        .payload.state = {.index = index},
+    };
+    vhost_user_blk_request(dev, &msg, true);
+}
+
+static void vhost_user_blk_set_ioeventfd(struct vhost_user_blk_dev *dev,
+                                         unsigned int index,
+                                         bool assign)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+    uint64_t addr = virtio_pci_get_notify_addr(pci_dev, &dev->vq[index]);
+
+    vm_ioeventfd_register(dev->vm, dev->kickfd[index], addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH |
+                              (assign ? 0 : KVM_IOEVENTFD_FLAG_DEASSIGN),
+                          index);
+}
+
+/* The queue layout is complete once the guest enables it, so it is handed
+ * to the backend from here on. The features of the guest are final by then,
+ * and are sent with the first queue after each reset. If the backend does
+ * not take the queue, it stays disabled and the device asks the guest for a
+ * reset.
+ */
+static void vhost_user_blk_enable_vq(struct virtq *vq)
+{
+    struct vhost_user_blk_dev *dev = (struct vhost_user_blk_dev *) vq->dev;
+    vm_t *v = dev->vm;
+    unsigned int index = vq - dev->vq;
+    bool sent = false;
+    uint64_t guest_feature = dev->virtio_pci_dev.guest_feature;
+    uint64_t n = 1;
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+
+    if (!dev->features_set) {
+        if (dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+            guest_feature |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        if (vhost_user_blk_set_u64(dev, VHOST_USER_SET_FEATURES,
+                                   guest_feature) < 0)
+            goto fail;
+        dev->features_set = true;
+    }
+
+    /* A packed ring starts at index 0 with the wrap counter set */
+    unsigned int base =
+        (dev->virtio_pci_dev.guest_feature & (1ULL << VIRTIO_F_RING_PACKED))
+            ? 1 << 15
+            : 0;
+    struct vhost_user_msg addr = {
+        .hdr = {.request = VHOST_USER_SET_VRING_ADDR,
+                .size = sizeof(struct vhost_vring_addr)},
+        .payload.addr = {
+            .index = index,
+            .desc_user_addr = (uint64_t) vq->desc_ring,
+            .avail_user_addr = (uint64_t) vq->guest_event,
+            .used_user_addr = (uint64_t) vq->device_event,
+        },
+    };
+    sent = true;
+    if (vhost_user_blk_set_state(dev, VHOST_USER_SET_VRING_NUM, index,
+                                 vq->info.size) < 0 ||
+        vhost_user_blk_set_state(dev, VHOST_USER_SET_VRING_BASE, index, base) <
+            0 ||
+        vhost_user_blk_request(dev, &addr, false) < 0 ||
+        vhost_user_blk_set_vring_fd(dev, VHOST_USER_SET_VRING_KICK, index,
+                                    dev->kickfd[index]) < 0 ||
+        vhost_user_blk_set_vring_fd(dev, VHOST_USER_SET_VRING_CALL, index,
+                                    dev->irqfd) < 0)
+        goto fail;
+    if ((dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) &&
+        vhost_user_blk_set_state(dev, VHOST_USER_SET_VRING_ENABLE, index, 1) <
+            0)
+        goto fail;
+    vhost_user_blk_set_ioeventfd(dev, index, true);
+    return;
+
+fail:
+    if (sent)
+        vhost_user_blk_stop_vq(dev, index);
+    vq->info.enable = false;
+    virtio_pci_set_needs_reset(&dev->virtio_pci_dev);
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to write the irqfd");
+}
+
+/* Queues are only disabled by a reset of the device, after which the guest
+ * may negotiate other features.
+ */
+static void vhost_user_blk_disable_vq(struct virtq *vq)
+{
+    struct vhost_user_blk_dev *dev = (struct vhost_user_blk_dev *) vq->dev;
+    unsigned int index = vq - dev->vq;
+
+    dev->features_set = false;
+    if (!vq->info.enable)
+        return;
+    vhost_user_blk_stop_vq(dev, index);
+    vhost_user_blk_set_ioeventfd(dev, index, false);
+    vq->info.enable = false;
+}
+
+/* Kicks normally reach the backend through the ioeventfd. One which was not
+ * matched by it, e.g. because of its width, is forwarded here.
+ */
+static void vhost_user_blk_kick(struct virtq *vq)
+{
+    struct vhost_user_blk_dev *dev = (struct vhost_user_blk_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (write(dev->kickfd[vq - dev->vq], &n, sizeof(n)) < 0)
+        throw_err("Failed to kick the vhost-user backend");
+}
+
+/* The backend signals the irqfd itself */
+static void vhost_user_blk_notify_used(struct virtq *vq) {}
+
+static struct virtq_ops ops = {
+    .enable_vq = vhost_user_blk_enable_vq,
+    .disable_vq = vhost_user_blk_disable_vq,
+    .complete_request = vhost_user_blk_kick,
+    .notify_used = vhost_user_blk_notify_used,
+};
+
+static int vhost_user_blk_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Negotiate with the backend up to the point where the guest takes over */
+static int vhost_user_blk_setup(struct vhost_user_blk_dev *dev)
+{
+    struct vhost_user_msg owner = {.hdr.request = VHOST_USER_SET_OWNER};
+    uint64_t protocol_features = 0, nr_vqs = 1;
+
+    if (vhost_user_blk_request(dev, &owner, false) < 0 ||
+        vhost_user_blk_get_u64(dev, VHOST_USER_GET_FEATURES, &dev->features) <
+            0)
+        return -1;
+    if (!(dev->features & (1ULL << VIRTIO_F_VERSION_1))) {
+        errno = ENOTSUP;
+        return throw_err("The vhost-user backend does not support virtio 1.0");
+    }
+
+    if (dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        if (vhost_user_blk_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                   &protocol_features) < 0)
+            return -1;
+        protocol_features &= VHOST_USER_BLK_PROTOCOL_FEATURES;
+        if (vhost_user_blk_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                                   protocol_features) < 0)
+            return -1;
+        dev->protocol_features = protocol_features;
+    }
+    if (!vhost_user_blk_has_protocol(dev, VHOST_USER_PROTOCOL_F_CONFIG)) {
+        errno = ENOTSUP;
+        return throw_err("The vhost-user backend cannot report its config");
+    }
+    if (vhost_user_blk_get_config(dev) < 0)
+        return -1;
+
+    if (vhost_user_blk_has_protocol(dev, VHOST_USER_PROTOCOL_F_MQ) &&
+        vhost_user_blk_get_u64(dev, VHOST_USER_GET_QUEUE_NUM, &nr_vqs) < 0)
+        return -1;
+    if ((dev->features & (1ULL << VIRTIO_BLK_F_MQ)) &&
+        dev->config.num_queues < nr_vqs)
+        nr_vqs = dev->config.num_queues;
+    if (!(dev->features & (1ULL << VIRTIO_BLK_F_MQ)) || nr_vqs < 1)
+        nr_vqs = 1;
+    if (nr_vqs > VHOST_USER_BLK_MAX_VQ)
+        nr_vqs = VHOST_USER_BLK_MAX_VQ;
+    dev->nr_vqs = nr_vqs;
+    dev->config.num_queues = nr_vqs;
+
+    return vhost_user_blk_set_mem_table(dev);
+}
+
+bool vhost_user_blk_is_spec(const char *spec)
+{
+    return !strncmp(spec, VHOST_USER_BLK_PREFIX, strlen(VHOST_USER_BLK_PREFIX));
+}
+
+/* The disk is described as "vhost-user:socket-path" */
+int vhost_user_blk_init_pci(struct vhost_user_blk_dev *dev,
+                            struct vm *vm,
+                            const char *spec,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus)
+{
+    const char *path = spec + strlen(VHOST_USER_BLK_PREFIX);
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+
+    memset(dev, 0, sizeof(struct vhost_user_blk_dev));
+    dev->vm = vm;
+    dev->irq_num = irq_num;
+    if (vm->mem_fd < 0)
+        return throw_err("vhost-user needs guest memory backed by a memfd");
+    dev->sock = vhost_user_blk_connect(path);
+    if (dev->sock < 0)
+        return throw_err("Failed to connect to the vhost-user backend %s",
+                         path);
+    if (vhost_user_blk_setup(dev) < 0) {
+        close(dev->sock);
+        return -1;
+    }
+
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(vm, dev->irqfd, irq_num, 0);
+    for (int i = 0; i < dev->nr_vqs; i++) {
+        dev->kickfd[i] = eventfd(0, EFD_CLOEXEC);
+        virtq_init(&dev->vq[i], dev, &ops);
+    }
+    dev->enable = true;
+
+    virtio_pci_init(pci_dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_BLK,
+                           VIRTIO_BLK_PCI_CLASS, irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, dev->nr_vqs);
+    pci_dev->device_feature = dev->features & VHOST_USER_BLK_FEATURES;
+    /* Only the backend knows when it raises an interrupt */
+    pci_dev->external_isr = true;
+    virtio_pci_enable(pci_dev);
+    return 0;
+}
+
+void vhost_user_blk_exit(struct vhost_user_blk_dev *dev)
+{
+    if (!dev->enable)
+        return;
+
+    /* Stop the rings, so the backend no longer touches guest memory */
+    for (int i = 0; i < dev->nr_vqs; i++) {
+        if (dev->vq[i].info.enable)
+            vhost_user_blk_stop_vq(dev, i);
+        close(dev->kickfd[i]);
+    }
+    close(dev->sock);
+    close(dev->irqfd);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <linux/virtio_blk.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+/* virtio-blk device whose queues are processed by a vhost-user backend.
+ *
+ * kvm-host only emulates the PCI transport. Guest memory, the vrings and the
+ * kick and call eventfds are handed to the backend, so requests and their
+ * completions go between the guest and the backend without kvm-host.
+ */
+
+#define VHOST_USER_BLK_PREFIX "vhost-user:"
+#define VHOST_USER_BLK_MAX_VQ 8
+
+struct vm;
+
+struct vhost_user_blk_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_blk_config config;
+    struct virtq vq[VHOST_USER_BLK_MAX_VQ];
+    int kickfd[VHOST_USER_BLK_MAX_VQ];
+    int nr_vqs;
+    int irqfd;
+    int irq_num;
+    int sock;
+    uint64_t features;          /* offered by the backend */
+    uint64_t protocol_features; /* negotiated with the backend */
+    bool features_set;
+    struct vm *vm;
+    bool enable;
+};
+
+bool vhost_user_blk_is_spec(const char *spec);
+int vhost_user_blk_init_pci(struct vhost_user_blk_dev *dev,
+                            struct vm *vm,
+                            const char *spec,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus);
+void vhost_user_blk_exit(struct vhost_user_blk_dev *dev);
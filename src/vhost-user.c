@@ -0,0 +1,103 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "vhost-user.h"
+
+/* The header and the payload are sent in one message, with msg->nr_fds file
+ * descriptors attached.
+ */
+int vhost_user_send(int sock, struct vhost_user_msg *msg)
+{
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)] = {0};
+    struct iovec iov[] = {
+        {.iov_base = &msg->hdr, .iov_len = sizeof(msg->hdr)},
+        {.iov_base = &msg->payload, .iov_len = msg->hdr.size},
+    };
+    struct msghdr mh = {
+        .msg_iov = iov,
+        .msg_iovlen = msg->hdr.size ? 2 : 1,
+    };
+
+    msg->hdr.flags |= VHOST_USER_VERSION;
+    if (msg->nr_fds) {
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * msg->nr_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * msg->nr_fds);
+        memcpy(CMSG_DATA(cmsg), msg->fds, sizeof(int) * msg->nr_fds);
+    }
+
+    ssize_t len = sizeof(msg->hdr) + msg->hdr.size;
+    ssize_t r;
+    do {
+        r = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+    if (r != len) {
+        if (r >= 0)
+            errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+/* Receive one message. File descriptors only come along with the header. */
+int vhost_user_recv(int sock, struct vhost_user_msg *msg)
+{
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+    struct iovec iov = {.iov_base = &msg->hdr, .iov_len = sizeof(msg->hdr)};
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t r;
+
+    msg->nr_fds = 0;
+    do {
+        r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (r < 0 && errno == EINTR);
+    if (r != sizeof(msg->hdr)) {
+        if (r >= 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+         cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        msg->nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(msg->fds, CMSG_DATA(cmsg), sizeof(int) * msg->nr_fds);
+    }
+
+    if (msg->hdr.size > sizeof(msg->payload)) {
+        vhost_user_close_fds(msg);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (msg->hdr.size) {
+        do {
+            r = recv(sock, &msg->payload, msg->hdr.size, MSG_WAITALL);
+        } while (r < 0 && errno == EINTR);
+        if (r != msg->hdr.size) {
+            vhost_user_close_fds(msg);
+            if (r >= 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void vhost_user_close_fds(struct vhost_user_msg *msg)
+{
+    for (int i = 0; i < msg->nr_fds; i++)
+        close(msg->fds[i]);
+    msg->nr_fds = 0;
+}
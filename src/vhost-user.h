@@ -0,0 +1,92 @@
+#pragma once
+
+#include <linux/vhost_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* vhost-user protocol, which lets a separate process implement the data path
+ * of a virtio device. Messages travel over a Unix stream socket, with file
+ * descriptors such as guest memory and eventfds attached as SCM_RIGHTS.
+ *
+ * Reference: https://qemu-project.gitlab.io/qemu/interop/vhost-user.html
+ */
+
+#define VHOST_USER_GET_FEATURES 1
+#define VHOST_USER_SET_FEATURES 2
+#define VHOST_USER_SET_OWNER 3
+#define VHOST_USER_SET_MEM_TABLE 5
+#define VHOST_USER_SET_VRING_NUM 8
+#define VHOST_USER_SET_VRING_ADDR 9
+#define VHOST_USER_SET_VRING_BASE 10
+#define VHOST_USER_GET_VRING_BASE 11
+#define VHOST_USER_SET_VRING_KICK 12
+#define VHOST_USER_SET_VRING_CALL 13
+#define VHOST_USER_SET_VRING_ERR 14
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM 17
+#define VHOST_USER_SET_VRING_ENABLE 18
+#define VHOST_USER_GET_CONFIG 24
+#define VHOST_USER_SET_CONFIG 25
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_FLAG_REPLY (1 << 2)
+#define VHOST_USER_FLAG_NEED_REPLY (1 << 3)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ 0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+/* The index of SET_VRING_KICK/CALL/ERR carries this flag if no fd is sent */
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+#define VHOST_USER_VRING_IDX_MASK 0xff
+
+#define VHOST_USER_MAX_REGIONS 8
+#define VHOST_USER_MAX_FDS 8
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+struct vhost_user_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+};
+
+struct vhost_user_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+};
+
+struct vhost_user_hdr {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+} __attribute__((packed));
+
+struct vhost_user_msg {
+    struct vhost_user_hdr hdr;
+    union {
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        struct vhost_user_memory memory;
+        struct vhost_user_config config;
+    } payload;
+    int fds[VHOST_USER_MAX_FDS];
+    int nr_fds;
+};
+
+int vhost_user_send(int sock, struct vhost_user_msg *msg);
+int vhost_user_recv(int sock, struct vhost_user_msg *msg);
+void vhost_user_close_fds(struct vhost_user_msg *msg);
@@ -0,0 +1,70 @@
+#include <fcntl.h>
+#include <linux/vhost.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "vhost.h"
+#include "vm.h"
+
+/* Open a vhost device, take ownership of it and hand it the guest memory */
+int vhost_open(const char *path, struct vm *v, uint64_t *features)
+{
+    struct {
+        struct vhost_memory mem;
+        struct vhost_memory_region region;
+    } table = {
+        .mem.nregions = 1,
+        .region = {
+            .guest_phys_addr = RAM_BASE,
+            .memory_size = RAM_SIZE,
+            .userspace_addr = (uint64_t) v->mem,
+        },
+    };
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+        return throw_err("Failed to open %s", path);
+    if (ioctl(fd, VHOST_SET_OWNER) < 0 ||
+        ioctl(fd, VHOST_GET_FEATURES, features) < 0 ||
+        ioctl(fd, VHOST_SET_MEM_TABLE, &table) < 0) {
+        close(fd);
+        return throw_err("Failed to set up %s", path);
+    }
+    return fd;
+}
+
+int vhost_set_features(int fd, uint64_t features)
+{
+    if (ioctl(fd, VHOST_SET_FEATURES, &features) < 0)
+        return throw_err("Failed to set the features of vhost");
+    return 0;
+}
+
+/* Hand the split ring of a virtqueue to the driver as its queue @index */
+int vhost_start_vq(int fd,
+                   struct vm *v,
+                   struct virtq *vq,
+                   unsigned int index,
+                   int kickfd,
+                   int callfd)
+{
+    struct vhost_vring_state num = {.index = index, .num = vq->info.size};
+    struct vhost_vring_state base = {.index = index, .num = 0};
+    struct vhost_vring_addr addr = {
+        .index = index,
+        .desc_user_addr = (uint64_t) vm_guest_to_host(v, vq->info.desc_addr),
+        .avail_user_addr = (uint64_t) vm_guest_to_host(v, vq->info.driver_addr),
+        .used_user_addr = (uint64_t) vm_guest_to_host(v, vq->info.device_addr),
+    };
+    struct vhost_vring_file kick = {.index = index, .fd = kickfd};
+    struct vhost_vring_file call = {.index = index, .fd = callfd};
+
+    if (ioctl(fd, VHOST_SET_VRING_NUM, &num) < 0 ||
+        ioctl(fd, VHOST_SET_VRING_BASE, &base) < 0 ||
+        ioctl(fd, VHOST_SET_VRING_ADDR, &addr) < 0 ||
+        ioctl(fd, VHOST_SET_VRING_KICK, &kick) < 0 ||
+        ioctl(fd, VHOST_SET_VRING_CALL, &call) < 0)
+        return throw_err("Failed to start vhost queue %u", index);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "virtq.h"
+
+/* Helpers shared by the devices whose data path runs in a vhost kernel
+ * driver, e.g. vhost-net and vhost-vsock. Guest memory is described to the
+ * driver as a single region, and the guest has to use split rings, as vhost
+ * does not implement packed ones.
+ */
+
+struct vm;
+
+int vhost_open(const char *path, struct vm *v, uint64_t *features);
+int vhost_set_features(int fd, uint64_t features);
+int vhost_start_vq(int fd,
+                   struct vm *v,
+                   struct virtq *vq,
+                   unsigned int index,
+                   int kickfd,
+                   int callfd);
@@ -0,0 +1,507 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+#include "snapshot.h"
+#include "uffd.h"
+#include "utils.h"
+#include "virtio-balloon.h"
+#include "vm.h"
+
+#define VIRTIO_BALLOON_INFLATE 0
+#define VIRTIO_BALLOON_DEFLATE 1
+#define VIRTIO_BALLOON_MAX_SEGS 64
+#define VIRTIO_BALLOON_PAGE_SIZE (1 << VIRTIO_BALLOON_PFN_SHIFT)
+
+/* The stats and reporting queues follow the deflate queue in this order,
+ * but only if the guest accepted their feature.
+ */
+static struct virtq *virtio_balloon_feature_vq(struct virtio_balloon_dev *dev,
+                                               int feature)
+{
+    uint64_t features = dev->virtio_pci_dev.guest_feature;
+    int index = VIRTIO_BALLOON_DEFLATE + 1;
+
+    if (!(features & (1ULL << feature)))
+        return NULL;
+    if (feature == VIRTIO_BALLOON_F_REPORTING &&
+        (features & (1ULL << VIRTIO_BALLOON_F_STATS_VQ)))
+        index++;
+    return &dev->vq[index];
+}
+
+static bool virtio_balloon_vq_ready(struct virtq *vq)
+{
+    return vq && vq->info.enable && virtq_has_avail(vq);
+}
+
+static struct vring_packed_desc *virtio_balloon_get_chain(
+    struct virtio_balloon_dev *dev,
+    struct virtq *vq,
+    struct iovec *iov,
+    int *cnt)
+{
+    struct vring_packed_desc *head = virtq_get_avail(vq);
+
+    *cnt = 0;
+    for (struct vring_packed_desc *desc = head; desc;
+         desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL) {
+        void *buf = vm_guest_range_to_host(dev->vm, desc->addr, desc->len);
+        if (!buf || *cnt == VIRTIO_BALLOON_MAX_SEGS)
+            continue;
+        iov[*cnt].iov_base = buf;
+        iov[(*cnt)++].iov_len = desc->len;
+    }
+    return head;
+}
+
+/* Give the RAM of a guest range back to the host. The guest does not
+ * expect released pages to keep their contents.
+ */
+static void virtio_balloon_release(struct virtio_balloon_dev *dev,
+                                   uint64_t guest,
+                                   uint64_t len)
+{
+    void *host = vm_guest_range_to_host(dev->vm, guest, len);
+
+    if (!host || dev->advice < 0)
+        return;
+    if (madvise(host, len, dev->advice) == 0)
+        return;
+    /* MADV_FREE only applies to anonymous memory, not the mapped kernel */
+    if (errno == EINVAL && dev->advice == MADV_FREE &&
+        madvise(host, len, MADV_DONTNEED) == 0)
+        return;
+    throw_err("Failed to release %llu bytes of guest memory at 0x%llx",
+              (unsigned long long) len, (unsigned long long) guest);
+}
+
+/* The buffers list the frames of the pages which left the guest. Adjacent
+ * frames are released together, which frees a transparent huge page whole
+ * rather than splitting it a page at a time.
+ */
+static void virtio_balloon_inflate(struct virtio_balloon_dev *dev,
+                                   struct iovec *iov,
+                                   int cnt)
+{
+    uint64_t start = 0, len = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        const uint8_t *buf = iov[i].iov_base;
+        for (size_t off = 0; off + sizeof(uint32_t) <= iov[i].iov_len;
+             off += sizeof(uint32_t)) {
+            uint32_t pfn;
+            memcpy(&pfn, buf + off, sizeof(pfn));
+            uint64_t addr = (uint64_t) pfn << VIRTIO_BALLOON_PFN_SHIFT;
+            if (len && addr == start + len) {
+                len += VIRTIO_BALLOON_PAGE_SIZE;
+                continue;
+            }
+            if (len)
+                virtio_balloon_release(dev, start, len);
+            start = addr;
+            len = VIRTIO_BALLOON_PAGE_SIZE;
+        }
+    }
+    if (len)
+        virtio_balloon_release(dev, start, len);
+}
+
+/* Pages taken out of the balloon are faulted in again as the guest uses
+ * them, so both queues are simply returned once the inflated pages are
+ * released.
+ */
+static bool virtio_balloon_pages(struct virtio_balloon_dev *dev, int index)
+{
+    struct virtq *vq = &dev->vq[index];
+    struct iovec iov[VIRTIO_BALLOON_MAX_SEGS];
+    bool used = false;
+    int cnt;
+
+    while (virtio_balloon_vq_ready(vq)) {
+        struct vring_packed_desc *head =
+            virtio_balloon_get_chain(dev, vq, iov, &cnt);
+        if (index == VIRTIO_BALLOON_INFLATE)
+            virtio_balloon_inflate(dev, iov, cnt);
+        virtq_put_used(head, 0);
+        used = true;
+    }
+    return used;
+}
+
+/* Each descriptor is a free block of the guest, of at least a pageblock */
+static bool virtio_balloon_report(struct virtio_balloon_dev *dev)
+{
+    struct virtq *vq =
+        virtio_balloon_feature_vq(dev, VIRTIO_BALLOON_F_REPORTING);
+    bool used = false;
+
+    while (virtio_balloon_vq_ready(vq)) {
+        struct vring_packed_desc *head = virtq_get_avail(vq);
+        uint64_t reported = 0;
+        for (struct vring_packed_desc *desc = head; desc;
+             desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL) {
+            virtio_balloon_release(dev, desc->addr, desc->len);
+            reported += desc->len;
+        }
+        __atomic_fetch_add(&dev->nr_reported, reported, __ATOMIC_RELAXED);
+        virtq_put_used(head, 0);
+        used = true;
+    }
+    return used;
+}
+
+/* The guest has a single stats buffer, which is kept until the next update
+ * is wanted, and filled again by the guest once it is returned.
+ */
+static bool virtio_balloon_stats(struct virtio_balloon_dev *dev, bool update)
+{
+    struct virtq *vq =
+        virtio_balloon_feature_vq(dev, VIRTIO_BALLOON_F_STATS_VQ);
+    struct iovec iov[VIRTIO_BALLOON_MAX_SEGS];
+    bool used = false;
+    int cnt;
+
+    if (!vq || !vq->info.enable)
+        return false;
+    if (update && dev->stats_idx >= 0) {
+        virtq_put_used(&vq->desc_ring[dev->stats_idx], 0);
+        dev->stats_idx = -1;
+        used = true;
+    }
+    while (virtq_has_avail(vq)) {
+        struct vring_packed_desc *head =
+            virtio_balloon_get_chain(dev, vq, iov, &cnt);
+        if (dev->stats_idx >= 0) {
+            virtq_put_used(&vq->desc_ring[dev->stats_idx], 0);
+            used = true;
+        }
+        dev->stats_idx = head - vq->desc_ring;
+
+        pthread_mutex_lock(&dev->lock);
+        for (int i = 0; i < cnt; i++) {
+            const uint8_t *buf = iov[i].iov_base;
+            for (size_t off = 0;
+                 off + sizeof(struct virtio_balloon_stat) <= iov[i].iov_len;
+                 off += sizeof(struct virtio_balloon_stat)) {
+                struct virtio_balloon_stat stat;
+                memcpy(&stat, buf + off, sizeof(stat));
+                if (stat.tag >= VIRTIO_BALLOON_S_NR)
+                    continue;
+                dev->stats[stat.tag] = stat.val;
+                dev->stats_valid |= 1U << stat.tag;
+            }
+        }
+        pthread_mutex_unlock(&dev->lock);
+    }
+    return used;
+}
+
+static bool virtio_balloon_process(struct virtio_balloon_dev *dev,
+                                   bool update)
+{
+    bool used[VIRTIO_BALLOON_VQ_NUM] = {false};
+    struct virtq *stats_vq =
+        virtio_balloon_feature_vq(dev, VIRTIO_BALLOON_F_STATS_VQ);
+    struct virtq *report_vq =
+        virtio_balloon_feature_vq(dev, VIRTIO_BALLOON_F_REPORTING);
+    bool irq = false;
+
+    used[VIRTIO_BALLOON_INFLATE] =
+        virtio_balloon_pages(dev, VIRTIO_BALLOON_INFLATE);
+    used[VIRTIO_BALLOON_DEFLATE] =
+        virtio_balloon_pages(dev, VIRTIO_BALLOON_DEFLATE);
+    if (stats_vq)
+        used[stats_vq - dev->vq] = virtio_balloon_stats(dev, update);
+    if (report_vq)
+        used[report_vq - dev->vq] = virtio_balloon_report(dev);
+
+    for (int i = 0; i < VIRTIO_BALLOON_VQ_NUM; i++) {
+        struct virtq *vq = &dev->vq[i];
+        irq |= used[i] &&
+               vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    return irq;
+}
+
+static void virtio_balloon_raise_irq(struct virtio_balloon_dev *dev,
+                                     uint32_t isr)
+{
+    uint64_t n = 1;
+
+    dev->virtio_pci_dev.config.isr_cap.isr_status |= isr;
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to write the irqfd");
+}
+
+static void *virtio_balloon_thread(void *arg)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) arg;
+    struct pollfd fds[] = {
+        {.fd = dev->kickfd, .events = POLLIN},
+        {.fd = dev->stopfd, .events = POLLIN},
+        {.fd = dev->statsfd, .events = POLLIN},
+    };
+    uint64_t n;
+
+    placement_apply(PLACEMENT_IO, "virtio-balloon");
+    while (true) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the virtio-balloon");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if ((fds[0].revents & POLLIN) &&
+            read(dev->kickfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the virtio-balloon kick");
+        if ((fds[2].revents & POLLIN) &&
+            read(dev->statsfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the virtio-balloon stats request");
+        if (virtio_balloon_process(dev, fds[2].revents & POLLIN))
+            virtio_balloon_raise_irq(dev, VIRTIO_PCI_ISR_QUEUE);
+    }
+    return NULL;
+}
+
+static void virtio_balloon_enable_vq(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    vm_t *v = dev->vm;
+    int index = vq - dev->vq;
+
+    if (vq->info.enable)
+        return;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+    /* The thread may look at the queue as soon as it is enabled */
+    __atomic_store_n(&vq->info.enable, true, __ATOMIC_RELEASE);
+
+    uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, dev->kickfd, addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH, index);
+    virtio_balloon_start(dev);
+}
+
+/* A kick which missed the ioeventfd is passed on to the thread */
+static void virtio_balloon_kick(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (write(dev->kickfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to kick the virtio-balloon");
+}
+
+static void virtio_balloon_notify_used(struct virtq *vq)
+{
+    struct virtio_balloon_dev *dev = (struct virtio_balloon_dev *) vq->dev;
+
+    virtio_balloon_raise_irq(dev, VIRTIO_PCI_ISR_QUEUE);
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_balloon_enable_vq,
+    .complete_request = virtio_balloon_kick,
+    .notify_used = virtio_balloon_notify_used,
+};
+
+/* Released RAM is freed at once with "dontneed", or only once the host
+ * runs short of memory with "free", which is cheaper if the guest soon
+ * takes the pages back. RAM shared through a file is always punched out
+ * of the file.
+ */
+int virtio_balloon_init_pci(struct virtio_balloon_dev *dev,
+                            struct vm *vm,
+                            const char *release,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+    int advice;
+
+    if (!strcmp(release, "dontneed")) {
+        advice = MADV_DONTNEED;
+    } else if (!strcmp(release, "free")) {
+        advice = MADV_FREE;
+    } else {
+        errno = EINVAL;
+        return throw_err("Unknown balloon release %s, not dontneed or free",
+                         release);
+    }
+
+    memset(dev, 0x00, sizeof(struct virtio_balloon_dev));
+    dev->vm = vm;
+    dev->irq_num = irq_num;
+    dev->enable = true;
+    dev->stats_idx = -1;
+    dev->advice = vm->mem_fd >= 0 ? MADV_REMOVE : advice;
+    /* The fault handler serves a page of the snapshot only once */
+    if (vm->lazy_mem && vm->lazy_mem->enable)
+        dev->advice = -1;
+    pthread_mutex_init(&dev->lock, NULL);
+
+    dev->kickfd = eventfd(0, EFD_CLOEXEC);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    dev->stopfd = eventfd(0, EFD_CLOEXEC);
+    dev->statsfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(vm, dev->irqfd, irq_num, 0);
+    for (int i = 0; i < VIRTIO_BALLOON_VQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+
+    virtio_pci_init(pci_dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_BALLOON,
+                           VIRTIO_BALLOON_PCI_CLASS, irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, VIRTIO_BALLOON_VQ_NUM);
+    virtio_pci_add_feature(pci_dev,
+                           (1ULL << VIRTIO_BALLOON_F_STATS_VQ) |
+                               (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) |
+                               (1ULL << VIRTIO_BALLOON_F_REPORTING));
+    virtio_pci_enable(pci_dev);
+    return 0;
+}
+
+/* Ask the guest to give up @num_pages pages of 4 KB */
+void virtio_balloon_set_target(struct virtio_balloon_dev *dev,
+                               uint64_t num_pages)
+{
+    __atomic_store_n(&dev->config.num_pages, num_pages, __ATOMIC_RELAXED);
+    virtio_balloon_raise_irq(dev, VIRTIO_PCI_ISR_CONFIG);
+}
+
+/* Describe the balloon and the last statistics of the guest, and ask the
+ * guest for new ones.
+ */
+int virtio_balloon_info(struct virtio_balloon_dev *dev, char *buf, size_t size)
+{
+    int shift = 20 - VIRTIO_BALLOON_PFN_SHIFT;
+    uint64_t target = __atomic_load_n(&dev->config.num_pages, __ATOMIC_RELAXED);
+    uint64_t actual = __atomic_load_n(&dev->config.actual, __ATOMIC_RELAXED);
+    uint64_t reported = __atomic_load_n(&dev->nr_reported, __ATOMIC_RELAXED);
+    static const int tags[] = {
+        VIRTIO_BALLOON_S_MEMTOT,
+        VIRTIO_BALLOON_S_MEMFREE,
+        VIRTIO_BALLOON_S_AVAIL,
+        VIRTIO_BALLOON_S_CACHES,
+    };
+    static const char *names[] = {"total", "free", "available", "caches"};
+    uint64_t n = 1;
+    int len;
+
+    len = snprintf(buf, size, "target %llu MB actual %llu MB reported %llu MB",
+                   (unsigned long long) (target >> shift),
+                   (unsigned long long) (actual >> shift),
+                   (unsigned long long) (reported >> 20));
+    pthread_mutex_lock(&dev->lock);
+    for (size_t i = 0; i < ARRAY_SIZE(tags) && len < (int) size; i++) {
+        if (dev->stats_valid & (1U << tags[i]))
+            len += snprintf(buf + len, size - len, " %s %llu MB", names[i],
+                            (unsigned long long) (dev->stats[tags[i]] >> 20));
+    }
+    pthread_mutex_unlock(&dev->lock);
+    if (write(dev->statsfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to request the virtio-balloon stats");
+    return len;
+}
+
+/* The thread serves all queues, and is started once the first is enabled,
+ * also after virtio_balloon_stop.
+ */
+void virtio_balloon_start(struct virtio_balloon_dev *dev)
+{
+    bool enabled = false;
+
+    for (int i = 0; i < VIRTIO_BALLOON_VQ_NUM; i++)
+        enabled |= dev->vq[i].info.enable;
+    if (dev->thread_started || !enabled)
+        return;
+    pthread_create(&dev->thread, NULL, virtio_balloon_thread, dev);
+    dev->thread_started = true;
+}
+
+void virtio_balloon_stop(struct virtio_balloon_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (!dev->thread_started)
+        return;
+    if (write(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to stop the virtio-balloon thread");
+    pthread_join(dev->thread, NULL);
+    if (read(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to reset the stop event of virtio-balloon");
+    dev->thread_started = false;
+}
+
+struct virtio_balloon_state {
+    struct virtio_balloon_config config;
+    int32_t stats_idx;
+    uint32_t stats_valid;
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    uint64_t nr_reported;
+};
+
+int virtio_balloon_save(struct virtio_balloon_dev *dev,
+                        struct snapshot *s,
+                        uint32_t id)
+{
+    struct virtio_balloon_state state;
+
+    memset(&state, 0, sizeof(state));
+    state.config = dev->config;
+    state.stats_idx = dev->stats_idx;
+    state.stats_valid = dev->stats_valid;
+    memcpy(state.stats, dev->stats, sizeof(state.stats));
+    state.nr_reported = dev->nr_reported;
+    if (snapshot_add(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    return virtio_pci_save(&dev->virtio_pci_dev, s, id);
+}
+
+/* The kept stats buffer is returned from the restored ring */
+int virtio_balloon_restore(struct virtio_balloon_dev *dev,
+                           struct snapshot *s,
+                           uint32_t id)
+{
+    struct virtio_balloon_state state;
+
+    if (snapshot_read(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    if (state.stats_idx < -1 || state.stats_idx >= VIRTQ_SIZE)
+        return throw_err("The balloon state of the snapshot is corrupted");
+    dev->config = state.config;
+    dev->stats_idx = state.stats_idx;
+    dev->stats_valid = state.stats_valid;
+    memcpy(dev->stats, state.stats, sizeof(dev->stats));
+    dev->nr_reported = state.nr_reported;
+    return virtio_pci_restore(&dev->virtio_pci_dev, s, id);
+}
+
+void virtio_balloon_exit(struct virtio_balloon_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    virtio_balloon_stop(dev);
+    close(dev->kickfd);
+    close(dev->irqfd);
+    close(dev->stopfd);
+    close(dev->statsfd);
+    pthread_mutex_destroy(&dev->lock);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+}
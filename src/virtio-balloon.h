@@ -0,0 +1,72 @@
+#pragma once
+
+#include <linux/virtio_balloon.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+/* virtio-balloon device, which gives guest RAM back to the host.
+ *
+ * The host sets how many pages the guest should give up, and the guest
+ * inflates the balloon by that many pages. Their RAM is released, as is the
+ * RAM of the free pages the guest reports on its own with
+ * VIRTIO_BALLOON_F_REPORTING, in blocks of at least a huge page. Contiguous
+ * pages are released with a single madvise, so that whole transparent huge
+ * pages are freed without splitting them. Deflating needs no work, as a
+ * released page is faulted in again when the guest touches it.
+ *
+ * The guest sends its memory statistics in a buffer of the stats queue,
+ * which the device keeps until it wants them updated.
+ */
+
+#define VIRTIO_BALLOON_PCI_CLASS 0x050000
+#define VIRTIO_BALLOON_VQ_NUM 4 /* inflate, deflate, stats, reporting */
+
+struct vm;
+struct snapshot;
+
+struct virtio_balloon_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_balloon_config config;
+    struct virtq vq[VIRTIO_BALLOON_VQ_NUM];
+    int advice; /* madvise of released RAM, -1 to keep it */
+    int kickfd;  /* shared by all queues */
+    int statsfd; /* asks the thread to return the stats buffer */
+    int irqfd;
+    int stopfd;
+    pthread_t thread;
+    bool thread_started;
+    int stats_idx; /* descriptor of the kept stats buffer, or -1 */
+
+    pthread_mutex_t lock; /* of the statistics */
+    uint64_t stats[VIRTIO_BALLOON_S_NR];
+    uint32_t stats_valid; /* a bit per tag */
+    uint64_t nr_reported; /* bytes */
+    int irq_num;
+    struct vm *vm;
+    bool enable;
+};
+
+int virtio_balloon_init_pci(struct virtio_balloon_dev *dev,
+                            struct vm *vm,
+                            const char *release,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus);
+void virtio_balloon_set_target(struct virtio_balloon_dev *dev,
+                               uint64_t num_pages);
+int virtio_balloon_info(struct virtio_balloon_dev *dev, char *buf, size_t size);
+void virtio_balloon_start(struct virtio_balloon_dev *dev);
+void virtio_balloon_stop(struct virtio_balloon_dev *dev);
+int virtio_balloon_save(struct virtio_balloon_dev *dev,
+                        struct snapshot *s,
+                        uint32_t id);
+int virtio_balloon_restore(struct virtio_balloon_dev *dev,
+                           struct snapshot *s,
+                           uint32_t id);
+void virtio_balloon_exit(struct virtio_balloon_dev *dev);
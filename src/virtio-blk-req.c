@@ -0,0 +1,332 @@
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "virtio-blk-req.h"
+
+/* Check the I/O limits before harvesting the next request. If they are
+ * exceeded, the request is left in the ring and the throttle timer is armed,
+ * so the handler goes back to waiting instead of sleeping here.
+ */
+static bool virtio_blk_throttled(struct virtio_blk_disk *disk)
+{
+    uint64_t wait = throttle_check(&disk->throttle);
+    if (!wait)
+        return false;
+
+    struct itimerspec its = {
+        .it_value.tv_sec = wait / 1000000000ULL,
+        .it_value.tv_nsec = wait % 1000000000ULL,
+    };
+    if (timerfd_settime(disk->throttle_timerfd, 0, &its, NULL) < 0)
+        throw_err("Failed to arm the throttle timer");
+    return true;
+}
+
+/* The guest turned the volatile write cache off through the config space, so
+ * a write must be stable before it is completed.
+ */
+static ssize_t virtio_blk_write_done(struct virtio_blk_disk *disk, ssize_t r)
+{
+    if (r < 0)
+        return r;
+    if (!disk->config.wce &&
+        disk->diskimg->cache_mode != DISKIMG_CACHE_WRITETHROUGH &&
+        diskimg_flush(disk->diskimg) < 0)
+        return -1;
+    return r;
+}
+
+static void virtio_blk_capture(struct virtio_blk_disk *disk,
+                               struct virtio_blk_queue *queue,
+                               uint32_t type,
+                               uint64_t sector,
+                               uint32_t len)
+{
+    if (disk->capture)
+        blk_trace_add(&disk->trace, type, queue->index, sector, len);
+}
+
+static uint8_t virtio_blk_discard(struct virtio_blk_disk *disk,
+                                  struct virtio_blk_queue *queue,
+                                  struct virtio_blk_discard_write_zeroes *seg,
+                                  uint32_t len)
+{
+    uint32_t nr_segs = len / sizeof(*seg);
+
+    if (nr_segs == 0 || nr_segs > disk->config.max_discard_seg)
+        return VIRTIO_BLK_S_IOERR;
+    /* Segments start on the advertised alignment, and only the one at the
+     * end of a disk whose size is not aligned may be shorter.
+     */
+    for (uint32_t i = 0; i < nr_segs; i++) {
+        uint32_t align = disk->config.discard_sector_alignment;
+        if (seg[i].flags ||
+            seg[i].num_sectors > disk->config.max_discard_sectors ||
+            seg[i].sector > disk->config.capacity ||
+            seg[i].num_sectors > disk->config.capacity - seg[i].sector ||
+            seg[i].sector % align ||
+            (seg[i].num_sectors % align &&
+             seg[i].sector + seg[i].num_sectors != disk->config.capacity))
+            return VIRTIO_BLK_S_IOERR;
+        virtio_blk_capture(disk, queue, VIRTIO_BLK_T_DISCARD, seg[i].sector,
+                           seg[i].num_sectors << 9);
+        if (diskimg_discard(disk->diskimg, seg[i].sector << 9,
+                            (size_t) seg[i].num_sectors << 9) < 0)
+            return errno == EOPNOTSUPP ? VIRTIO_BLK_S_UNSUPP
+                                       : VIRTIO_BLK_S_IOERR;
+    }
+    return VIRTIO_BLK_S_OK;
+}
+
+static bool virtio_blk_is_rw(struct virtio_blk_inflight *req)
+{
+    return req->type == VIRTIO_BLK_T_IN || req->type == VIRTIO_BLK_T_OUT;
+}
+
+/* Take the next request off the ring. The whole chain is taken even if it
+ * is malformed, which returns false and leaves the request to be failed.
+ */
+static bool virtio_blk_harvest(struct virtio_blk_disk *disk,
+                               struct virtio_blk_queue *queue,
+                               struct virtq *vq,
+                               struct virtio_blk_inflight *req)
+{
+    struct vring_packed_desc *head = virtq_get_avail(vq), *desc = head;
+    struct virtio_blk_outhdr *hdr;
+
+    blk_stats_harvest(&queue->stats, &req->timing);
+    req->used_desc = head;
+    req->type = VIRTIO_BLK_T_MALFORMED;
+    req->op = BLK_STATS_OTHER;
+    req->bytes = 0;
+    req->data_desc = NULL;
+    req->data = NULL;
+    req->status = NULL;
+    req->result = VIRTIO_BLK_S_IOERR;
+
+    /* The status byte is in the last descriptor of the chain */
+    while (virtq_check_next(desc)) {
+        struct vring_packed_desc *next = virtq_get_avail(vq);
+        if (!next)
+            break;
+        if (desc != head && !req->data_desc)
+            req->data_desc = desc;
+        desc = next;
+    }
+    if (desc == head || virtq_check_next(desc))
+        return false;
+    req->status = disk->guest_to_host(disk->owner, desc->addr, 1);
+    hdr = disk->guest_to_host(disk->owner, head->addr, sizeof(*hdr));
+    if (!req->status || !hdr)
+        return false;
+    if (!req->data_desc &&
+        (hdr->type == VIRTIO_BLK_T_IN || hdr->type == VIRTIO_BLK_T_OUT ||
+         hdr->type == VIRTIO_BLK_T_DISCARD))
+        return false;
+    if (req->data_desc) {
+        req->data = disk->guest_to_host(disk->owner, req->data_desc->addr,
+                                        req->data_desc->len);
+        if (!req->data)
+            return false;
+    }
+    /* Nothing past the end of the disk, which a compressed image or an NBD
+     * export cannot serve
+     */
+    if ((hdr->type == VIRTIO_BLK_T_IN || hdr->type == VIRTIO_BLK_T_OUT) &&
+        (hdr->sector > disk->config.capacity ||
+         req->data_desc->len > (disk->config.capacity - hdr->sector) << 9))
+        return false;
+    req->type = hdr->type;
+    req->sector = hdr->sector;
+
+    if (virtio_blk_is_rw(req)) {
+        req->op = req->type == VIRTIO_BLK_T_IN ? BLK_STATS_READ
+                                                : BLK_STATS_WRITE;
+        req->bytes = req->data_desc->len;
+        virtio_blk_capture(disk, queue, req->type, req->sector, req->bytes);
+    } else if (req->type == VIRTIO_BLK_T_FLUSH) {
+        req->op = BLK_STATS_FLUSH;
+        virtio_blk_capture(disk, queue, req->type, 0, 0);
+    }
+    throttle_account(&disk->throttle, req->bytes);
+    return true;
+}
+
+/* Reads and writes are only submitted here and may still be in flight when
+ * this returns. The other requests are carried out right away.
+ */
+static void virtio_blk_submit(struct virtio_blk_disk *disk,
+                              struct virtio_blk_queue *queue,
+                              struct virtio_blk_inflight *req)
+{
+    switch (req->type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        req->io = (struct diskimg_req){
+            .write = req->type == VIRTIO_BLK_T_OUT,
+            .data = req->data,
+            .offset = req->sector << 9,
+            .size = req->data_desc->len,
+        };
+        diskimg_submit(disk->diskimg, &req->io);
+        return;
+    case VIRTIO_BLK_T_DISCARD:
+        req->result =
+            virtio_blk_discard(disk, queue, req->data, req->data_desc->len);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        req->result = diskimg_flush(disk->diskimg) < 0 ? VIRTIO_BLK_S_IOERR
+                                                        : VIRTIO_BLK_S_OK;
+        break;
+    default:
+        req->result = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+    blk_stats_backend_done(&req->timing);
+}
+
+/* Wait for the request if needed and hand it back to the guest */
+static void virtio_blk_finish(struct virtio_blk_disk *disk,
+                              struct virtio_blk_queue *queue,
+                              struct virtio_blk_inflight *req)
+{
+    if (virtio_blk_is_rw(req)) {
+        ssize_t r = diskimg_complete(disk->diskimg, &req->io);
+        if (req->io.write)
+            r = virtio_blk_write_done(disk, r);
+        req->result = r < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        blk_stats_backend_done(&req->timing);
+    }
+    if (req->status)
+        *req->status = req->result;
+    virtq_put_used(req->used_desc, 0);
+    blk_stats_publish(&queue->stats, &req->timing, req->op, req->bytes,
+                      req->result != VIRTIO_BLK_S_OK);
+}
+
+/* Up to VIRTIO_BLK_MAX_INFLIGHT reads and writes are submitted before the
+ * first of them is waited for, so a backend such as NBD works on them in
+ * parallel. They are still completed in ring order. Flushes and discards
+ * wait for everything before them, so they never overtake a write.
+ */
+void virtio_blk_process(struct virtio_blk_disk *disk,
+                        struct virtio_blk_queue *queue,
+                        struct virtq *vq)
+{
+    struct virtio_blk_inflight *inflight = queue->inflight;
+    int nr_inflight = 0;
+
+    blk_stats_batch_begin(&queue->stats);
+    while (virtq_has_avail(vq) && !virtio_blk_throttled(disk)) {
+        struct virtio_blk_inflight *req = &inflight[nr_inflight];
+
+        if (!virtio_blk_harvest(disk, queue, vq, req)) {
+            /* Failed in ring order, after the requests before it */
+            for (int i = 0; i < nr_inflight; i++)
+                virtio_blk_finish(disk, queue, &inflight[i]);
+            virtio_blk_finish(disk, queue, req);
+            nr_inflight = 0;
+            continue;
+        }
+        if (!virtio_blk_is_rw(req)) {
+            for (int i = 0; i < nr_inflight; i++)
+                virtio_blk_finish(disk, queue, &inflight[i]);
+            inflight[0] = *req;
+            req = &inflight[0];
+            nr_inflight = 0;
+        }
+        virtio_blk_submit(disk, queue, req);
+        if (++nr_inflight == VIRTIO_BLK_MAX_INFLIGHT || !virtio_blk_is_rw(req)) {
+            for (int i = 0; i < nr_inflight; i++)
+                virtio_blk_finish(disk, queue, &inflight[i]);
+            nr_inflight = 0;
+        }
+    }
+    for (int i = 0; i < nr_inflight; i++)
+        virtio_blk_finish(disk, queue, &inflight[i]);
+}
+
+/* Features of the disk on top of the transport ones */
+uint64_t virtio_blk_disk_features(struct virtio_blk_disk *disk)
+{
+    if (disk->diskimg->readonly)
+        return 1ULL << VIRTIO_BLK_F_RO;
+    return (1ULL << VIRTIO_BLK_F_FLUSH) | (1ULL << VIRTIO_BLK_F_CONFIG_WCE) |
+           (1ULL << VIRTIO_BLK_F_DISCARD);
+}
+
+int virtio_blk_disk_init(struct virtio_blk_disk *disk,
+                         struct diskimg *diskimg,
+                         virtio_blk_guest_to_host_t guest_to_host,
+                         void *owner)
+{
+    memset(disk, 0x00, sizeof(struct virtio_blk_disk));
+    disk->diskimg = diskimg;
+    disk->guest_to_host = guest_to_host;
+    disk->owner = owner;
+    disk->config.capacity = diskimg->size >> 9;
+    /* The write cache is only visible to the guest if the image may hold
+     * writes back. Guests can still toggle it through VIRTIO_BLK_F_CONFIG_WCE.
+     */
+    disk->config.wce = diskimg->cache_mode != DISKIMG_CACHE_WRITETHROUGH;
+    /* Discarded ranges are punched out of the image, keeping it sparse */
+    disk->config.max_discard_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+    disk->config.max_discard_seg = VIRTIO_BLK_MAX_DISCARD_SEG;
+    disk->config.discard_sector_alignment = VIRTIO_BLK_DISCARD_ALIGNMENT >> 9;
+    disk->throttle_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (disk->throttle_timerfd < 0)
+        return throw_err("Failed to create the throttle timer");
+    throttle_init(&disk->throttle, &diskimg->throttle);
+    disk->capture = diskimg->capture_file &&
+                    blk_trace_open(&disk->trace, diskimg->capture_file) == 0;
+    return 0;
+}
+
+void virtio_blk_queue_init(struct virtio_blk_queue *queue, int index)
+{
+    queue->index = index;
+    blk_stats_init(&queue->stats);
+}
+
+void virtio_blk_disk_dump_stats(struct virtio_blk_disk *disk,
+                                struct virtio_blk_queue *queues,
+                                int nr_queues,
+                                const char *name,
+                                FILE *f,
+                                enum blk_stats_format format)
+{
+    struct throttle_stats *throttle = &disk->throttle.stats;
+    char queue_name[64];
+
+    if (format == BLK_STATS_JSON) {
+        fprintf(f, "{\"name\": ");
+        blk_stats_json_string(f, name);
+        fprintf(f, ", \"queues\": [");
+    }
+    for (int i = 0; i < nr_queues; i++) {
+        snprintf(queue_name, sizeof(queue_name), "%s.q%d", name, i);
+        if (format == BLK_STATS_JSON && i)
+            fprintf(f, ", ");
+        blk_stats_dump(&queues[i].stats, queue_name, f, format);
+    }
+    if (format == BLK_STATS_JSON) {
+        fprintf(f,
+                "], \"throttle\": {\"enabled\": %s, \"throttled\": %lu, "
+                "\"throttled_ns\": %lu}}",
+                disk->throttle.enabled ? "true" : "false",
+                throttle->nr_throttled, throttle->throttled_ns);
+    } else if (disk->throttle.enabled) {
+        fprintf(f, "%s: throttled %lu times for %lu ms\n", name,
+                throttle->nr_throttled, throttle->throttled_ns / 1000000);
+    }
+}
+
+void virtio_blk_disk_exit(struct virtio_blk_disk *disk)
+{
+    diskimg_exit(disk->diskimg);
+    close(disk->throttle_timerfd);
+    if (disk->capture)
+        blk_trace_close(&disk->trace);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <linux/virtio_blk.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blk-stats.h"
+#include "blk-trace.h"
+#include "diskimg.h"
+#include "throttle.h"
+#include "virtq.h"
+
+/* Request handling of virtio-blk, independent of how the queues reach the
+ * guest. It is shared by the device model of kvm-host and by kvm-host-blkd,
+ * which serves the same requests to other VMMs over vhost-user. Guest
+ * addresses are translated by the user, which also raises the interrupts.
+ */
+
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS (1U << 22)
+#define VIRTIO_BLK_MAX_DISCARD_SEG 32
+#define VIRTIO_BLK_DISCARD_ALIGNMENT 4096
+#define VIRTIO_BLK_MAX_INFLIGHT 32
+#define VIRTIO_BLK_T_MALFORMED UINT32_MAX /* type of a chain failed at once */
+
+/* A request taken off the ring which has not been completed yet */
+struct virtio_blk_inflight {
+    uint32_t type;
+    uint64_t sector;
+    struct vring_packed_desc *used_desc;
+    struct vring_packed_desc *data_desc;
+    void *data;
+    uint8_t *status;
+    uint8_t result;
+    struct diskimg_req io;
+    struct blk_stats_req timing;
+    enum blk_stats_op op;
+    size_t bytes;
+};
+
+/* Returns NULL unless [addr, addr + len) is guest memory */
+typedef void *(*virtio_blk_guest_to_host_t)(void *owner,
+                                            uint64_t addr,
+                                            uint64_t len);
+
+struct virtio_blk_disk {
+    struct virtio_blk_config config;
+    struct diskimg *diskimg;
+    struct throttle throttle;
+    int throttle_timerfd; /* expires when deferred requests may be issued */
+    struct blk_trace trace;
+    bool capture;
+    virtio_blk_guest_to_host_t guest_to_host;
+    void *owner;
+};
+
+struct virtio_blk_queue {
+    int index;
+    struct virtio_blk_inflight inflight[VIRTIO_BLK_MAX_INFLIGHT];
+    struct blk_stats stats;
+};
+
+int virtio_blk_disk_init(struct virtio_blk_disk *disk,
+                         struct diskimg *diskimg,
+                         virtio_blk_guest_to_host_t guest_to_host,
+                         void *owner);
+uint64_t virtio_blk_disk_features(struct virtio_blk_disk *disk);
+void virtio_blk_queue_init(struct virtio_blk_queue *queue, int index);
+void virtio_blk_process(struct virtio_blk_disk *disk,
+                        struct virtio_blk_queue *queue,
+                        struct virtq *vq);
+void virtio_blk_disk_dump_stats(struct virtio_blk_disk *disk,
+                                struct virtio_blk_queue *queues,
+                                int nr_queues,
+                                const char *name,
+                                FILE *f,
+                                enum blk_stats_format format);
+void virtio_blk_disk_exit(struct virtio_blk_disk *disk);
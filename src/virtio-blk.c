@@ -1,6 +1,6 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
-#include <signal.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "err.h"
+#include "placement.h"
 #include "utils.h"
 #include "virtio-blk.h"
 #include "vm.h"
@@ -17,38 +18,42 @@ static void virtio_blk_notify_used(struct virtq *vq)
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
     uint64_t n = 1;
 
+    dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
     if (write(dev->irqfd, &n, sizeof(n)) < 0)
         throw_err("Failed to write the irqfd");
+    blk_stats_notify(&dev->queues[vq - dev->vq].stats);
 }
 
-static int virtio_blk_virtq_available(struct virtio_blk_dev *dev, int timeout)
-{
-    struct pollfd pollfd = (struct pollfd){
-        .fd = dev->ioeventfd,
-        .events = POLLIN,
-    };
-    return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
-}
-
-static volatile bool thread_stop = false;
-
-static void *virtio_blk_thread(struct virtio_blk_dev *dev)
-{
-    while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
-        if (virtio_blk_virtq_available(dev, -1))
-            pthread_kill((pthread_t) dev->vq_avail_thread, SIGUSR1);
-    }
-
-    return NULL;
-}
-
+/* The available ring is processed when the guest kicks the queue, or when
+ * the throttle timer expires and deferred requests may be issued. Each disk
+ * has its own thread, so the disks never wait for each other.
+ */
 static void *virtio_blk_vq_avail_handler(void *arg)
 {
     struct virtq *vq = (struct virtq *) arg;
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
+    struct pollfd pollfds[] = {
+        {.fd = dev->ioeventfd, .events = POLLIN},
+        {.fd = dev->disk.throttle_timerfd, .events = POLLIN},
+        {.fd = dev->stopfd, .events = POLLIN},
+    };
     uint64_t n;
 
-    while (read(dev->ioeventfd, &n, sizeof(n))) {
+    placement_apply(PLACEMENT_IO, "virtio-blk");
+    while (true) {
+        if (poll(pollfds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the virtio-blk queue");
+            break;
+        }
+        if (pollfds[2].revents & POLLIN)
+            break;
+        for (int i = 0; i < 2; i++) {
+            if ((pollfds[i].revents & POLLIN) &&
+                read(pollfds[i].fd, &n, sizeof(n)) < 0)
+                throw_err("Failed to read the event of virtio-blk");
+        }
         virtq_handle_avail(vq);
     }
     return NULL;
@@ -57,7 +62,7 @@ static void *virtio_blk_vq_avail_handler(void *arg)
 static void virtio_blk_enable_vq(struct virtq *vq)
 {
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
-    vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
+    vm_t *v = dev->vm;
 
     if (vq->info.enable)
         return;
@@ -70,69 +75,17 @@ static void virtio_blk_enable_vq(struct virtq *vq)
         v, vq->info.driver_addr);
 
     uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
-    vm_ioeventfd_register(v, dev->ioeventfd, addr,
-                          dev->virtio_pci_dev.notify_cap->cap.length, 0);
-    pthread_create(&dev->vq_avail_thread, NULL, virtio_blk_vq_avail_handler,
-                   (void *) vq);
-}
-
-static ssize_t virtio_blk_write(struct virtio_blk_dev *dev,
-                                void *data,
-                                off_t offset,
-                                size_t size)
-{
-    return diskimg_write(dev->diskimg, data, offset, size);
-}
-
-static ssize_t virtio_blk_read(struct virtio_blk_dev *dev,
-                               void *data,
-                               off_t offset,
-                               size_t size)
-{
-    return diskimg_read(dev->diskimg, data, offset, size);
+    /* The guest writes the 16-bit queue index to the notify address */
+    vm_ioeventfd_register(v, dev->ioeventfd, addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH, vq - dev->vq);
+    virtio_blk_start(dev);
 }
 
 static void virtio_blk_complete_request(struct virtq *vq)
 {
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) vq->dev;
-    vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
-    uint8_t status;
-    struct vring_packed_desc *desc;
-    struct virtio_blk_req req;
-
-    while ((desc = virtq_get_avail(vq))) {
-        struct vring_packed_desc *used_desc = desc;
-        int r = 0;
-
-        memcpy(&req, vm_guest_to_host(v, desc->addr), desc->len);
-        if (req.type == VIRTIO_BLK_T_IN || req.type == VIRTIO_BLK_T_OUT) {
-            if (!virtq_check_next(desc))
-                return;
-            desc = virtq_get_avail(vq);
-            req.data_size = desc->len;
-            req.data = vm_guest_to_host(v, desc->addr);
-
-            ssize_t r;
-            if (req.type == VIRTIO_BLK_T_IN)
-                r = virtio_blk_read(dev, req.data, req.sector << 9,
-                                    req.data_size);
-            else
-                r = virtio_blk_write(dev, req.data, req.sector << 9,
-                                     req.data_size);
-
-            status = r < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
-        } else {
-            status = VIRTIO_BLK_S_UNSUPP;
-        }
-        if (!virtq_check_next(desc))
-            return;
-        desc = virtq_get_avail(vq);
-        req.status = vm_guest_to_host(v, desc->addr);
-        *req.status = status;
-        used_desc->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
-        used_desc->len = r;
-        dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
-    }
+
+    virtio_blk_process(&dev->disk, &dev->queues[vq - dev->vq], vq);
 }
 
 static struct virtq_ops ops = {
@@ -141,57 +94,103 @@ static struct virtq_ops ops = {
     .notify_used = virtio_blk_notify_used,
 };
 
+static void *virtio_blk_guest_to_host(void *owner,
+                                      uint64_t addr,
+                                      uint64_t len)
+{
+    return vm_guest_range_to_host((vm_t *) owner, addr, len);
+}
+
 static void virtio_blk_setup(struct virtio_blk_dev *dev,
-                             struct diskimg *diskimg)
+                             struct diskimg *diskimg,
+                             int irq_num)
 {
-    vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
+    vm_t *v = dev->vm;
 
     dev->enable = true;
-    /* FIXME: irq_num should be different to other devs */
-    dev->irq_num = VIRTIO_BLK_IRQ;
-    dev->diskimg = diskimg;
-    dev->config.capacity = diskimg->size >> 9;
+    dev->irq_num = irq_num;
+    virtio_blk_disk_init(&dev->disk, diskimg, virtio_blk_guest_to_host, v);
     dev->ioeventfd = eventfd(0, EFD_CLOEXEC);
     dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    dev->stopfd = eventfd(0, EFD_CLOEXEC);
     vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
-    for (int i = 0; i < VIRTIO_BLK_VIRTQ_NUM; i++)
+    for (int i = 0; i < VIRTIO_BLK_VIRTQ_NUM; i++) {
         virtq_init(&dev->vq[i], dev, &ops);
+        virtio_blk_queue_init(&dev->queues[i], i);
+    }
 }
 
 void virtio_blk_init_pci(struct virtio_blk_dev *virtio_blk_dev,
                          struct diskimg *diskimg,
+                         int irq_num,
                          struct pci *pci,
                          struct bus *io_bus,
                          struct bus *mmio_bus)
 {
     struct virtio_pci_dev *dev = &virtio_blk_dev->virtio_pci_dev;
     /* Initialize the device based on PCI */
-    virtio_blk_setup(virtio_blk_dev, diskimg);
+    virtio_blk_setup(virtio_blk_dev, diskimg, irq_num);
     virtio_pci_init(dev, pci, io_bus, mmio_bus);
-    virtio_pci_set_dev_cfg(dev, &virtio_blk_dev->config,
-                           sizeof(virtio_blk_dev->config));
+    virtio_pci_set_dev_cfg(dev, &virtio_blk_dev->disk.config,
+                           sizeof(virtio_blk_dev->disk.config));
     virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_BLK, VIRTIO_BLK_PCI_CLASS,
                            virtio_blk_dev->irq_num);
     virtio_pci_set_virtq(dev, virtio_blk_dev->vq, VIRTIO_BLK_VIRTQ_NUM);
-    virtio_pci_add_feature(dev, 0);
+    virtio_pci_add_feature(dev,
+                           virtio_blk_disk_features(&virtio_blk_dev->disk));
     virtio_pci_enable(dev);
-    pthread_create(&virtio_blk_dev->worker_thread, NULL,
-                   (void *) virtio_blk_thread, (void *) virtio_blk_dev);
 }
 
-void virtio_blk_init(struct virtio_blk_dev *dev)
+void virtio_blk_dump_stats(struct virtio_blk_dev *dev,
+                           const char *name,
+                           FILE *f,
+                           enum blk_stats_format format)
+{
+    virtio_blk_disk_dump_stats(&dev->disk, dev->queues, VIRTIO_BLK_VIRTQ_NUM,
+                               name, f, format);
+}
+
+void virtio_blk_init(struct virtio_blk_dev *dev, struct vm *vm)
 {
     memset(dev, 0x00, sizeof(struct virtio_blk_dev));
+    dev->vm = vm;
+}
+
+/* Start the thread of an enabled queue, also after virtio_blk_stop */
+void virtio_blk_start(struct virtio_blk_dev *dev)
+{
+    if (dev->vq_avail_thread_started || !dev->vq[0].info.enable)
+        return;
+    pthread_create(&dev->vq_avail_thread, NULL, virtio_blk_vq_avail_handler,
+                   (void *) &dev->vq[0]);
+    dev->vq_avail_thread_started = true;
+}
+
+/* Every request taken off the ring is complete once the thread stops, and
+ * it is started again by virtio_blk_start.
+ */
+void virtio_blk_stop(struct virtio_blk_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (!dev->vq_avail_thread_started)
+        return;
+    if (write(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to stop the virtio-blk thread");
+    pthread_join(dev->vq_avail_thread, NULL);
+    if (read(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to reset the stop event of virtio-blk");
+    dev->vq_avail_thread_started = false;
 }
 
 void virtio_blk_exit(struct virtio_blk_dev *dev)
 {
     if (!dev->enable)
         return;
-    __atomic_store_n(&thread_stop, true, __ATOMIC_RELAXED);
-    pthread_join(dev->vq_avail_thread, NULL);
-    diskimg_exit(dev->diskimg);
+    virtio_blk_stop(dev);
+    virtio_blk_disk_exit(&dev->disk);
     virtio_pci_exit(&dev->virtio_pci_dev);
     close(dev->irqfd);
     close(dev->ioeventfd);
+    close(dev->stopfd);
 }
\ No newline at end of file
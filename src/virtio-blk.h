@@ -7,38 +7,42 @@
 
 #include "diskimg.h"
 #include "pci.h"
+#include "virtio-blk-req.h"
 #include "virtio-pci.h"
 #include "virtq.h"
 
 #define VIRTIO_BLK_VIRTQ_NUM 1
 #define VIRTIO_BLK_PCI_CLASS 0x018000
 
-struct virtio_blk_req {
-    uint32_t type;
-    uint32_t reserved;
-    uint64_t sector;
-    uint8_t *data;
-    uint16_t data_size;
-    uint8_t *status;
-};
+struct vm;
 
 struct virtio_blk_dev {
     struct virtio_pci_dev virtio_pci_dev;
-    struct virtio_blk_config config;
+    struct virtio_blk_disk disk;
     struct virtq vq[VIRTIO_BLK_VIRTQ_NUM];
+    struct virtio_blk_queue queues[VIRTIO_BLK_VIRTQ_NUM];
     int irqfd;
     int ioeventfd;
+    int stopfd;
     int irq_num;
     pthread_t vq_avail_thread;
-    pthread_t worker_thread;
-    struct diskimg *diskimg;
+    bool vq_avail_thread_started;
+    char name[8]; /* vdX, also counting the vhost-user disks before it */
+    struct vm *vm;
     bool enable;
 };
 
-void virtio_blk_init(struct virtio_blk_dev *virtio_blk_dev);
+void virtio_blk_dump_stats(struct virtio_blk_dev *dev,
+                           const char *name,
+                           FILE *f,
+                           enum blk_stats_format format);
+void virtio_blk_init(struct virtio_blk_dev *dev, struct vm *vm);
+void virtio_blk_start(struct virtio_blk_dev *dev);
+void virtio_blk_stop(struct virtio_blk_dev *dev);
 void virtio_blk_exit(struct virtio_blk_dev *dev);
 void virtio_blk_init_pci(struct virtio_blk_dev *dev,
                          struct diskimg *diskimg,
+                         int irq_num,
                          struct pci *pci,
                          struct bus *io_bus,
                          struct bus *mmio_bus);
\ No newline at end of file
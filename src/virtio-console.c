@@ -0,0 +1,609 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "virtio-console.h"
+#include "vm.h"
+
+#define VIRTIO_CONSOLE_CTRL_RX 2 /* device to guest */
+#define VIRTIO_CONSOLE_CTRL_TX 3 /* guest to device */
+#define VIRTIO_CONSOLE_MAX_SEGS 64
+
+static int virtio_console_vq_index(int port, bool tx)
+{
+    return (port ? port * 2 + 2 : 0) + tx;
+}
+
+static bool virtio_console_readable(int fd)
+{
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+
+    return poll(&pollfd, 1, 0) > 0 && (pollfd.revents & (POLLIN | POLLHUP));
+}
+
+/* Collect the buffers of a descriptor chain which the device may read, or
+ * those it may write with @write, and return the head of the chain.
+ */
+static struct vring_packed_desc *virtio_console_get_chain(
+    struct virtio_console_dev *dev,
+    struct virtq *vq,
+    bool write,
+    struct iovec *iov,
+    int *cnt)
+{
+    struct vring_packed_desc *head = virtq_get_avail(vq);
+
+    *cnt = 0;
+    for (struct vring_packed_desc *desc = head; desc;
+         desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL) {
+        void *buf = vm_guest_range_to_host(dev->vm, desc->addr, desc->len);
+        if (!buf || !!(desc->flags & VRING_DESC_F_WRITE) != write ||
+            *cnt == VIRTIO_CONSOLE_MAX_SEGS)
+            continue;
+        iov[*cnt].iov_base = buf;
+        iov[(*cnt)++].iov_len = desc->len;
+    }
+    return head;
+}
+
+static void virtio_console_queue_ctrl(struct virtio_console_dev *dev,
+                                      uint32_t id,
+                                      uint16_t event,
+                                      uint16_t value)
+{
+    struct virtio_console_ctrl_msg *msg;
+
+    if (dev->nr_ctrl_msgs == VIRTIO_CONSOLE_MAX_CTRL) {
+        throw_err("Too many pending virtio-console control messages");
+        return;
+    }
+    msg = &dev->ctrl_msgs[dev->nr_ctrl_msgs++];
+    msg->ctrl = (struct virtio_console_control){
+        .id = id,
+        .event = event,
+        .value = value,
+    };
+    msg->name[0] = '\0';
+    if (event == VIRTIO_CONSOLE_PORT_NAME)
+        memcpy(msg->name, dev->ports[id].name, sizeof(msg->name));
+}
+
+static bool virtio_console_port_connected(struct virtio_console_port *port)
+{
+    return port->backend != VIRTIO_CONSOLE_SOCKET || port->outfd >= 0;
+}
+
+static void virtio_console_handle_ctrl(struct virtio_console_dev *dev,
+                                       struct virtio_console_control *ctrl)
+{
+    uint32_t id = ctrl->id;
+
+    switch (ctrl->event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (ctrl->value != 1)
+            break;
+        for (int i = 0; i < dev->nr_ports; i++)
+            virtio_console_queue_ctrl(dev, i, VIRTIO_CONSOLE_PORT_ADD, 1);
+        break;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (id >= (uint32_t) dev->nr_ports || ctrl->value != 1)
+            break;
+        if (dev->ports[id].backend == VIRTIO_CONSOLE_STDIO)
+            virtio_console_queue_ctrl(dev, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1);
+        if (dev->ports[id].name[0])
+            virtio_console_queue_ctrl(dev, id, VIRTIO_CONSOLE_PORT_NAME, 1);
+        if (virtio_console_port_connected(&dev->ports[id]))
+            virtio_console_queue_ctrl(dev, id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+        break;
+    default:
+        /* The guest opening and closing ports makes no difference here */
+        break;
+    }
+}
+
+static bool virtio_console_ctrl_tx(struct virtio_console_dev *dev)
+{
+    struct virtq *vq = &dev->vq[VIRTIO_CONSOLE_CTRL_TX];
+    struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+    bool used = false;
+    int cnt;
+
+    while (vq->info.enable && virtq_has_avail(vq)) {
+        struct vring_packed_desc *head =
+            virtio_console_get_chain(dev, vq, false, iov, &cnt);
+        if (cnt && iov[0].iov_len >= sizeof(struct virtio_console_control))
+            virtio_console_handle_ctrl(dev, iov[0].iov_base);
+        virtq_put_used(head, 0);
+        used = true;
+    }
+    return used;
+}
+
+/* Pass pending control messages on as long as the guest has buffers */
+static bool virtio_console_ctrl_rx(struct virtio_console_dev *dev)
+{
+    struct virtq *vq = &dev->vq[VIRTIO_CONSOLE_CTRL_RX];
+    struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+    int sent = 0, cnt;
+
+    while (vq->info.enable && sent < dev->nr_ctrl_msgs &&
+           virtq_has_avail(vq)) {
+        struct virtio_console_ctrl_msg *msg = &dev->ctrl_msgs[sent++];
+        struct vring_packed_desc *head =
+            virtio_console_get_chain(dev, vq, true, iov, &cnt);
+        size_t len = sizeof(msg->ctrl) + strlen(msg->name);
+        size_t copied = 0;
+
+        for (int i = 0; i < cnt && copied < len; i++) {
+            size_t n = len - copied;
+            if (n > iov[i].iov_len)
+                n = iov[i].iov_len;
+            memcpy(iov[i].iov_base, (uint8_t *) msg + copied, n);
+            copied += n;
+        }
+        virtq_put_used(head, copied);
+    }
+    dev->nr_ctrl_msgs -= sent;
+    memmove(dev->ctrl_msgs, dev->ctrl_msgs + sent,
+            dev->nr_ctrl_msgs * sizeof(dev->ctrl_msgs[0]));
+    return sent > 0;
+}
+
+static void virtio_console_disconnect(struct virtio_console_dev *dev, int id)
+{
+    struct virtio_console_port *port = &dev->ports[id];
+
+    close(port->outfd);
+    port->infd = port->outfd = -1;
+    virtio_console_queue_ctrl(dev, id, VIRTIO_CONSOLE_PORT_OPEN, 0);
+}
+
+static void virtio_console_accept(struct virtio_console_dev *dev, int id)
+{
+    struct virtio_console_port *port = &dev->ports[id];
+    int fd = accept4(port->listenfd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    port->infd = port->outfd = fd;
+    virtio_console_queue_ctrl(dev, id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+}
+
+static void virtio_console_write(struct virtio_console_dev *dev,
+                                 int id,
+                                 struct iovec *iov,
+                                 int cnt)
+{
+    struct virtio_console_port *port = &dev->ports[id];
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+
+    while (port->outfd >= 0 && msg.msg_iovlen) {
+        ssize_t n = port->backend == VIRTIO_CONSOLE_SOCKET
+                        ? sendmsg(port->outfd, &msg, MSG_NOSIGNAL)
+                        : writev(port->outfd, msg.msg_iov, msg.msg_iovlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (port->backend == VIRTIO_CONSOLE_SOCKET)
+                virtio_console_disconnect(dev, id);
+            else
+                throw_err("Failed to write the output of port %d", id);
+            return;
+        }
+        while (msg.msg_iovlen && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+}
+
+/* Output of the guest is written out a whole buffer at a time */
+static bool virtio_console_tx(struct virtio_console_dev *dev, int id)
+{
+    struct virtq *vq = &dev->vq[virtio_console_vq_index(id, true)];
+    struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+    bool used = false;
+    int cnt;
+
+    while (vq->info.enable && virtq_has_avail(vq)) {
+        struct vring_packed_desc *head =
+            virtio_console_get_chain(dev, vq, false, iov, &cnt);
+        virtio_console_write(dev, id, iov, cnt);
+        virtq_put_used(head, 0);
+        used = true;
+    }
+    return used;
+}
+
+static bool virtio_console_rx_ready(struct virtio_console_dev *dev, int id)
+{
+    struct virtq *vq = &dev->vq[virtio_console_vq_index(id, false)];
+
+    return dev->ports[id].infd >= 0 && vq->info.enable && virtq_has_avail(vq);
+}
+
+/* Input is read straight into the receive buffers of the guest */
+static bool virtio_console_rx(struct virtio_console_dev *dev, int id)
+{
+    struct virtio_console_port *port = &dev->ports[id];
+    struct virtq *vq = &dev->vq[virtio_console_vq_index(id, false)];
+    struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+    bool used = false;
+    int cnt;
+
+    while (virtio_console_rx_ready(dev, id) &&
+           virtio_console_readable(port->infd)) {
+        uint16_t next_avail_idx = vq->next_avail_idx;
+        bool used_wrap_count = vq->used_wrap_count;
+        struct vring_packed_desc *head =
+            virtio_console_get_chain(dev, vq, true, iov, &cnt);
+        /* A chain with no room to read into would look like end of input */
+        if (!cnt) {
+            virtq_put_used(head, 0);
+            used = true;
+            continue;
+        }
+        ssize_t n = readv(port->infd, iov, cnt);
+        /* Nothing was read, so the chain is left on the ring for later */
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            vq->next_avail_idx = next_avail_idx;
+            vq->used_wrap_count = used_wrap_count;
+            if (errno == EAGAIN)
+                break;
+            continue;
+        }
+        virtq_put_used(head, n > 0 ? n : 0);
+        used = true;
+        if (n < 0 && errno != EIO)
+            throw_err("Failed to read the input of port %d", id);
+        if (n > 0 || (n < 0 && errno != EIO))
+            continue;
+        /* End of input */
+        if (port->backend == VIRTIO_CONSOLE_SOCKET)
+            virtio_console_disconnect(dev, id);
+        else
+            port->infd = -1;
+    }
+    return used;
+}
+
+static bool virtio_console_process(struct virtio_console_dev *dev)
+{
+    bool used[VIRTIO_CONSOLE_VQ_NUM] = {false};
+    bool irq = false;
+
+    used[VIRTIO_CONSOLE_CTRL_TX] = virtio_console_ctrl_tx(dev);
+    for (int i = 0; i < dev->nr_ports; i++) {
+        used[virtio_console_vq_index(i, true)] = virtio_console_tx(dev, i);
+        used[virtio_console_vq_index(i, false)] = virtio_console_rx(dev, i);
+    }
+    used[VIRTIO_CONSOLE_CTRL_RX] = virtio_console_ctrl_rx(dev);
+
+    for (int i = 0; i < VIRTIO_CONSOLE_VQ_NUM; i++) {
+        struct virtq *vq = &dev->vq[i];
+        irq |= used[i] &&
+               vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    return irq;
+}
+
+static void *virtio_console_thread(void *arg)
+{
+    struct virtio_console_dev *dev = (struct virtio_console_dev *) arg;
+    struct pollfd fds[VIRTIO_CONSOLE_MAX_PORTS + 2];
+    int ids[VIRTIO_CONSOLE_MAX_PORTS + 2];
+    uint64_t n;
+
+    placement_apply(PLACEMENT_CONSOLE, "virtio-console");
+    while (true) {
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = dev->kickfd, .events = POLLIN};
+        fds[nfds++] = (struct pollfd){.fd = dev->stopfd, .events = POLLIN};
+        for (int i = 0; i < dev->nr_ports; i++) {
+            struct virtio_console_port *port = &dev->ports[i];
+            int fd = -1;
+            /* Input is only read while the guest has buffers for it */
+            if (virtio_console_rx_ready(dev, i))
+                fd = port->infd;
+            else if (port->listenfd >= 0 && port->outfd < 0)
+                fd = port->listenfd;
+            if (fd < 0)
+                continue;
+            ids[nfds] = i;
+            fds[nfds++] = (struct pollfd){.fd = fd, .events = POLLIN};
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the virtio-console");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if ((fds[0].revents & POLLIN) &&
+            read(dev->kickfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to read the virtio-console kick");
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents && fds[i].fd == dev->ports[ids[i]].listenfd)
+                virtio_console_accept(dev, ids[i]);
+        }
+        n = 1;
+        if (virtio_console_process(dev)) {
+            dev->virtio_pci_dev.config.isr_cap.isr_status |=
+                VIRTIO_PCI_ISR_QUEUE;
+            if (write(dev->irqfd, &n, sizeof(n)) < 0)
+                throw_err("Failed to write the irqfd");
+        }
+    }
+    return NULL;
+}
+
+static void virtio_console_enable_vq(struct virtq *vq)
+{
+    struct virtio_console_dev *dev = (struct virtio_console_dev *) vq->dev;
+    vm_t *v = dev->vm;
+    int index = vq - dev->vq;
+
+    if (vq->info.enable)
+        return;
+    vq->desc_ring =
+        (struct vring_packed_desc *) vm_guest_to_host(v, vq->info.desc_addr);
+    vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.device_addr);
+    vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+        v, vq->info.driver_addr);
+    /* The thread may look at the queue as soon as it is enabled */
+    __atomic_store_n(&vq->info.enable, true, __ATOMIC_RELEASE);
+
+    uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, dev->kickfd, addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH, index);
+    virtio_console_start(dev);
+}
+
+/* A kick which missed the ioeventfd is passed on to the thread */
+static void virtio_console_kick(struct virtq *vq)
+{
+    struct virtio_console_dev *dev = (struct virtio_console_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (write(dev->kickfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to kick the virtio-console");
+}
+
+static void virtio_console_notify_used(struct virtq *vq)
+{
+    struct virtio_console_dev *dev = (struct virtio_console_dev *) vq->dev;
+    uint64_t n = 1;
+
+    dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to write the irqfd");
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_console_enable_vq,
+    .complete_request = virtio_console_kick,
+    .notify_used = virtio_console_notify_used,
+};
+
+static int virtio_console_listen(struct virtio_console_port *port,
+                                 const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return throw_err("Socket path '%s' is too long", path);
+    strcpy(addr.sun_path, path);
+    port->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (port->listenfd < 0)
+        return throw_err("Failed to create the socket of port %s", port->name);
+    unlink(path);
+    if (bind(port->listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(port->listenfd, 1) < 0)
+        return throw_err("Failed to listen on %s", path);
+    port->path = strdup(path);
+    return 0;
+}
+
+/* A port is described as "name,file=path" or "name,socket=path". A file
+ * only receives the output of the guest, while one client at a time may
+ * connect to a socket in both directions.
+ */
+int virtio_console_add_port(struct virtio_console_dev *dev, const char *spec)
+{
+    struct virtio_console_port *port = &dev->ports[dev->nr_ports];
+    const char *opt = strchr(spec, ',');
+    const char *path;
+    size_t len = opt ? (size_t) (opt - spec) : strlen(spec);
+
+    if (dev->nr_ports == VIRTIO_CONSOLE_MAX_PORTS)
+        return throw_err("At most %d console ports are supported",
+                         VIRTIO_CONSOLE_MAX_PORTS - 1);
+    if (!len || len >= VIRTIO_CONSOLE_NAME_LEN)
+        return throw_err("Invalid console port name in '%s'", spec);
+    if (!opt)
+        return throw_err("Missing backend of console port '%s'", spec);
+
+    memset(port, 0, sizeof(*port));
+    memcpy(port->name, spec, len);
+    port->infd = port->outfd = port->listenfd = -1;
+    if (!strncmp(opt + 1, "file=", 5)) {
+        path = opt + 6;
+        port->backend = VIRTIO_CONSOLE_FILE;
+        port->outfd =
+            open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (port->outfd < 0)
+            return throw_err("Failed to open %s", path);
+    } else if (!strncmp(opt + 1, "socket=", 7)) {
+        path = opt + 8;
+        port->backend = VIRTIO_CONSOLE_SOCKET;
+        if (virtio_console_listen(port, path) < 0) {
+            if (port->listenfd >= 0)
+                close(port->listenfd);
+            return -1;
+        }
+    } else {
+        return throw_err("Unknown backend of console port '%s'", spec);
+    }
+
+    dev->nr_ports++;
+    dev->config.max_nr_ports = dev->nr_ports;
+    virtio_pci_set_virtq(&dev->virtio_pci_dev, dev->vq,
+                         virtio_console_vq_index(dev->nr_ports, false));
+    return 0;
+}
+
+int virtio_console_init_pci(struct virtio_console_dev *dev,
+                            struct vm *vm,
+                            bool stdio,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+    struct virtio_console_port *console = &dev->ports[0];
+
+    memset(dev, 0x00, sizeof(struct virtio_console_dev));
+    dev->vm = vm;
+    dev->irq_num = irq_num;
+    dev->enable = true;
+    /* Port 0 is hvc0, which is left unconnected if ttyS0 has stdio */
+    console->infd = console->outfd = console->listenfd = -1;
+    if (stdio) {
+        console->backend = VIRTIO_CONSOLE_STDIO;
+        console->infd = STDIN_FILENO;
+        console->outfd = STDOUT_FILENO;
+    }
+    dev->nr_ports = 1;
+    dev->config.max_nr_ports = 1;
+
+    dev->kickfd = eventfd(0, EFD_CLOEXEC);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    dev->stopfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(vm, dev->irqfd, irq_num, 0);
+    for (int i = 0; i < VIRTIO_CONSOLE_VQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+
+    virtio_pci_init(pci_dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_CONSOLE,
+                           VIRTIO_CONSOLE_PCI_CLASS, irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, virtio_console_vq_index(1, false));
+    virtio_pci_add_feature(pci_dev, 1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+    virtio_pci_enable(pci_dev);
+    return 0;
+}
+
+/* The thread serves all queues, and is started once the first is enabled,
+ * also after virtio_console_stop.
+ */
+void virtio_console_start(struct virtio_console_dev *dev)
+{
+    bool enabled = false;
+
+    for (int i = 0; i < VIRTIO_CONSOLE_VQ_NUM; i++)
+        enabled |= dev->vq[i].info.enable;
+    if (dev->thread_started || !enabled)
+        return;
+    pthread_create(&dev->thread, NULL, virtio_console_thread, dev);
+    dev->thread_started = true;
+}
+
+void virtio_console_stop(struct virtio_console_dev *dev)
+{
+    uint64_t n = 1;
+
+    if (!dev->thread_started)
+        return;
+    if (write(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to stop the virtio-console thread");
+    pthread_join(dev->thread, NULL);
+    if (read(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to reset the stop event of virtio-console");
+    dev->thread_started = false;
+}
+
+struct virtio_console_state {
+    struct virtio_console_ctrl_msg ctrl_msgs[VIRTIO_CONSOLE_MAX_CTRL];
+    uint32_t nr_ctrl_msgs;
+    uint8_t connected[VIRTIO_CONSOLE_MAX_PORTS];
+};
+
+int virtio_console_save(struct virtio_console_dev *dev,
+                        struct snapshot *s,
+                        uint32_t id)
+{
+    struct virtio_console_state state;
+
+    memset(&state, 0, sizeof(state));
+    memcpy(state.ctrl_msgs, dev->ctrl_msgs, sizeof(state.ctrl_msgs));
+    state.nr_ctrl_msgs = dev->nr_ctrl_msgs;
+    for (int i = 0; i < dev->nr_ports; i++)
+        state.connected[i] = virtio_console_port_connected(&dev->ports[i]);
+    if (snapshot_add(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    return virtio_pci_save(&dev->virtio_pci_dev, s, id);
+}
+
+/* The client of a socket port is gone after a restore, which the guest
+ * learns like any other disconnect.
+ */
+int virtio_console_restore(struct virtio_console_dev *dev,
+                           struct snapshot *s,
+                           uint32_t id)
+{
+    struct virtio_console_state state;
+
+    if (snapshot_read(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    if (state.nr_ctrl_msgs > VIRTIO_CONSOLE_MAX_CTRL)
+        return throw_err("The console state of the snapshot is corrupted");
+    memcpy(dev->ctrl_msgs, state.ctrl_msgs, sizeof(dev->ctrl_msgs));
+    dev->nr_ctrl_msgs = state.nr_ctrl_msgs;
+    for (int i = 0; i < dev->nr_ports; i++) {
+        if (state.connected[i] &&
+            !virtio_console_port_connected(&dev->ports[i]))
+            virtio_console_queue_ctrl(dev, i, VIRTIO_CONSOLE_PORT_OPEN, 0);
+    }
+    return virtio_pci_restore(&dev->virtio_pci_dev, s, id);
+}
+
+void virtio_console_exit(struct virtio_console_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    virtio_console_stop(dev);
+    for (int i = 1; i < dev->nr_ports; i++) {
+        struct virtio_console_port *port = &dev->ports[i];
+        if (port->outfd >= 0)
+            close(port->outfd);
+        if (port->listenfd >= 0) {
+            close(port->listenfd);
+            unlink(port->path);
+            free(port->path);
+        }
+    }
+    close(dev->kickfd);
+    close(dev->irqfd);
+    close(dev->stopfd);
+    virtio_pci_exit(&dev->virtio_pci_dev);
+}
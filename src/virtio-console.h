@@ -0,0 +1,86 @@
+#pragma once
+
+#include <linux/virtio_console.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+/* virtio-console device with multiport support. Port 0 is the hvc0 console
+ * on stdin and stdout, further ports show up in the guest as
+ * /dev/virtio-ports/<name> and are connected to a file or a unix socket.
+ *
+ * Queue 0 and 1 are the receive and transmit queues of port 0, queue 2 and 3
+ * the control queues, followed by a pair of queues for every further port.
+ * A single thread serves all of them, so output is written in whole
+ * buffers rather than a byte per exit.
+ */
+
+#define VIRTIO_CONSOLE_PCI_CLASS 0x078000
+#define VIRTIO_CONSOLE_MAX_PORTS 8
+#define VIRTIO_CONSOLE_VQ_NUM (VIRTIO_CONSOLE_MAX_PORTS * 2 + 2)
+#define VIRTIO_CONSOLE_NAME_LEN 64
+#define VIRTIO_CONSOLE_MAX_CTRL (VIRTIO_CONSOLE_MAX_PORTS * 4)
+
+enum virtio_console_backend {
+    VIRTIO_CONSOLE_NONE,
+    VIRTIO_CONSOLE_STDIO,
+    VIRTIO_CONSOLE_FILE,
+    VIRTIO_CONSOLE_SOCKET,
+};
+
+struct virtio_console_port {
+    char name[VIRTIO_CONSOLE_NAME_LEN];
+    enum virtio_console_backend backend;
+    int infd;     /* -1 if the port has no input */
+    int outfd;    /* -1 if output is dropped */
+    int listenfd; /* of a socket port */
+    char *path;   /* of a socket port, unlinked at exit */
+};
+
+/* A control message waiting for a buffer of the guest */
+struct virtio_console_ctrl_msg {
+    struct virtio_console_control ctrl;
+    char name[VIRTIO_CONSOLE_NAME_LEN];
+};
+
+struct vm;
+
+struct virtio_console_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_console_config config;
+    struct virtq vq[VIRTIO_CONSOLE_VQ_NUM];
+    struct virtio_console_port ports[VIRTIO_CONSOLE_MAX_PORTS];
+    int nr_ports;
+    struct virtio_console_ctrl_msg ctrl_msgs[VIRTIO_CONSOLE_MAX_CTRL];
+    int nr_ctrl_msgs;
+    int kickfd; /* shared by all queues */
+    int irqfd;
+    int stopfd;
+    pthread_t thread;
+    bool thread_started;
+    int irq_num;
+    struct vm *vm;
+    bool enable;
+};
+
+int virtio_console_init_pci(struct virtio_console_dev *dev,
+                            struct vm *vm,
+                            bool stdio,
+                            int irq_num,
+                            struct pci *pci,
+                            struct bus *io_bus,
+                            struct bus *mmio_bus);
+int virtio_console_add_port(struct virtio_console_dev *dev, const char *spec);
+void virtio_console_start(struct virtio_console_dev *dev);
+void virtio_console_stop(struct virtio_console_dev *dev);
+int virtio_console_save(struct virtio_console_dev *dev,
+                        struct snapshot *s,
+                        uint32_t id);
+int virtio_console_restore(struct virtio_console_dev *dev,
+                           struct snapshot *s,
+                           uint32_t id);
+void virtio_console_exit(struct virtio_console_dev *dev);
@@ -0,0 +1,711 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <linux/vhost.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "placement.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "vhost.h"
+#include "virtio-net.h"
+#include "vm.h"
+
+#define VIRTIO_NET_FEATURES                                               \
+    ((1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_CSUM) |    \
+     (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_GUEST_TSO4) |     \
+     (1ULL << VIRTIO_NET_F_GUEST_TSO6) | (1ULL << VIRTIO_NET_F_GUEST_ECN) | \
+     (1ULL << VIRTIO_NET_F_HOST_TSO4) | (1ULL << VIRTIO_NET_F_HOST_TSO6) |  \
+     (1ULL << VIRTIO_NET_F_HOST_ECN) | (1ULL << VIRTIO_NET_F_MRG_RXBUF) |   \
+     (1ULL << VIRTIO_NET_F_CTRL_VQ))
+
+#define VIRTIO_NET_MAX_TX_SEGS 64
+#define VIRTIO_NET_DEFAULT_MAC {0x52, 0x54, 0x00, 0x12, 0x34, 0x56}
+
+struct virtio_net_ctrl_req {
+    struct virtio_net_ctrl_hdr *hdr;
+    void *data;
+    uint32_t data_len;
+    uint8_t *ack;
+};
+
+static bool virtio_net_has_feature(struct virtio_net_dev *dev, int feature)
+{
+    return dev->virtio_pci_dev.guest_feature & (1ULL << feature);
+}
+
+static int virtio_net_ctrl_index(struct virtio_net_dev *dev)
+{
+    return dev->nr_pairs * 2;
+}
+
+static void virtio_net_notify_used(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    uint64_t n = 1;
+
+    dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to write the irqfd");
+}
+
+static void virtio_net_notify(struct virtq *vq)
+{
+    if (vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+        virtq_notify_used(vq);
+}
+
+/* Copy the pending frame into as many receive buffers as it takes. Returns
+ * false if the ring ran out of buffers before the frame was complete. A
+ * frame which does not fit into the buffers the guest may give it is
+ * dropped, and the buffers it took are left on the ring.
+ */
+static bool virtio_net_rx_fill(struct virtio_net_queue_pair *qp)
+{
+    struct virtio_net_dev *dev = qp->dev;
+    struct virtq *vq = &dev->vq[qp->index * 2];
+    struct virtio_net_rx *rx = &qp->rx;
+    bool mergeable = virtio_net_has_feature(dev, VIRTIO_NET_F_MRG_RXBUF);
+
+    while (rx->copied < rx->len) {
+        if (rx->nr_bufs == VIRTQ_SIZE || (rx->nr_bufs && !mergeable)) {
+            vq->next_avail_idx = rx->avail_idx;
+            vq->used_wrap_count = rx->wrap_count;
+            __atomic_fetch_add(&qp->nr_rx_dropped, 1, __ATOMIC_RELAXED);
+            rx->len = 0;
+            rx->nr_bufs = 0;
+            return true;
+        }
+        if (!virtq_has_avail(vq))
+            return false;
+        if (!rx->nr_bufs) {
+            rx->avail_idx = vq->next_avail_idx;
+            rx->wrap_count = vq->used_wrap_count;
+        }
+
+        struct vring_packed_desc *desc = virtq_get_avail(vq);
+        uint32_t written = 0;
+        rx->bufs[rx->nr_bufs] = desc;
+        while (desc) {
+            size_t n = rx->len - rx->copied;
+            if (n > desc->len)
+                n = desc->len;
+            void *buf = vm_guest_range_to_host(dev->vm, desc->addr, n);
+            if ((desc->flags & VRING_DESC_F_WRITE) && buf) {
+                memcpy(buf, rx->frame + rx->copied, n);
+                if (!rx->copied && n >= sizeof(struct virtio_net_hdr_v1))
+                    rx->hdr = buf;
+                rx->copied += n;
+                written += n;
+            }
+            desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL;
+        }
+        rx->buf_lens[rx->nr_bufs++] = written;
+    }
+
+    if (rx->hdr)
+        rx->hdr->num_buffers = rx->nr_bufs;
+    for (int i = rx->nr_bufs - 1; i >= 0; i--)
+        virtq_put_used(rx->bufs[i], rx->buf_lens[i]);
+    rx->len = 0;
+    return true;
+}
+
+static bool virtio_net_rx_ready(struct virtio_net_queue_pair *qp)
+{
+    struct virtq *vq = &qp->dev->vq[qp->index * 2];
+
+    return vq->info.enable && virtq_has_avail(vq);
+}
+
+/* Frames are read from the tap queue as long as the guest has buffers for
+ * them, and the guest is interrupted once for all of them.
+ */
+static void virtio_net_rx(struct virtio_net_queue_pair *qp)
+{
+    struct virtio_net_rx *rx = &qp->rx;
+    struct virtq *vq = &qp->dev->vq[qp->index * 2];
+    bool used = false;
+
+    while (vq->info.enable) {
+        if (!rx->len) {
+            ssize_t n = read(qp->tapfd, rx->frame, VIRTIO_NET_MAX_FRAME);
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    throw_err("Failed to read from the tap queue");
+                break;
+            }
+            if (n < (ssize_t) sizeof(struct virtio_net_hdr_v1))
+                continue;
+            rx->len = n;
+            rx->copied = 0;
+            rx->nr_bufs = 0;
+            rx->hdr = NULL;
+            /* The tap interface leaves the field alone */
+            ((struct virtio_net_hdr_v1 *) rx->frame)->num_buffers = 1;
+        }
+        if (!virtio_net_rx_fill(qp))
+            break;
+        used |= rx->nr_bufs > 0;
+    }
+    if (used)
+        virtio_net_notify(vq);
+}
+
+/* Frames are written straight from guest memory, header included */
+static void virtio_net_tx(struct virtio_net_queue_pair *qp)
+{
+    struct virtio_net_dev *dev = qp->dev;
+    struct virtq *vq = &dev->vq[qp->index * 2 + 1];
+    struct iovec iov[VIRTIO_NET_MAX_TX_SEGS];
+    bool used = false;
+
+    while (vq->info.enable && virtq_has_avail(vq)) {
+        struct vring_packed_desc *head = virtq_get_avail(vq), *desc = head;
+        bool bad = false;
+        int nr_iov = 0;
+
+        while (desc) {
+            void *buf = vm_guest_range_to_host(dev->vm, desc->addr, desc->len);
+            if (!buf || nr_iov == VIRTIO_NET_MAX_TX_SEGS)
+                bad = true;
+            else
+                iov[nr_iov++] = (struct iovec){buf, desc->len};
+            desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL;
+        }
+        /* Frames the tap queue cannot take are dropped, as on a busy link */
+        if (!bad && writev(qp->tapfd, iov, nr_iov) < 0 && errno != EAGAIN &&
+            errno != EIO)
+            throw_err("Failed to write to the tap queue");
+        virtq_put_used(head, 0);
+        used = true;
+    }
+    if (used)
+        virtio_net_notify(vq);
+}
+
+static void *virtio_net_pair_thread(void *arg)
+{
+    struct virtio_net_queue_pair *qp = (struct virtio_net_queue_pair *) arg;
+    struct pollfd pollfds[] = {
+        {.fd = qp->tapfd},
+        {.fd = qp->kickfd[0], .events = POLLIN},
+        {.fd = qp->kickfd[1], .events = POLLIN},
+        {.fd = qp->dev->stopfd, .events = POLLIN},
+    };
+    uint64_t n;
+
+    placement_apply(PLACEMENT_IO, "virtio-net-q%d", qp->index);
+    for (;;) {
+        /* Without receive buffers, the tap queue waits for a kick */
+        pollfds[0].events = virtio_net_rx_ready(qp) ? POLLIN : 0;
+        if (poll(pollfds, 4, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_err("Failed to poll the virtio-net queue");
+            break;
+        }
+        if (pollfds[3].revents & POLLIN)
+            break;
+        for (int i = 1; i < 3; i++) {
+            if ((pollfds[i].revents & POLLIN) &&
+                read(pollfds[i].fd, &n, sizeof(n)) < 0)
+                throw_err("Failed to read the event of virtio-net");
+        }
+        virtio_net_tx(qp);
+        virtio_net_rx(qp);
+    }
+    return NULL;
+}
+
+static void virtio_net_ctrl_add(struct virtio_net_dev *dev,
+                                struct virtio_net_ctrl_req *req,
+                                uint64_t addr,
+                                uint32_t len,
+                                bool write)
+{
+    void *buf = vm_guest_range_to_host(dev->vm, addr, len);
+
+    if (!buf || !len)
+        return;
+    if (write) {
+        if (!req->ack)
+            req->ack = buf;
+    } else if (!req->hdr) {
+        if (len >= sizeof(*req->hdr))
+            req->hdr = buf;
+    } else if (!req->data) {
+        req->data = buf;
+        req->data_len = len;
+    }
+}
+
+/* Only the number of queue pairs can be set, as no other control feature
+ * is offered.
+ */
+static void virtio_net_ctrl_handle(struct virtio_net_dev *dev,
+                                   struct virtio_net_ctrl_req *req)
+{
+    uint8_t ack = VIRTIO_NET_ERR;
+
+    if (!req->hdr || !req->ack)
+        return;
+    if (req->hdr->class == VIRTIO_NET_CTRL_MQ &&
+        req->hdr->cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+        req->data_len >= sizeof(struct virtio_net_ctrl_mq)) {
+        struct virtio_net_ctrl_mq *mq = req->data;
+        uint16_t pairs = mq->virtqueue_pairs;
+        if (pairs >= 1 && pairs <= dev->nr_pairs &&
+            tap_set_queues(&dev->tap, pairs) == 0)
+            ack = VIRTIO_NET_OK;
+    }
+    *req->ack = ack;
+}
+
+/* The control queue is processed in the vCPU thread, as its notifications
+ * are not bound to an ioeventfd.
+ */
+static void virtio_net_ctrl(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+
+    while (virtq_has_avail(vq)) {
+        struct vring_packed_desc *head = virtq_get_avail(vq), *desc = head;
+        struct virtio_net_ctrl_req req = {0};
+
+        while (desc) {
+            virtio_net_ctrl_add(dev, &req, desc->addr, desc->len,
+                                desc->flags & VRING_DESC_F_WRITE);
+            desc = virtq_check_next(desc) ? virtq_get_avail(vq) : NULL;
+        }
+        virtio_net_ctrl_handle(dev, &req);
+        virtq_put_used(head, 1);
+    }
+}
+
+/* vhost-net only implements split rings, so that is what the guest uses
+ * with vhost=on, and the control queue is a split ring as well.
+ */
+static void virtio_net_ctrl_split(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    uint16_t size = vq->info.size;
+    struct vring_desc *desc = vm_guest_range_to_host(
+        dev->vm, vq->info.desc_addr, sizeof(struct vring_desc) * size);
+    struct vring_avail *avail = vm_guest_range_to_host(
+        dev->vm, vq->info.driver_addr,
+        sizeof(struct vring_avail) + sizeof(uint16_t) * size);
+    struct vring_used *used = vm_guest_range_to_host(
+        dev->vm, vq->info.device_addr,
+        sizeof(struct vring_used) + sizeof(struct vring_used_elem) * size);
+
+    if (!desc || !avail || !used)
+        return;
+    while (dev->ctrl_last_avail !=
+           __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE)) {
+        uint16_t head = avail->ring[dev->ctrl_last_avail++ % size];
+        struct virtio_net_ctrl_req req = {0};
+
+        for (uint16_t i = head, n = 0; i < size && n < size; n++) {
+            virtio_net_ctrl_add(dev, &req, desc[i].addr, desc[i].len,
+                                desc[i].flags & VRING_DESC_F_WRITE);
+            if (!(desc[i].flags & VRING_DESC_F_NEXT))
+                break;
+            i = desc[i].next;
+        }
+        virtio_net_ctrl_handle(dev, &req);
+        used->ring[used->idx % size] = (struct vring_used_elem){head, 1};
+        __atomic_store_n(&used->idx, used->idx + 1, __ATOMIC_RELEASE);
+    }
+    if (!(avail->flags & VRING_AVAIL_F_NO_INTERRUPT))
+        virtq_notify_used(vq);
+}
+
+/* Receive offloads of the tap interface follow what the guest accepts */
+static unsigned int virtio_net_tap_offload(struct virtio_net_dev *dev)
+{
+    unsigned int offload = 0;
+
+    if (!virtio_net_has_feature(dev, VIRTIO_NET_F_GUEST_CSUM))
+        return 0;
+    offload |= TUN_F_CSUM;
+    if (virtio_net_has_feature(dev, VIRTIO_NET_F_GUEST_TSO4))
+        offload |= TUN_F_TSO4;
+    if (virtio_net_has_feature(dev, VIRTIO_NET_F_GUEST_TSO6))
+        offload |= TUN_F_TSO6;
+    if (virtio_net_has_feature(dev, VIRTIO_NET_F_GUEST_ECN))
+        offload |= TUN_F_TSO_ECN;
+    return offload;
+}
+
+/* The features of the guest are final once it enables the first queue */
+static int virtio_net_set_features(struct virtio_net_dev *dev)
+{
+    uint64_t features = dev->virtio_pci_dev.guest_feature & dev->vhost_features;
+
+    if (tap_set_offload(&dev->tap, virtio_net_tap_offload(dev)) < 0)
+        return -1;
+    for (int i = 0; dev->vhost && i < dev->nr_pairs; i++) {
+        if (vhost_set_features(dev->pairs[i].vhostfd, features) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int virtio_net_vhost_start_vq(struct virtio_net_dev *dev,
+                                     struct virtq *vq)
+{
+    int index = vq - dev->vq;
+    struct virtio_net_queue_pair *qp = &dev->pairs[index / 2];
+    unsigned int n = index % 2;
+    struct vhost_vring_file backend = {.index = n, .fd = qp->tapfd};
+
+    if (vhost_start_vq(qp->vhostfd, dev->vm, vq, n, qp->kickfd[n],
+                       dev->irqfd) < 0)
+        return -1;
+    if (ioctl(qp->vhostfd, VHOST_NET_SET_BACKEND, &backend) < 0)
+        return throw_err("Failed to start vhost-net queue %d", index);
+    return 0;
+}
+
+static void virtio_net_enable_vq(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    vm_t *v = dev->vm;
+    int index = vq - dev->vq;
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    if (!dev->features_set) {
+        if (virtio_net_set_features(dev) < 0)
+            return;
+        dev->features_set = true;
+    }
+    /* The split rings of vhost=on are left unset, so that a kick which
+     * missed the ioeventfd never reads them as packed ones
+     */
+    if (dev->vhost && index == virtio_net_ctrl_index(dev))
+        return;
+    if (!dev->vhost) {
+        vq->desc_ring = (struct vring_packed_desc *) vm_guest_to_host(
+            v, vq->info.desc_addr);
+        vq->device_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+            v, vq->info.device_addr);
+        vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
+            v, vq->info.driver_addr);
+    }
+    if (index == virtio_net_ctrl_index(dev))
+        return;
+
+    struct virtio_net_queue_pair *qp = &dev->pairs[index / 2];
+    uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, qp->kickfd[index % 2], addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH, index);
+    if (dev->vhost)
+        virtio_net_vhost_start_vq(dev, vq);
+    else
+        virtio_net_start(dev);
+}
+
+/* A kick which missed the ioeventfd is passed on to the queue handler */
+static void virtio_net_kick(struct virtq *vq)
+{
+    struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    int index = vq - dev->vq;
+    uint64_t n = 1;
+
+    if (write(dev->pairs[index / 2].kickfd[index % 2], &n, sizeof(n)) < 0)
+        throw_err("Failed to kick the virtio-net queue");
+}
+
+static struct virtq_ops data_ops = {
+    .enable_vq = virtio_net_enable_vq,
+    .complete_request = virtio_net_kick,
+    .notify_used = virtio_net_notify_used,
+};
+
+static struct virtq_ops ctrl_ops = {
+    .enable_vq = virtio_net_enable_vq,
+    .complete_request = virtio_net_ctrl,
+    .notify_used = virtio_net_notify_used,
+};
+
+static struct virtq_ops ctrl_split_ops = {
+    .enable_vq = virtio_net_enable_vq,
+    .complete_request = virtio_net_ctrl_split,
+    .notify_used = virtio_net_notify_used,
+};
+
+static int virtio_net_parse_mac(struct virtio_net_dev *dev, const char *mac)
+{
+    uint8_t *m = dev->config.mac;
+
+    if (sscanf(mac, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &m[0], &m[1], &m[2],
+               &m[3], &m[4], &m[5]) != 6)
+        return throw_err("Invalid MAC address '%s'", mac);
+    return 0;
+}
+
+/* The interface is described as "ifname[,key=value]...". Supported keys:
+ * - queues=n: number of queue pairs (default: 1)
+ * - vhost=on|off: move frames in the kernel with vhost-net (default: off)
+ * - mac=xx:xx:xx:xx:xx:xx: MAC address of the guest
+ */
+static int virtio_net_parse_opts(struct virtio_net_dev *dev, char *opts)
+{
+    char *saveptr;
+
+    for (char *opt = strtok_r(opts, ",", &saveptr); opt;
+         opt = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(opt, '=');
+        if (!value)
+            return throw_err("Missing value of net option '%s'", opt);
+        *value++ = '\0';
+
+        if (!strcmp(opt, "queues")) {
+            dev->nr_pairs = atoi(value);
+            if (dev->nr_pairs < 1 ||
+                dev->nr_pairs > VIRTIO_NET_MAX_QUEUE_PAIRS)
+                return throw_err("The number of queues must be 1-%d",
+                                 VIRTIO_NET_MAX_QUEUE_PAIRS);
+        } else if (!strcmp(opt, "vhost")) {
+            if (strcmp(value, "on") && strcmp(value, "off"))
+                return throw_err("vhost must be on or off");
+            dev->vhost = !strcmp(value, "on");
+        } else if (!strcmp(opt, "mac")) {
+            if (virtio_net_parse_mac(dev, value) < 0)
+                return -1;
+        } else {
+            return throw_err("Unknown net option '%s'", opt);
+        }
+    }
+    return 0;
+}
+
+static int virtio_net_setup(struct virtio_net_dev *dev, const char *spec)
+{
+    char *ifname = strdup(spec);
+    char *opts = strchr(ifname, ',');
+    int ret = -1;
+
+    if (opts)
+        *opts++ = '\0';
+    if (opts && virtio_net_parse_opts(dev, opts) < 0)
+        goto out;
+    if (tap_open(&dev->tap, ifname, dev->nr_pairs) < 0)
+        goto out;
+    dev->vhost_features = ~0ULL;
+    for (int i = 0; i < dev->nr_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &dev->pairs[i];
+        qp->dev = dev;
+        qp->index = i;
+        qp->tapfd = dev->tap.fds[i];
+        qp->vhostfd = -1;
+        qp->kickfd[0] = eventfd(0, EFD_CLOEXEC);
+        qp->kickfd[1] = eventfd(0, EFD_CLOEXEC);
+        qp->rx.frame = malloc(VIRTIO_NET_MAX_FRAME);
+        if (dev->vhost) {
+            qp->vhostfd =
+                vhost_open("/dev/vhost-net", dev->vm, &dev->vhost_features);
+            if (qp->vhostfd < 0)
+                goto out;
+        }
+    }
+    ret = 0;
+out:
+    free(ifname);
+    return ret;
+}
+
+int virtio_net_init_pci(struct virtio_net_dev *dev,
+                        struct vm *vm,
+                        const char *spec,
+                        int irq_num,
+                        struct pci *pci,
+                        struct bus *io_bus,
+                        struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+    uint8_t mac[] = VIRTIO_NET_DEFAULT_MAC;
+    uint64_t features = VIRTIO_NET_FEATURES;
+
+    memset(dev, 0x00, sizeof(struct virtio_net_dev));
+    dev->vm = vm;
+    dev->irq_num = irq_num;
+    dev->nr_pairs = 1;
+    memcpy(dev->config.mac, mac, sizeof(mac));
+    dev->enable = true;
+    if (virtio_net_setup(dev, spec) < 0) {
+        virtio_net_exit(dev);
+        return -1;
+    }
+    if (dev->nr_pairs > 1)
+        features |= 1ULL << VIRTIO_NET_F_MQ;
+    dev->config.max_virtqueue_pairs = dev->nr_pairs;
+
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    dev->stopfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(vm, dev->irqfd, irq_num, 0);
+    for (int i = 0; i < dev->nr_pairs * 2; i++)
+        virtq_init(&dev->vq[i], dev, &data_ops);
+    virtq_init(&dev->vq[virtio_net_ctrl_index(dev)], dev,
+               dev->vhost ? &ctrl_split_ops : &ctrl_ops);
+
+    virtio_pci_init(pci_dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_NET,
+                           VIRTIO_NET_PCI_CLASS, irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, dev->nr_pairs * 2 + 1);
+    if (dev->vhost) {
+        /* vhost-net has to support the virtio 1.0 layout of the header */
+        if (!(dev->vhost_features & (1ULL << VIRTIO_F_VERSION_1))) {
+            errno = ENOTSUP;
+            virtio_net_exit(dev);
+            return throw_err("vhost-net does not support virtio 1.0");
+        }
+        if (!(dev->vhost_features & (1ULL << VIRTIO_NET_F_MRG_RXBUF)))
+            features &= ~(1ULL << VIRTIO_NET_F_MRG_RXBUF);
+        pci_dev->device_feature &= ~(1ULL << VIRTIO_F_RING_PACKED);
+        /* vhost-net interrupts the guest behind the back of kvm-host */
+        pci_dev->external_isr = true;
+    }
+    virtio_pci_add_feature(pci_dev, features);
+    virtio_pci_enable(pci_dev);
+    return 0;
+}
+
+/* Start the threads of the queue pairs with an enabled queue, also after
+ * virtio_net_stop.
+ */
+void virtio_net_start(struct virtio_net_dev *dev)
+{
+    if (dev->vhost)
+        return;
+    for (int i = 0; i < dev->nr_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &dev->pairs[i];
+        if (qp->thread_started || (!dev->vq[i * 2].info.enable &&
+                                   !dev->vq[i * 2 + 1].info.enable))
+            continue;
+        pthread_create(&qp->thread, NULL, virtio_net_pair_thread, qp);
+        qp->thread_started = true;
+    }
+}
+
+/* Stop the threads of the queue pairs. A frame which is only partly copied
+ * is dropped, and the buffers it took are handed back empty.
+ */
+void virtio_net_stop(struct virtio_net_dev *dev)
+{
+    bool started = false;
+    uint64_t n = 1;
+
+    for (int i = 0; i < dev->nr_pairs; i++)
+        started |= dev->pairs[i].thread_started;
+    if (!started)
+        return;
+    if (write(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to stop the virtio-net threads");
+    for (int i = 0; i < dev->nr_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &dev->pairs[i];
+        struct virtio_net_rx *rx = &qp->rx;
+        if (!qp->thread_started)
+            continue;
+        pthread_join(qp->thread, NULL);
+        qp->thread_started = false;
+        for (int j = rx->nr_bufs - 1; rx->len && j >= 0; j--)
+            virtq_put_used(rx->bufs[j], 0);
+        if (rx->len && rx->nr_bufs)
+            virtio_net_notify(&dev->vq[qp->index * 2]);
+        rx->len = 0;
+        rx->nr_bufs = 0;
+    }
+    if (read(dev->stopfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to reset the stop event of virtio-net");
+}
+
+struct virtio_net_state {
+    uint32_t nr_attached; /* tap queues, as set by the guest */
+};
+
+int virtio_net_save(struct virtio_net_dev *dev, struct snapshot *s, uint32_t id)
+{
+    struct virtio_net_state state = {.nr_attached = 0};
+
+    if (dev->vhost)
+        return throw_err("Interfaces with vhost=on cannot be saved");
+    for (int i = 0; i < dev->tap.nr_queues; i++)
+        state.nr_attached += dev->tap.attached[i];
+    if (snapshot_add(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    return virtio_pci_save(&dev->virtio_pci_dev, s, id);
+}
+
+int virtio_net_restore(struct virtio_net_dev *dev,
+                       struct snapshot *s,
+                       uint32_t id)
+{
+    struct virtio_net_state state;
+
+    if (dev->vhost)
+        return throw_err("Interfaces with vhost=on cannot be restored");
+    if (snapshot_read(s, SNAPSHOT_DEV, id, &state, sizeof(state)) < 0)
+        return -1;
+    if (state.nr_attached > (uint32_t) dev->tap.nr_queues ||
+        tap_set_queues(&dev->tap, state.nr_attached) < 0)
+        return throw_err("Failed to restore the queues of %s",
+                         dev->tap.ifname);
+    return virtio_pci_restore(&dev->virtio_pci_dev, s, id);
+}
+
+void virtio_net_dump_stats(struct virtio_net_dev *dev,
+                           FILE *f,
+                           enum blk_stats_format format)
+{
+    unsigned long long dropped = 0;
+
+    for (int i = 0; i < dev->nr_pairs; i++)
+        dropped += __atomic_load_n(&dev->pairs[i].nr_rx_dropped,
+                                   __ATOMIC_RELAXED);
+    if (format == BLK_STATS_JSON) {
+        fprintf(f, "{\"name\": ");
+        blk_stats_json_string(f, dev->tap.ifname);
+        fprintf(f, ", \"rx_dropped\": %llu}", dropped);
+    } else {
+        fprintf(f, "%s: %llu received frames dropped\n", dev->tap.ifname,
+                dropped);
+    }
+}
+
+void virtio_net_exit(struct virtio_net_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    if (dev->stopfd > 0)
+        virtio_net_stop(dev);
+    for (int i = 0; i < dev->nr_pairs; i++) {
+        struct virtio_net_queue_pair *qp = &dev->pairs[i];
+        if (!qp->dev)
+            break;
+        if (qp->vhostfd >= 0)
+            close(qp->vhostfd);
+        if (qp->kickfd[0] > 0) {
+            close(qp->kickfd[0]);
+            close(qp->kickfd[1]);
+        }
+        free(qp->rx.frame);
+    }
+    tap_close(&dev->tap);
+    if (dev->irqfd > 0) {
+        close(dev->irqfd);
+        close(dev->stopfd);
+    }
+    virtio_pci_exit(&dev->virtio_pci_dev);
+}
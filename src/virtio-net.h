@@ -0,0 +1,95 @@
+#pragma once
+
+#include <linux/virtio_net.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blk-stats.h"
+#include "pci.h"
+#include "tap.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+/* virtio-net device backed by a tap interface.
+ *
+ * Each queue pair has one tap queue. Without vhost, a thread per pair moves
+ * frames between the tap queue and the rings. With vhost=on, the vhost-net
+ * kernel driver does it instead, kicked through ioeventfds and signalling
+ * the irqfd directly. The control queue is always handled by kvm-host.
+ */
+
+#define VIRTIO_NET_PCI_CLASS 0x020000
+#define VIRTIO_NET_MAX_QUEUE_PAIRS TAP_MAX_QUEUES
+#define VIRTIO_NET_MAX_VQ (VIRTIO_NET_MAX_QUEUE_PAIRS * 2 + 1)
+/* The largest GSO frame plus its header */
+#define VIRTIO_NET_MAX_FRAME (65535 + sizeof(struct virtio_net_hdr_v1))
+
+struct virtio_net_dev;
+
+/* A received frame which is copied into receive buffers. The buffers are
+ * only marked used once the frame is complete, as the guest expects all
+ * buffers of a frame to be there when it sees the first.
+ */
+struct virtio_net_rx {
+    uint8_t *frame;
+    size_t len;
+    size_t copied;
+    struct virtio_net_hdr_v1 *hdr; /* in the first buffer */
+    struct vring_packed_desc *bufs[VIRTQ_SIZE];
+    uint32_t buf_lens[VIRTQ_SIZE];
+    int nr_bufs;
+    uint16_t avail_idx; /* where the first buffer was taken, to drop it */
+    bool wrap_count;
+};
+
+struct virtio_net_queue_pair {
+    struct virtio_net_dev *dev;
+    int index;
+    int tapfd;
+    int kickfd[2]; /* rx, tx */
+    int vhostfd;
+    struct virtio_net_rx rx;
+    uint64_t nr_rx_dropped; /* frames larger than the receive buffers */
+    pthread_t thread;
+    bool thread_started;
+};
+
+struct vm;
+
+struct virtio_net_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_net_config config;
+    struct virtq vq[VIRTIO_NET_MAX_VQ];
+    struct virtio_net_queue_pair pairs[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    int nr_pairs;
+    struct tap tap;
+    bool vhost;
+    uint64_t vhost_features;
+    uint16_t ctrl_last_avail; /* of the split control ring with vhost */
+    bool features_set;
+    int irqfd;
+    int stopfd;
+    int irq_num;
+    struct vm *vm;
+    bool enable;
+};
+
+int virtio_net_init_pci(struct virtio_net_dev *dev,
+                        struct vm *vm,
+                        const char *spec,
+                        int irq_num,
+                        struct pci *pci,
+                        struct bus *io_bus,
+                        struct bus *mmio_bus);
+void virtio_net_start(struct virtio_net_dev *dev);
+void virtio_net_stop(struct virtio_net_dev *dev);
+int virtio_net_save(struct virtio_net_dev *dev, struct snapshot *s, uint32_t id);
+int virtio_net_restore(struct virtio_net_dev *dev,
+                       struct snapshot *s,
+                       uint32_t id);
+void virtio_net_dump_stats(struct virtio_net_dev *dev,
+                           FILE *f,
+                           enum blk_stats_format format);
+void virtio_net_exit(struct virtio_net_dev *dev);
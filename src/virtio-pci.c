@@ -4,7 +4,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "err.h"
 #include "pci.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "virtio-pci.h"
 
@@ -44,9 +46,14 @@ static void virtio_pci_write_guest_feature(struct virtio_pci_dev *dev)
     }
 }
 
+/* The guest negotiates the features again, and devices whose queues run
+ * outside of kvm-host stop them.
+ */
 static void virtio_pci_reset(struct virtio_pci_dev *dev)
 {
-    /* TODO: virtio pci reset */
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++)
+        virtq_disable(&dev->vq[i]);
+    dev->guest_feature = 0;
 }
 
 static void virtio_pci_write_status(struct virtio_pci_dev *dev)
@@ -57,6 +64,15 @@ static void virtio_pci_write_status(struct virtio_pci_dev *dev)
     }
 }
 
+/* The device has failed and only works again after the guest resets it. The
+ * caller raises the interrupt which reports the configuration change.
+ */
+void virtio_pci_set_needs_reset(struct virtio_pci_dev *dev)
+{
+    dev->config.common_cfg.device_status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    dev->config.isr_cap.isr_status |= VIRTIO_PCI_ISR_CONFIG;
+}
+
 static void virtio_pci_select_virtq(struct virtio_pci_dev *dev)
 {
     uint16_t select = dev->config.common_cfg.queue_select;
@@ -138,6 +154,13 @@ static void virtio_pci_space_read(struct virtio_pci_dev *dev,
                                   uint8_t size)
 {
     if (offset < offsetof(struct virtio_pci_config, dev_cfg)) {
+        /* The guest ignores an interrupt unless the ISR shows its cause. It
+         * cannot be tracked if the interrupt was raised elsewhere, and with
+         * no shared lines a queue interrupt is the only possible cause.
+         */
+        if (offset == offsetof(struct virtio_pci_config, isr_cap) &&
+            dev->external_isr)
+            dev->config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
         memcpy(data, (void *) &dev->config + offset, size);
         if (offset == offsetof(struct virtio_pci_config, isr_cap)) {
             dev->config.isr_cap.isr_status = 0;
@@ -277,6 +300,89 @@ void virtio_pci_enable(struct virtio_pci_dev *dev)
     pci_dev_register(&dev->pci_dev);
 }
 
+/* The device configuration is not saved, as it follows from the options the
+ * device is created with.
+ */
+struct virtio_pci_state {
+    uint8_t cfg_space[PCI_CFG_SPACE_SIZE];
+    struct virtio_pci_common_cfg common_cfg;
+    struct virtio_pci_isr_cap isr_cap;
+    struct virtio_pci_notify_data notify_data;
+    uint64_t device_feature;
+    uint64_t guest_feature;
+};
+
+struct virtq_state {
+    struct virtq_info info;
+    uint16_t next_avail_idx;
+    uint16_t used_wrap_count;
+};
+
+int virtio_pci_save(struct virtio_pci_dev *dev, struct snapshot *s, uint32_t id)
+{
+    struct virtio_pci_state state;
+
+    memset(&state, 0, sizeof(state));
+    memcpy(state.cfg_space, dev->pci_dev.cfg_space, PCI_CFG_SPACE_SIZE);
+    state.common_cfg = dev->config.common_cfg;
+    state.isr_cap = dev->config.isr_cap;
+    state.notify_data = dev->config.notify_data;
+    state.device_feature = dev->device_feature;
+    state.guest_feature = dev->guest_feature;
+    if (snapshot_add(s, SNAPSHOT_VIRTIO_PCI, id, &state, sizeof(state)) < 0)
+        return -1;
+
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++) {
+        struct virtq *vq = &dev->vq[i];
+        struct virtq_state vq_state = {
+            .info = vq->info,
+            .next_avail_idx = vq->next_avail_idx,
+            .used_wrap_count = vq->used_wrap_count,
+        };
+        if (snapshot_add(s, SNAPSHOT_VIRTQ, id << 16 | i, &vq_state,
+                         sizeof(vq_state)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Queues which the guest had enabled are enabled again, which starts their
+ * processing, so the state of the device itself goes first.
+ */
+int virtio_pci_restore(struct virtio_pci_dev *dev,
+                       struct snapshot *s,
+                       uint32_t id)
+{
+    struct virtio_pci_state state;
+
+    if (snapshot_read(s, SNAPSHOT_VIRTIO_PCI, id, &state, sizeof(state)) < 0)
+        return -1;
+    if (state.device_feature != dev->device_feature ||
+        state.common_cfg.num_queues != dev->config.common_cfg.num_queues)
+        return throw_err("Device %u differs from the one in the snapshot", id);
+
+    pci_dev_restore(&dev->pci_dev, state.cfg_space);
+    dev->config.common_cfg = state.common_cfg;
+    dev->config.isr_cap = state.isr_cap;
+    dev->config.notify_data = state.notify_data;
+    dev->guest_feature = state.guest_feature;
+
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++) {
+        struct virtq *vq = &dev->vq[i];
+        struct virtq_state vq_state;
+        if (snapshot_read(s, SNAPSHOT_VIRTQ, id << 16 | i, &vq_state,
+                          sizeof(vq_state)) < 0)
+            return -1;
+        vq->info = vq_state.info;
+        vq->info.enable = 0;
+        vq->next_avail_idx = vq_state.next_avail_idx;
+        vq->used_wrap_count = vq_state.used_wrap_count;
+        if (vq_state.info.enable)
+            virtq_enable(vq);
+    }
+    return 0;
+}
+
 void virtio_pci_exit()
 {
     /* TODO: exit of the virtio pci device */
@@ -1,12 +1,17 @@
 #pragma once
 
 #include <linux/virtio_pci.h>
+#include <stdbool.h>
 
 #include "pci.h"
 #include "virtq.h"
 
 #define VIRTIO_PCI_VENDOR_ID 0x1AF4
+#define VIRTIO_PCI_DEVICE_ID_NET 0x1041
 #define VIRTIO_PCI_DEVICE_ID_BLK 0x1042
+#define VIRTIO_PCI_DEVICE_ID_CONSOLE 0x1043
+#define VIRTIO_PCI_DEVICE_ID_BALLOON 0x1045
+#define VIRTIO_PCI_DEVICE_ID_VSOCK 0x1053
 #define VIRTIO_PCI_CAP_NUM 5
 #define VIRTIO_PCI_ISR_QUEUE 1
 
@@ -26,6 +31,8 @@ struct virtio_pci_config {
     void *dev_cfg;
 };
 
+struct snapshot;
+
 struct virtio_pci_dev {
     struct pci_dev pci_dev;
     struct virtio_pci_config config;
@@ -34,6 +41,7 @@ struct virtio_pci_dev {
     struct virtio_pci_notify_cap *notify_cap;
     struct virtio_pci_cap *dev_cfg_cap;
     struct virtq *vq;
+    bool external_isr; /* interrupts are raised behind the back of kvm-host */
 };
 
 uint64_t virtio_pci_get_notify_addr(struct virtio_pci_dev *dev,
@@ -50,6 +58,13 @@ void virtio_pci_set_virtq(struct virtio_pci_dev *dev,
                           uint16_t num_queues);
 void virtio_pci_add_feature(struct virtio_pci_dev *dev, uint64_t feature);
 void virtio_pci_enable(struct virtio_pci_dev *dev);
+void virtio_pci_set_needs_reset(struct virtio_pci_dev *dev);
+int virtio_pci_save(struct virtio_pci_dev *dev,
+                    struct snapshot *s,
+                    uint32_t id);
+int virtio_pci_restore(struct virtio_pci_dev *dev,
+                       struct snapshot *s,
+                       uint32_t id);
 void virtio_pci_init(struct virtio_pci_dev *dev,
                      struct pci *pci,
                      struct bus *io_bus,
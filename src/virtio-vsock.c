@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <linux/vhost.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "vhost.h"
+#include "virtio-vsock.h"
+#include "vm.h"
+
+#define VIRTIO_VSOCK_FEATURES (1ULL << VIRTIO_VSOCK_F_SEQPACKET)
+
+static void virtio_vsock_enable_vq(struct virtq *vq)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) vq->dev;
+    vm_t *v = dev->vm;
+    int index = vq - dev->vq;
+
+    if (vq->info.enable)
+        return;
+    vq->info.enable = true;
+    /* Buffers of the event queue stay with the guest, as no events are sent */
+    if (index == VIRTIO_VSOCK_VQ_EVENT)
+        return;
+
+    /* The features of the guest are final once it enables the first queue */
+    if (dev->nr_started == 0 &&
+        vhost_set_features(dev->vhostfd, dev->virtio_pci_dev.guest_feature &
+                                              dev->vhost_features) < 0)
+        return;
+    uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, dev->kickfd[index], addr, sizeof(uint16_t),
+                          KVM_IOEVENTFD_FLAG_DATAMATCH, index);
+    if (vhost_start_vq(dev->vhostfd, v, vq, index, dev->kickfd[index],
+                       dev->irqfd) < 0)
+        return;
+
+    /* vhost-vsock runs both queues at once */
+    int running = 1;
+    if (++dev->nr_started == 2 &&
+        ioctl(dev->vhostfd, VHOST_VSOCK_SET_RUNNING, &running) < 0)
+        throw_err("Failed to start vhost-vsock");
+}
+
+/* Kicks which missed the ioeventfd are passed on to vhost-vsock */
+static void virtio_vsock_kick(struct virtq *vq)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) vq->dev;
+    int index = vq - dev->vq;
+    uint64_t n = 1;
+
+    if (index == VIRTIO_VSOCK_VQ_EVENT)
+        return;
+    if (write(dev->kickfd[index], &n, sizeof(n)) < 0)
+        throw_err("Failed to kick the virtio-vsock queue");
+}
+
+static void virtio_vsock_notify_used(struct virtq *vq)
+{
+    struct virtio_vsock_dev *dev = (struct virtio_vsock_dev *) vq->dev;
+    uint64_t n = 1;
+
+    if (write(dev->irqfd, &n, sizeof(n)) < 0)
+        throw_err("Failed to write the irqfd");
+}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_vsock_enable_vq,
+    .complete_request = virtio_vsock_kick,
+    .notify_used = virtio_vsock_notify_used,
+};
+
+/* Claim @cid for the guest, or the first free CID if it is "auto" */
+static int virtio_vsock_set_cid(struct virtio_vsock_dev *dev, const char *cid)
+{
+    uint64_t guest_cid;
+    char *end;
+
+    if (!strcmp(cid, "auto")) {
+        for (guest_cid = VIRTIO_VSOCK_MIN_CID; guest_cid < UINT32_MAX;
+             guest_cid++) {
+            if (ioctl(dev->vhostfd, VHOST_VSOCK_SET_GUEST_CID, &guest_cid) ==
+                0)
+                break;
+            if (errno != EADDRINUSE)
+                return throw_err("Failed to set the guest CID");
+        }
+    } else {
+        errno = 0;
+        guest_cid = strtoull(cid, &end, 0);
+        if (errno || *end || guest_cid < VIRTIO_VSOCK_MIN_CID ||
+            guest_cid >= UINT32_MAX)
+            return throw_err("Invalid guest CID '%s'", cid);
+        if (ioctl(dev->vhostfd, VHOST_VSOCK_SET_GUEST_CID, &guest_cid) < 0)
+            return throw_err("Failed to set the guest CID %llu",
+                             (unsigned long long) guest_cid);
+    }
+    dev->config.guest_cid = guest_cid;
+    return 0;
+}
+
+int virtio_vsock_init_pci(struct virtio_vsock_dev *dev,
+                          struct vm *vm,
+                          const char *cid,
+                          int irq_num,
+                          struct pci *pci,
+                          struct bus *io_bus,
+                          struct bus *mmio_bus)
+{
+    struct virtio_pci_dev *pci_dev = &dev->virtio_pci_dev;
+
+    memset(dev, 0x00, sizeof(struct virtio_vsock_dev));
+    dev->vm = vm;
+    dev->irq_num = irq_num;
+    dev->kickfd[0] = dev->kickfd[1] = dev->irqfd = -1;
+    dev->enable = true;
+    dev->vhostfd = vhost_open("/dev/vhost-vsock", vm, &dev->vhost_features);
+    if (dev->vhostfd < 0 || virtio_vsock_set_cid(dev, cid) < 0) {
+        virtio_vsock_exit(dev);
+        return -1;
+    }
+    if (!(dev->vhost_features & (1ULL << VIRTIO_F_VERSION_1))) {
+        virtio_vsock_exit(dev);
+        errno = ENOTSUP;
+        return throw_err("vhost-vsock does not support virtio 1.0");
+    }
+
+    dev->kickfd[0] = eventfd(0, EFD_CLOEXEC);
+    dev->kickfd[1] = eventfd(0, EFD_CLOEXEC);
+    dev->irqfd = eventfd(0, EFD_CLOEXEC);
+    vm_irqfd_register(vm, dev->irqfd, irq_num, 0);
+    for (int i = 0; i < VIRTIO_VSOCK_VQ_NUM; i++)
+        virtq_init(&dev->vq[i], dev, &ops);
+
+    virtio_pci_init(pci_dev, pci, io_bus, mmio_bus);
+    virtio_pci_set_dev_cfg(pci_dev, &dev->config, sizeof(dev->config));
+    virtio_pci_set_pci_hdr(pci_dev, VIRTIO_PCI_DEVICE_ID_VSOCK,
+                           VIRTIO_VSOCK_PCI_CLASS, irq_num);
+    virtio_pci_set_virtq(pci_dev, dev->vq, VIRTIO_VSOCK_VQ_NUM);
+    /* vhost only implements split rings */
+    pci_dev->device_feature &= ~(1ULL << VIRTIO_F_RING_PACKED);
+    /* vhost-vsock interrupts the guest behind the back of kvm-host */
+    pci_dev->external_isr = true;
+    virtio_pci_add_feature(pci_dev,
+                           VIRTIO_VSOCK_FEATURES & dev->vhost_features);
+    virtio_pci_enable(pci_dev);
+    return 0;
+}
+
+void virtio_vsock_exit(struct virtio_vsock_dev *dev)
+{
+    int running = 0;
+
+    if (!dev->enable)
+        return;
+    if (dev->nr_started == 2)
+        ioctl(dev->vhostfd, VHOST_VSOCK_SET_RUNNING, &running);
+    if (dev->vhostfd >= 0)
+        close(dev->vhostfd);
+    for (int i = 0; i < 2; i++) {
+        if (dev->kickfd[i] >= 0)
+            close(dev->kickfd[i]);
+    }
+    if (dev->irqfd >= 0) {
+        close(dev->irqfd);
+        virtio_pci_exit(&dev->virtio_pci_dev);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <linux/virtio_vsock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+/* virtio-vsock device whose rx and tx queues are served by the vhost-vsock
+ * kernel driver, so host sockets of the AF_VSOCK family reach the guest
+ * without passing through kvm-host. The event queue is left to the guest.
+ */
+
+#define VIRTIO_VSOCK_PCI_CLASS 0x078000
+#define VIRTIO_VSOCK_VQ_RX 0
+#define VIRTIO_VSOCK_VQ_TX 1
+#define VIRTIO_VSOCK_VQ_EVENT 2
+#define VIRTIO_VSOCK_VQ_NUM 3
+/* CIDs 0-2 are reserved for the hypervisor, local loopback and the host */
+#define VIRTIO_VSOCK_MIN_CID 3
+
+struct vm;
+
+struct virtio_vsock_dev {
+    struct virtio_pci_dev virtio_pci_dev;
+    struct virtio_vsock_config config;
+    struct virtq vq[VIRTIO_VSOCK_VQ_NUM];
+    int vhostfd;
+    uint64_t vhost_features;
+    int kickfd[2]; /* rx, tx */
+    int irqfd;
+    int nr_started;
+    int irq_num;
+    struct vm *vm;
+    bool enable;
+};
+
+int virtio_vsock_init_pci(struct virtio_vsock_dev *dev,
+                          struct vm *vm,
+                          const char *cid,
+                          int irq_num,
+                          struct pci *pci,
+                          struct bus *io_bus,
+                          struct bus *mmio_bus);
+void virtio_vsock_exit(struct virtio_vsock_dev *dev);
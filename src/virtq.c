@@ -19,9 +19,12 @@ void virtq_enable(struct virtq *vq)
     vq->ops->enable_vq(vq);
 }
 
-void virtq_disable(struct virtq *vq) {}
+void virtq_disable(struct virtq *vq)
+{
+    if (vq->ops->disable_vq)
+        vq->ops->disable_vq(vq);
+}
 
-#define VIRTQ_SIZE 128
 void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops)
 {
     vq->info.size = VIRTQ_SIZE;
@@ -38,14 +41,21 @@ bool virtq_check_next(struct vring_packed_desc *desc)
     return desc->flags & VRING_DESC_F_NEXT;
 }
 
-struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+bool virtq_has_avail(struct virtq *vq)
 {
     struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
     uint16_t flags = desc->flags;
     bool avail = flags & (1ULL << VRING_PACKED_DESC_F_AVAIL);
     bool used = flags & (1ULL << VRING_PACKED_DESC_F_USED);
 
-    if (avail != vq->used_wrap_count || used == vq->used_wrap_count) {
+    return avail == vq->used_wrap_count && used != vq->used_wrap_count;
+}
+
+struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+{
+    struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
+
+    if (!virtq_has_avail(vq)) {
         return NULL;
     }
     vq->next_avail_idx++;
@@ -56,11 +66,23 @@ struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
     return desc;
 }
 
+/* Hand a descriptor chain back in place. The flags of the head are written
+ * last, as they are where the guest looks for used buffers.
+ */
+void virtq_put_used(struct vring_packed_desc *head, uint32_t len)
+{
+    head->len = len;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    head->flags ^= (1ULL << VRING_PACKED_DESC_F_USED);
+}
+
 void virtq_handle_avail(struct virtq *vq)
 {
     if (!vq->info.enable)
         return;
     virtq_complete_request(vq);
-    if (vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+    /* Queues of split rings leave guest_event unset and notify by themselves */
+    if (vq->guest_event &&
+        vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
         virtq_notify_used(vq);
 }
\ No newline at end of file
@@ -4,11 +4,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define VIRTQ_SIZE 128
+
 struct virtq;
 
 struct virtq_ops {
     void (*complete_request)(struct virtq *vq);
     void (*enable_vq)(struct virtq *vq);
+    void (*disable_vq)(struct virtq *vq); /* optional, on a device reset */
     void (*notify_used)(struct virtq *vq);
 };
 
@@ -34,8 +37,10 @@ struct virtq {
     struct virtq_ops *ops;
 };
 
+bool virtq_has_avail(struct virtq *vq);
 struct vring_packed_desc *virtq_get_avail(struct virtq *vq);
 bool virtq_check_next(struct vring_packed_desc *desc);
+void virtq_put_used(struct vring_packed_desc *head, uint32_t len);
 void virtq_enable(struct virtq *vq);
 void virtq_disable(struct virtq *vq);
 void virtq_complete_request(struct virtq *vq);
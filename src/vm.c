@@ -1,42 +1,113 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <linux/kvm_para.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "bus.h"
 #include "err.h"
+#include "utils.h"
 #include "vm.h"
 
+static int vm_set_ram_region(vm_t *v, uint32_t flags)
+{
+    struct kvm_userspace_memory_region region = {
+        .slot = 0,
+        .flags = flags,
+        .guest_phys_addr = RAM_BASE,
+        .memory_size = RAM_SIZE,
+        .userspace_addr = (__u64) v->mem,
+    };
+
+    return ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region);
+}
+
+/* vm_kick only needs the signal to interrupt KVM_RUN */
+static void vm_kick_signal(int sig) {}
+
 int vm_init(vm_t *v)
 {
+    struct sigaction sa = {
+        .sa_handler = vm_kick_signal,
+        .sa_flags = SA_RESTART,
+    };
+
+    sigaction(VM_KICK_SIGNAL, &sa, NULL);
     if ((v->kvm_fd = open("/dev/kvm", O_RDWR)) < 0)
         return throw_err("Failed to open /dev/kvm");
 
     if ((v->vm_fd = ioctl(v->kvm_fd, KVM_CREATE_VM, 0)) < 0)
         return throw_err("Failed to create vm");
 
+    v->nr_disks = 0;
+    v->nr_vhost_user_disks = 0;
+    v->nr_nics = 0;
+    v->virtio_vsock_dev.enable = false;
+    v->virtio_console_dev.enable = false;
+    v->virtio_balloon_dev.enable = false;
+    v->nr_irqs = 0;
+    v->run = NULL;
+    v->stop_requested = false;
+    v->log_dev_writes = false;
+
     if (vm_arch_init(v) < 0)
         return -1;
 
-    v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
-                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (!v->mem)
+    /* Memory shared with vhost-user backends needs a file to pass on */
+    v->mem_fd = -1;
+    if (v->restore) {
+        if (v->shared_mem) {
+            errno = ENOTSUP;
+            return throw_err("vhost-user disks cannot be restored");
+        }
+        if (v->restore->ram_size != RAM_SIZE)
+            return throw_err("The snapshot has %llu bytes of RAM, not %d",
+                             (unsigned long long) v->restore->ram_size,
+                             RAM_SIZE);
+        /* Pages are read from the snapshot as the guest touches them */
+        if (v->restore->ram)
+            v->mem = v->restore->ram;
+        else if (v->lazy_mem)
+            v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        else
+            v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          v->restore->fd, v->restore->ram_offset);
+        if (v->mem != MAP_FAILED && v->lazy_mem &&
+            uffd_mem_start(v->lazy_mem, v->mem, RAM_SIZE, v->restore->fd,
+                           v->restore->ram_offset) < 0)
+            return -1;
+    } else if (v->shared_mem) {
+        v->mem_fd = memfd_create("kvm-host-ram", MFD_CLOEXEC);
+        if (v->mem_fd < 0 || ftruncate(v->mem_fd, RAM_SIZE) < 0)
+            return throw_err("Failed to create the vm memory file");
+        v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      v->mem_fd, 0);
+    } else {
+        v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (v->mem == MAP_FAILED)
         return throw_err("Failed to mmap vm memory");
+    /* Pages of the RAM of a clone or a migrated VM are already placed */
+    if (!(v->restore && v->restore->ram) &&
+        numa_bind(&v->numa, v->mem, RAM_SIZE) < 0)
+        return -1;
 
-    struct kvm_userspace_memory_region region = {
-        .slot = 0,
-        .flags = 0,
-        .guest_phys_addr = RAM_BASE,
-        .memory_size = RAM_SIZE,
-        .userspace_addr = (__u64) v->mem,
-    };
-    if (ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+    /* The kernel is loaded while the RAM is populated */
+    if (!v->restore && prealloc_start(&v->prealloc, v->mem, RAM_SIZE) < 0)
+        return -1;
+
+    if (vm_set_ram_region(v, 0) < 0)
         return throw_err("Failed to set user memory region");
 
     if ((v->vcpu_fd = ioctl(v->vm_fd, KVM_CREATE_VCPU, 0)) < 0)
@@ -54,46 +125,232 @@ int vm_init(vm_t *v)
     return 0;
 }
 
-int vm_load_image(vm_t *v, const char *image_path)
+/* Put @size bytes at @offset of a file, which is also mapped at @data, into
+ * guest memory at @guest. Whole pages are mapped privately from the file over
+ * the RAM, so that they are only read as the guest touches them and share the
+ * page cache until it writes them. Partial pages at both ends are copied, and
+ * so is everything if @fd is -1, if the file and the guest address are not
+ * aligned alike, or if the RAM is shared with other processes, preallocated
+ * or bound to NUMA nodes, which a new mapping would undo.
+ */
+int vm_load_file(vm_t *v,
+                 int fd,
+                 const void *data,
+                 off_t offset,
+                 uint64_t guest,
+                 size_t size)
 {
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0)
-        return 1;
+    uint8_t *dest = vm_guest_range_to_host(v, guest, size);
+    size_t head, body;
 
+    if (!dest)
+        return throw_err("The image does not fit into guest memory");
+    head = -guest % VM_PAGE_SIZE;
+    if (fd < 0 || v->mem_fd >= 0 || v->prealloc.nr_threads ||
+        v->numa.nr_nodes || (offset - guest) % VM_PAGE_SIZE || head >= size) {
+        memcpy(dest, (const uint8_t *) data + offset, size);
+        return 0;
+    }
+    body = (size - head) & ~((size_t) VM_PAGE_SIZE - 1);
+    memcpy(dest, (const uint8_t *) data + offset, head);
+    if (body && mmap(dest + head, body, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd,
+                     offset + head) == MAP_FAILED)
+        return throw_err("Failed to map the image into guest memory");
+    memcpy(dest + head + body, (const uint8_t *) data + offset + head + body,
+           size - head - body);
+    return 0;
+}
+
+/* The file is mapped for the arch loader to parse, which places its
+ * payload with vm_load_file. It is only mapped into the guest if the user
+ * asked for it, as pages the guest has not written follow changes to the
+ * file, and touching one past a truncated end raises SIGBUS in the vCPU.
+ */
+static int vm_load(vm_t *v,
+                   const char *path,
+                   int (*load)(vm_t *v, void *data, size_t size, int fd))
+{
     struct stat st;
-    fstat(fd, &st);
-    size_t datasz = st.st_size;
-    void *data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
+    void *data;
+    int fd, ret;
 
-    int ret = vm_arch_load_image(v, data, datasz);
-    munmap(data, datasz);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return throw_err("Failed to open %s", path);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return throw_err("Failed to map %s", path);
+    }
+    ret = load(v, data, st.st_size, v->map_images ? fd : -1);
+    munmap(data, st.st_size);
+    close(fd);
     return ret;
 }
 
+int vm_load_image(vm_t *v, const char *image_path)
+{
+    return vm_load(v, image_path, vm_arch_load_image);
+}
+
 int vm_load_initrd(vm_t *v, const char *initrd_path)
 {
-    int fd = open(initrd_path, O_RDONLY);
-    if (fd < 0)
-        return 1;
+    return vm_load(v, initrd_path, vm_arch_load_initrd);
+}
 
-    struct stat st;
-    fstat(fd, &st);
-    size_t datasz = st.st_size;
-    void *data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
+/* Every call adds one virtio-blk device with its own PCI slot and IRQ */
+int vm_load_diskimg(vm_t *v, const char *diskimg_file)
+{
+    if (v->nr_disks + v->nr_vhost_user_disks == VM_MAX_DISKS)
+        return throw_err("At most %d disks are supported", VM_MAX_DISKS);
 
-    int ret = vm_arch_load_initrd(v, data, datasz);
-    munmap(data, datasz);
-    return ret;
+    if (vhost_user_blk_is_spec(diskimg_file)) {
+        int irq = vm_alloc_irq(v);
+        if (irq < 0)
+            return -1;
+        if (vhost_user_blk_init_pci(
+                &v->vhost_user_blk_dev[v->nr_vhost_user_disks], v,
+                diskimg_file, irq, &v->pci, &v->io_bus, &v->mmio_bus) < 0)
+            return -1;
+        v->nr_vhost_user_disks++;
+        return 0;
+    }
+
+    struct diskimg *diskimg = &v->diskimg[v->nr_disks];
+    struct virtio_blk_dev *dev = &v->virtio_blk_dev[v->nr_disks];
+    int irq = vm_alloc_irq(v);
+    if (irq < 0)
+        return -1;
+    if (diskimg_init(diskimg, diskimg_file) < 0)
+        return -1;
+    virtio_blk_init(dev, v);
+    snprintf(dev->name, sizeof(dev->name), "vd%c",
+             'a' + v->nr_disks + v->nr_vhost_user_disks);
+    virtio_blk_init_pci(dev, diskimg, irq, &v->pci, &v->io_bus, &v->mmio_bus);
+    v->nr_disks++;
+    return 0;
 }
 
-int vm_load_diskimg(vm_t *v, const char *diskimg_file)
+int vm_add_nic(vm_t *v, const char *spec)
 {
-    if (diskimg_init(&v->diskimg, diskimg_file) < 0)
+    if (v->nr_nics == VM_MAX_NICS)
+        return throw_err("At most %d network interfaces are supported",
+                         VM_MAX_NICS);
+
+    int irq = vm_alloc_irq(v);
+    if (irq < 0)
+        return -1;
+    if (virtio_net_init_pci(&v->virtio_net_dev[v->nr_nics], v, spec, irq,
+                            &v->pci, &v->io_bus, &v->mmio_bus) < 0)
+        return -1;
+    v->nr_nics++;
+    return 0;
+}
+
+int vm_add_vsock(vm_t *v, const char *cid)
+{
+    int irq = vm_alloc_irq(v);
+    if (irq < 0)
+        return -1;
+    return virtio_vsock_init_pci(&v->virtio_vsock_dev, v, cid, irq, &v->pci,
+                                 &v->io_bus, &v->mmio_bus);
+}
+
+/* The console is hvc0 on stdio unless ttyS0 is, plus the given ports */
+int vm_add_console(vm_t *v, char **port_specs, int nr_ports)
+{
+    struct virtio_console_dev *dev = &v->virtio_console_dev;
+
+    int irq = vm_alloc_irq(v);
+    if (irq < 0)
+        return -1;
+    virtio_console_init_pci(dev, v, !v->serial_console, irq, &v->pci,
+                            &v->io_bus, &v->mmio_bus);
+    for (int i = 0; i < nr_ports; i++) {
+        if (virtio_console_add_port(dev, port_specs[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int vm_add_balloon(vm_t *v, const char *release)
+{
+    int irq = vm_alloc_irq(v);
+    if (irq < 0)
+        return -1;
+    return virtio_balloon_init_pci(&v->virtio_balloon_dev, v, release, irq,
+                                   &v->pci, &v->io_bus, &v->mmio_bus);
+}
+
+/* Create a VM with the devices of @config, which boots its kernel or
+ * resumes from @restore. The RAM of the snapshot is faulted in by @lazy_mem
+ * if it is set.
+ */
+int vm_create(vm_t *v,
+              struct vm_config *config,
+              struct snapshot *restore,
+              struct uffd_mem *lazy_mem)
+{
+    v->shared_mem = false;
+    for (int i = 0; i < config->nr_diskimg_files; i++)
+        v->shared_mem |= vhost_user_blk_is_spec(config->diskimg_files[i]);
+    v->serial_console = config->serial_console;
+    v->map_images = config->map_images;
+    v->restore = restore;
+    v->lazy_mem = lazy_mem;
+    memset(&v->prealloc, 0, sizeof(v->prealloc));
+    if (config->prealloc && prealloc_parse(&v->prealloc, config->prealloc) < 0)
+        return -1;
+    memset(&v->numa, 0, sizeof(v->numa));
+    if (config->numa &&
+        (numa_parse(&v->numa, config->numa) < 0 || numa_pin(&v->numa) < 0))
+        return -1;
+    if (vm_init(v) < 0)
+        return throw_err("Failed to initialize guest vm");
+
+    /* The kernel of a restored VM is already in its memory */
+    if (!restore) {
+        if (vm_load_image(v, config->kernel_file) < 0)
+            return throw_err("Failed to load guest image");
+        if (config->initrd_file &&
+            vm_load_initrd(v, config->initrd_file) < 0)
+            return throw_err("Failed to load initrd");
+    }
+    for (int i = 0; i < config->nr_diskimg_files; i++) {
+        if (vm_load_diskimg(v, config->diskimg_files[i]) < 0)
+            return throw_err("Failed to load disk image %s",
+                             config->diskimg_files[i]);
+    }
+    for (int i = 0; i < config->nr_nic_specs; i++) {
+        if (vm_add_nic(v, config->nic_specs[i]) < 0)
+            return throw_err("Failed to add network interface %s",
+                             config->nic_specs[i]);
+    }
+
+    if (config->vsock_cid && vm_add_vsock(v, config->vsock_cid) < 0)
+        return throw_err("Failed to add the vsock device");
+
+    if (vm_add_console(v, config->port_specs, config->nr_port_specs) < 0)
+        return throw_err("Failed to add the console");
+
+    if (config->balloon && vm_add_balloon(v, config->balloon) < 0)
+        return throw_err("Failed to add the balloon");
+
+    if (vm_late_init(v) < 0)
+        return -1;
+
+    if (prealloc_wait(&v->prealloc) < 0)
         return -1;
-    virtio_blk_init_pci(&v->virtio_blk_dev, &v->diskimg, &v->pci, &v->io_bus,
-                        &v->mmio_bus);
+
+    if (restore) {
+        if (vm_restore(v) < 0)
+            return throw_err("Failed to restore the VM");
+        v->restore = NULL;
+    }
     return 0;
 }
 
@@ -121,12 +378,28 @@ int vm_run(vm_t *v)
     struct kvm_run *run =
         mmap(0, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, v->vcpu_fd, 0);
 
+    v->vcpu_thread = pthread_self();
+    __atomic_store_n(&v->run, run, __ATOMIC_RELEASE);
     while (1) {
+        /* KVM completes the exit in progress and returns right away. The
+         * flag is cleared again for a VM which continues after a stop, and
+         * vm_kick signals the thread in case it is cleared too late.
+         */
+        run->immediate_exit =
+            __atomic_load_n(&v->stop_requested, __ATOMIC_ACQUIRE);
         int err = ioctl(v->vcpu_fd, KVM_RUN, 0);
         if (err < 0 && (errno != EINTR && errno != EAGAIN)) {
+            v->run = NULL;
             munmap(run, run_size);
             return throw_err("Failed to execute kvm_run");
         }
+        if (err < 0 && errno == EINTR &&
+            __atomic_load_n(&v->stop_requested, __ATOMIC_ACQUIRE)) {
+            v->stop_requested = false;
+            v->run = NULL;
+            munmap(run, run_size);
+            return VM_RUN_STOPPED;
+        }
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             vm_handle_io(v, run);
@@ -138,16 +411,308 @@ int vm_run(vm_t *v)
             break;
         case KVM_EXIT_SHUTDOWN:
             printf("shutdown\n");
+            v->run = NULL;
             munmap(run, run_size);
             return 0;
         default:
             printf("reason: %d\n", run->exit_reason);
+            v->run = NULL;
             munmap(run, run_size);
             return -1;
         }
     }
 }
 
+/* Make vm_run return VM_RUN_STOPPED, with the vCPU state complete for
+ * saving. It is safe to call from a signal handler of the vCPU thread, where
+ * the signal also interrupts KVM_RUN.
+ */
+void vm_stop(vm_t *v)
+{
+    struct kvm_run *run = __atomic_load_n(&v->run, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&v->stop_requested, true, __ATOMIC_RELEASE);
+    if (run)
+        run->immediate_exit = 1;
+}
+
+/* vm_stop for other threads than the vCPU thread, which is interrupted by
+ * VM_KICK_SIGNAL if it is in KVM_RUN.
+ */
+void vm_kick(vm_t *v)
+{
+    vm_stop(v);
+    if (__atomic_load_n(&v->run, __ATOMIC_ACQUIRE))
+        pthread_kill(v->vcpu_thread, VM_KICK_SIGNAL);
+}
+
+/* Devices which keep state outside of kvm-host cannot be saved */
+int vm_check_snapshot_devices(vm_t *v)
+{
+    if (v->nr_vhost_user_disks || v->virtio_vsock_dev.enable) {
+        errno = ENOTSUP;
+        return throw_err("VMs with vhost-user disks or vsock cannot be saved");
+    }
+    return 0;
+}
+
+/* A VM is restored with the devices of the saved one, which is checked by
+ * their PCI device IDs in the order they are created.
+ */
+static int vm_list_devices(vm_t *v, uint16_t *ids)
+{
+    int nr = 0;
+
+    for (int i = 0; i < v->nr_disks; i++)
+        ids[nr++] = VIRTIO_PCI_DEVICE_ID_BLK;
+    for (int i = 0; i < v->nr_nics; i++)
+        ids[nr++] = VIRTIO_PCI_DEVICE_ID_NET;
+    if (v->virtio_console_dev.enable)
+        ids[nr++] = VIRTIO_PCI_DEVICE_ID_CONSOLE;
+    if (v->virtio_balloon_dev.enable)
+        ids[nr++] = VIRTIO_PCI_DEVICE_ID_BALLOON;
+    return nr;
+}
+
+#define VM_MAX_DEVICES (VM_MAX_DISKS + VM_MAX_NICS + 2)
+
+/* Stop the devices of a VM which vm_stop has stopped, and collect their
+ * state and that of the vCPU in @s. The devices continue after
+ * vm_resume_devices.
+ */
+int vm_save_state(vm_t *v, struct snapshot *s)
+{
+    uint16_t ids[VM_MAX_DEVICES];
+    int nr = vm_list_devices(v, ids), id = 0;
+
+    if (vm_check_snapshot_devices(v) < 0)
+        return -1;
+    for (int i = 0; i < v->nr_disks; i++)
+        virtio_blk_stop(&v->virtio_blk_dev[i]);
+    for (int i = 0; i < v->nr_nics; i++)
+        virtio_net_stop(&v->virtio_net_dev[i]);
+    virtio_console_stop(&v->virtio_console_dev);
+    virtio_balloon_stop(&v->virtio_balloon_dev);
+
+    if (snapshot_add(s, SNAPSHOT_DEVICES, 0, ids, nr * sizeof(ids[0])) < 0 ||
+        snapshot_add(s, SNAPSHOT_PCI, 0, &v->pci.pci_addr,
+                     sizeof(v->pci.pci_addr)) < 0 ||
+        vm_arch_save(v, s) < 0 || serial_save(&v->serial, s) < 0)
+        return -1;
+    for (int i = 0; i < v->nr_disks; i++) {
+        if (virtio_pci_save(&v->virtio_blk_dev[i].virtio_pci_dev, s, id++) <
+            0)
+            return -1;
+    }
+    for (int i = 0; i < v->nr_nics; i++) {
+        if (virtio_net_save(&v->virtio_net_dev[i], s, id++) < 0)
+            return -1;
+    }
+    if (v->virtio_console_dev.enable &&
+        virtio_console_save(&v->virtio_console_dev, s, id++) < 0)
+        return -1;
+    if (v->virtio_balloon_dev.enable &&
+        virtio_balloon_save(&v->virtio_balloon_dev, s, id++) < 0)
+        return -1;
+    return 0;
+}
+
+void vm_resume_devices(vm_t *v)
+{
+    for (int i = 0; i < v->nr_disks; i++)
+        virtio_blk_start(&v->virtio_blk_dev[i]);
+    for (int i = 0; i < v->nr_nics; i++)
+        virtio_net_start(&v->virtio_net_dev[i]);
+    if (v->virtio_console_dev.enable)
+        virtio_console_start(&v->virtio_console_dev);
+    if (v->virtio_balloon_dev.enable)
+        virtio_balloon_start(&v->virtio_balloon_dev);
+}
+
+/* The VM must have been stopped by vm_stop, and its devices stay stopped,
+ * so it cannot continue after it is saved.
+ */
+int vm_save(vm_t *v, const char *path)
+{
+    struct snapshot s;
+    int ret;
+
+    snapshot_init(&s);
+    ret = vm_save_state(v, &s);
+    if (!ret)
+        ret = snapshot_write(&s, path, v->mem, RAM_SIZE);
+    snapshot_free(&s);
+    return ret;
+}
+
+/* Load the state of v->restore, whose RAM vm_init has mapped, into the
+ * devices added since.
+ */
+int vm_restore(vm_t *v)
+{
+    struct snapshot *s = v->restore;
+    struct snapshot_section *devices = snapshot_find(s, SNAPSHOT_DEVICES, 0);
+    uint16_t ids[VM_MAX_DEVICES];
+    int nr = vm_list_devices(v, ids), id = 0;
+
+    if (vm_check_snapshot_devices(v) < 0)
+        return -1;
+    if (!devices || devices->len != nr * sizeof(ids[0]) ||
+        memcmp(devices->data, ids, devices->len))
+        return throw_err("The devices differ from those of the snapshot");
+    if (snapshot_read(s, SNAPSHOT_PCI, 0, &v->pci.pci_addr,
+                      sizeof(v->pci.pci_addr)) < 0 ||
+        vm_arch_restore(v, s) < 0 || serial_restore(&v->serial, s) < 0)
+        return -1;
+    for (int i = 0; i < v->nr_disks; i++) {
+        if (virtio_pci_restore(&v->virtio_blk_dev[i].virtio_pci_dev, s,
+                               id++) < 0)
+            return -1;
+    }
+    for (int i = 0; i < v->nr_nics; i++) {
+        if (virtio_net_restore(&v->virtio_net_dev[i], s, id++) < 0)
+            return -1;
+    }
+    if (v->virtio_console_dev.enable &&
+        virtio_console_restore(&v->virtio_console_dev, s, id++) < 0)
+        return -1;
+    if (v->virtio_balloon_dev.enable &&
+        virtio_balloon_restore(&v->virtio_balloon_dev, s, id++) < 0)
+        return -1;
+    return 0;
+}
+
+/* The child of vm_clone, which keeps nothing of its parent but stdout and
+ * stderr, and exits once its VM does.
+ */
+static void vm_run_clone(struct vm_config *config,
+                         struct snapshot *s,
+                         const char *console)
+{
+    vm_t clone;
+    int fd, ret;
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    if (syscall(SYS_close_range, 3, ~0U, 0) < 0) {
+        for (fd = 3; fd < 1024; fd++)
+            close(fd);
+    }
+    /* The terminal stays with the template */
+    fd = open("/dev/null", O_RDONLY);
+    if (fd < 0 || dup2(fd, STDIN_FILENO) < 0)
+        _exit(EXIT_FAILURE);
+    close(fd);
+    if (console) {
+        fd = open(console, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+            throw_err("Failed to open the console %s of the clone", console);
+            _exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    if (vm_create(&clone, config, s, NULL) < 0)
+        _exit(EXIT_FAILURE);
+    while ((ret = vm_run(&clone)) == VM_RUN_STOPPED)
+        ;
+    vm_exit(&clone);
+    fflush(NULL);
+    _exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Fork a clone of a VM which vm_stop has stopped. The clone resumes from
+ * the state of the VM, whose RAM it shares copy-on-write, with the devices
+ * of @config but the disks, interfaces and console output of @opts.
+ * Read-only disks are shared, writable ones are copied to the paths in
+ * @opts. The VM itself may continue once its pid is returned.
+ */
+pid_t vm_clone(vm_t *v, struct vm_config *config, struct vm_clone_opts *opts)
+{
+    struct vm_config clone_config = *config;
+    static char disk_specs[VM_MAX_DISKS][PATH_MAX];
+    static char disk_paths[VM_MAX_DISKS][PATH_MAX];
+    struct snapshot s;
+    pid_t pid = -1;
+
+    /* A second VM on the same backend would corrupt the disk */
+    if (v->nr_vhost_user_disks) {
+        errno = ENOTSUP;
+        return throw_err("VMs with vhost-user disks cannot be cloned");
+    }
+    for (int i = 0; i < v->nr_disks; i++) {
+        if (v->diskimg[i].nbd && !v->diskimg[i].readonly) {
+            errno = ENOTSUP;
+            return throw_err("VMs with writable NBD disks cannot be cloned");
+        }
+    }
+
+    for (int i = 0; i < v->virtio_console_dev.nr_ports; i++) {
+        if (v->virtio_console_dev.ports[i].backend == VIRTIO_CONSOLE_SOCKET) {
+            errno = ENOTSUP;
+            return throw_err("VMs with socket console ports cannot be cloned");
+        }
+    }
+    for (int i = 0; i < v->nr_nics; i++) {
+        if (!opts->nic_specs[i])
+            return throw_err("A clone needs its own tap for interface %d", i);
+        clone_config.nic_specs[i] = opts->nic_specs[i];
+    }
+    /* The child would find zeros where the pages are still missing */
+    if (v->lazy_mem && uffd_mem_populate_all(v->lazy_mem) < 0)
+        return -1;
+
+    snapshot_init(&s);
+    if (vm_save_state(v, &s) < 0)
+        goto out;
+    for (int i = 0; i < v->nr_disks; i++) {
+        const char *spec = config->diskimg_files[i];
+        const char *disk_opts = strchr(spec, ',');
+        const char *path = opts->disk_paths[i];
+
+        if (v->diskimg[i].readonly)
+            continue;
+        if (!path) {
+            snprintf(disk_paths[i], PATH_MAX, "%.*s.clone%d",
+                     (int) strcspn(spec, ","), spec, opts->id);
+            path = disk_paths[i];
+        }
+        if (snprintf(disk_specs[i], PATH_MAX, "%s%s", path,
+                     disk_opts ? disk_opts : "") >= PATH_MAX) {
+            throw_err("The disk path %s is too long", path);
+            goto out;
+        }
+        if (diskimg_clone(&v->diskimg[i], path) < 0)
+            goto out;
+        clone_config.diskimg_files[i] = disk_specs[i];
+    }
+
+    s.ram = v->mem;
+    s.ram_size = RAM_SIZE;
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0)
+        vm_run_clone(&clone_config, &s, opts->console);
+    if (pid < 0)
+        throw_err("Failed to fork a clone");
+out:
+    vm_resume_devices(v);
+    snapshot_free(&s);
+    return pid;
+}
+
+/* PCI devices do not share interrupts, since irqfd injects edges that a
+ * second device on the same line would swallow.
+ */
+int vm_alloc_irq(vm_t *v)
+{
+    static const int irqs[] = PCI_IRQS;
+
+    if ((size_t) v->nr_irqs == ARRAY_SIZE(irqs))
+        return throw_err("No free interrupt for another PCI device");
+    return irqs[v->nr_irqs++];
+}
+
 void *vm_guest_to_host(vm_t *v, uint64_t guest)
 {
     if (guest < RAM_BASE)
@@ -155,6 +720,78 @@ void *vm_guest_to_host(vm_t *v, uint64_t guest)
     return (void *) ((uintptr_t) v->mem + guest - RAM_BASE);
 }
 
+/* KVM only logs the writes of the guest, so the pages of every buffer a
+ * device maps are logged here while the VM migrates.
+ */
+static void vm_log_dev_write(vm_t *v, uint64_t guest, uint64_t len)
+{
+    if (!__atomic_load_n(&v->log_dev_writes, __ATOMIC_ACQUIRE) || !len)
+        return;
+    for (uint64_t page = (guest - RAM_BASE) / VM_PAGE_SIZE;
+         page <= (guest - RAM_BASE + len - 1) / VM_PAGE_SIZE; page++)
+        __atomic_fetch_or(&v->dev_dirty[page / 64], 1ULL << (page % 64),
+                          __ATOMIC_RELAXED);
+}
+
+/* Returns NULL unless [guest, guest + len) lies in guest memory */
+void *vm_guest_range_to_host(vm_t *v, uint64_t guest, uint64_t len)
+{
+    if (guest < RAM_BASE || guest + len < guest ||
+        guest + len > RAM_BASE + RAM_SIZE)
+        return NULL;
+    vm_log_dev_write(v, guest, len);
+    return vm_guest_to_host(v, guest);
+}
+
+/* Make KVM log the pages the guest writes, for vm_get_dirty_log */
+int vm_set_dirty_log(vm_t *v, bool enable)
+{
+    if (vm_set_ram_region(v, enable ? KVM_MEM_LOG_DIRTY_PAGES : 0) < 0)
+        return throw_err("Failed to %s dirty page logging",
+                         enable ? "enable" : "disable");
+    return 0;
+}
+
+/* Fill @bitmap with a bit per page the guest has written since the last
+ * call, and start logging anew.
+ */
+int vm_get_dirty_log(vm_t *v, uint64_t *bitmap)
+{
+    struct kvm_dirty_log log = {.slot = 0, .dirty_bitmap = bitmap};
+
+    if (ioctl(v->vm_fd, KVM_GET_DIRTY_LOG, &log) < 0)
+        return throw_err("Failed to get the dirty page log");
+    return 0;
+}
+
+static void vm_log_virtq_writes(vm_t *v, struct virtio_pci_dev *dev)
+{
+    for (int i = 0; i < dev->config.common_cfg.num_queues; i++) {
+        struct virtq_info *info = &dev->vq[i].info;
+        if (!info->enable)
+            continue;
+        vm_guest_range_to_host(v, info->desc_addr,
+                               info->size * sizeof(struct vring_packed_desc));
+        vm_guest_range_to_host(v, info->device_addr,
+                               sizeof(struct vring_packed_desc_event));
+    }
+}
+
+/* The rings are mapped once when their queue is enabled, so the pages
+ * devices write them to are logged separately, once the devices are stopped.
+ */
+void vm_log_ring_writes(vm_t *v)
+{
+    for (int i = 0; i < v->nr_disks; i++)
+        vm_log_virtq_writes(v, &v->virtio_blk_dev[i].virtio_pci_dev);
+    for (int i = 0; i < v->nr_nics; i++)
+        vm_log_virtq_writes(v, &v->virtio_net_dev[i].virtio_pci_dev);
+    if (v->virtio_console_dev.enable)
+        vm_log_virtq_writes(v, &v->virtio_console_dev.virtio_pci_dev);
+    if (v->virtio_balloon_dev.enable)
+        vm_log_virtq_writes(v, &v->virtio_balloon_dev.virtio_pci_dev);
+}
+
 void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags)
 {
     struct kvm_irqfd irqfd = {
@@ -167,13 +804,32 @@ void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags)
         throw_err("Failed to set the status of IRQFD");
 }
 
+/* The line of @gsi stays up after a write to @fd until the guest
+ * acknowledges the interrupt, which is then signalled on @resamplefd.
+ */
+int vm_irqfd_register_resample(vm_t *v, int fd, int resamplefd, int gsi)
+{
+    struct kvm_irqfd irqfd = {
+        .fd = fd,
+        .gsi = gsi,
+        .flags = KVM_IRQFD_FLAG_RESAMPLE,
+        .resamplefd = resamplefd,
+    };
+
+    if (ioctl(v->vm_fd, KVM_IRQFD, &irqfd) < 0)
+        return throw_err("Failed to register a resampling IRQFD");
+    return 0;
+}
+
 void vm_ioeventfd_register(vm_t *v,
                            int fd,
                            unsigned long long addr,
                            int len,
-                           int flags)
+                           int flags,
+                           unsigned long long datamatch)
 {
     struct kvm_ioeventfd ioeventfd = {
+        .datamatch = datamatch,
         .fd = fd,
         .addr = addr,
         .len = len,
@@ -184,12 +840,61 @@ void vm_ioeventfd_register(vm_t *v,
         throw_err("Failed to set the status of IOEVENTFD");
 }
 
+/* Dump the statistics of the devices, e.g. on request of the user */
+void vm_dump_stats(vm_t *v, FILE *f, enum blk_stats_format format)
+{
+    if (format == BLK_STATS_JSON)
+        fprintf(f, "{\"disks\": [");
+    for (int i = 0; i < v->nr_disks; i++) {
+        struct virtio_blk_dev *dev = &v->virtio_blk_dev[i];
+        if (format == BLK_STATS_JSON && i)
+            fprintf(f, ", ");
+        virtio_blk_dump_stats(dev, dev->name, f, format);
+    }
+    if (format == BLK_STATS_JSON)
+        fprintf(f, "]");
+    if (v->nr_nics && format == BLK_STATS_JSON)
+        fprintf(f, ", \"nics\": [");
+    for (int i = 0; i < v->nr_nics; i++) {
+        if (format == BLK_STATS_JSON && i)
+            fprintf(f, ", ");
+        virtio_net_dump_stats(&v->virtio_net_dev[i], f, format);
+    }
+    if (v->nr_nics && format == BLK_STATS_JSON)
+        fprintf(f, "]");
+    if (v->lazy_mem) {
+        if (format == BLK_STATS_JSON)
+            fprintf(f, ", \"memory\": ");
+        uffd_mem_dump_stats(v->lazy_mem, f, format);
+    }
+    if (v->prealloc.nr_workers) {
+        if (format == BLK_STATS_JSON)
+            fprintf(f, ", \"prealloc\": ");
+        prealloc_dump_stats(&v->prealloc, f, format);
+    }
+    if (format == BLK_STATS_JSON)
+        fprintf(f, "}\n");
+    fflush(f);
+}
+
 void vm_exit(vm_t *v)
 {
     serial_exit(&v->serial);
-    virtio_blk_exit(&v->virtio_blk_dev);
+    for (int i = 0; i < v->nr_disks; i++)
+        virtio_blk_exit(&v->virtio_blk_dev[i]);
+    for (int i = 0; i < v->nr_vhost_user_disks; i++)
+        vhost_user_blk_exit(&v->vhost_user_blk_dev[i]);
+    for (int i = 0; i < v->nr_nics; i++)
+        virtio_net_exit(&v->virtio_net_dev[i]);
+    virtio_vsock_exit(&v->virtio_vsock_dev);
+    virtio_console_exit(&v->virtio_console_dev);
+    virtio_balloon_exit(&v->virtio_balloon_dev);
     close(v->kvm_fd);
     close(v->vm_fd);
     close(v->vcpu_fd);
+    if (v->lazy_mem)
+        uffd_mem_exit(v->lazy_mem);
     munmap(v->mem, RAM_SIZE);
+    if (v->mem_fd >= 0)
+        close(v->mem_fd);
 }
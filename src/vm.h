@@ -1,43 +1,140 @@
 #pragma once
 
 #define RAM_SIZE (1 << 30)
+#define VM_MAX_DISKS 8
+#define VM_MAX_NICS 4
+#define VM_RUN_STOPPED 1 /* returned by vm_run after vm_stop */
+#define VM_KICK_SIGNAL SIGRTMIN /* interrupts KVM_RUN for vm_kick */
+#define VM_PAGE_SIZE 4096
 
+#include <signal.h>
+#include <sys/types.h>
+
+#include "numa.h"
 #include "pci.h"
+#include "prealloc.h"
 #include "serial.h"
+#include "snapshot.h"
+#include "uffd.h"
+#include "vhost-user-blk.h"
+#include "virtio-balloon.h"
 #include "virtio-blk.h"
+#include "virtio-console.h"
+#include "virtio-net.h"
+#include "virtio-vsock.h"
 
-typedef struct {
+typedef struct vm {
     int kvm_fd, vm_fd, vcpu_fd;
     void *mem;
+    int mem_fd;      /* backs mem if it is shared with other processes */
+    bool shared_mem; /* set before vm_init, needed by vhost-user devices */
+    bool serial_console; /* set before vm_init, ttyS0 instead of hvc0 */
+    bool map_images; /* set before vm_init, map the kernel and initrd */
+    struct snapshot *restore; /* set before vm_init to map its RAM */
+    struct uffd_mem *lazy_mem; /* set with restore to fault its RAM in */
+    struct prealloc prealloc;  /* set before vm_init to populate the RAM */
+    struct numa numa;          /* set before vm_init to bind the RAM */
+    struct kvm_run *run;      /* while in vm_run */
+    pthread_t vcpu_thread;    /* which runs vm_run */
+    bool stop_requested;
+    bool log_dev_writes; /* while migrating */
+    uint64_t dev_dirty[RAM_SIZE / VM_PAGE_SIZE / 64]; /* pages devices mapped */
     serial_dev_t serial;
     struct bus mmio_bus;
     struct bus io_bus;
     struct pci pci;
-    struct diskimg diskimg;
-    struct virtio_blk_dev virtio_blk_dev;
+    struct diskimg diskimg[VM_MAX_DISKS];
+    struct virtio_blk_dev virtio_blk_dev[VM_MAX_DISKS];
+    int nr_disks;
+    struct vhost_user_blk_dev vhost_user_blk_dev[VM_MAX_DISKS];
+    int nr_vhost_user_disks;
+    struct virtio_net_dev virtio_net_dev[VM_MAX_NICS];
+    int nr_nics;
+    struct virtio_vsock_dev virtio_vsock_dev;
+    struct virtio_console_dev virtio_console_dev;
+    struct virtio_balloon_dev virtio_balloon_dev;
+    int nr_irqs; /* number of interrupts handed out of PCI_IRQS */
     void *priv;
 } vm_t;
 
+/* The boot files and devices of a VM, as given on the command line */
+struct vm_config {
+    const char *kernel_file;
+    const char *initrd_file;
+    char *diskimg_files[VM_MAX_DISKS];
+    int nr_diskimg_files;
+    char *nic_specs[VM_MAX_NICS];
+    int nr_nic_specs;
+    char *vsock_cid;
+    char *port_specs[VIRTIO_CONSOLE_MAX_PORTS - 1];
+    int nr_port_specs;
+    bool serial_console;
+    bool map_images;      /* map the kernel and initrd instead of copying */
+    const char *prealloc; /* threads populating the RAM at boot, or NULL */
+    const char *numa;     /* host nodes of the guest nodes, or NULL */
+    const char *balloon;  /* how ballooned RAM is released, or NULL */
+};
+
+/* What a clone gets instead of the devices of its template */
+struct vm_clone_opts {
+    const char *disk_paths[VM_MAX_DISKS]; /* copies of the writable disks */
+    int id; /* the copies are image.cloneN by default, N being the id */
+    char *nic_specs[VM_MAX_NICS];
+    const char *console; /* file for the stdout of the clone, or NULL */
+};
+
 int vm_arch_init(vm_t *v);
 int vm_arch_cpu_init(vm_t *v);
 int vm_arch_init_platform_device(vm_t *v);
-int vm_arch_load_image(vm_t *v, void *image, size_t size);
-int vm_arch_load_initrd(vm_t *v, void *initrd, size_t size);
+int vm_arch_load_image(vm_t *v, void *image, size_t size, int fd);
+int vm_arch_load_initrd(vm_t *v, void *initrd, size_t size, int fd);
+int vm_arch_save(vm_t *v, struct snapshot *s);
+int vm_arch_restore(vm_t *v, struct snapshot *s);
 
 int vm_init(vm_t *v);
 int vm_load_image(vm_t *v, const char *image_path);
 int vm_load_initrd(vm_t *v, const char *initrd_path);
+int vm_load_file(vm_t *v,
+                 int fd,
+                 const void *data,
+                 off_t offset,
+                 uint64_t guest,
+                 size_t size);
 int vm_load_diskimg(vm_t *v, const char *diskimg_file);
+int vm_add_nic(vm_t *v, const char *spec);
+int vm_add_vsock(vm_t *v, const char *cid);
+int vm_add_console(vm_t *v, char **port_specs, int nr_ports);
+int vm_add_balloon(vm_t *v, const char *release);
 int vm_late_init(vm_t *v);
+int vm_create(vm_t *v,
+              struct vm_config *config,
+              struct snapshot *restore,
+              struct uffd_mem *lazy_mem);
 int vm_run(vm_t *v);
+void vm_stop(vm_t *v);
+void vm_kick(vm_t *v);
+int vm_check_snapshot_devices(vm_t *v);
+int vm_save_state(vm_t *v, struct snapshot *s);
+void vm_resume_devices(vm_t *v);
+int vm_save(vm_t *v, const char *path);
+int vm_restore(vm_t *v);
+pid_t vm_clone(vm_t *v, struct vm_config *config, struct vm_clone_opts *opts);
 int vm_irq_line(vm_t *v, int irq, int level);
+int vm_alloc_irq(vm_t *v);
 void *vm_guest_to_host(vm_t *v, uint64_t guest);
+void *vm_guest_range_to_host(vm_t *v, uint64_t guest, uint64_t len);
+int vm_set_dirty_log(vm_t *v, bool enable);
+int vm_get_dirty_log(vm_t *v, uint64_t *bitmap);
+void vm_log_ring_writes(vm_t *v);
 void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags);
+int vm_irqfd_register_resample(vm_t *v, int fd, int resamplefd, int gsi);
 void vm_ioeventfd_register(vm_t *v,
                            int fd,
                            unsigned long long addr,
                            int len,
-                           int flags);
+                           int flags,
+                           unsigned long long datamatch);
 void vm_handle_io(vm_t *v, struct kvm_run *run);
 void vm_handle_mmio(vm_t *v, struct kvm_run *run);
+void vm_dump_stats(vm_t *v, FILE *f, enum blk_stats_format format);
 void vm_exit(vm_t *v);
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <libgen.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "vhost-user.h"
+
+/* Drives kvm-host-blkd the way a VMM does, with a memfd standing in for the
+ * guest RAM, and checks which ring setups it serves and which it refuses,
+ * and that a ring serves requests again after it was stopped.
+ */
+
+#define MEM_SIZE (64 * 1024)
+#define RING_NUM 8
+#define DESC_ADDR 0x0000
+#define DRIVER_EVENT_ADDR 0x1000
+#define DEVICE_EVENT_ADDR 0x1010
+#define HDR_ADDR 0x2000
+#define DATA_ADDR 0x3000
+#define STATUS_ADDR 0x4000
+#define IMAGE_SIZE (64 * 1024)
+
+static uint8_t *mem;
+static int memfd, sock, kickfd, callfd;
+
+/* Send a request which is acknowledged, and return the backend's verdict */
+static uint64_t request(struct vhost_user_msg *msg)
+{
+    uint32_t req = msg->hdr.request;
+
+    msg->hdr.flags = VHOST_USER_FLAG_NEED_REPLY;
+    CHECK(vhost_user_send(sock, msg) == 0);
+    CHECK(vhost_user_recv(sock, msg) == 0);
+    CHECK(msg->hdr.request == req);
+    return msg->payload.u64;
+}
+
+static uint64_t set_u64(uint32_t req, uint64_t value)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = req, .size = sizeof(uint64_t)},
+        .payload.u64 = value,
+    };
+    return request(&msg);
+}
+
+static uint64_t set_state(uint32_t req, unsigned int num)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = req, .size = sizeof(struct vhost_vring_state)},
+        .payload.state = {.index = 0, .num = num},
+    };
+    return request(&msg);
+}
+
+static uint64_t set_vring_fd(uint32_t req, int fd)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = req, .size = sizeof(uint64_t)},
+        .payload.u64 = fd < 0 ? VHOST_USER_VRING_NOFD_MASK : 0,
+        .fds = {fd},
+        .nr_fds = fd >= 0,
+    };
+    return request(&msg);
+}
+
+static uint64_t set_mem_table(void)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = VHOST_USER_SET_MEM_TABLE,
+                .size = offsetof(struct vhost_user_memory, regions) +
+                        sizeof(struct vhost_user_region)},
+        .payload.memory = {
+            .nregions = 1,
+            .regions[0] = {.memory_size = MEM_SIZE,
+                           .userspace_addr = (uintptr_t) mem},
+        },
+        .fds = {memfd},
+        .nr_fds = 1,
+    };
+    return request(&msg);
+}
+
+static uint64_t set_vring_addr(uint64_t desc)
+{
+    struct vhost_user_msg msg = {
+        .hdr = {.request = VHOST_USER_SET_VRING_ADDR,
+                .size = sizeof(struct vhost_vring_addr)},
+        .payload.addr = {
+            .desc_user_addr = (uintptr_t) mem + desc,
+            .avail_user_addr = (uintptr_t) mem + DRIVER_EVENT_ADDR,
+            .used_user_addr = (uintptr_t) mem + DEVICE_EVENT_ADDR,
+        },
+    };
+    return request(&msg);
+}
+
+/* A fresh ring at index 0 with the wrap counter set, as after a reset */
+static void start_ring(void)
+{
+    memset(mem, 0, MEM_SIZE);
+    CHECK(set_state(VHOST_USER_SET_VRING_NUM, RING_NUM) == 0);
+    CHECK(set_state(VHOST_USER_SET_VRING_BASE, 1 << 15) == 0);
+    CHECK(set_vring_addr(DESC_ADDR) == 0);
+    CHECK(set_vring_fd(VHOST_USER_SET_VRING_KICK, kickfd) == 0);
+    CHECK(set_vring_fd(VHOST_USER_SET_VRING_CALL, callfd) == 0);
+    CHECK(set_state(VHOST_USER_SET_VRING_ENABLE, 1) == 0);
+}
+
+/* Read the first sector through the three descriptors at the start of the
+ * ring, and wait for the backend to hand them back.
+ */
+static void read_sector(void)
+{
+    struct vring_packed_desc *desc = (struct vring_packed_desc *) mem;
+    struct virtio_blk_outhdr *hdr = (void *) (mem + HDR_ADDR);
+    uint16_t avail = 1 << VRING_PACKED_DESC_F_AVAIL;
+    struct pollfd pfd = {.fd = callfd, .events = POLLIN};
+    uint64_t n = 1;
+
+    *hdr = (struct virtio_blk_outhdr){.type = VIRTIO_BLK_T_IN};
+    mem[STATUS_ADDR] = 0xff;
+    desc[0] = (struct vring_packed_desc){HDR_ADDR, sizeof(*hdr), 0,
+                                         VRING_DESC_F_NEXT | avail};
+    desc[1] = (struct vring_packed_desc){
+        DATA_ADDR, 512, 0, VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | avail};
+    desc[2] = (struct vring_packed_desc){STATUS_ADDR, 1, 0,
+                                         VRING_DESC_F_WRITE | avail};
+    CHECK(write(kickfd, &n, sizeof(n)) == sizeof(n));
+    CHECK(poll(&pfd, 1, 5000) == 1);
+    CHECK(read(callfd, &n, sizeof(n)) == sizeof(n));
+    CHECK(desc[0].flags & (1 << VRING_PACKED_DESC_F_USED));
+    CHECK(mem[STATUS_ADDR] == VIRTIO_BLK_S_OK);
+    for (int i = 0; i < 512; i++)
+        CHECK(mem[DATA_ADDR + i] == 'x');
+}
+
+static pid_t spawn_blkd(const char *self, const char *path, const char *image)
+{
+    char blkd[4096];
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    pid_t pid;
+
+    /* build/tests/test-blkd runs build/kvm-host-blkd */
+    snprintf(blkd, sizeof(blkd), "%s/../kvm-host-blkd", dirname(strdupa(self)));
+    pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        /* Stop along with a failed check */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execl(blkd, blkd, path, image, NULL);
+        _exit(127);
+    }
+
+    strcpy(addr.sun_path, path);
+    for (int i = 0; i < 100; i++) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        CHECK(sock >= 0);
+        if (!connect(sock, (struct sockaddr *) &addr, sizeof(addr)))
+            return pid;
+        close(sock);
+        usleep(50000);
+    }
+    CHECK(!"kvm-host-blkd did not listen");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    char image[] = "/tmp/test-blkd-XXXXXX", path[64];
+    struct vhost_user_msg msg;
+    static char data[IMAGE_SIZE];
+
+    int fd = mkstemp(image);
+    CHECK(fd >= 0);
+    memset(data, 'x', sizeof(data));
+    CHECK(write(fd, data, sizeof(data)) == sizeof(data));
+    close(fd);
+    snprintf(path, sizeof(path), "/tmp/test-blkd-%d.sock", getpid());
+    pid_t pid = spawn_blkd(argv[0], path, image);
+
+    memfd = memfd_create("test-blkd", MFD_CLOEXEC);
+    CHECK(memfd >= 0 && ftruncate(memfd, MEM_SIZE) == 0);
+    mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    CHECK(mem != MAP_FAILED);
+    kickfd = eventfd(0, EFD_CLOEXEC);
+    callfd = eventfd(0, EFD_CLOEXEC);
+    CHECK(kickfd >= 0 && callfd >= 0);
+
+    msg = (struct vhost_user_msg){.hdr.request = VHOST_USER_SET_OWNER};
+    CHECK(vhost_user_send(sock, &msg) == 0);
+    msg = (struct vhost_user_msg){.hdr.request = VHOST_USER_GET_FEATURES};
+    CHECK(vhost_user_send(sock, &msg) == 0);
+    CHECK(vhost_user_recv(sock, &msg) == 0);
+    CHECK(msg.payload.u64 & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+    msg = (struct vhost_user_msg){
+        .hdr = {.request = VHOST_USER_SET_PROTOCOL_FEATURES,
+                .size = sizeof(uint64_t)},
+        .payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK,
+    };
+    CHECK(vhost_user_send(sock, &msg) == 0);
+    CHECK(set_u64(VHOST_USER_SET_FEATURES,
+                  (1ULL << VIRTIO_F_VERSION_1) |
+                      (1ULL << VIRTIO_F_RING_PACKED) |
+                      (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) == 0);
+    CHECK(set_mem_table() == 0);
+
+    /* Rings which do not fit in the memory table */
+    CHECK(set_state(VHOST_USER_SET_VRING_NUM, RING_NUM) == 0);
+    CHECK(set_vring_addr(MEM_SIZE - 64) != 0);
+    CHECK(set_vring_addr(DESC_ADDR) == 0);
+    CHECK(set_state(VHOST_USER_SET_VRING_NUM, 2 * MEM_SIZE / 16) == 0);
+    CHECK(set_vring_fd(VHOST_USER_SET_VRING_KICK, kickfd) == 0);
+    CHECK(set_state(VHOST_USER_SET_VRING_ENABLE, 1) != 0);
+
+    /* Without a kick fd, a ring is only served with -p */
+    CHECK(set_vring_fd(VHOST_USER_SET_VRING_KICK, -1) != 0);
+
+    start_ring();
+    read_sector();
+
+    /* Nothing under a running ring changes */
+    CHECK(set_mem_table() != 0);
+    CHECK(set_vring_addr(DESC_ADDR) != 0);
+    CHECK(set_state(VHOST_USER_SET_VRING_NUM, RING_NUM) != 0);
+
+    /* A device reset in kvm-host stops the ring, and the guest sets it up
+     * again from scratch, with its features sent once more and the same
+     * kick eventfd.
+     */
+    msg = (struct vhost_user_msg){
+        .hdr = {.request = VHOST_USER_GET_VRING_BASE,
+                .size = sizeof(struct vhost_vring_state)},
+    };
+    CHECK(vhost_user_send(sock, &msg) == 0);
+    CHECK(vhost_user_recv(sock, &msg) == 0);
+    CHECK(msg.payload.state.num == (3 | 1 << 15));
+    CHECK(set_u64(VHOST_USER_SET_FEATURES,
+                  (1ULL << VIRTIO_F_VERSION_1) |
+                      (1ULL << VIRTIO_F_RING_PACKED) |
+                      (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) == 0);
+    start_ring();
+    read_sector();
+
+    close(sock);
+    kill(pid, SIGTERM);
+    CHECK(waitpid(pid, NULL, 0) == pid);
+    unlink(image);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cimg.h"
+#include "test.h"
+
+#define CHUNK_SHIFT CIMG_MIN_CHUNK_SHIFT
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define IMAGE_SIZE (2 * CHUNK_SIZE + 1000) /* the last chunk is partial */
+#define NR_CHUNKS 3
+
+static uint8_t image[IMAGE_SIZE];
+
+/* Lay the image out the way kvm-host-cimg does */
+static int write_image(void)
+{
+    char path[] = "/tmp/test-cimg-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    unlink(path);
+
+    struct cimg_header hdr = {
+        .version = htole32(CIMG_VERSION),
+        .chunk_shift = htole32(CHUNK_SHIFT),
+        .size = htole64(IMAGE_SIZE),
+        .nr_chunks = htole64(NR_CHUNKS),
+    };
+    memcpy(hdr.magic, CIMG_MAGIC, sizeof(hdr.magic));
+    uint64_t index[NR_CHUNKS + 1];
+    uint64_t pos = sizeof(hdr) + sizeof(index);
+    uint8_t dst[CHUNK_SIZE + 1024];
+
+    for (int i = 0; i < NR_CHUNKS; i++) {
+        size_t len = i < NR_CHUNKS - 1 ? CHUNK_SIZE : IMAGE_SIZE % CHUNK_SIZE;
+        size_t stored = sizeof(dst);
+        CHECK(cimg_compress_chunk(dst, &stored, image + i * CHUNK_SIZE, len,
+                                  Z_DEFAULT_COMPRESSION) == 0);
+        CHECK(pwrite(fd, dst, stored, pos) == (ssize_t) stored);
+        index[i] = htole64(pos);
+        pos += stored;
+    }
+    index[NR_CHUNKS] = htole64(pos);
+    CHECK(pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+    CHECK(pwrite(fd, index, sizeof(index), sizeof(hdr)) == sizeof(index));
+    return fd;
+}
+
+/* Every byte of buf is zero */
+static int is_zero(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i])
+            return 0;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    struct cimg cimg;
+    uint8_t buf[2 * CHUNK_SIZE];
+
+    /* A compressible chunk, a zero one and a partial random-ish one */
+    for (int i = 0; i < CHUNK_SIZE; i++)
+        image[i] = i % 7;
+    for (int i = 2 * CHUNK_SIZE; i < IMAGE_SIZE; i++)
+        image[i] = (i * 2654435761U) >> 24;
+
+    int fd = write_image();
+    CHECK(cimg_open(&cimg, fd) == 0);
+    CHECK(cimg.size == IMAGE_SIZE);
+    CHECK(cimg.nr_chunks == NR_CHUNKS);
+
+    /* Across chunks */
+    CHECK(cimg_read(&cimg, buf, 100, CHUNK_SIZE) == CHUNK_SIZE);
+    CHECK(!memcmp(buf, image + 100, CHUNK_SIZE));
+
+    /* Straddling the end, where the tail reads as zeros */
+    memset(buf, 0xff, sizeof(buf));
+    CHECK(cimg_read(&cimg, buf, IMAGE_SIZE - 500, 2000) == 2000);
+    CHECK(!memcmp(buf, image + IMAGE_SIZE - 500, 500));
+    CHECK(is_zero(buf + 500, 1500));
+
+    /* At and past the end of the image */
+    memset(buf, 0xff, sizeof(buf));
+    CHECK(cimg_read(&cimg, buf, IMAGE_SIZE, 512) == 512);
+    CHECK(is_zero(buf, 512));
+    memset(buf, 0xff, sizeof(buf));
+    CHECK(cimg_read(&cimg, buf, 1 << 30, sizeof(buf)) == sizeof(buf));
+    CHECK(is_zero(buf, sizeof(buf)));
+
+    CHECK(cimg_read(&cimg, buf, 0, 0) == 0);
+
+    cimg_close(&cimg);
+
+    /* A size whose rounding up to chunks wraps around, with no chunks */
+    struct cimg_header hdr;
+    CHECK(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+    hdr.size = htole64(UINT64_MAX - 100);
+    hdr.nr_chunks = 0;
+    CHECK(pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr));
+    CHECK(cimg_open(&cimg, fd) < 0);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskimg.h"
+#include "test.h"
+
+#define KB 1024
+#define IMAGE_SIZE (1024 * KB)
+
+static struct diskimg diskimg;
+
+/* The data extents of the image are exactly the given [start, end) pairs */
+static void check_map(size_t nr, const off_t *ranges)
+{
+    struct diskimg_extent_map *map = &diskimg.map;
+
+    CHECK(map->nr_extents == nr);
+    for (size_t i = 0; i < nr; i++) {
+        CHECK(map->extents[i].start == ranges[2 * i]);
+        CHECK(map->extents[i].end == ranges[2 * i + 1]);
+    }
+}
+
+static void write_range(off_t start, off_t end, int c)
+{
+    static char buf[IMAGE_SIZE];
+
+    memset(buf, c, end - start);
+    CHECK(diskimg_write(&diskimg, buf, start, end - start) == end - start);
+}
+
+/* Every byte of [start, end) reads as c */
+static void check_data(off_t start, off_t end, int c)
+{
+    static char buf[IMAGE_SIZE];
+
+    memset(buf, ~c, end - start);
+    CHECK(diskimg_read(&diskimg, buf, start, end - start) == end - start);
+    for (off_t i = 0; i < end - start; i++)
+        CHECK(buf[i] == (char) c);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/test-diskimg-XXXXXX";
+    int fd = mkstemp(path);
+
+    CHECK(fd >= 0);
+    CHECK(ftruncate(fd, IMAGE_SIZE) == 0);
+    close(fd);
+    CHECK(diskimg_init(&diskimg, path) == 0);
+    CHECK(diskimg.size == IMAGE_SIZE);
+    check_map(0, NULL);
+
+    /* Separate writes make separate extents, kept in order */
+    write_range(256 * KB, 320 * KB, 'b');
+    write_range(64 * KB, 128 * KB, 'a');
+    check_map(2, (off_t[]){64 * KB, 128 * KB, 256 * KB, 320 * KB});
+
+    /* Adjacent and overlapping writes are merged */
+    write_range(128 * KB, 192 * KB, 'a');
+    check_map(2, (off_t[]){64 * KB, 192 * KB, 256 * KB, 320 * KB});
+    write_range(160 * KB, 288 * KB, 'c');
+    check_map(1, (off_t[]){64 * KB, 320 * KB});
+
+    /* A write within data leaves the map alone */
+    write_range(96 * KB, 100 * KB, 'd');
+    check_map(1, (off_t[]){64 * KB, 320 * KB});
+
+    /* A discard in the middle splits the extent */
+    CHECK(diskimg_discard(&diskimg, 128 * KB, 64 * KB) == 0);
+    check_map(2, (off_t[]){64 * KB, 128 * KB, 192 * KB, 320 * KB});
+    check_data(0, 64 * KB, 0);
+    check_data(64 * KB, 96 * KB, 'a');
+    check_data(96 * KB, 100 * KB, 'd');
+    check_data(128 * KB, 192 * KB, 0);
+    check_data(192 * KB, 288 * KB, 'c');
+    check_data(288 * KB, 320 * KB, 'b');
+
+    /* Discards trim the ends, and remove what they cover */
+    CHECK(diskimg_discard(&diskimg, 0, 96 * KB) == 0);
+    CHECK(diskimg_discard(&diskimg, 288 * KB, 64 * KB) == 0);
+    check_map(2, (off_t[]){96 * KB, 128 * KB, 192 * KB, 288 * KB});
+    CHECK(diskimg_discard(&diskimg, 0, IMAGE_SIZE) == 0);
+    check_map(0, NULL);
+    check_data(0, IMAGE_SIZE, 0);
+
+    diskimg_exit(&diskimg);
+    unlink(path);
+    return 0;
+}
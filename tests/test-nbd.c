@@ -0,0 +1,246 @@
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "nbd.h"
+#include "test.h"
+
+/* A one-shot NBD server which answers the first request of the client with
+ * a reply picked by the test, valid or not.
+ */
+
+#define NBD_MAGIC 0x4e42444d41474943ULL
+#define NBD_IHAVEOPT 0x49484156454f5054ULL
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REPLY_FLAG_DONE 1
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+
+#define EXPORT_SIZE (1 << 20)
+#define REQ_OFFSET 4096
+#define REQ_LEN 512
+
+enum reply {
+    REPLY_DATA,       /* the data of the request */
+    REPLY_HOLE,       /* the request is a hole */
+    REPLY_PAST_END,   /* data after the requested range */
+    REPLY_WRAPPING,   /* a hole whose end wraps around */
+    REPLY_BAD_HANDLE, /* a reply to a request which was never sent */
+};
+
+struct server {
+    int listenfd;
+    enum reply reply;
+};
+
+/* An empty recv() would wait for data on a Unix socket */
+static void recv_all(int fd, void *buf, size_t len)
+{
+    if (len)
+        CHECK(recv(fd, buf, len, MSG_WAITALL) == (ssize_t) len);
+}
+
+static void send_all(int fd, const void *buf, size_t len)
+{
+    CHECK(send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t) len);
+}
+
+static void send_opt_reply(int fd, uint32_t opt, uint32_t type, uint32_t len)
+{
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t type;
+        uint32_t len;
+    } __attribute__((packed)) reply = {htobe64(NBD_REP_MAGIC), htobe32(opt),
+                                       htobe32(type), htobe32(len)};
+    send_all(fd, &reply, sizeof(reply));
+}
+
+/* Fixed newstyle without structured replies unless asked for, then GO */
+static void handshake(int fd)
+{
+    struct {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting = {htobe64(NBD_MAGIC),
+                                          htobe64(NBD_IHAVEOPT), htobe16(3)};
+    uint32_t cflags;
+
+    send_all(fd, &greeting, sizeof(greeting));
+    recv_all(fd, &cflags, sizeof(cflags));
+    while (1) {
+        struct {
+            uint64_t magic;
+            uint32_t opt;
+            uint32_t len;
+        } __attribute__((packed)) opt;
+        char data[256];
+
+        recv_all(fd, &opt, sizeof(opt));
+        CHECK(be32toh(opt.len) <= sizeof(data));
+        recv_all(fd, data, be32toh(opt.len));
+        if (be32toh(opt.opt) != NBD_OPT_GO) {
+            send_opt_reply(fd, be32toh(opt.opt), NBD_REP_ACK, 0);
+            continue;
+        }
+        struct {
+            uint16_t type;
+            uint64_t size;
+            uint16_t flags;
+        } __attribute__((packed)) info = {0, htobe64(EXPORT_SIZE), htobe16(1)};
+        send_opt_reply(fd, NBD_OPT_GO, NBD_REP_INFO, sizeof(info));
+        send_all(fd, &info, sizeof(info));
+        send_opt_reply(fd, NBD_OPT_GO, NBD_REP_ACK, 0);
+        return;
+    }
+}
+
+static void send_chunk(int fd,
+                       uint16_t type,
+                       uint64_t handle,
+                       uint64_t offset,
+                       uint32_t len)
+{
+    struct {
+        uint32_t magic;
+        uint16_t flags;
+        uint16_t type;
+        uint64_t handle;
+        uint32_t len;
+        uint64_t offset;
+    } __attribute__((packed)) chunk = {
+        htobe32(NBD_STRUCTURED_REPLY_MAGIC),
+        htobe16(NBD_REPLY_FLAG_DONE),
+        htobe16(type),
+        htobe64(handle),
+        htobe32(sizeof(uint64_t) +
+                (type == NBD_REPLY_TYPE_OFFSET_HOLE ? sizeof(uint32_t) : len)),
+        htobe64(offset),
+    };
+    uint8_t data[REQ_LEN];
+
+    send_all(fd, &chunk, sizeof(chunk));
+    if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+        uint32_t hole_len = htobe32(len);
+        send_all(fd, &hole_len, sizeof(hole_len));
+        return;
+    }
+    CHECK(len <= sizeof(data));
+    memset(data, 0xab, len);
+    send_all(fd, data, len);
+}
+
+static void *server_thread(void *arg)
+{
+    struct server *s = arg;
+    struct {
+        uint32_t magic;
+        uint16_t flags;
+        uint16_t type;
+        uint64_t handle;
+        uint64_t offset;
+        uint32_t len;
+    } __attribute__((packed)) req;
+    char buf[64];
+
+    int fd = accept(s->listenfd, NULL, NULL);
+    CHECK(fd >= 0);
+    handshake(fd);
+    recv_all(fd, &req, sizeof(req));
+    uint64_t handle = be64toh(req.handle), offset = be64toh(req.offset);
+    switch (s->reply) {
+    case REPLY_DATA:
+        send_chunk(fd, NBD_REPLY_TYPE_OFFSET_DATA, handle, offset, REQ_LEN);
+        break;
+    case REPLY_HOLE:
+        send_chunk(fd, NBD_REPLY_TYPE_OFFSET_HOLE, handle, offset, REQ_LEN);
+        break;
+    case REPLY_PAST_END:
+        send_chunk(fd, NBD_REPLY_TYPE_OFFSET_DATA, handle, offset + 16,
+                   REQ_LEN);
+        break;
+    case REPLY_WRAPPING:
+        send_chunk(fd, NBD_REPLY_TYPE_OFFSET_HOLE, handle, UINT64_MAX - 16,
+                   REQ_LEN);
+        break;
+    case REPLY_BAD_HANDLE: {
+        struct {
+            uint32_t magic;
+            uint32_t error;
+            uint64_t handle;
+        } __attribute__((packed)) reply = {htobe32(NBD_SIMPLE_REPLY_MAGIC), 0,
+                                           htobe64(NBD_MAX_INFLIGHT + 1)};
+        send_all(fd, &reply, sizeof(reply));
+        break;
+    }
+    }
+    /* Wait for the client to hang up */
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+    close(fd);
+    return NULL;
+}
+
+/* Read REQ_LEN bytes at REQ_OFFSET from a server sending @reply */
+static int read_with_reply(enum reply reply, uint8_t *buf)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct server s = {.reply = reply};
+    char uri[sizeof(addr.sun_path) + 64];
+    struct nbd nbd;
+    pthread_t tid;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/test-nbd-%d.sock",
+             getpid());
+    unlink(addr.sun_path);
+    s.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(s.listenfd >= 0);
+    CHECK(bind(s.listenfd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    CHECK(listen(s.listenfd, 1) == 0);
+    pthread_create(&tid, NULL, server_thread, &s);
+
+    snprintf(uri, sizeof(uri), "nbd+unix:///test?socket=%s", addr.sun_path);
+    CHECK(nbd_open(&nbd, uri, 1) == 0);
+    CHECK(nbd.size == EXPORT_SIZE);
+    memset(buf, 0xff, REQ_LEN);
+    int ret = nbd_io(&nbd, NBD_CMD_READ, 0, buf, REQ_OFFSET, REQ_LEN);
+    nbd_close(&nbd);
+
+    pthread_join(tid, NULL);
+    close(s.listenfd);
+    unlink(addr.sun_path);
+    return ret;
+}
+
+int main(void)
+{
+    uint8_t buf[REQ_LEN];
+
+    CHECK(read_with_reply(REPLY_DATA, buf) == 0);
+    for (int i = 0; i < REQ_LEN; i++)
+        CHECK(buf[i] == 0xab);
+
+    CHECK(read_with_reply(REPLY_HOLE, buf) == 0);
+    for (int i = 0; i < REQ_LEN; i++)
+        CHECK(buf[i] == 0);
+
+    /* Replies which do not fit the request fail it instead of landing
+     * outside of its buffer.
+     */
+    CHECK(read_with_reply(REPLY_PAST_END, buf) == -EIO);
+    CHECK(read_with_reply(REPLY_WRAPPING, buf) == -EIO);
+    CHECK(read_with_reply(REPLY_BAD_HANDLE, buf) == -EIO);
+    return 0;
+}